@@ -0,0 +1,671 @@
+#include "../inc/db.h"
+#include "../inc/sharded_db.h"
+#include "../inc/client.h"
+#include "../inc/compiled.h"
+#include "../inc/server.h"
+
+#include <benchmark/benchmark.h>
+#include <symengine/expression.h>
+#include <symengine/symbol.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <optional>
+#include <random>
+#include <string>
+#include <tuple>
+#include <vector>
+
+// Microbenchmarks for FunDB. Results go to the console by default; for regression tracking run
+//   ./fundb_bench --benchmark_out=results.json --benchmark_out_format=json
+// The in-process server benchmarks answer HTTP requests with the server's own request handling
+// against a database of their own. The socket benchmarks are optional extras that talk to a running
+// my_app_server and are skipped if none is reachable; FUNDB_BENCH_HOST, FUNDB_BENCH_HTTP_PORT and
+// FUNDB_BENCH_BINARY_PORT say where it listens.
+
+// Number of distinct queries each lookup benchmark cycles through
+static constexpr size_t QUERY_COUNT = 4096;
+
+// --- Fixtures ---
+
+// Polynomial in x and y with `terms` distinct terms: sum of k * x^k * y for k = 1..terms
+static SymEngine::Expression make_expression(int terms)
+{
+    SymEngine::Expression x(SymEngine::symbol("x"));
+    SymEngine::Expression y(SymEngine::symbol("y"));
+    SymEngine::Expression expr(0);
+    for (int k = 1; k <= terms; ++k)
+    {
+        expr = expr + k * pow(x, k) * y;
+    }
+    return expr;
+}
+
+static std::string stored_name(size_t i)
+{
+    return "f" + std::to_string(i);
+}
+
+// Database holding `count` functions in an index of `capacity` slots. Filling one is far slower
+// than the benchmarks that use it, so each configuration is built once per run and kept.
+static FunDB::Database &filled_database(size_t count, size_t capacity, size_t cache_entries)
+{
+    static std::map<std::tuple<size_t, size_t, size_t>, std::unique_ptr<FunDB::Database>> databases;
+    auto &database = databases[{count, capacity, cache_entries}];
+    if (!database)
+    {
+        const std::string prefix = "bench_" + std::to_string(count) + "_" + std::to_string(capacity) + "_" + std::to_string(cache_entries);
+        database = std::make_unique<FunDB::Database>(prefix + ".dat", prefix + ".idx", capacity, cache_entries);
+        database->clear();
+        const SymEngine::Expression expr = make_expression(3);
+        std::vector<FunDB::Function> batch;
+        for (size_t i = 0; i < count; ++i)
+        {
+            batch.push_back({stored_name(i), {"x", "y"}, expr});
+            if (batch.size() == 65536 || i + 1 == count)
+            {
+                database->write_batch(batch);
+                batch.clear();
+            }
+        }
+    }
+    return *database;
+}
+
+// Names to look up: `hit_percent` of them stored in a database of `count` functions, the rest not
+static std::vector<std::string> query_names(size_t count, int hit_percent)
+{
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<size_t> pick(0, count - 1);
+    std::uniform_int_distribution<int> percent(0, 99);
+    std::vector<std::string> names;
+    names.reserve(QUERY_COUNT);
+    for (size_t i = 0; i < QUERY_COUNT; ++i)
+    {
+        names.push_back(percent(rng) < hit_percent ? stored_name(pick(rng)) : "missing" + std::to_string(pick(rng)));
+    }
+    return names;
+}
+
+// --- Index lookups: capacity (log2), load factor (percent), hit ratio (percent) ---
+static void BM_Contains(benchmark::State &state)
+{
+    const size_t capacity = size_t{1} << state.range(0);
+    const size_t count = capacity * state.range(1) / 100;
+    FunDB::Database &database = filled_database(count, capacity, 0);
+    const std::vector<std::string> names = query_names(count, static_cast<int>(state.range(2)));
+
+    size_t i = 0;
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(database.contains(names[i++ % QUERY_COUNT]));
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.counters["capacity"] = static_cast<double>(database.capacity());
+}
+BENCHMARK(BM_Contains)
+    ->ArgNames({"log2_capacity", "load_pct", "hit_pct"})
+    ->ArgsProduct({{10, 14, 18}, {25, 50, 69}, {0, 50, 100}});
+
+// --- load_function: functions stored, cache entries, hit ratio (percent) ---
+static void BM_LoadFunction(benchmark::State &state)
+{
+    const size_t count = state.range(0);
+    FunDB::Database &database = filled_database(count, 1024, state.range(1));
+    const std::vector<std::string> names = query_names(count, static_cast<int>(state.range(2)));
+
+    size_t i = 0;
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(database.load_function(names[i++ % QUERY_COUNT]));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_LoadFunction)
+    ->ArgNames({"functions", "cache", "hit_pct"})
+    ->ArgsProduct({{1 << 10, 1 << 16}, {0, 4096}, {50, 100}});
+
+// --- load_many: functions stored, names per call; uncached, compare with BM_LoadFunction ---
+static void BM_LoadMany(benchmark::State &state)
+{
+    const size_t count = state.range(0);
+    const size_t batch = state.range(1);
+    FunDB::Database &database = filled_database(count, 1024, 0);
+    const std::vector<std::string> names = query_names(count, 100);
+
+    size_t i = 0;
+    std::vector<std::string_view> request(batch);
+    for (auto _ : state)
+    {
+        for (auto &name : request)
+        {
+            name = names[i++ % QUERY_COUNT];
+        }
+        benchmark::DoNotOptimize(database.load_many(request));
+    }
+    state.SetItemsProcessed(state.iterations() * batch);
+}
+BENCHMARK(BM_LoadMany)
+    ->ArgNames({"functions", "batch"})
+    ->ArgsProduct({{1 << 10, 1 << 16}, {1, 16, 64}});
+
+// --- Listing names in sorted order with a prefix scan ---
+static void BM_ScanPrefix(benchmark::State &state)
+{
+    const size_t count = state.range(0);
+    FunDB::Database &database = filled_database(count, 1024, 0);
+    // Each prefix "f<j>" with two digits matches 111 of 2^14 stored names and 1111 of 2^17
+    size_t i = 0;
+    size_t listed = 0;
+    for (auto _ : state)
+    {
+        FunDB::NameScan scan = database.scan_prefix(stored_name(20 + i++ % 80));
+        while (scan.next())
+        {
+            ++listed;
+        }
+    }
+    state.SetItemsProcessed(listed);
+}
+BENCHMARK(BM_ScanPrefix)->ArgName("functions")->Arg(1 << 14)->Arg(1 << 17);
+
+// Read-only image of filled_database(count, ...) from Database::freeze, opened without a cache
+static FunDB::Database &frozen_database(size_t count)
+{
+    static std::map<size_t, std::unique_ptr<FunDB::Database>> snapshots;
+    auto &snapshot = snapshots[count];
+    if (!snapshot)
+    {
+        const std::string image = "bench_" + std::to_string(count) + ".snap";
+        const size_t capacity = size_t{1} << 18;
+        filled_database(count, capacity, 0).freeze(image);
+        snapshot = FunDB::Database::open_snapshot(image, 0);
+    }
+    return *snapshot;
+}
+
+// --- Snapshot lookups: hit ratio (percent); compare with BM_Contains at the same size ---
+static void BM_SnapshotContains(benchmark::State &state)
+{
+    const size_t count = (size_t{1} << 18) * 69 / 100;
+    FunDB::Database &snapshot = frozen_database(count);
+    const std::vector<std::string> names = query_names(count, static_cast<int>(state.range(0)));
+
+    size_t i = 0;
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(snapshot.contains(names[i++ % QUERY_COUNT]));
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.counters["image_bytes"] = static_cast<double>(snapshot.stats().data_bytes);
+}
+BENCHMARK(BM_SnapshotContains)->ArgName("hit_pct")->Arg(0)->Arg(50)->Arg(100);
+
+// --- Uncached snapshot loads, which skip compiling; compare with BM_LoadFunction ---
+static void BM_SnapshotLoad(benchmark::State &state)
+{
+    const size_t count = (size_t{1} << 18) * 69 / 100;
+    FunDB::Database &snapshot = frozen_database(count);
+    const std::vector<std::string> names = query_names(count, 100);
+
+    size_t i = 0;
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(snapshot.load_cached(names[i++ % QUERY_COUNT]));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_SnapshotLoad);
+
+// --- Evaluation of an expression of N terms ---
+static void BM_FunctionEvaluate(benchmark::State &state)
+{
+    const FunDB::Function func{"f", {"x", "y"}, make_expression(static_cast<int>(state.range(0)))};
+    const std::unordered_map<std::string, double> values{{"x", 0.5}, {"y", 2.0}};
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(func.evaluate(values));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_FunctionEvaluate)->ArgName("terms")->Arg(1)->Arg(8)->Arg(64);
+
+static void BM_CompiledEvaluate(benchmark::State &state)
+{
+    const FunDB::CompiledFunction compiled(FunDB::Function{"f", {"x", "y"}, make_expression(static_cast<int>(state.range(0)))});
+    const double args[] = {0.5, 2.0};
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(compiled.evaluate(args));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_CompiledEvaluate)->ArgName("terms")->Arg(1)->Arg(8)->Arg(64);
+
+static void BM_CompiledGradient(benchmark::State &state)
+{
+    const FunDB::CompiledFunction compiled(FunDB::Function{"f", {"x", "y"}, make_expression(static_cast<int>(state.range(0)))});
+    const double args[] = {0.5, 2.0};
+    double gradient[2];
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(compiled.evaluate_with_gradient(args, gradient));
+        benchmark::DoNotOptimize(gradient);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_CompiledGradient)->ArgName("terms")->Arg(1)->Arg(8)->Arg(64);
+
+static void BM_CompiledEvaluateBatch(benchmark::State &state)
+{
+    const FunDB::CompiledFunction compiled(FunDB::Function{"f", {"x", "y"}, make_expression(static_cast<int>(state.range(0)))});
+    const size_t points = 4096;
+    std::vector<double> xs(points, 0.5), ys(points, 2.0), out(points);
+    for (auto _ : state)
+    {
+        compiled.evaluate_batch({xs.data(), ys.data()}, out.data(), points);
+        benchmark::DoNotOptimize(out.data());
+    }
+    state.SetItemsProcessed(state.iterations() * points);
+}
+BENCHMARK(BM_CompiledEvaluateBatch)->ArgName("terms")->Arg(1)->Arg(8)->Arg(64);
+
+// The same polynomials optimized as the Database does when storing them
+static void BM_OptimizedEvaluate(benchmark::State &state)
+{
+    const FunDB::CompiledFunction compiled(FunDB::Function{"f", {"x", "y"}, make_expression(static_cast<int>(state.range(0)))}, true);
+    const double args[] = {0.5, 2.0};
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(compiled.evaluate(args));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_OptimizedEvaluate)->ArgName("terms")->Arg(1)->Arg(8)->Arg(64);
+
+static void BM_OptimizedEvaluateBatch(benchmark::State &state)
+{
+    const FunDB::CompiledFunction compiled(FunDB::Function{"f", {"x", "y"}, make_expression(static_cast<int>(state.range(0)))}, true);
+    const size_t points = 4096;
+    std::vector<double> xs(points, 0.5), ys(points, 2.0), out(points);
+    for (auto _ : state)
+    {
+        compiled.evaluate_batch({xs.data(), ys.data()}, out.data(), points);
+        benchmark::DoNotOptimize(out.data());
+    }
+    state.SetItemsProcessed(state.iterations() * points);
+}
+BENCHMARK(BM_OptimizedEvaluateBatch)->ArgName("terms")->Arg(1)->Arg(8)->Arg(64);
+
+// --- Writes: save_function per durability mode, write_batch per batch size ---
+static void BM_SaveFunction(benchmark::State &state)
+{
+    FunDB::Database database{"bench_save.dat", "bench_save.idx"};
+    database.clear();
+    database.set_durability({static_cast<FunDB::Durability>(state.range(0))});
+    const SymEngine::Expression expr = make_expression(3);
+    size_t i = 0;
+    for (auto _ : state)
+    {
+        database.save_function({stored_name(i++), {"x", "y"}, expr});
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+// 0 = None, 1 = PerWrite, 2 = GroupCommit
+BENCHMARK(BM_SaveFunction)->ArgName("durability")->Arg(0)->Arg(1)->Arg(2)->UseRealTime();
+
+static void BM_WriteBatch(benchmark::State &state)
+{
+    FunDB::Database database{"bench_batch.dat", "bench_batch.idx"};
+    database.clear();
+    const SymEngine::Expression expr = make_expression(3);
+    const size_t batch_size = state.range(0);
+    size_t next = 0;
+    for (auto _ : state)
+    {
+        state.PauseTiming();
+        std::vector<FunDB::Function> batch;
+        batch.reserve(batch_size);
+        for (size_t i = 0; i < batch_size; ++i)
+        {
+            batch.push_back({stored_name(next++), {"x", "y"}, expr});
+        }
+        state.ResumeTiming();
+        database.write_batch(batch);
+    }
+    state.SetItemsProcessed(state.iterations() * batch_size);
+}
+BENCHMARK(BM_WriteBatch)->ArgName("batch")->Arg(1)->Arg(64)->Arg(4096)->UseRealTime();
+
+// --- save_function from several threads: shards (0 = a plain Database) ---
+static void BM_ConcurrentSave(benchmark::State &state)
+{
+    static std::unique_ptr<FunDB::Database> plain;
+    static std::unique_ptr<FunDB::ShardedDatabase> sharded;
+    const size_t shards = state.range(0);
+    if (state.thread_index() == 0)
+    {
+        if (shards == 0)
+        {
+            plain = std::make_unique<FunDB::Database>("bench_concurrent.dat", "bench_concurrent.idx");
+            plain->clear();
+        }
+        else
+        {
+            sharded = std::make_unique<FunDB::ShardedDatabase>("bench_concurrent_" + std::to_string(shards), shards);
+            sharded->clear();
+        }
+    }
+    const SymEngine::Expression expr = make_expression(3);
+    const std::string prefix = "t" + std::to_string(state.thread_index()) + "_";
+    size_t i = 0;
+    for (auto _ : state)
+    {
+        FunDB::Function func{prefix + stored_name(i++), {"x", "y"}, expr};
+        if (shards == 0)
+        {
+            plain->save_function(func);
+        }
+        else
+        {
+            sharded->save_function(func);
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+    if (state.thread_index() == 0)
+    {
+        plain.reset();
+        sharded.reset();
+    }
+}
+BENCHMARK(BM_ConcurrentSave)->ArgName("shards")->Arg(0)->Arg(8)->ThreadRange(1, 8)->UseRealTime();
+
+// --- Server request handling in process: requests through process_input on an in-memory connection ---
+
+static std::string json_request(const std::string &path, const std::string &body)
+{
+    return "POST " + path + " HTTP/1.1\r\nHost: bench\r\nContent-Type: application/json\r\nContent-Length: " +
+           std::to_string(body.size()) + "\r\n\r\n" + body;
+}
+
+// Database of `durability` mode holding bench_fn, created afresh for each benchmark that asks
+static std::unique_ptr<FunDB::Database> server_database(FunDB::Durability durability = FunDB::Durability::None)
+{
+    auto database = std::make_unique<FunDB::Database>("bench_server.dat", "bench_server.idx");
+    database->clear();
+    database->set_durability({durability});
+    database->save_function({"bench_fn", {"x", "y"}, SymEngine::Expression("x*y + 2*x + 3")});
+    return database;
+}
+
+// Answer all of `input` on `conn` as an event loop does once it has arrived, writing the responses
+// nowhere; returns the bytes of response produced
+static size_t serve_in_process(FunDB::Database &database, FunDB::Connection &conn, const std::string &input)
+{
+    conn.input += input;
+    size_t produced = 0;
+    while (FunDB::process_input(database, conn))
+    {
+        produced += conn.output.size();
+        conn.output.clear();
+    }
+    return produced;
+}
+
+// True if the first response to `request` on a fresh connection has status 200 or 201
+static bool answers_ok(FunDB::Database &database, const std::string &request)
+{
+    FunDB::Connection conn;
+    conn.input = request;
+    FunDB::process_input(database, conn);
+    return conn.output.rfind("HTTP/1.1 200", 0) == 0 || conn.output.rfind("HTTP/1.1 201", 0) == 0;
+}
+
+// Requests pipelined per call
+static void BM_InProcessEvaluate(benchmark::State &state)
+{
+    auto database = server_database();
+    const std::string request = json_request("/evaluate", R"({"name":"bench_fn","values":{"x":1.5,"y":2.5}})");
+    if (!answers_ok(*database, request))
+    {
+        state.SkipWithError("Evaluate request failed");
+        return;
+    }
+    std::string input;
+    for (int64_t i = 0; i < state.range(0); ++i)
+    {
+        input += request;
+    }
+    FunDB::Connection conn;
+    size_t bytes = 0;
+    for (auto _ : state)
+    {
+        bytes += serve_in_process(*database, conn, input);
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+    state.SetBytesProcessed(bytes);
+}
+BENCHMARK(BM_InProcessEvaluate)->ArgName("depth")->Arg(1)->Arg(64);
+
+// Stores are answered after the save and, with durability, its sync; 0 = None, 1 = PerWrite, 2 = GroupCommit
+static void BM_InProcessStore(benchmark::State &state)
+{
+    auto database = server_database(static_cast<FunDB::Durability>(state.range(0)));
+    std::vector<std::string> requests;
+    requests.reserve(QUERY_COUNT);
+    for (size_t i = 0; i < QUERY_COUNT; ++i)
+    {
+        requests.push_back(json_request("/store", R"({"name":")" + stored_name(i) + R"(","symbols":["x","y"],"expression":"x*y + )" + std::to_string(i) + R"("})"));
+    }
+    if (!answers_ok(*database, requests[0]))
+    {
+        state.SkipWithError("Store request failed");
+        return;
+    }
+    FunDB::Connection conn;
+    size_t i = 0;
+    for (auto _ : state)
+    {
+        serve_in_process(*database, conn, requests[i++ % requests.size()]);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_InProcessStore)->ArgName("durability")->Arg(0)->Arg(1)->Arg(2)->UseRealTime();
+
+// Value sets per /evaluate_batch request, answered as one streamed NDJSON response
+static void BM_InProcessEvaluateBatch(benchmark::State &state)
+{
+    auto database = server_database();
+    std::string body = R"({"name":"bench_fn","values":[)";
+    for (int64_t i = 0; i < state.range(0); ++i)
+    {
+        body += (i ? "," : "") + std::string(R"({"x":)") + std::to_string(i) + R"(,"y":2.5})";
+    }
+    body += "]}";
+    const std::string request = json_request("/evaluate_batch", body);
+    if (!answers_ok(*database, request))
+    {
+        state.SkipWithError("Batch request failed");
+        return;
+    }
+    FunDB::Connection conn;
+    size_t bytes = 0;
+    for (auto _ : state)
+    {
+        bytes += serve_in_process(*database, conn, request);
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+    state.SetBytesProcessed(bytes);
+}
+BENCHMARK(BM_InProcessEvaluateBatch)->ArgName("points")->Arg(16)->Arg(256);
+
+// --- Server round trips against a running my_app_server (optional; skipped without one) ---
+
+static std::string bench_host()
+{
+    const char *host = std::getenv("FUNDB_BENCH_HOST");
+    return host ? host : "127.0.0.1";
+}
+
+static int bench_port(const char *variable, int fallback)
+{
+    const char *port = std::getenv(variable);
+    return port ? std::atoi(port) : fallback;
+}
+
+// Binary protocol client shared by the server benchmarks, or nullptr if no server is reachable
+static FunDB::Client *server_client()
+{
+    static std::optional<FunDB::Client> client;
+    static bool tried = false;
+    if (!tried)
+    {
+        tried = true;
+        try
+        {
+            client.emplace(bench_host(), bench_port("FUNDB_BENCH_BINARY_PORT", FunDB::DEFAULT_BINARY_PORT));
+            client->store("bench_fn", {"x", "y"}, "x*y + 2*x + 3");
+        }
+        catch (const std::exception &)
+        {
+            client.reset();
+        }
+    }
+    return client ? &*client : nullptr;
+}
+
+static void BM_ServerEvaluate(benchmark::State &state)
+{
+    FunDB::Client *client = server_client();
+    if (!client)
+    {
+        state.SkipWithError("No server reachable");
+        return;
+    }
+    const std::vector<double> args{1.5, 2.5};
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(client->evaluate("bench_fn", args));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ServerEvaluate)->UseRealTime();
+
+static void BM_ServerStore(benchmark::State &state)
+{
+    FunDB::Client *client = server_client();
+    if (!client)
+    {
+        state.SkipWithError("No server reachable");
+        return;
+    }
+    size_t i = 0;
+    for (auto _ : state)
+    {
+        client->store("bench_store" + std::to_string(i++ % QUERY_COUNT), {"x"}, "x + 1");
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ServerStore)->UseRealTime();
+
+// Requests in flight per round trip
+static void BM_ServerEvaluatePipelined(benchmark::State &state)
+{
+    FunDB::Client *client = server_client();
+    if (!client)
+    {
+        state.SkipWithError("No server reachable");
+        return;
+    }
+    const std::vector<std::vector<double>> points(state.range(0), std::vector<double>{1.5, 2.5});
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(client->evaluate_pipelined("bench_fn", points));
+    }
+    state.SetItemsProcessed(state.iterations() * points.size());
+}
+BENCHMARK(BM_ServerEvaluatePipelined)->ArgName("depth")->Arg(16)->Arg(256)->UseRealTime();
+
+// Connected keep-alive socket to the HTTP listener, or -1
+static int http_connect()
+{
+    int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(static_cast<uint16_t>(bench_port("FUNDB_BENCH_HTTP_PORT", 6374)));
+    if (fd < 0 || ::inet_pton(AF_INET, bench_host().c_str(), &address.sin_addr) != 1 ||
+        ::connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0)
+    {
+        if (fd >= 0)
+        {
+            ::close(fd);
+        }
+        return -1;
+    }
+    int one = 1;
+    ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+// Send `request` and read one response, using its Content-Length; false on any failure
+static bool http_round_trip(int fd, const std::string &request, std::string &buffer)
+{
+    if (::send(fd, request.data(), request.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(request.size()))
+    {
+        return false;
+    }
+    buffer.clear();
+    while (true)
+    {
+        size_t header_end = buffer.find("\r\n\r\n");
+        if (header_end != std::string::npos)
+        {
+            size_t length_at = buffer.find("Content-Length: ");
+            size_t body_size = length_at < header_end ? std::strtoul(buffer.c_str() + length_at + 16, nullptr, 10) : 0;
+            if (buffer.size() >= header_end + 4 + body_size)
+            {
+                return true;
+            }
+        }
+        char chunk[4096];
+        ssize_t n = ::recv(fd, chunk, sizeof(chunk), 0);
+        if (n <= 0)
+        {
+            return false;
+        }
+        buffer.append(chunk, static_cast<size_t>(n));
+    }
+}
+
+static void BM_ServerHttpEvaluate(benchmark::State &state)
+{
+    int fd = server_client() ? http_connect() : -1;
+    if (fd < 0)
+    {
+        state.SkipWithError("No server reachable");
+        return;
+    }
+    const std::string body = R"({"name":"bench_fn","values":{"x":1.5,"y":2.5}})";
+    const std::string request = "POST /evaluate HTTP/1.1\r\nHost: bench\r\nContent-Type: application/json\r\nContent-Length: " +
+                                std::to_string(body.size()) + "\r\n\r\n" + body;
+    std::string buffer;
+    for (auto _ : state)
+    {
+        if (!http_round_trip(fd, request, buffer))
+        {
+            state.SkipWithError("Connection to server lost");
+            break;
+        }
+    }
+    ::close(fd);
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ServerHttpEvaluate)->UseRealTime();
+
+BENCHMARK_MAIN();
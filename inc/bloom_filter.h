@@ -0,0 +1,55 @@
+#pragma once
+
+#include "mapped_file.h"
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace FunDB
+{
+    // --- Blocked Bloom filter over the stored names, to answer most lookups of absent names ---
+    // Each name sets 8 bits within one 64-byte block chosen by its hash, so a check touches a
+    // single cache line. The filter keeps at least 12 bits per name, at which about 1 in 100
+    // absent names gets through. Names are never removed (clear() starts over), so the filter only
+    // ever gains bits; once it holds more names than it was sized for, the Database builds a
+    // larger one. Names are passed as their hash64(), the hash the index probes with, so a lookup
+    // hashes the name once. The filter's header records the size and generation of the data file
+    // whose names it holds.
+    class BloomFilter
+    {
+    private:
+        const std::filesystem::path path;
+        const std::filesystem::path new_path;
+        MappedFile file;
+
+        static void insert(MappedFile &file, uint64_t name_hash);
+
+    public:
+        explicit BloomFilter(std::filesystem::path path);
+
+        // Map the filter on disk; the size of the data file whose names it holds, or nullopt if
+        // there is no usable filter
+        std::optional<uint64_t> load();
+        // Generation of the data file the filter was built for; only after load() found a filter
+        uint32_t generation() const;
+        // Forget the filter and remove the file; may_contain is true for every name until the next install
+        void clear();
+        // Record a name saved for the first time; no effect without a filter
+        void add(uint64_t name_hash);
+        // False only if no name with this hash was ever added
+        bool may_contain(uint64_t name_hash) const;
+        // More names than the filter was sized for
+        bool grow_due() const;
+        // Write a filter of `names`, sized for twice as many, to a new file covering the first
+        // `data_bytes` of generation `generation` of the data file
+        MappedFile build(const std::vector<std::string> &names, uint64_t data_bytes, uint32_t generation) const;
+        // Swap in a filter from build()
+        void install(MappedFile table);
+        // Flush the bits to disk, then record that the filter holds the names of the first
+        // `data_bytes` of generation `generation` of the data file
+        void checkpoint(uint64_t data_bytes, uint32_t generation);
+    };
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+namespace FunDB
+{
+    // Appends fixed-width values in host byte order, like the rest of the on-disk format
+    class ByteWriter
+    {
+    private:
+        std::string &out;
+
+    public:
+        explicit ByteWriter(std::string &out) : out(out) {}
+
+        template <typename T>
+        void put(T value)
+        {
+            this->out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+        }
+
+        void put_bytes(std::string_view bytes) { this->out.append(bytes); }
+
+        void put_string(std::string_view text)
+        {
+            this->put<uint32_t>(text.size());
+            this->out.append(text);
+        }
+    };
+
+    // Bounds-checked reader over data written by ByteWriter
+    class ByteReader
+    {
+    private:
+        std::string_view in;
+        size_t position{0};
+        // Message of the exception thrown when the data runs out
+        const char *truncated_message;
+
+    public:
+        explicit ByteReader(std::string_view in, const char *truncated_message = "Corrupt function record: unexpected end of data.")
+            : in(in), truncated_message(truncated_message) {}
+
+        template <typename T>
+        T get()
+        {
+            T value;
+            std::memcpy(&value, this->take(sizeof(T)).data(), sizeof(T));
+            return value;
+        }
+
+        std::string_view take(size_t size)
+        {
+            if (size > this->in.size() - this->position)
+            {
+                throw std::runtime_error(this->truncated_message);
+            }
+            std::string_view bytes = this->in.substr(this->position, size);
+            this->position += size;
+            return bytes;
+        }
+
+        std::string_view get_string() { return this->take(this->get<uint32_t>()); }
+        bool at_end() const { return this->position == this->in.size(); }
+    };
+}
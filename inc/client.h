@@ -0,0 +1,55 @@
+#pragma once
+
+#include "wire.h"
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace FunDB
+{
+    // A function as returned by the server: its symbols and the expression as text
+    struct StoredFunction
+    {
+        std::string name;
+        std::vector<std::string> symbols;
+        std::string expression;
+    };
+
+    // Blocking client for the binary protocol (see wire.h) over one persistent connection.
+    // Not thread-safe; use one Client per thread.
+    class Client
+    {
+    private:
+        int fd{-1};
+        uint32_t next_id{0};
+        // Bytes received but not yet returned as responses
+        std::string input;
+
+        uint32_t send_request(WireOp op, const std::string &payload);
+        // Send several requests with one write; returns the id of the first
+        uint32_t send_requests(const std::string &frames, uint32_t count);
+        // Block until the response to request `id` arrives and return its payload; throws on
+        // Error, and on NotFound unless `not_found` is given, in which case it is set instead
+        std::string read_response(uint32_t id, bool *not_found = nullptr);
+
+    public:
+        Client(const std::string &host, int port = DEFAULT_BINARY_PORT);
+        ~Client();
+
+        Client(const Client &) = delete;
+        Client &operator=(const Client &) = delete;
+        Client(Client &&other) noexcept;
+        Client &operator=(Client &&other) noexcept;
+
+        void store(const std::string &name, const std::vector<std::string> &symbols, const std::string &expression);
+        std::optional<StoredFunction> load(const std::string &name);
+        // Arguments are given in the order of the function's symbols
+        double evaluate(const std::string &name, const std::vector<double> &args);
+        // One column of `count` values per symbol, as for evaluate_stored_batch
+        void evaluate_batch(const std::string &name, const std::vector<const double *> &columns, double *out, size_t count);
+        // Evaluate each point as its own request, sending them all before reading any response
+        std::vector<double> evaluate_pipelined(const std::string &name, const std::vector<std::vector<double>> &points);
+    };
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include "fun.h"
+#include "bytes.h"
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+
+namespace FunDB
+{
+    // Binary payloads start with a NUL tag byte followed by a format version. Legacy text payloads
+    // ("sym,sym|expr") never start with NUL, so the tag is enough to tell the two apart.
+    constexpr char BINARY_RECORD_TAG = '\0';
+    constexpr uint8_t BINARY_RECORD_VERSION = 1;
+
+    // Function payload: symbols plus the expression tree as a postorder node array
+    std::string encode_function(const Function &func);
+    // Decode either payload format; `name` comes from the record key
+    Function decode_function(std::string name, std::string_view payload);
+
+    // --- Templates: an expression's shape with its numeric coefficients taken out as parameters ---
+    // Numbers that are terms of a sum or factors of a product become parameters, except the -1 of a
+    // negation; exponents and numbers inside other nodes stay part of the shape. So all functions
+    // a*x**2 + b*y**2 + c*x*y share the shape p0*x**2 + p1*y**2 + p2*x*y and differ in (a, b, c).
+    struct TemplateSplit
+    {
+        // The function with its i-th coefficient replaced by parameter_symbol(i)
+        Function shape;
+        SymEngine::vec_basic parameters;
+    };
+    TemplateSplit split_template(const Function &func);
+    // The function `shape` describes once `parameters` are put back in
+    Function instantiate_template(std::string name, const Function &shape, const SymEngine::vec_basic &parameters);
+    // Symbol that stands for parameter `index` in a shape; its name starts with a control character
+    // that stores refuse in a function's own symbols (see check_symbols)
+    SymEngine::RCP<const SymEngine::Basic> parameter_symbol(size_t index);
+    std::optional<size_t> parameter_index(const std::string &symbol_name);
+    // Throws if `func` declares or uses a symbol whose name starts like a parameter's
+    void check_symbols(const Function &func);
+
+    // Payload of a function stored as a reference to its shape, which is stored once as its own
+    // record, plus the values of the shape's parameters
+    constexpr uint8_t TEMPLATED_RECORD_VERSION = 2;
+    struct TemplatedRecord
+    {
+        // hash64 of the shape's payload
+        uint64_t template_id;
+        SymEngine::vec_basic parameters;
+    };
+    std::string encode_templated(const TemplatedRecord &record);
+    bool is_templated(std::string_view payload);
+    TemplatedRecord decode_templated(std::string_view payload);
+    // The template id alone, without decoding the parameters; the payload must be templated
+    uint64_t templated_id(std::string_view payload);
+
+    // Payload of either kind followed by the optimized program of its function (see
+    // CompiledFunction::encode), which is evaluated in place of lowering the expression again.
+    // The payload is kept as written, so loading the function returns the expression it was saved with.
+    constexpr uint8_t OPTIMIZED_RECORD_VERSION = 3;
+    struct OptimizedRecord
+    {
+        std::string_view payload;
+        // Empty if the payload was stored without a program
+        std::string_view program;
+    };
+    std::string encode_optimized(std::string_view payload, std::string_view program);
+    // The payload and program of any stored payload
+    OptimizedRecord split_optimized(std::string_view payload);
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include "fun.h"
+
+#include <symengine/basic.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string_view>
+
+namespace FunDB
+{
+    enum class OpCode : uint8_t
+    {
+        Const,    // push constants[operand]
+        Var,      // push args[operand]
+        Param,    // push the bound value of template parameter `operand`
+        Symbolic, // push the value of fallbacks[operand], evaluated symbolically
+        Add,
+        Sub,
+        Mul,
+        Div,
+        Pow,
+        Neg,
+        Sqrt,
+        Exp,
+        Log,
+        Abs,
+        Sin,
+        Cos,
+        Tan,
+        Asin,
+        Acos,
+        Atan,
+        Sinh,
+        Cosh,
+        Tanh,
+        // Written by optimized programs only (see CompiledFunction's `optimize`)
+        PowInt, // raise to the power `operand`, an int32_t, by repeated multiplication
+        Store,  // copy the top of the stack into locals[operand]
+        Load,   // push locals[operand]
+    };
+
+    struct Instruction
+    {
+        OpCode op;
+        uint32_t operand;
+    };
+
+    // Instruction stream of a compiled expression. Functions that share a template (see codec.h)
+    // share one Program and differ only in the parameter values bound to it.
+    struct Program
+    {
+        std::vector<std::string> symbols;
+        std::vector<Instruction> code;
+        std::vector<double> constants;
+        // Subtrees the instruction set cannot express; evaluated with SymEngine as a last resort
+        std::vector<SymEngine::RCP<const SymEngine::Basic>> fallbacks;
+        size_t max_stack{0};
+        size_t parameter_count{0};
+        // Values kept by Store for later Loads
+        size_t local_count{0};
+    };
+
+    // A Function lowered once into a flat postorder instruction stream for a small stack machine.
+    // Arguments are passed positionally, in the order of the function's `symbols`.
+    class CompiledFunction
+    {
+    private:
+        std::shared_ptr<const Program> program = std::make_shared<const Program>();
+        std::vector<double> parameters;
+
+        static void lower(Program &program, const SymEngine::RCP<const SymEngine::Basic> &node, size_t depth, bool optimize);
+        static void emit(Program &program, OpCode op, uint32_t operand, size_t depth);
+        // Rewrite the instruction stream so each distinct subexpression is computed once and integer
+        // powers are multiplied out
+        static void optimize_program(Program &program);
+        SymEngine::map_basic_basic fallback_subs(const double *args) const;
+        double evaluate_fallback(uint32_t index, const double *args) const;
+        // Partial derivatives of fallback `index` with respect to every symbol, by SymEngine diff
+        void fallback_gradient(uint32_t index, const double *args, double *gradient) const;
+        // The arguments in symbol order; the buffer is reused by the calling thread
+        const double *gather_args(const std::unordered_map<std::string, double> &values) const;
+        void evaluate_block(const double *const *columns, size_t offset, size_t n, double *out) const;
+
+    public:
+        CompiledFunction() = default;
+        // Template parameters in the expression must be bound before it is evaluated. With
+        // `optimize`, sums of powers are lowered in Horner form, repeated subexpressions are
+        // computed once and kept in locals, and small integer powers become multiplications. This
+        // costs more to compile and can round differently from the expression as written, so the
+        // Database only does it when storing functions (see Database::set_optimize_on_store).
+        explicit CompiledFunction(const Function &func, bool optimize = false);
+
+        size_t arity() const { return this->program->symbols.size(); }
+        const std::vector<std::string> &get_symbols() const { return this->program->symbols; }
+        size_t parameter_count() const { return this->program->parameter_count; }
+        // The same program with `parameters` as the values of its template parameters
+        CompiledFunction bind(std::vector<double> parameters) const;
+        // The program and its bound parameters as bytes, so it can be stored compiled (see
+        // snapshot.h); nullopt if it evaluates subtrees symbolically, which only SymEngine can hold
+        std::optional<std::string> encode() const;
+        // A program written by encode(); throws unless every instruction is valid and the stack
+        // never runs dry, so evaluating it cannot read out of bounds
+        static CompiledFunction decode(std::string_view bytes);
+
+        // `args` must hold one value per symbol; does not allocate once the calling thread has warmed up
+        double evaluate(const double *args) const;
+        double evaluate(const std::unordered_map<std::string, double> &values) const;
+
+        // Value and partial derivatives with respect to every symbol in one pass, by forward-mode
+        // automatic differentiation: each stack entry carries its gradient along with its value,
+        // so the cost is about (1 + arity) evaluations. `gradient` must hold one entry per symbol.
+        double evaluate_with_gradient(const double *args, double *gradient) const;
+        ValueGradient evaluate_with_gradient(const std::unordered_map<std::string, double> &values) const;
+
+        // Evaluate `count` points given as one column per symbol (structure of arrays) into `out`.
+        // Columns are processed in fixed-size blocks with SIMD kernels. Large batches are split across helper
+        // threads from a budget shared by all callers, so concurrent batches never use more threads than
+        // the hardware has; if a chunk throws, the exception is rethrown after every chunk has finished.
+        void evaluate_batch(const std::vector<const double *> &columns, double *out, size_t count) const;
+    };
+}
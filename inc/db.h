@@ -1,33 +1,380 @@
 #pragma once
 
 #include "fun.h"
+#include "compiled.h"
+#include "lru_cache.h"
+#include "mapped_file.h"
+#include "bloom_filter.h"
+#include "metrics.h"
+#include "name_index.h"
+#include "snapshot.h"
 
+#include <atomic>
+#include <memory>
 #include <string>
 #include <vector>
 #include <unordered_map>
 #include <optional>
 #include <cstdint>
+#include <chrono>
+#include <condition_variable>
 #include <filesystem>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <shared_mutex>
 #include <string_view>
+#include <thread>
 
 namespace FunDB
 {
+    // A parsed function together with its compiled form, as kept in the Database's cache
+    struct CachedFunction
+    {
+        Function function;
+        std::optional<CompiledFunction> compiled;
+        // Why the expression could not be compiled, if it could not
+        std::string compile_error;
+
+        explicit CachedFunction(Function func);
+        // A function stored as a template: `shape`'s compiled program bound to `parameters`
+        CachedFunction(Function func, const CachedFunction &shape, const SymEngine::vec_basic &parameters);
+        // A function whose program was compiled before, e.g. read from a snapshot
+        CachedFunction(Function func, CompiledFunction compiled);
+        // Throws if the expression could not be compiled
+        const CompiledFunction &get_compiled() const;
+    };
+
+    struct CacheStats
+    {
+        uint64_t hits;
+        uint64_t misses;
+        size_t entries;
+        size_t capacity;
+    };
+
+    struct CompactionStats
+    {
+        size_t live_records;
+        uint64_t bytes_before;
+        uint64_t bytes_after;
+        uint64_t reclaimed_bytes;
+    };
+
+    struct FreezeStats
+    {
+        size_t functions;
+        // Functions stored with their compiled program; the rest are compiled when loaded
+        size_t precompiled;
+        uint64_t image_bytes;
+    };
+
+    // Point-in-time view of a Database for monitoring
+    struct DatabaseStats
+    {
+        size_t entries;
+        // Distinct expression shapes stored as templates
+        size_t templates;
+        size_t capacity;
+        uint64_t data_bytes;
+        uint64_t live_bytes;
+        CacheStats cache;
+        // All zero when built with FUNDB_METRICS=0
+        MetricsSnapshot metrics;
+    };
+
+    // When a save is guaranteed to survive a crash of the machine, not just of the process
+    enum class Durability
+    {
+        // Leave flushing to the operating system; a power loss may drop the latest saves
+        None,
+        // Sync the data file before every save returns
+        PerWrite,
+        // Saves wait for a background sync that covers every save made in the meantime
+        GroupCommit,
+    };
+
+    struct DurabilityOptions
+    {
+        Durability mode = Durability::None;
+        // A group is everything saved while the previous sync ran. A positive interval also holds
+        // each group open that long after its first save, unless group_size saves are waiting first,
+        // trading latency for fewer syncs when writers are few.
+        std::chrono::microseconds group_interval{0};
+        size_t group_size = 64;
+    };
+
+    // Concurrency model: any number of threads may read (load_function, load_cached, the evaluate
+    // helpers) while one thread writes. Readers hold `mutex` shared while they probe the index and
+    // copy a record out of the mapping, then parse and compile without any lock; cache hits take
+    // only their cache shard's lock. Writers are serialized by `write_mutex`, append to the data
+    // file without disturbing the mapping readers use, and take `mutex` exclusively just to remap
+    // it and update the index, so readers see either the old or the new slot, never a torn table.
+    // Compaction copies records while readers continue and only swaps the files exclusively.
+    class Database;
+
+    // Names of a range in sorted order, fetched from the Database a batch at a time so that no lock
+    // is held between batches. Names saved during the scan are seen if they sort after the last
+    // name returned so far.
+    class NameScan
+    {
+    private:
+        const Database &database;
+        // Where the next batch starts: the range's start at first, then just past the last name fetched
+        std::string position;
+        std::optional<std::string> end;
+        std::vector<std::string> batch;
+        size_t next_in_batch{0};
+        bool exhausted{false};
+        std::vector<std::shared_ptr<const CachedFunction>> functions;
+        size_t next_function_in_batch{0};
+
+        bool fetch();
+
+    public:
+        NameScan(const Database &database, std::string lo, std::optional<std::string> hi);
+        // The next name, or nullopt once the range is done
+        std::optional<std::string> next();
+        // The next function, loaded with the rest of its batch by Database::load_many; nullptr once
+        // the range is done
+        std::shared_ptr<const CachedFunction> next_function();
+    };
+
     class Database
     {
     private:
         const std::filesystem::path data_file;
         const std::filesystem::path index_file;
-        const size_t HASH_TABLE_SIZE{};
+        // Index being built by an in-progress resize; renamed over index_file once complete
+        const std::filesystem::path resize_file;
+        // New data file and index written by compact() before they are renamed into place
+        const std::filesystem::path compact_data_file;
+        const std::filesystem::path compact_index_file;
+        // Capacity of a newly created index; the index grows from there as names are added
+        const size_t initial_capacity{};
         const uint64_t TOMBSTONE{0xFFFFFFFFFFFFFFFF};
-        void save_index(const std::unordered_map<std::string, uint64_t> &index) const;
-        uint64_t lookup_key(std::string_view key) const;
+        // Both files stay open and mapped for the lifetime of the database
+        MappedFile data_map;
+        MappedFile index_map;
+        // While the index grows, new slots go to resize_map and index_map is drained into it
+        // a few slots per write; lookups check resize_map first and fall back to index_map
+        MappedFile resize_map;
+        size_t resize_cursor{0};
+        // Slots in use, including those of template records
+        size_t entry_count{0};
+        // Template records among them; kept in the index header
+        size_t template_count{0};
+        // Bytes of the data file taken up by the latest record of each name; kept in the index header
+        uint64_t live_bytes{0};
+        // Bumped by every compaction, which replaces the data file; kept in the index header and
+        // in the headers of the name files, so files left from before a compaction are told apart
+        uint32_t data_generation{0};
+        // Parsed and compiled functions by name; entries are dropped whenever their name is saved
+        mutable ShardedLruCache<std::string, std::shared_ptr<const CachedFunction>> cache;
+        // The two files of names kept next to the index are derived state like the index itself:
+        // each covers a prefix of the data file, and the names of records after it are added
+        // again when the file is loaded. A missing or damaged file, or one written for another
+        // generation of the data file, is rebuilt from the data file. Either is replaced by
+        // writing a new file and renaming it over the old one in install().
+        // Names in sorted order for scans, in `<index>.names`
+        NameIndex sorted_names;
+        // Names that may be stored, so that most lookups of absent names stop before the index;
+        // in `<index>.bloom`
+        BloomFilter name_filter;
+        // Compiled shapes by template id. Templates never change once stored, so entries stay valid.
+        mutable ShardedLruCache<uint64_t, std::shared_ptr<const CachedFunction>> templates;
+        mutable Metrics metrics;
+        // Store each function with its optimized program; see set_optimize_on_store
+        std::atomic<bool> optimize_on_store{false};
+        // Set by open_snapshot: reads are served from this image and writes are refused
+        std::unique_ptr<const Snapshot> snapshot;
+        mutable std::shared_mutex mutex;
+        std::mutex write_mutex;
+        // Bumped by every write; a reader only caches what it loaded if no write happened meanwhile
+        uint64_t write_generation{0};
+        // Group commit: writes are numbered as they are appended, and the committer thread records
+        // the number of the last write its sync covered. commit_mutex is taken after write_mutex.
+        DurabilityOptions durability;
+        mutable std::mutex commit_mutex;
+        std::condition_variable commit_requested;
+        std::condition_variable commit_done;
+        uint64_t appended_writes{0};
+        uint64_t synced_writes{0};
+        bool stop_committer{false};
+        std::thread committer;
+        // Set if a group sync failed; every later group commit reports it
+        std::string commit_error;
+        // Compaction a write started once compaction_due(); at most one runs at a time
+        std::atomic<bool> compaction_running{false};
+        std::future<void> background_compaction;
+        // Loads queued on the shared worker pool by load_async and load_many_async and not yet
+        // finished; the destructor waits for them, since they use this database
+        mutable std::mutex loads_mutex;
+        mutable std::condition_variable loads_done;
+        mutable size_t pending_loads{0};
+        // A record in the data file, viewed in place in the mapping
+        struct RecordView
+        {
+            std::string_view key;
+            std::string_view value;
+            uint64_t next_offset;
+            // Records written before checksums were added have none
+            bool checksummed;
+        };
+        Database(std::unique_ptr<const Snapshot> snapshot, const std::string &image_filename, size_t cache_entries);
+        void open_files();
+        // Throws in snapshot mode
+        void require_writable() const;
+        // The function from the snapshot, cached; nullptr if the image does not hold it
+        std::shared_ptr<const CachedFunction> load_from_snapshot(const std::string &key) const;
+        void init_index(MappedFile &index, size_t capacity);
+        void rebuild_index();
+        bool recover_index();
+        uint64_t scan_log(uint64_t offset, const std::function<void(uint64_t, const RecordView &)> &visit) const;
+        void truncate_log(uint64_t valid_end);
+        void recount_live_bytes();
+        // Bring the sorted names and the name filter, as loaded with the data file sizes they cover,
+        // up to date with the data file, or build them anew
+        void open_name_indexes(std::optional<uint64_t> names_covered_bytes, std::optional<uint64_t> filter_covered_bytes);
+        // Write the names added since the last run into a new one; callers hold write_mutex
+        void merge_sorted_names();
+        // Replace the name filter with one sized for twice the names; callers hold write_mutex
+        void grow_name_filter();
+        std::vector<std::string> collect_names() const;
+        // Offset of the latest record of every name and template, in no particular order; callers hold either lock
+        std::vector<uint64_t> collect_offsets() const;
+        void checkpoint_locked();
+        void start_resize();
+        void migrate_slots(size_t count);
+        void finish_resize();
+        std::string_view key_at(uint64_t offset) const;
+        // With `verify`, a record whose checksum does not match is treated like a torn one
+        std::optional<RecordView> read_record(uint64_t offset, bool verify = false) const;
+        // read_record from another mapping of a data file
+        static std::optional<RecordView> read_record_in(const MappedFile &data, uint64_t offset, bool verify = false);
+        uint64_t record_size(uint64_t offset) const;
+        void set_live_bytes(uint64_t live_bytes);
+        void set_template_count(size_t template_count);
+        // Adds the number of occupied slots compared to `probes`, if given
+        size_t probe(const MappedFile &index, std::string_view key, uint64_t hash, size_t *probes = nullptr) const;
+        uint64_t find_in(const MappedFile &index, std::string_view key, uint64_t hash, size_t *probes = nullptr) const;
+        uint64_t find_key(std::string_view key, uint64_t hash, size_t *probes = nullptr) const;
+        uint64_t lookup_key(std::string_view key, uint64_t hash) const;
+        void find_candidates(const MappedFile &index, uint64_t hash, std::vector<std::pair<uint64_t, size_t>> &ranges) const;
+        // Parse a record copied out under the lock and cache it unless a write happened since `generation`
+        std::shared_ptr<const CachedFunction> parse_and_cache(const std::string &key, const std::string &payload, uint64_t generation) const;
+        std::shared_ptr<const CachedFunction> load_template(uint64_t template_id) const;
+        // A function's payload as it will be stored, and the record of the template it refers to, if any
+        struct EncodedFunction
+        {
+            std::string payload;
+            std::string template_key;
+            std::string template_payload;
+        };
+        EncodedFunction encode_for_store(const Function &func) const;
+        // True if the record of `encoded`'s template has to be appended before it; `new_templates`
+        // holds those this write appends already. If a different shape is stored under the same id,
+        // `encoded` falls back to the full payload. Callers hold write_mutex.
+        bool resolve_template(const Function &func, EncodedFunction &encoded, std::unordered_map<std::string, std::string> &new_templates) const;
+        void index_record(std::string_view key, uint64_t hash, uint64_t offset);
+        uint64_t append_records(const std::string &records);
+        bool compaction_due() const;
+        CompactionStats compact_locked();
+        // Start compacting on a background thread unless a compaction is already running; callers hold write_mutex
+        void start_background_compaction();
+        void run_background_compaction();
+        // Run `task` on WorkerPool::shared(), counted in pending_loads
+        template <typename Task>
+        auto submit_load(Task task) const;
+        static void finish_load(const Database *database);
+        uint64_t log_write();
+        void wait_for_commit(uint64_t write);
+        void mark_all_synced();
+        void run_committer();
+        void stop_commit_thread();
 
     public:
-        explicit Database(std::string data_filename = "functions.dat", std::string index_filename = "functions.idx", size_t hash_table_size = 1 << 20);
+        explicit Database(std::string data_filename = "functions.dat", std::string index_filename = "functions.idx", size_t initial_capacity = 1024, size_t cache_entries = 4096);
+        // Open an image written by freeze() read-only. Lookups cost one slot and one record read, and
+        // nothing is parsed until a function is loaded. With `verify`, the image's checksum is checked first.
+        static std::unique_ptr<Database> open_snapshot(const std::string &image_filename, size_t cache_entries = 4096, bool verify = false);
+        // Syncs outstanding writes and checkpoints the index
+        ~Database();
         void clear();
-        void save_function(const Function &func) const;
+        size_t size() const;
+        // Number of slots in the index (the larger table while a resize is in progress)
+        size_t capacity() const;
+        // Throws, before writing anything, if the name starts with a NUL byte; those are reserved
+        void save_function(const Function &func);
+        // Append all functions in one write, index them in one pass and sync both files once;
+        // refuses the whole batch if any name is refused by save_function
+        void write_batch(const std::vector<Function> &functions);
         std::optional<Function> load_function(std::string_view name) const;
+        // Whether `name` is stored; probes the index without reading or parsing the record
+        bool contains(std::string_view name) const;
+        // Every stored name, in index order
+        std::vector<std::string> names() const;
+        // Call `visit` with every stored function, in data file order. The live records are found under
+        // the lock and then read from a mapping of the file of their own, so writes meanwhile neither
+        // wait for the scan nor change what it sees, and nothing it decodes goes into the cache.
+        void for_each(const std::function<void(const Function &)> &visit) const;
+        // Names in [lo, hi) in sorted order; without `hi` the scan runs to the last name
+        NameScan scan(std::string lo, std::optional<std::string> hi = std::nullopt) const;
+        // Names that start with `prefix`, in sorted order; with `after`, only those that sort after it,
+        // which resumes a listing that stopped at `after`
+        NameScan scan_prefix(std::string_view prefix, std::string_view after = {}) const;
+        // Up to `limit` names in [lo, hi) in sorted order, read under one lock; what scans fetch their batches with
+        std::vector<std::string> names_in_range(std::string_view lo, const std::optional<std::string> &hi, size_t limit) const;
+        // Parsed and compiled function from the cache, loading it on a miss; nullptr if the name is not stored
+        std::shared_ptr<const CachedFunction> load_cached(std::string_view name) const;
+        // load_cached for each of `names`, in order. The cache misses are looked up under one lock,
+        // and the pages of all their records are requested from the kernel before any is read, so
+        // a cold batch waits for the disk about once instead of once per name.
+        std::vector<std::shared_ptr<const CachedFunction>> load_many(const std::vector<std::string_view> &names) const;
+        // load_cached and load_many on WorkerPool::shared(), whose bounded set of threads is shared
+        // by every Database; loads queue up once all of them are busy
+        std::future<std::shared_ptr<const CachedFunction>> load_async(std::string name) const;
+        std::future<std::vector<std::shared_ptr<const CachedFunction>>> load_many_async(std::vector<std::string> names) const;
+        CacheStats cache_stats() const;
+        // Sizes, cache statistics, operation latencies and lookup probe lengths
+        DatabaseStats stats() const;
+        // Where the evaluate helpers and other callers record their own timings
+        Metrics &get_metrics() const { return this->metrics; }
+        // True once superseded records make up most of a data file of at least 1 MiB; a write
+        // that finds this starts a compaction in the background and returns without waiting for it
+        bool needs_compaction() const;
+        // Wait until the compaction a write started, if any, has finished
+        void wait_for_compaction();
+        // Rewrite only the latest record of each name into a new data file and index and swap
+        // them in place of the old ones; the swap is safe against crashes at any point
+        CompactionStats compact();
+        // Run compact() on a background thread; readers carry on meanwhile and writers wait for it
+        std::future<CompactionStats> compact_async();
+        // Write every function, with its compiled program where possible, into an immutable image
+        // for open_snapshot. Writers wait until it is done, so the image holds one point in time.
+        // Throws in snapshot mode.
+        FreezeStats freeze(const std::string &image_filename);
+        bool is_snapshot() const { return this->snapshot != nullptr; }
+        // Choose how saves are made durable; Durability::None (the default) never syncs except
+        // in write_batch, compact and checkpoint
+        void set_durability(const DurabilityOptions &options);
+        DurabilityOptions get_durability() const;
+        // Optimize functions as they are saved (see CompiledFunction's `optimize`) and store the
+        // optimized program next to the expression, so loads evaluate it without compiling.
+        // load_function still returns the expression as saved. Off by default; templates are
+        // optimized once, when their first function is saved.
+        void set_optimize_on_store(bool enabled);
+        // Sync the data file and the index and record how much of the data file the index covers,
+        // so the next open only has to replay records appended after this point
+        void checkpoint();
     };
 
+    // Render `stats` in the Prometheus text exposition format
+    std::string format_prometheus(const DatabaseStats &stats);
+
     double evaluate_stored_function(const Database &database, std::string_view search_name, const std::unordered_map<std::string, double> &values);
+    // Value and partial derivatives of a stored function, the gradient in the order of its symbols
+    ValueGradient evaluate_stored_gradient(const Database &database, std::string_view search_name, const std::unordered_map<std::string, double> &values);
+    // Look the function up once and evaluate it over `count` points given as one column per symbol
+    void evaluate_stored_batch(const Database &database, std::string_view search_name, const std::vector<const double *> &columns, double *out, size_t count);
 }
\ No newline at end of file
@@ -2,12 +2,20 @@
 
 #include <symengine/expression.h>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <unordered_map>
 #include <optional>
 
 namespace FunDB
 {
+    // Value of a function and its partial derivatives, one per symbol in the order of `symbols`
+    struct ValueGradient
+    {
+        double value;
+        std::vector<double> gradient;
+    };
+
     struct Function
     {
         std::string name;
@@ -15,6 +23,13 @@ namespace FunDB
         SymEngine::Expression expr;
 
         double evaluate(const std::unordered_map<std::string, double> &values) const;
+        // Compile once and evaluate `count` points, one input column per entry in `symbols`
+        void evaluate_batch(const std::vector<const double *> &columns, double *out, size_t count) const;
+        // Compile once and evaluate the value and every partial derivative in one pass
+        ValueGradient evaluate_with_gradient(const std::unordered_map<std::string, double> &values) const;
+        // Versioned binary record payload (see codec.h)
         std::string serialize() const;
+        // Decode a payload written by serialize(), or a legacy "sym,sym|expr" text payload
+        static Function deserialize(std::string name, std::string_view data);
     };
 }
\ No newline at end of file
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <cstdint>
+#include <string_view>
+
+namespace FunDB
+{
+    // XXH64 of `data`. Unlike std::hash the result is fixed by the algorithm, so it is the same
+    // for every build, standard library and platform and can be persisted in index files.
+    uint64_t hash64(std::string_view data, uint64_t seed = 0);
+}
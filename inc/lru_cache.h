@@ -0,0 +1,158 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace FunDB
+{
+    // Bounded, thread-safe least-recently-used map with hit/miss counters.
+    template <typename Key, typename Value>
+    class LruCache
+    {
+    private:
+        using Entry = std::pair<Key, Value>;
+
+        const size_t capacity;
+        // Most recently used entries are at the front
+        std::list<Entry> entries;
+        std::unordered_map<Key, typename std::list<Entry>::iterator> positions;
+        mutable std::mutex mutex;
+        mutable std::atomic<uint64_t> hits{0};
+        mutable std::atomic<uint64_t> misses{0};
+
+    public:
+        explicit LruCache(size_t capacity) : capacity(capacity) {}
+
+        std::optional<Value> get(const Key &key)
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            auto it = this->positions.find(key);
+            if (it == this->positions.end())
+            {
+                this->misses.fetch_add(1, std::memory_order_relaxed);
+                return std::nullopt;
+            }
+            this->hits.fetch_add(1, std::memory_order_relaxed);
+            this->entries.splice(this->entries.begin(), this->entries, it->second);
+            return it->second->second;
+        }
+
+        void put(const Key &key, Value value)
+        {
+            if (this->capacity == 0)
+            {
+                return;
+            }
+            std::lock_guard<std::mutex> lock(this->mutex);
+            auto it = this->positions.find(key);
+            if (it != this->positions.end())
+            {
+                it->second->second = std::move(value);
+                this->entries.splice(this->entries.begin(), this->entries, it->second);
+                return;
+            }
+            if (this->entries.size() >= this->capacity)
+            {
+                this->positions.erase(this->entries.back().first);
+                this->entries.pop_back();
+            }
+            this->entries.emplace_front(key, std::move(value));
+            this->positions[key] = this->entries.begin();
+        }
+
+        void erase(const Key &key)
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            auto it = this->positions.find(key);
+            if (it != this->positions.end())
+            {
+                this->entries.erase(it->second);
+                this->positions.erase(it);
+            }
+        }
+
+        void clear()
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->entries.clear();
+            this->positions.clear();
+        }
+
+        size_t size() const
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            return this->entries.size();
+        }
+
+        size_t max_size() const { return this->capacity; }
+        uint64_t hit_count() const { return this->hits.load(std::memory_order_relaxed); }
+        uint64_t miss_count() const { return this->misses.load(std::memory_order_relaxed); }
+    };
+
+    // LruCache split into independently locked shards by key hash, so concurrent readers of
+    // different keys rarely wait on the same mutex. Small caches keep a single shard and therefore
+    // exact LRU order; larger ones are split so each shard still holds at least MIN_SHARD_ENTRIES.
+    template <typename Key, typename Value>
+    class ShardedLruCache
+    {
+    private:
+        static constexpr size_t MAX_SHARDS = 16;
+        static constexpr size_t MIN_SHARD_ENTRIES = 64;
+
+        std::vector<std::unique_ptr<LruCache<Key, Value>>> shards;
+
+        LruCache<Key, Value> &shard(const Key &key) const
+        {
+            return *this->shards[std::hash<Key>{}(key) % this->shards.size()];
+        }
+
+    public:
+        explicit ShardedLruCache(size_t capacity)
+        {
+            const size_t count = std::max<size_t>(1, std::min(MAX_SHARDS, capacity / MIN_SHARD_ENTRIES));
+            for (size_t i = 0; i < count; ++i)
+            {
+                // Spread the capacity so the shards add up to exactly `capacity`
+                this->shards.push_back(std::make_unique<LruCache<Key, Value>>(capacity / count + (i < capacity % count)));
+            }
+        }
+
+        std::optional<Value> get(const Key &key) { return this->shard(key).get(key); }
+        void put(const Key &key, Value value) { this->shard(key).put(key, std::move(value)); }
+        void erase(const Key &key) { this->shard(key).erase(key); }
+
+        void clear()
+        {
+            for (auto &shard : this->shards)
+            {
+                shard->clear();
+            }
+        }
+
+        size_t size() const { return this->sum(&LruCache<Key, Value>::size); }
+        size_t max_size() const { return this->sum(&LruCache<Key, Value>::max_size); }
+        uint64_t hit_count() const { return this->sum(&LruCache<Key, Value>::hit_count); }
+        uint64_t miss_count() const { return this->sum(&LruCache<Key, Value>::miss_count); }
+
+    private:
+        template <typename Result>
+        Result sum(Result (LruCache<Key, Value>::*stat)() const) const
+        {
+            Result total = 0;
+            for (const auto &shard : this->shards)
+            {
+                total += ((*shard).*stat)();
+            }
+            return total;
+        }
+    };
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <utility>
+#include <vector>
+
+namespace FunDB
+{
+    // Files written front to back (compacted data files, name runs, snapshots) are buffered and
+    // appended in chunks this large
+    constexpr size_t WRITE_CHUNK_BYTES = 1 << 20;
+
+    // Owns an open file descriptor and a shared memory mapping of the whole file. The mapping
+    // reserves address space past the end of the file, so growing the file only needs a new
+    // mapping (and a new data()) once it outgrows the reservation.
+    class MappedFile
+    {
+    private:
+        int fd{-1};
+        char *base{nullptr};
+        // Bytes of the file, and bytes of address space mapped for it
+        size_t length{0};
+        size_t reserved{0};
+        bool writable{false};
+        void unmap();
+
+    public:
+        MappedFile() = default;
+        // Opens or creates `path` for reading and appending; `writable` also maps it writable
+        MappedFile(const std::filesystem::path &path, bool writable);
+        // Map an existing file that is only ever read, so it may be read-only on disk or on a
+        // read-only mount
+        static MappedFile open_read_only(const std::filesystem::path &path);
+        ~MappedFile();
+
+        MappedFile(const MappedFile &) = delete;
+        MappedFile &operator=(const MappedFile &) = delete;
+        MappedFile(MappedFile &&other) noexcept;
+        MappedFile &operator=(MappedFile &&other) noexcept;
+
+        // Pick up the file's current size on disk (e.g. after it has been appended to), mapping it
+        // afresh only if it no longer fits in the reserved address space
+        void remap();
+        // Truncate or extend the file to `size` bytes and re-map it
+        void resize(size_t size);
+        // Write `size` bytes at the end of the file, re-map it and return the offset they were written at
+        uint64_t append(const void *buffer, size_t size);
+        // Like append, but leaves the mapping as it is, so it stays valid for concurrent readers
+        uint64_t write_at_end(const void *buffer, size_t size);
+        // Flush the mapping (if writable) and the file contents to stable storage
+        void sync();
+        // Ask the kernel to start reading the pages covering [offset, offset + size) in the
+        // background, so touching them later does not block on the disk one page at a time
+        void prefetch(uint64_t offset, size_t size) const;
+        // Prefetch many (offset, size) ranges, merging those a few pages apart into one request
+        void prefetch(std::vector<std::pair<uint64_t, size_t>> ranges) const;
+        void close();
+
+        bool is_open() const { return this->fd >= 0; }
+        int descriptor() const { return this->fd; }
+        const char *data() const { return this->base; }
+        char *data() { return this->base; }
+        size_t size() const { return this->length; }
+    };
+}
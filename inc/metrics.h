@@ -0,0 +1,220 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Instrumentation is compiled in unless the build defines FUNDB_METRICS=0 (CMake option
+// FUNDB_METRICS=OFF), in which case Metrics, ScopedTimer and StripedCounter are empty and every
+// call to them compiles away.
+#ifndef FUNDB_METRICS
+#define FUNDB_METRICS 1
+#endif
+
+// Every operation is counted, but reading the clock costs about as much as an index lookup, so
+// only one in this many operations (a power of two) of each thread is timed
+#ifndef FUNDB_METRICS_SAMPLE_INTERVAL
+#define FUNDB_METRICS_SAMPLE_INTERVAL 8
+#endif
+
+namespace FunDB
+{
+    // Operations whose latency is recorded
+    enum class Operation : size_t
+    {
+        // Probing the index for a name
+        Lookup,
+        // load_cached as a whole, cache hit or miss; load_many counts once
+        Load,
+        // Decoding a record into a Function and compiling it, on a cache miss
+        Parse,
+        // Evaluating a stored function, per call (a batch counts once)
+        Evaluate,
+        // save_function, including any wait for durability; write_batch counts once
+        Store,
+    };
+    constexpr size_t OPERATION_COUNT = 5;
+    const char *operation_name(Operation operation);
+
+    // --- Log-linear latency histogram in nanoseconds, in the style of HdrHistogram ---
+    // Values below 16 have a bucket each; above that every power of two is split into 8 buckets,
+    // so a bucket's bounds are within 12.5% of any value in it. Values from 2^40 ns (about 18
+    // minutes) up share the last bucket.
+    struct LatencyHistogram
+    {
+        static constexpr size_t SUB_BUCKETS = 8;
+        static constexpr size_t LINEAR_BUCKETS = 2 * SUB_BUCKETS;
+        static constexpr size_t MAX_EXPONENT = 40;
+        static constexpr size_t BUCKETS = LINEAR_BUCKETS + (MAX_EXPONENT - 4) * SUB_BUCKETS;
+
+        std::vector<uint64_t> counts = std::vector<uint64_t>(BUCKETS);
+        uint64_t count{0};
+        uint64_t sum_ns{0};
+        uint64_t max_ns{0};
+
+        static size_t bucket_of(uint64_t ns);
+        // Smallest value that falls in the bucket after `bucket`
+        static uint64_t bucket_end(size_t bucket);
+        // Estimated value below which a fraction `q` of the samples fall; 0 without samples
+        uint64_t quantile(double q) const;
+        // Samples in buckets that end at or below `ns`
+        uint64_t count_at_most(uint64_t ns) const;
+    };
+
+    // Number of linear probes a lookup took; longer probes share the last entry
+    constexpr size_t MAX_RECORDED_PROBES = 32;
+
+    struct MetricsSnapshot
+    {
+        // Operations performed, counted exactly
+        std::array<uint64_t, OPERATION_COUNT> counts{};
+        // Latencies of the sampled operations
+        std::array<LatencyHistogram, OPERATION_COUNT> operations;
+        // probe_lengths[n] counts lookups that compared n occupied slots before stopping
+        std::vector<uint64_t> probe_lengths = std::vector<uint64_t>(MAX_RECORDED_PROBES + 1);
+        // Record bytes copied out of the data file on cache misses
+        uint64_t bytes_read{0};
+    };
+
+#if FUNDB_METRICS
+    constexpr size_t METRIC_STRIPES = 16;
+    // Stripe of the calling thread: threads are numbered as they first record anything and keep
+    // their stripe for good
+    size_t metric_stripe();
+
+    // Counters and histograms kept in a block per thread. A thread registers its block the first
+    // time it records and is the only one that writes to it, so recording is a relaxed load and
+    // store rather than a locked add; a snapshot sums the blocks.
+    class Metrics
+    {
+    private:
+        struct alignas(64) ThreadBlock
+        {
+            std::array<std::atomic<uint64_t>, OPERATION_COUNT> counts{};
+            std::array<std::array<std::atomic<uint64_t>, LatencyHistogram::BUCKETS>, OPERATION_COUNT> buckets{};
+            std::array<std::atomic<uint64_t>, OPERATION_COUNT> sums{};
+            std::array<std::atomic<uint64_t>, OPERATION_COUNT> maxima{};
+            std::array<std::atomic<uint64_t>, MAX_RECORDED_PROBES + 1> probes{};
+            std::atomic<uint64_t> bytes_read{0};
+            // Operations counted, for choosing which to time; only the owning thread reads it
+            uint32_t operations{0};
+        };
+        // Tells this Metrics apart in the threads' caches of their blocks, which outlive it
+        const uint64_t id;
+        mutable std::mutex mutex;
+        // Guarded by `mutex`. A thread that starts after another has exited may get its block.
+        std::unordered_map<std::thread::id, std::unique_ptr<ThreadBlock>> blocks;
+
+        struct CachedBlock
+        {
+            uint64_t owner;
+            ThreadBlock *block;
+        };
+        // Blocks the calling thread has used lately, by the id of their Metrics
+        static thread_local std::vector<CachedBlock> cached_blocks;
+
+        ThreadBlock &block();
+        ThreadBlock &register_thread();
+
+    public:
+        static constexpr bool enabled = true;
+
+        Metrics();
+        Metrics(const Metrics &) = delete;
+        Metrics &operator=(const Metrics &) = delete;
+
+        // Count one `operation`; true if it should also be timed and passed to record
+        bool count(Operation operation);
+        void record(Operation operation, uint64_t ns);
+        void record_probes(size_t probes);
+        void add_bytes_read(uint64_t bytes);
+        MetricsSnapshot snapshot() const;
+    };
+
+    // Counts an operation and, if it is sampled, records the time from construction to destruction
+    class ScopedTimer
+    {
+    private:
+        Metrics &metrics;
+        Operation operation;
+        bool timed;
+        std::chrono::steady_clock::time_point start;
+
+    public:
+        ScopedTimer(Metrics &metrics, Operation operation)
+            : metrics(metrics), operation(operation), timed(metrics.count(operation))
+        {
+            if (this->timed)
+            {
+                this->start = std::chrono::steady_clock::now();
+            }
+        }
+        ~ScopedTimer()
+        {
+            if (this->timed)
+            {
+                auto elapsed = std::chrono::steady_clock::now() - this->start;
+                this->metrics.record(this->operation, std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+            }
+        }
+        ScopedTimer(const ScopedTimer &) = delete;
+        ScopedTimer &operator=(const ScopedTimer &) = delete;
+    };
+
+    // A single count in cache-line-aligned stripes, each thread adding to its own, for events
+    // recorded from many threads that are rare next to a lookup
+    class StripedCounter
+    {
+    private:
+        struct alignas(64) Stripe
+        {
+            std::atomic<int64_t> value{0};
+        };
+        std::unique_ptr<Stripe[]> stripes{new Stripe[METRIC_STRIPES]};
+
+    public:
+        void add(int64_t delta) { this->stripes[metric_stripe()].value.fetch_add(delta, std::memory_order_relaxed); }
+        int64_t value() const
+        {
+            int64_t total = 0;
+            for (size_t i = 0; i < METRIC_STRIPES; ++i)
+            {
+                total += this->stripes[i].value.load(std::memory_order_relaxed);
+            }
+            return total;
+        }
+    };
+#else
+    class Metrics
+    {
+    public:
+        static constexpr bool enabled = false;
+
+        bool count(Operation) { return false; }
+        void record(Operation, uint64_t) {}
+        void record_probes(size_t) {}
+        void add_bytes_read(uint64_t) {}
+        MetricsSnapshot snapshot() const { return {}; }
+    };
+
+    class ScopedTimer
+    {
+    public:
+        ScopedTimer(Metrics &, Operation) {}
+    };
+
+    class StripedCounter
+    {
+    public:
+        void add(int64_t) {}
+        int64_t value() const { return 0; }
+    };
+#endif
+}
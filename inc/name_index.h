@@ -0,0 +1,74 @@
+#pragma once
+
+#include "mapped_file.h"
+
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <optional>
+#include <set>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace FunDB
+{
+    // --- Every stored name in sorted order, for prefix and range scans ---
+    // Names are kept in an immutable sorted run on disk plus an in-memory set of the names added
+    // since the run was written. Once the set outgrows an eighth of the run, the two are merged
+    // into a new run with one sequential write. The first name of every block of BLOCK_NAMES names
+    // in the run is kept in memory, so a scan finds its start with a binary search and reads on
+    // sequentially from there. Names are never removed, except all at once by clear(). The run's
+    // header records the size and generation of the data file whose names it holds.
+    class NameIndex
+    {
+    public:
+        static constexpr size_t BLOCK_NAMES = 64;
+
+        // A run file as written by merged(), ready to be swapped in by install()
+        struct Run
+        {
+            MappedFile file;
+            // First name of each block and its offset in the file
+            std::vector<std::pair<std::string, uint64_t>> blocks;
+            uint64_t count{0};
+        };
+
+    private:
+        const std::filesystem::path path;
+        const std::filesystem::path new_path;
+        Run run;
+        std::set<std::string, std::less<>> added;
+
+        bool in_run(std::string_view name) const;
+        // Offset of the first name of the run that is not less than `name`
+        uint64_t seek(std::string_view name) const;
+
+    public:
+        explicit NameIndex(std::filesystem::path path);
+
+        // Map the run on disk; the size of the data file whose names it holds, or nullopt if
+        // there is no usable run
+        std::optional<uint64_t> load();
+        // Generation of the data file the run was written for; only after load() found a run
+        uint32_t generation() const;
+        // Drop the run and the added names and remove the file
+        void clear();
+        // Record a name saved for the first time; no effect if the run holds it already
+        void add(std::string_view name);
+        bool has_added() const { return !this->added.empty(); }
+        bool merge_due() const;
+        // Write the run merged with the added names, or `names` (in any order) instead of either,
+        // to a new file covering the first `data_bytes` of generation `generation` of the data file
+        Run merged(uint64_t data_bytes, uint32_t generation) const;
+        Run build(std::vector<std::string> names, uint64_t data_bytes, uint32_t generation) const;
+        // Swap in a run from merged() or build(); the added names it was written from are dropped
+        void install(Run run);
+        // Record that the run holds the names of the first `data_bytes` of the data file; callers
+        // check has_added() first
+        void set_covered_bytes(uint64_t data_bytes);
+        // Up to `limit` names in [lo, hi) in order; without `hi` the range is unbounded
+        std::vector<std::string> range(std::string_view lo, const std::optional<std::string> &hi, size_t limit) const;
+    };
+}
@@ -0,0 +1,179 @@
+#pragma once
+
+#include "db.h"
+#include "wire.h"
+#include "worker_pool.h"
+
+#include "nlohmann/json.hpp"
+
+#include <sys/epoll.h>
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+namespace FunDB
+{
+    // --- HTTP and binary protocol handling for my_app_server ---
+    // Each EventLoop owns the Connections accepted on its thread and feeds them to process_input()
+    // as bytes arrive; everything here except EventLoop and open_listener() works on the
+    // connection's buffers alone, so it can be driven without sockets.
+
+    // Requests larger than this are refused instead of buffered
+    constexpr size_t MAX_HEADER_BYTES = 64 * 1024;
+    constexpr size_t MAX_BODY_BYTES = 64 * 1024 * 1024;
+    // A connection stops evaluating once this much output is waiting for the client, and stops
+    // reading once its input buffer is this full as well, so a slow reader cannot make the server buffer
+    // a whole batch
+    constexpr size_t OUTPUT_HIGH_WATER = 256 * 1024;
+    constexpr size_t MAX_BUFFERED_INPUT = 1024 * 1024;
+    // Longest NDJSON line accepted by /evaluate_batch
+    constexpr size_t MAX_LINE_BYTES = 1024 * 1024;
+    // Distinct functions a batch keeps looked up at once
+    constexpr size_t MAX_BATCH_FUNCTIONS = 4096;
+
+    struct HttpRequest
+    {
+        std::string method;
+        std::string path;
+        // Everything after '?' in the request target
+        std::string query;
+        std::string version;
+        // Header names are lower-cased
+        std::unordered_map<std::string, std::string> headers;
+        std::string body;
+        // Body bytes left on the connection for the handler to consume as they arrive; only streamed
+        // NDJSON requests to /evaluate_batch leave their body unread
+        size_t unread_body = 0;
+    };
+
+    struct HttpResponse
+    {
+        std::string status_line = "HTTP/1.1 200 OK\r\n";
+        std::string content_type = "application/json";
+        std::string body;
+    };
+
+    // --- /evaluate_batch: results are streamed as NDJSON lines in a chunked response ---
+    // The items come either from a JSON body, parsed up front, or from an NDJSON body that is read
+    // line by line as it arrives. Only a bounded window of either is evaluated ahead of the client.
+    struct BatchStream
+    {
+        bool keep_alive = true;
+        // Function used for items that are just a set of values
+        std::string default_name;
+        // Functions are looked up once per distinct name; nullptr records a missing name
+        std::unordered_map<std::string, std::shared_ptr<const FunDB::CachedFunction>> functions;
+        // JSON body: the items, the next one to evaluate, and whether they are (name, values) pairs
+        nlohmann::json items;
+        size_t next_item = 0;
+        bool pairs = false;
+        // NDJSON body: bytes still to be read from the connection
+        bool ndjson = false;
+        size_t body_remaining = 0;
+    };
+
+    // Per-connection state, owned by the event loop the connection was accepted on
+    struct Connection
+    {
+        std::string input;
+        std::string output;
+        size_t output_sent = 0;
+        bool close_after_write = false;
+        // The client has shut down its side; answer what it sent, then close
+        bool peer_closed = false;
+        // Accepted on the binary protocol listener rather than the HTTP one
+        bool binary = false;
+        std::optional<BatchStream> batch;
+        // Tells connections apart after one closes and its descriptor is reused
+        uint64_t id = 0;
+        // A request is being answered off the event loop; the requests after it wait their turn
+        bool waiting = false;
+    };
+
+    // A request answered off the event loop: it runs on another thread and returns what to do to
+    // the connection, which the loop then applies on its own thread
+    using DeferredWork = std::function<std::function<void(Connection &)>()>;
+    // Takes DeferredWork for one connection and sees that its result is applied
+    using Deferrer = std::function<void(DeferredWork)>;
+
+    enum class ParseResult
+    {
+        Incomplete,
+        Complete,
+        Invalid,
+    };
+
+    // Route one request to the database and build its JSON response
+    HttpResponse handle_request(Database &database, const HttpRequest &request);
+
+    // Parse the request starting at `offset` in `conn.input`, once its headers and whole body have arrived.
+    // Sets `consumed` to the request's length in bytes. Invalid requests get an error response queued.
+    ParseResult parse_request(Connection &conn, size_t offset, HttpRequest &request, size_t &consumed);
+
+    // Answer one binary protocol request, appending the response frame to `out`
+    void handle_binary_request(Database &database, const WireFrame &frame, std::string &out);
+
+    // Answer the complete requests in `conn.input`, in order, until output backs up, and erase them.
+    // Returns whether anything was consumed or produced, so the caller knows whether to try again.
+    // Stores that have to wait for a sync (see Database::set_durability) are passed to `defer`,
+    // if given, and leave the connection `waiting` until their result has been applied.
+    bool process_input(Database &database, Connection &conn, const Deferrer &defer = nullptr);
+
+    struct Completions;
+
+    // One reactor: accepts from the shared listening sockets and serves its connections on the
+    // thread that runs it. Requests that would block it on a sync run on `blocking_work`, and their
+    // answers come back through completion_fd().
+    class EventLoop
+    {
+    private:
+        Database &database;
+        WorkerPool &blocking_work;
+        const int server_fd;
+        const int binary_fd;
+        int epoll_fd = -1;
+        // Shared with the deferred work, which may still be running when the loop is destroyed
+        std::shared_ptr<Completions> completions;
+        std::unordered_map<int, Connection> connections;
+        uint64_t last_id = 0;
+        // Connections closed while dispatching the current batch
+        std::vector<int> closed;
+        std::vector<std::tuple<int, uint64_t, std::function<void(Connection &)>>> done;
+
+        void accept_from(int listen_fd);
+        Deferrer defer_for(int fd, uint64_t id);
+        void serve(int fd, Connection &conn, uint32_t events);
+        void apply_completions();
+
+    public:
+        // `binary_fd` may be -1. Throws std::runtime_error if the epoll instance or eventfd cannot be created.
+        EventLoop(Database &database, int server_fd, int binary_fd, WorkerPool &blocking_work);
+        // Closes the connections still open
+        ~EventLoop();
+
+        EventLoop(const EventLoop &) = delete;
+        EventLoop &operator=(const EventLoop &) = delete;
+
+        // Serve `fd`, a non-blocking client socket, as if it had been accepted from the HTTP
+        // listener, or from the binary one if `binary` is set
+        void adopt(int fd, bool binary);
+        // Handle one batch of events as epoll_wait returned it
+        void dispatch(const epoll_event *events, int count);
+        // Wait for events and dispatch them until epoll_wait fails
+        void run();
+        // Readable while finished deferred work waits to be dispatched
+        int completion_fd() const;
+    };
+
+    // Run an EventLoop until it fails, reporting why; for use as a thread's body
+    void run_event_loop(Database &database, int server_fd, int binary_fd, WorkerPool &blocking_work);
+
+    // Non-blocking socket listening on `port` on all interfaces, or -1 after reporting why not
+    int open_listener(int port, int backlog);
+}
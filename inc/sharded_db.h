@@ -0,0 +1,59 @@
+#pragma once
+
+#include "db.h"
+
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace FunDB
+{
+    // Partitions names by hash across independent Databases, each with its own data file, index,
+    // cache and locks. Writers to different shards never wait for each other, each index only
+    // holds its share of the names, and bulk operations run one thread per shard.
+    class ShardedDatabase
+    {
+    private:
+        std::vector<std::unique_ptr<Database>> shards;
+
+    public:
+        // Shard i keeps its files in `<base_name>.<i>.dat` and `<base_name>.<i>.idx`. The shard
+        // count is recorded in `<base_name>.shards`; opening with another count throws, since names
+        // would be looked for in the wrong shard. `cache_entries` is split evenly between shards.
+        explicit ShardedDatabase(std::string base_name = "functions", size_t shard_count = 8, size_t initial_capacity = 1024, size_t cache_entries = 4096);
+
+        size_t shard_count() const { return this->shards.size(); }
+        // Index of the shard that holds `name`
+        size_t shard_of(std::string_view name) const;
+        // The shard that holds `name`, e.g. to pass to evaluate_stored_function
+        const Database &shard_for(std::string_view name) const { return *this->shards[this->shard_of(name)]; }
+        Database &shard(size_t i) { return *this->shards.at(i); }
+        const Database &shard(size_t i) const { return *this->shards.at(i); }
+
+        void clear();
+        size_t size() const;
+        void save_function(const Function &func);
+        // Split `functions` by shard and write each part with Database::write_batch, in parallel
+        void write_batch(const std::vector<Function> &functions);
+        std::optional<Function> load_function(std::string_view name) const;
+        bool contains(std::string_view name) const;
+        std::shared_ptr<const CachedFunction> load_cached(std::string_view name) const;
+        // Database::load_many on each shard for its part of `names`; results are in the order of `names`
+        std::vector<std::shared_ptr<const CachedFunction>> load_many(const std::vector<std::string_view> &names) const;
+        // Every stored name, listing the shards in parallel
+        std::vector<std::string> names() const;
+        // Call `visit` for every stored function. Shards are scanned in parallel, so `visit` is called
+        // from several threads at once. Each shard is read in file order without going through
+        // its cache (see Database::for_each).
+        void for_each(const std::function<void(const Function &)> &visit) const;
+        // Compact every shard in parallel
+        std::vector<CompactionStats> compact();
+        void set_durability(const DurabilityOptions &options);
+        void set_optimize_on_store(bool enabled);
+        void checkpoint();
+        std::vector<DatabaseStats> stats() const;
+    };
+}
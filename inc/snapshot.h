@@ -0,0 +1,102 @@
+#pragma once
+
+#include "mapped_file.h"
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace FunDB
+{
+    // --- Immutable image of a database, for deployments that only read after a bulk load ---
+    // The image holds every function's record back to back in name order, then the records of the
+    // template shapes, followed by a minimal perfect hash over the names and the record offsets in
+    // name order. The hash is CHD-style:
+    // a name's hash picks a bucket, the bucket's pilot picks the name's slot, and pilots are chosen
+    // when the image is written so that the n names land in n distinct slots. A lookup reads the
+    // pilot, one slot and one record; the slot keeps a 16-bit fingerprint of the name, as in the
+    // index, so most absent names stop at the slot.
+    //
+    // Records store the function's payload as the database stored it and, when it has one that
+    // needs no SymEngine, its compiled program (see CompiledFunction::encode), so loading skips
+    // lowering the expression. Functions stored as templates keep only their parameters; each
+    // shape is a record of its own, found by template id, with the program they all share.
+    // Opening maps the file and checks the header; the checksum over the rest of the image is only
+    // verified on request, since that reads all of it.
+    struct SnapshotRecord
+    {
+        std::string_view name;
+        // Payload as the database stored it, templated or not (see codec.h)
+        std::string_view payload;
+        // Compiled program as CompiledFunction::encode writes it; empty if it is compiled on load
+        std::string_view program;
+    };
+
+    // Writes an image to `<path>.new` and renames it over `path` once it is complete and synced
+    class SnapshotWriter
+    {
+    private:
+        const std::filesystem::path path;
+        const std::filesystem::path new_path;
+        MappedFile file;
+        std::string chunk;
+        // Offset of every record, in name order
+        std::vector<uint64_t> offsets;
+        // Template id and offset of every shape record
+        std::vector<std::pair<uint64_t, uint64_t>> templates;
+        std::string last_name;
+
+        void flush();
+        std::string_view name_at(uint64_t offset) const;
+        // Choose a pilot for every bucket so that the names hashed with `seed` fill every slot;
+        // false if two names collide outright and another seed is needed
+        bool place(uint64_t seed, uint64_t buckets, std::vector<uint32_t> &pilots, std::vector<uint64_t> &slots) const;
+
+    public:
+        explicit SnapshotWriter(std::filesystem::path path);
+        // Names must be added in increasing order
+        void add(std::string_view name, std::string_view payload, std::string_view program);
+        // The shape of template `template_id`, in any order relative to the names
+        void add_template(uint64_t template_id, std::string_view payload, std::string_view program);
+        // Build the hash, write the tables and header and install the image; returns its size in bytes
+        uint64_t finish();
+    };
+
+    class Snapshot
+    {
+    private:
+        MappedFile file;
+        uint64_t count{0};
+        uint64_t buckets{0};
+        uint64_t seed{0};
+        uint64_t records_end{0};
+        const uint32_t *pilots{nullptr};
+        const uint64_t *slots{nullptr};
+        const uint64_t *sorted{nullptr};
+        // (template id, offset) pairs in id order
+        const uint64_t *template_table{nullptr};
+        uint64_t template_count{0};
+
+        SnapshotRecord record_at(uint64_t offset) const;
+
+    public:
+        // Map the image at `path`; throws if it is missing or not a complete image. With `verify`,
+        // also checks the checksum over the whole image.
+        explicit Snapshot(const std::filesystem::path &path, bool verify = false);
+
+        size_t size() const { return this->count; }
+        uint64_t bytes() const { return this->file.size(); }
+        // The record of `name`, or nullopt if the image does not hold it
+        std::optional<SnapshotRecord> find(std::string_view name) const;
+        // The shape record of template `template_id`, or nullopt
+        std::optional<SnapshotRecord> find_template(uint64_t template_id) const;
+        // The record of the `rank`-th name in sorted order
+        SnapshotRecord at(size_t rank) const;
+        // Rank of the first name not less than `name`
+        size_t lower_bound(std::string_view name) const;
+    };
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include "bytes.h"
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+namespace FunDB
+{
+    // --- Binary protocol spoken by my_app_server's second listener and FunDB::Client ---
+    // Every message is a frame: [u32 length][u8 code][u32 request id][payload], where length
+    // counts the bytes after itself. Requests carry an opcode and responses a status; a response
+    // echoes its request's id. Requests may be pipelined and are answered in order. Fixed-width
+    // values use ByteWriter's host byte order (little-endian on every supported platform), doubles
+    // travel as raw IEEE-754 and strings are u32-length-prefixed.
+    //
+    //   Store          name, u32 n, n symbols, expression text  ->  (empty)
+    //   Load           name                                     ->  u32 n, n symbols, expression text
+    //   Evaluate       name, u32 n, n doubles in symbol order   ->  double
+    //   EvaluateBatch  name, u32 rows, u32 n, n columns of rows doubles  ->  rows doubles
+    //
+    // NotFound and Error responses carry a message string.
+    enum class WireOp : uint8_t
+    {
+        Store = 1,
+        Load = 2,
+        Evaluate = 3,
+        EvaluateBatch = 4,
+    };
+
+    enum class WireStatus : uint8_t
+    {
+        Ok = 0,
+        NotFound = 1,
+        Error = 2,
+    };
+
+    constexpr int DEFAULT_BINARY_PORT = 6375;
+    constexpr size_t WIRE_HEADER_BYTES = sizeof(uint32_t) + sizeof(uint8_t) + sizeof(uint32_t);
+    // Frames larger than this are refused
+    constexpr uint32_t MAX_WIRE_FRAME_BYTES = 64 * 1024 * 1024;
+
+    struct WireFrame
+    {
+        uint8_t code;
+        uint32_t id;
+        std::string_view payload;
+    };
+
+    // Append a frame for `payload` to `out`
+    inline void append_wire_frame(std::string &out, uint8_t code, uint32_t id, std::string_view payload)
+    {
+        ByteWriter writer(out);
+        writer.put<uint32_t>(sizeof(uint8_t) + sizeof(uint32_t) + payload.size());
+        writer.put<uint8_t>(code);
+        writer.put<uint32_t>(id);
+        writer.put_bytes(payload);
+    }
+
+    // Parse the frame at the start of `buffer`. Returns its total size, or 0 if it has not fully
+    // arrived yet; throws if the frame is malformed or too large.
+    inline size_t parse_wire_frame(std::string_view buffer, WireFrame &frame)
+    {
+        if (buffer.size() < sizeof(uint32_t))
+        {
+            return 0;
+        }
+        uint32_t length;
+        std::memcpy(&length, buffer.data(), sizeof(length));
+        if (length < WIRE_HEADER_BYTES - sizeof(uint32_t) || length > MAX_WIRE_FRAME_BYTES)
+        {
+            throw std::runtime_error("Invalid frame length.");
+        }
+        if (buffer.size() - sizeof(uint32_t) < length)
+        {
+            return 0;
+        }
+        ByteReader reader(buffer.substr(sizeof(uint32_t), length), "Invalid frame.");
+        frame.code = reader.get<uint8_t>();
+        frame.id = reader.get<uint32_t>();
+        frame.payload = buffer.substr(WIRE_HEADER_BYTES, length - (WIRE_HEADER_BYTES - sizeof(uint32_t)));
+        return sizeof(uint32_t) + length;
+    }
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace FunDB
+{
+    // A bounded set of threads that run submitted tasks in the order they arrive. Threads are
+    // started as tasks need them, up to the limit; beyond that, tasks wait in the queue, so
+    // submitting at any rate never creates more than `max_threads` threads.
+    class WorkerPool
+    {
+    private:
+        const size_t max_threads;
+        mutable std::mutex mutex;
+        std::condition_variable work_available;
+        std::deque<std::function<void()>> tasks;
+        std::vector<std::thread> threads;
+        // Threads waiting for a task
+        size_t idle{0};
+        bool stopping{false};
+
+        void post(std::function<void()> task);
+        void run();
+
+    public:
+        explicit WorkerPool(size_t max_threads);
+        // Runs the tasks still queued, then joins the threads
+        ~WorkerPool();
+
+        WorkerPool(const WorkerPool &) = delete;
+        WorkerPool &operator=(const WorkerPool &) = delete;
+
+        // Queue `task`; the future holds its result, or the exception it threw
+        template <typename Task>
+        std::future<std::invoke_result_t<Task>> submit(Task task)
+        {
+            using Result = std::invoke_result_t<Task>;
+            auto packaged = std::make_shared<std::packaged_task<Result()>>(std::move(task));
+            std::future<Result> result = packaged->get_future();
+            this->post([packaged]
+                       { (*packaged)(); });
+            return result;
+        }
+
+        size_t capacity() const { return this->max_threads; }
+        // Threads started so far; never more than capacity()
+        size_t thread_count() const;
+
+        // Pool for background loads, shared by every Database. Loads mostly wait for the disk, so
+        // it has a few threads more than the hardware, but at least four.
+        static WorkerPool &shared();
+    };
+}
@@ -0,0 +1,199 @@
+#include "../inc/bloom_filter.h"
+#include "../inc/hash.h"
+#include <cstring>
+
+namespace FunDB
+{
+    // --- Filter file layout: a 64-byte header followed by the blocks ---
+    static constexpr char BLOOM_MAGIC[8] = {'F', 'U', 'N', 'D', 'B', 'B', 'L', 'M'};
+    static constexpr uint32_t BLOOM_VERSION = 1;
+
+    struct BloomHeader
+    {
+        char magic[8];
+        uint32_t version;
+        // Generation of the data file the filter was built for (see Database)
+        uint32_t generation;
+        // Number of blocks, a power of two
+        uint64_t blocks;
+        // Names that set at least one new bit, which is about every name added
+        uint64_t names;
+        // Size of the data file whose names the filter holds; names of later records are added on load
+        uint64_t covered_bytes;
+        uint8_t padding[24];
+    };
+    static_assert(sizeof(BloomHeader) == 64, "Blocks must start on a cache line");
+
+    static constexpr size_t BLOCK_BITS = 512;
+    static constexpr size_t PROBES = 8;
+    // Space the filter is sized with, and the smallest filter built
+    static constexpr size_t BITS_PER_NAME = 12;
+    static constexpr uint64_t MIN_BLOCKS = 16;
+
+    static inline const BloomHeader *filter_header(const MappedFile &file)
+    {
+        return reinterpret_cast<const BloomHeader *>(file.data());
+    }
+
+    static inline BloomHeader *filter_header(MappedFile &file)
+    {
+        return reinterpret_cast<BloomHeader *>(file.data());
+    }
+
+    // The filter is given the index's hash of each name, so a lookup hashes the name once. It
+    // remixes that hash, so names sharing index slots or fingerprints do not also share filter bits
+    static inline uint64_t filter_hash(uint64_t hash)
+    {
+        hash = (hash ^ (hash >> 30)) * 0xBF58476D1CE4E5B9;
+        hash = (hash ^ (hash >> 27)) * 0x94D049BB133111EB;
+        return hash ^ (hash >> 31);
+    }
+
+    // Offset of the block for `hash`, chosen by the high half of the hash
+    static inline size_t block_offset(const MappedFile &file, uint64_t hash)
+    {
+        return sizeof(BloomHeader) + ((hash >> 32) & (filter_header(file)->blocks - 1)) * (BLOCK_BITS / 8);
+    }
+
+    // Bit `i` of the name's block, by double hashing the low half of its hash
+    static inline size_t probe_bit(uint64_t hash, size_t i)
+    {
+        const size_t start = hash & (BLOCK_BITS - 1);
+        const size_t step = ((hash >> 9) & (BLOCK_BITS - 1)) | 1;
+        return (start + i * step) & (BLOCK_BITS - 1);
+    }
+
+    BloomFilter::BloomFilter(std::filesystem::path path)
+        : path(path), new_path(path.string() + ".new")
+    {
+    }
+
+    std::optional<uint64_t> BloomFilter::load()
+    {
+        this->file.close();
+        std::filesystem::remove(this->new_path);
+        if (!std::filesystem::exists(this->path))
+        {
+            return std::nullopt;
+        }
+        MappedFile loaded(this->path, true);
+        const BloomHeader *header = filter_header(loaded);
+        if (loaded.size() < sizeof(BloomHeader) || std::memcmp(header->magic, BLOOM_MAGIC, sizeof(BLOOM_MAGIC)) != 0 ||
+            header->version != BLOOM_VERSION || header->blocks == 0 || (header->blocks & (header->blocks - 1)) != 0 ||
+            loaded.size() != sizeof(BloomHeader) + header->blocks * (BLOCK_BITS / 8))
+        {
+            return std::nullopt;
+        }
+        const uint64_t covered_bytes = header->covered_bytes;
+        this->file = std::move(loaded);
+        return covered_bytes;
+    }
+
+    void BloomFilter::clear()
+    {
+        this->file.close();
+        std::filesystem::remove(this->path);
+        std::filesystem::remove(this->new_path);
+    }
+
+    void BloomFilter::insert(MappedFile &file, uint64_t name_hash)
+    {
+        const uint64_t hash = filter_hash(name_hash);
+        uint64_t *block = reinterpret_cast<uint64_t *>(file.data() + block_offset(file, hash));
+        bool changed = false;
+        for (size_t i = 0; i < PROBES; ++i)
+        {
+            const size_t bit = probe_bit(hash, i);
+            const uint64_t mask = uint64_t{1} << (bit % 64);
+            changed |= (block[bit / 64] & mask) == 0;
+            block[bit / 64] |= mask;
+        }
+        filter_header(file)->names += changed;
+    }
+
+    void BloomFilter::add(uint64_t name_hash)
+    {
+        if (this->file.is_open())
+        {
+            insert(this->file, name_hash);
+        }
+    }
+
+    bool BloomFilter::may_contain(uint64_t name_hash) const
+    {
+        if (!this->file.is_open())
+        {
+            return true;
+        }
+        const uint64_t hash = filter_hash(name_hash);
+        const uint64_t *block = reinterpret_cast<const uint64_t *>(this->file.data() + block_offset(this->file, hash));
+        for (size_t i = 0; i < PROBES; ++i)
+        {
+            const size_t bit = probe_bit(hash, i);
+            if ((block[bit / 64] & (uint64_t{1} << (bit % 64))) == 0)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool BloomFilter::grow_due() const
+    {
+        if (!this->file.is_open())
+        {
+            return false;
+        }
+        const BloomHeader *header = filter_header(this->file);
+        return header->names * BITS_PER_NAME > header->blocks * BLOCK_BITS;
+    }
+
+    MappedFile BloomFilter::build(const std::vector<std::string> &names, uint64_t data_bytes, uint32_t generation) const
+    {
+        uint64_t blocks = MIN_BLOCKS;
+        while (blocks * BLOCK_BITS < 2 * names.size() * BITS_PER_NAME)
+        {
+            blocks <<= 1;
+        }
+        std::filesystem::remove(this->new_path);
+        MappedFile table(this->new_path, true);
+        // The file is extended with zeros, which is an empty filter
+        table.resize(sizeof(BloomHeader) + blocks * (BLOCK_BITS / 8));
+        BloomHeader header{};
+        std::memcpy(header.magic, BLOOM_MAGIC, sizeof(BLOOM_MAGIC));
+        header.version = BLOOM_VERSION;
+        header.generation = generation;
+        header.blocks = blocks;
+        header.covered_bytes = data_bytes;
+        std::memcpy(table.data(), &header, sizeof(header));
+        for (const auto &name : names)
+        {
+            insert(table, hash64(name));
+        }
+        table.sync();
+        return table;
+    }
+
+    void BloomFilter::install(MappedFile table)
+    {
+        std::filesystem::rename(this->new_path, this->path);
+        this->file = std::move(table);
+    }
+
+    uint32_t BloomFilter::generation() const
+    {
+        return filter_header(this->file)->generation;
+    }
+
+    void BloomFilter::checkpoint(uint64_t data_bytes, uint32_t generation)
+    {
+        if (!this->file.is_open())
+        {
+            return;
+        }
+        // The bits are on disk before the header claims them
+        this->file.sync();
+        filter_header(this->file)->covered_bytes = data_bytes;
+        filter_header(this->file)->generation = generation;
+    }
+}
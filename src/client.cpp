@@ -0,0 +1,268 @@
+#include "../inc/client.h"
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+#include <algorithm>
+
+namespace FunDB
+{
+    Client::Client(const std::string &host, int port)
+    {
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo *addresses = nullptr;
+        int rc = ::getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &addresses);
+        if (rc != 0)
+        {
+            throw std::runtime_error("Could not resolve '" + host + "': " + ::gai_strerror(rc));
+        }
+        for (addrinfo *address = addresses; address != nullptr; address = address->ai_next)
+        {
+            this->fd = ::socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC, address->ai_protocol);
+            if (this->fd < 0)
+            {
+                continue;
+            }
+            if (::connect(this->fd, address->ai_addr, address->ai_addrlen) == 0)
+            {
+                break;
+            }
+            ::close(this->fd);
+            this->fd = -1;
+        }
+        ::freeaddrinfo(addresses);
+        if (this->fd < 0)
+        {
+            throw std::runtime_error("Could not connect to " + host + ":" + std::to_string(port) + ".");
+        }
+        // Requests are small and latency-bound, so they must not wait for Nagle's algorithm
+        int one = 1;
+        ::setsockopt(this->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    Client::~Client()
+    {
+        if (this->fd >= 0)
+        {
+            ::close(this->fd);
+        }
+    }
+
+    Client::Client(Client &&other) noexcept
+        : fd(std::exchange(other.fd, -1)),
+          next_id(other.next_id),
+          input(std::move(other.input))
+    {
+    }
+
+    Client &Client::operator=(Client &&other) noexcept
+    {
+        if (this != &other)
+        {
+            if (this->fd >= 0)
+            {
+                ::close(this->fd);
+            }
+            this->fd = std::exchange(other.fd, -1);
+            this->next_id = other.next_id;
+            this->input = std::move(other.input);
+        }
+        return *this;
+    }
+
+    uint32_t Client::send_request(WireOp op, const std::string &payload)
+    {
+        std::string frame;
+        append_wire_frame(frame, static_cast<uint8_t>(op), this->next_id, payload);
+        return this->send_requests(frame, 1);
+    }
+
+    uint32_t Client::send_requests(const std::string &frames, uint32_t count)
+    {
+        size_t sent = 0;
+        while (sent < frames.size())
+        {
+            ssize_t n = ::send(this->fd, frames.data() + sent, frames.size() - sent, MSG_NOSIGNAL);
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                throw std::runtime_error(std::string("Could not send request: ") + std::strerror(errno));
+            }
+            sent += static_cast<size_t>(n);
+        }
+        uint32_t first = this->next_id;
+        this->next_id += count;
+        return first;
+    }
+
+    std::string Client::read_response(uint32_t id, bool *not_found)
+    {
+        while (true)
+        {
+            WireFrame frame;
+            size_t size = parse_wire_frame(this->input, frame);
+            if (size > 0)
+            {
+                if (frame.id != id)
+                {
+                    throw std::runtime_error("Response out of order.");
+                }
+                WireStatus status = static_cast<WireStatus>(frame.code);
+                std::string payload(frame.payload);
+                this->input.erase(0, size);
+                if (status == WireStatus::Ok)
+                {
+                    return payload;
+                }
+                ByteReader reader(payload, "Invalid response.");
+                std::string message(reader.get_string());
+                if (status == WireStatus::NotFound && not_found != nullptr)
+                {
+                    *not_found = true;
+                    return "";
+                }
+                throw std::runtime_error(message);
+            }
+
+            char buffer[64 * 1024];
+            ssize_t n = ::recv(this->fd, buffer, sizeof(buffer), 0);
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                throw std::runtime_error("Connection closed by server.");
+            }
+            this->input.append(buffer, static_cast<size_t>(n));
+        }
+    }
+
+    void Client::store(const std::string &name, const std::vector<std::string> &symbols, const std::string &expression)
+    {
+        std::string payload;
+        ByteWriter writer(payload);
+        writer.put_string(name);
+        writer.put<uint32_t>(symbols.size());
+        for (const auto &symbol : symbols)
+        {
+            writer.put_string(symbol);
+        }
+        writer.put_string(expression);
+        this->read_response(this->send_request(WireOp::Store, payload));
+    }
+
+    std::optional<StoredFunction> Client::load(const std::string &name)
+    {
+        std::string payload;
+        ByteWriter(payload).put_string(name);
+        bool not_found = false;
+        std::string response = this->read_response(this->send_request(WireOp::Load, payload), &not_found);
+        if (not_found)
+        {
+            return std::nullopt;
+        }
+
+        ByteReader reader(response, "Invalid response.");
+        StoredFunction func{name, {}, {}};
+        uint32_t symbol_count = reader.get<uint32_t>();
+        for (uint32_t i = 0; i < symbol_count; ++i)
+        {
+            func.symbols.emplace_back(reader.get_string());
+        }
+        func.expression = std::string(reader.get_string());
+        return func;
+    }
+
+    // Payload of an Evaluate request
+    static std::string evaluate_payload(const std::string &name, const std::vector<double> &args)
+    {
+        std::string payload;
+        ByteWriter writer(payload);
+        writer.put_string(name);
+        writer.put<uint32_t>(args.size());
+        writer.put_bytes(std::string_view(reinterpret_cast<const char *>(args.data()), args.size() * sizeof(double)));
+        return payload;
+    }
+
+    static double parse_result(const std::string &response)
+    {
+        return ByteReader(response, "Invalid response.").get<double>();
+    }
+
+    double Client::evaluate(const std::string &name, const std::vector<double> &args)
+    {
+        return parse_result(this->read_response(this->send_request(WireOp::Evaluate, evaluate_payload(name, args))));
+    }
+
+    void Client::evaluate_batch(const std::string &name, const std::vector<const double *> &columns, double *out, size_t count)
+    {
+        std::string payload;
+        ByteWriter writer(payload);
+        writer.put_string(name);
+        writer.put<uint32_t>(count);
+        writer.put<uint32_t>(columns.size());
+        for (const double *column : columns)
+        {
+            writer.put_bytes(std::string_view(reinterpret_cast<const char *>(column), count * sizeof(double)));
+        }
+
+        std::string response = this->read_response(this->send_request(WireOp::EvaluateBatch, payload));
+        if (response.size() != count * sizeof(double))
+        {
+            throw std::runtime_error("Invalid response.");
+        }
+        std::memcpy(out, response.data(), response.size());
+    }
+
+    std::vector<double> Client::evaluate_pipelined(const std::string &name, const std::vector<std::vector<double>> &points)
+    {
+        // Requests go out a window at a time so neither side's buffers grow without bound while
+        // the other is not reading
+        constexpr size_t PIPELINE_WINDOW = 1024;
+        std::vector<double> results;
+        results.reserve(points.size());
+        for (size_t start = 0; start < points.size(); start += PIPELINE_WINDOW)
+        {
+            const size_t count = std::min(PIPELINE_WINDOW, points.size() - start);
+            std::string frames;
+            for (size_t i = 0; i < count; ++i)
+            {
+                append_wire_frame(frames, static_cast<uint8_t>(WireOp::Evaluate), this->next_id + i, evaluate_payload(name, points[start + i]));
+            }
+            uint32_t first = this->send_requests(frames, count);
+
+            // Every response of the window is read even after an error, so the connection stays usable
+            std::optional<std::runtime_error> error;
+            for (size_t i = 0; i < count; ++i)
+            {
+                try
+                {
+                    results.push_back(parse_result(this->read_response(first + i)));
+                }
+                catch (const std::runtime_error &e)
+                {
+                    if (!error)
+                    {
+                        error = e;
+                    }
+                }
+            }
+            if (error)
+            {
+                throw *error;
+            }
+        }
+        return results;
+    }
+}
@@ -0,0 +1,621 @@
+#include "../inc/codec.h"
+#include <symengine/add.h>
+#include <symengine/mul.h>
+#include <symengine/pow.h>
+#include <symengine/symbol.h>
+#include <symengine/integer.h>
+#include <symengine/rational.h>
+#include <symengine/real_double.h>
+#include <symengine/constants.h>
+#include <symengine/functions.h>
+#include <symengine/parser.h>
+#include <symengine/visitor.h>
+#include <algorithm>
+#include <sstream>
+#include <unordered_map>
+#include <vector>
+
+namespace FunDB
+{
+    // Node kinds of the postorder expression array; values are part of the on-disk format
+    enum class NodeKind : uint8_t
+    {
+        Integer = 1,    // i64
+        Rational = 2,   // i64 numerator, i64 denominator
+        RealDouble = 3, // raw IEEE-754 double
+        Symbol = 4,     // u32 index into the record's name table
+        Pi = 5,
+        E = 6,
+        Add = 7, // u32 argument count
+        Mul = 8, // u32 argument count
+        Pow = 9,
+        Log = 10,
+        Abs = 11,
+        Sin = 12,
+        Cos = 13,
+        Tan = 14,
+        Asin = 15,
+        Acos = 16,
+        Atan = 17,
+        Sinh = 18,
+        Cosh = 19,
+        Tanh = 20,
+        Text = 21,      // u32 length + text; anything else, parsed back with SymEngine
+        Parameter = 22, // u32 index of a template parameter
+    };
+
+    // Parameter symbols are named "\x01" followed by their index
+    static constexpr char PARAMETER_PREFIX = '\x01';
+
+    SymEngine::RCP<const SymEngine::Basic> parameter_symbol(size_t index)
+    {
+        return SymEngine::symbol(PARAMETER_PREFIX + std::to_string(index));
+    }
+
+    std::optional<size_t> parameter_index(const std::string &symbol_name)
+    {
+        if (symbol_name.size() < 2 || symbol_name.size() > 10 || symbol_name[0] != PARAMETER_PREFIX ||
+            !std::all_of(symbol_name.begin() + 1, symbol_name.end(), [](char c)
+                         { return c >= '0' && c <= '9'; }))
+        {
+            return std::nullopt;
+        }
+        return std::stoul(symbol_name.substr(1));
+    }
+
+    void check_symbols(const Function &func)
+    {
+        auto reserved = [](const std::string &name)
+        { return !name.empty() && name[0] == PARAMETER_PREFIX; };
+        bool refused = std::any_of(func.symbols.begin(), func.symbols.end(), reserved);
+        for (const auto &symbol : SymEngine::free_symbols(*func.expr.get_basic()))
+        {
+            refused = refused || reserved(SymEngine::down_cast<const SymEngine::Symbol &>(*symbol).get_name());
+        }
+        if (refused)
+        {
+            throw std::runtime_error("Symbol names cannot start with the control character \\x01.");
+        }
+    }
+
+    class ExpressionEncoder
+    {
+    public:
+        std::vector<std::string> names;
+        std::unordered_map<std::string, uint32_t> name_index;
+        std::string nodes;
+        ByteWriter writer{nodes};
+        uint32_t node_count{0};
+
+        explicit ExpressionEncoder(const std::vector<std::string> &symbols)
+        {
+            for (const auto &symbol : symbols)
+            {
+                this->name(symbol);
+            }
+        }
+
+        uint32_t name(const std::string &symbol)
+        {
+            auto [it, inserted] = this->name_index.emplace(symbol, this->names.size());
+            if (inserted)
+            {
+                this->names.push_back(symbol);
+            }
+            return it->second;
+        }
+
+        void kind(NodeKind kind)
+        {
+            this->writer.put<uint8_t>(static_cast<uint8_t>(kind));
+            ++this->node_count;
+        }
+
+        void text(const SymEngine::Basic &node)
+        {
+            this->kind(NodeKind::Text);
+            this->writer.put_string(node.__str__());
+        }
+
+        void encode(const SymEngine::RCP<const SymEngine::Basic> &node)
+        {
+            switch (node->get_type_code())
+            {
+            case SymEngine::SYMENGINE_INTEGER:
+                try
+                {
+                    int64_t value = SymEngine::down_cast<const SymEngine::Integer &>(*node).as_int();
+                    this->kind(NodeKind::Integer);
+                    this->writer.put<int64_t>(value);
+                }
+                catch (const std::exception &)
+                {
+                    this->text(*node); // Does not fit in 64 bits
+                }
+                return;
+            case SymEngine::SYMENGINE_RATIONAL:
+                try
+                {
+                    const auto &rational = SymEngine::down_cast<const SymEngine::Rational &>(*node);
+                    int64_t num = rational.get_num()->as_int();
+                    int64_t den = rational.get_den()->as_int();
+                    this->kind(NodeKind::Rational);
+                    this->writer.put<int64_t>(num);
+                    this->writer.put<int64_t>(den);
+                }
+                catch (const std::exception &)
+                {
+                    this->text(*node);
+                }
+                return;
+            case SymEngine::SYMENGINE_REAL_DOUBLE:
+                this->kind(NodeKind::RealDouble);
+                this->writer.put<double>(SymEngine::down_cast<const SymEngine::RealDouble &>(*node).as_double());
+                return;
+            case SymEngine::SYMENGINE_SYMBOL:
+            {
+                const std::string &symbol = SymEngine::down_cast<const SymEngine::Symbol &>(*node).get_name();
+                if (std::optional<size_t> parameter = parameter_index(symbol))
+                {
+                    this->kind(NodeKind::Parameter);
+                    this->writer.put<uint32_t>(*parameter);
+                    return;
+                }
+                uint32_t index = this->name(symbol);
+                this->kind(NodeKind::Symbol);
+                this->writer.put<uint32_t>(index);
+                return;
+            }
+            case SymEngine::SYMENGINE_CONSTANT:
+                if (SymEngine::eq(*node, *SymEngine::pi))
+                {
+                    this->kind(NodeKind::Pi);
+                }
+                else if (SymEngine::eq(*node, *SymEngine::E))
+                {
+                    this->kind(NodeKind::E);
+                }
+                else
+                {
+                    this->text(*node);
+                }
+                return;
+            case SymEngine::SYMENGINE_ADD:
+            case SymEngine::SYMENGINE_MUL:
+            {
+                const SymEngine::vec_basic args = node->get_args();
+                for (const auto &arg : args)
+                {
+                    this->encode(arg);
+                }
+                this->kind(SymEngine::is_a<SymEngine::Add>(*node) ? NodeKind::Add : NodeKind::Mul);
+                this->writer.put<uint32_t>(args.size());
+                return;
+            }
+            case SymEngine::SYMENGINE_POW:
+            {
+                const auto &pow = SymEngine::down_cast<const SymEngine::Pow &>(*node);
+                this->encode(pow.get_base());
+                this->encode(pow.get_exp());
+                this->kind(NodeKind::Pow);
+                return;
+            }
+            default:
+                break;
+            }
+
+            NodeKind unary;
+            switch (node->get_type_code())
+            {
+            case SymEngine::SYMENGINE_LOG:
+                unary = NodeKind::Log;
+                break;
+            case SymEngine::SYMENGINE_ABS:
+                unary = NodeKind::Abs;
+                break;
+            case SymEngine::SYMENGINE_SIN:
+                unary = NodeKind::Sin;
+                break;
+            case SymEngine::SYMENGINE_COS:
+                unary = NodeKind::Cos;
+                break;
+            case SymEngine::SYMENGINE_TAN:
+                unary = NodeKind::Tan;
+                break;
+            case SymEngine::SYMENGINE_ASIN:
+                unary = NodeKind::Asin;
+                break;
+            case SymEngine::SYMENGINE_ACOS:
+                unary = NodeKind::Acos;
+                break;
+            case SymEngine::SYMENGINE_ATAN:
+                unary = NodeKind::Atan;
+                break;
+            case SymEngine::SYMENGINE_SINH:
+                unary = NodeKind::Sinh;
+                break;
+            case SymEngine::SYMENGINE_COSH:
+                unary = NodeKind::Cosh;
+                break;
+            case SymEngine::SYMENGINE_TANH:
+                unary = NodeKind::Tanh;
+                break;
+            default:
+                this->text(*node);
+                return;
+            }
+            this->encode(node->get_args()[0]);
+            this->kind(unary);
+        }
+    };
+
+    std::string encode_function(const Function &func)
+    {
+        ExpressionEncoder encoder(func.symbols);
+        encoder.encode(func.expr.get_basic());
+
+        std::string payload;
+        ByteWriter writer(payload);
+        writer.put<char>(BINARY_RECORD_TAG);
+        writer.put<uint8_t>(BINARY_RECORD_VERSION);
+        writer.put<uint32_t>(func.symbols.size());
+        writer.put<uint32_t>(encoder.names.size());
+        for (const auto &name : encoder.names)
+        {
+            writer.put_string(name);
+        }
+        writer.put<uint32_t>(encoder.node_count);
+        writer.put_bytes(encoder.nodes);
+        return payload;
+    }
+
+    static SymEngine::RCP<const SymEngine::Basic> pop(SymEngine::vec_basic &stack)
+    {
+        if (stack.empty())
+        {
+            throw std::runtime_error("Corrupt function record: malformed expression.");
+        }
+        SymEngine::RCP<const SymEngine::Basic> top = stack.back();
+        stack.pop_back();
+        return top;
+    }
+
+    // --- Decode `node_count` postorder nodes; returns the stack of values they leave ---
+    static SymEngine::vec_basic decode_nodes(ByteReader &reader, const std::vector<std::string> &names, uint32_t node_count)
+    {
+        SymEngine::vec_basic stack;
+        for (uint32_t i = 0; i < node_count; ++i)
+        {
+            NodeKind kind = static_cast<NodeKind>(reader.get<uint8_t>());
+            switch (kind)
+            {
+            case NodeKind::Integer:
+                stack.push_back(SymEngine::integer(static_cast<long>(reader.get<int64_t>())));
+                break;
+            case NodeKind::Rational:
+            {
+                long num = static_cast<long>(reader.get<int64_t>());
+                long den = static_cast<long>(reader.get<int64_t>());
+                stack.push_back(SymEngine::rational(num, den));
+                break;
+            }
+            case NodeKind::RealDouble:
+                stack.push_back(SymEngine::real_double(reader.get<double>()));
+                break;
+            case NodeKind::Symbol:
+            {
+                uint32_t index = reader.get<uint32_t>();
+                if (index >= names.size())
+                {
+                    throw std::runtime_error("Corrupt function record: bad symbol index.");
+                }
+                stack.push_back(SymEngine::symbol(names[index]));
+                break;
+            }
+            case NodeKind::Pi:
+                stack.push_back(SymEngine::pi);
+                break;
+            case NodeKind::E:
+                stack.push_back(SymEngine::E);
+                break;
+            case NodeKind::Add:
+            case NodeKind::Mul:
+            {
+                uint32_t argc = reader.get<uint32_t>();
+                if (argc > stack.size())
+                {
+                    throw std::runtime_error("Corrupt function record: malformed expression.");
+                }
+                SymEngine::vec_basic args(stack.end() - argc, stack.end());
+                stack.resize(stack.size() - argc);
+                stack.push_back(kind == NodeKind::Add ? SymEngine::add(args) : SymEngine::mul(args));
+                break;
+            }
+            case NodeKind::Pow:
+            {
+                auto exp = pop(stack);
+                auto base = pop(stack);
+                stack.push_back(SymEngine::pow(base, exp));
+                break;
+            }
+            case NodeKind::Log:
+                stack.push_back(SymEngine::log(pop(stack)));
+                break;
+            case NodeKind::Abs:
+                stack.push_back(SymEngine::abs(pop(stack)));
+                break;
+            case NodeKind::Sin:
+                stack.push_back(SymEngine::sin(pop(stack)));
+                break;
+            case NodeKind::Cos:
+                stack.push_back(SymEngine::cos(pop(stack)));
+                break;
+            case NodeKind::Tan:
+                stack.push_back(SymEngine::tan(pop(stack)));
+                break;
+            case NodeKind::Asin:
+                stack.push_back(SymEngine::asin(pop(stack)));
+                break;
+            case NodeKind::Acos:
+                stack.push_back(SymEngine::acos(pop(stack)));
+                break;
+            case NodeKind::Atan:
+                stack.push_back(SymEngine::atan(pop(stack)));
+                break;
+            case NodeKind::Sinh:
+                stack.push_back(SymEngine::sinh(pop(stack)));
+                break;
+            case NodeKind::Cosh:
+                stack.push_back(SymEngine::cosh(pop(stack)));
+                break;
+            case NodeKind::Tanh:
+                stack.push_back(SymEngine::tanh(pop(stack)));
+                break;
+            case NodeKind::Text:
+                stack.push_back(SymEngine::parse(std::string(reader.get_string())));
+                break;
+            case NodeKind::Parameter:
+                stack.push_back(parameter_symbol(reader.get<uint32_t>()));
+                break;
+            default:
+                throw std::runtime_error("Corrupt function record: unknown node kind.");
+            }
+        }
+        return stack;
+    }
+
+    static Function decode_binary(std::string name, std::string_view payload)
+    {
+        ByteReader reader(payload);
+        reader.get<char>(); // Tag
+        uint8_t version = reader.get<uint8_t>();
+        if (version == TEMPLATED_RECORD_VERSION)
+        {
+            throw std::runtime_error("Function record refers to a template and must be loaded through its Database.");
+        }
+        if (version != BINARY_RECORD_VERSION)
+        {
+            throw std::runtime_error("Unsupported function record version " + std::to_string(version) + ".");
+        }
+
+        uint32_t symbol_count = reader.get<uint32_t>();
+        uint32_t name_count = reader.get<uint32_t>();
+        if (symbol_count > name_count)
+        {
+            throw std::runtime_error("Corrupt function record: bad symbol table.");
+        }
+        std::vector<std::string> names;
+        names.reserve(name_count);
+        for (uint32_t i = 0; i < name_count; ++i)
+        {
+            names.emplace_back(reader.get_string());
+        }
+
+        SymEngine::vec_basic stack = decode_nodes(reader, names, reader.get<uint32_t>());
+        if (stack.size() != 1 || !reader.at_end())
+        {
+            throw std::runtime_error("Corrupt function record: malformed expression.");
+        }
+
+        names.resize(symbol_count);
+        return Function{std::move(name), std::move(names), SymEngine::Expression(stack.back())};
+    }
+
+    // --- Legacy "sym,sym|expr" payloads, as written before the binary format existed ---
+    static Function decode_text(std::string name, std::string_view payload)
+    {
+        size_t sep = payload.find('|');
+        if (sep == std::string_view::npos)
+        {
+            throw std::runtime_error("Corrupt function record: missing '|' separator.");
+        }
+        std::istringstream iss{std::string(payload.substr(0, sep))};
+        std::string sym;
+        std::vector<std::string> symbols;
+        while (std::getline(iss, sym, ','))
+            symbols.push_back(sym);
+        SymEngine::Expression expr{std::string(payload.substr(sep + 1))};
+        return Function{std::move(name), std::move(symbols), expr};
+    }
+
+    Function decode_function(std::string name, std::string_view payload)
+    {
+        payload = split_optimized(payload).payload;
+        if (!payload.empty() && payload[0] == BINARY_RECORD_TAG)
+        {
+            return decode_binary(std::move(name), payload);
+        }
+        return decode_text(std::move(name), payload);
+    }
+
+    // --- Templates ---
+
+    class TemplateSplitter
+    {
+    public:
+        SymEngine::vec_basic parameters;
+
+        // `coefficient` says whether a number here is a term of a sum or a factor of a product
+        SymEngine::RCP<const SymEngine::Basic> split(const SymEngine::RCP<const SymEngine::Basic> &node, bool coefficient)
+        {
+            if (SymEngine::is_a_Number(*node))
+            {
+                if (!coefficient)
+                {
+                    return node;
+                }
+                this->parameters.push_back(node);
+                return parameter_symbol(this->parameters.size() - 1);
+            }
+            switch (node->get_type_code())
+            {
+            case SymEngine::SYMENGINE_ADD:
+            case SymEngine::SYMENGINE_MUL:
+            {
+                const bool is_add = SymEngine::is_a<SymEngine::Add>(*node);
+                SymEngine::vec_basic args = node->get_args();
+                for (auto &arg : args)
+                {
+                    // A leading -1 factor is a negation, which the compiler turns into a subtraction
+                    if (!is_add && SymEngine::eq(*arg, *SymEngine::minus_one))
+                    {
+                        continue;
+                    }
+                    arg = this->split(arg, true);
+                }
+                return is_add ? SymEngine::add(args) : SymEngine::mul(args);
+            }
+            case SymEngine::SYMENGINE_POW:
+            {
+                const auto &pow = SymEngine::down_cast<const SymEngine::Pow &>(*node);
+                return SymEngine::pow(this->split(pow.get_base(), false), this->split(pow.get_exp(), false));
+            }
+            case SymEngine::SYMENGINE_LOG:
+                return SymEngine::log(this->split(node->get_args()[0], false));
+            case SymEngine::SYMENGINE_ABS:
+                return SymEngine::abs(this->split(node->get_args()[0], false));
+            case SymEngine::SYMENGINE_SIN:
+                return SymEngine::sin(this->split(node->get_args()[0], false));
+            case SymEngine::SYMENGINE_COS:
+                return SymEngine::cos(this->split(node->get_args()[0], false));
+            case SymEngine::SYMENGINE_TAN:
+                return SymEngine::tan(this->split(node->get_args()[0], false));
+            case SymEngine::SYMENGINE_ASIN:
+                return SymEngine::asin(this->split(node->get_args()[0], false));
+            case SymEngine::SYMENGINE_ACOS:
+                return SymEngine::acos(this->split(node->get_args()[0], false));
+            case SymEngine::SYMENGINE_ATAN:
+                return SymEngine::atan(this->split(node->get_args()[0], false));
+            case SymEngine::SYMENGINE_SINH:
+                return SymEngine::sinh(this->split(node->get_args()[0], false));
+            case SymEngine::SYMENGINE_COSH:
+                return SymEngine::cosh(this->split(node->get_args()[0], false));
+            case SymEngine::SYMENGINE_TANH:
+                return SymEngine::tanh(this->split(node->get_args()[0], false));
+            default:
+                // Symbols, constants and nodes the codec stores as text are kept whole
+                return node;
+            }
+        }
+    };
+
+    TemplateSplit split_template(const Function &func)
+    {
+        TemplateSplitter splitter;
+        SymEngine::RCP<const SymEngine::Basic> shape = splitter.split(func.expr.get_basic(), false);
+        return {Function{func.name, func.symbols, SymEngine::Expression(shape)}, std::move(splitter.parameters)};
+    }
+
+    Function instantiate_template(std::string name, const Function &shape, const SymEngine::vec_basic &parameters)
+    {
+        SymEngine::map_basic_basic subs;
+        for (size_t i = 0; i < parameters.size(); ++i)
+        {
+            subs[parameter_symbol(i)] = parameters[i];
+        }
+        return Function{std::move(name), shape.symbols, shape.expr.subs(subs)};
+    }
+
+    std::string encode_templated(const TemplatedRecord &record)
+    {
+        ExpressionEncoder encoder({});
+        for (const auto &parameter : record.parameters)
+        {
+            encoder.encode(parameter);
+        }
+
+        std::string payload;
+        ByteWriter writer(payload);
+        writer.put<char>(BINARY_RECORD_TAG);
+        writer.put<uint8_t>(TEMPLATED_RECORD_VERSION);
+        writer.put<uint64_t>(record.template_id);
+        writer.put<uint32_t>(record.parameters.size());
+        writer.put<uint32_t>(encoder.node_count);
+        writer.put_bytes(encoder.nodes);
+        return payload;
+    }
+
+    bool is_templated(std::string_view payload)
+    {
+        payload = split_optimized(payload).payload;
+        return payload.size() >= 2 && payload[0] == BINARY_RECORD_TAG && static_cast<uint8_t>(payload[1]) == TEMPLATED_RECORD_VERSION;
+    }
+
+    TemplatedRecord decode_templated(std::string_view payload)
+    {
+        ByteReader reader(split_optimized(payload).payload);
+        reader.get<char>();    // Tag
+        reader.get<uint8_t>(); // Version
+        TemplatedRecord record{reader.get<uint64_t>(), {}};
+        uint32_t parameter_count = reader.get<uint32_t>();
+        record.parameters = decode_nodes(reader, {}, reader.get<uint32_t>());
+        if (record.parameters.size() != parameter_count || !reader.at_end())
+        {
+            throw std::runtime_error("Corrupt function record: malformed template parameters.");
+        }
+        return record;
+    }
+
+    uint64_t templated_id(std::string_view payload)
+    {
+        ByteReader reader(split_optimized(payload).payload);
+        reader.get<char>();    // Tag
+        reader.get<uint8_t>(); // Version
+        return reader.get<uint64_t>();
+    }
+
+    // --- Optimized records: [tag][version][u32 payload size][payload][program] ---
+
+    std::string encode_optimized(std::string_view payload, std::string_view program)
+    {
+        std::string out;
+        ByteWriter writer(out);
+        writer.put<char>(BINARY_RECORD_TAG);
+        writer.put<uint8_t>(OPTIMIZED_RECORD_VERSION);
+        writer.put_string(payload);
+        writer.put_bytes(program);
+        return out;
+    }
+
+    static bool is_optimized(std::string_view payload)
+    {
+        return payload.size() >= 2 && payload[0] == BINARY_RECORD_TAG && static_cast<uint8_t>(payload[1]) == OPTIMIZED_RECORD_VERSION;
+    }
+
+    OptimizedRecord split_optimized(std::string_view payload)
+    {
+        if (!is_optimized(payload))
+        {
+            return {payload, {}};
+        }
+        ByteReader reader(payload.substr(2));
+        std::string_view inner = reader.get_string();
+        std::string_view program = reader.take(payload.size() - 2 - sizeof(uint32_t) - inner.size());
+        // A program is only ever stored after a plain or templated payload
+        if (is_optimized(inner) || program.empty())
+        {
+            throw std::runtime_error("Corrupt function record: malformed optimized payload.");
+        }
+        return {inner, program};
+    }
+}
@@ -0,0 +1,1267 @@
+#include "../inc/compiled.h"
+#include "../inc/codec.h"
+#include "../inc/bytes.h"
+#include <symengine/add.h>
+#include <symengine/mul.h>
+#include <symengine/pow.h>
+#include <symengine/symbol.h>
+#include <symengine/integer.h>
+#include <symengine/rational.h>
+#include <symengine/constants.h>
+#include <symengine/functions.h>
+#include <symengine/eval_double.h>
+#include <symengine/derivative.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <future>
+#include <map>
+#include <optional>
+#include <stdexcept>
+#include <thread>
+#include <tuple>
+
+// Build the batch kernels for several instruction sets and pick one at load time
+#if defined(__x86_64__) && defined(__GNUC__) && defined(__linux__)
+#define FUNDB_SIMD_CLONES __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define FUNDB_SIMD_CLONES
+#endif
+
+namespace FunDB
+{
+    // Rows evaluated together by one pass over the instruction stream
+    static constexpr size_t BATCH_BLOCK = 256;
+    // Below this many rows per thread, splitting a batch costs more than it saves
+    static constexpr size_t BATCH_ROWS_PER_THREAD = 1 << 16;
+    // Helper threads running batch chunks, across every caller. Batches only take helpers while the
+    // total stays below the hardware thread count, so batches evaluated concurrently (say, one per
+    // server event loop) run on their callers' threads instead of oversubscribing the machine.
+    static std::atomic<size_t> batch_helpers{0};
+
+    // Holds up to `wanted` helper threads from the shared budget until destroyed; `count` is how
+    // many it got, possibly none
+    struct BatchHelpers
+    {
+        size_t count = 0;
+
+        explicit BatchHelpers(size_t wanted)
+        {
+            const size_t limit = std::max(1u, std::thread::hardware_concurrency()) - 1;
+            size_t in_use = batch_helpers.load(std::memory_order_relaxed);
+            do
+            {
+                this->count = std::min(wanted, limit - std::min(limit, in_use));
+            } while (this->count > 0 && !batch_helpers.compare_exchange_weak(in_use, in_use + this->count, std::memory_order_relaxed));
+        }
+        ~BatchHelpers() { batch_helpers.fetch_sub(this->count, std::memory_order_relaxed); }
+        BatchHelpers(const BatchHelpers &) = delete;
+        BatchHelpers &operator=(const BatchHelpers &) = delete;
+    };
+    // Powers with integer exponents up to this size are multiplied out by optimized programs
+    static constexpr int32_t MAX_MULTIPLIED_EXPONENT = 64;
+
+    // x**exponent by squaring, for the exponents of PowInt
+    static inline double pow_int(double x, int32_t exponent)
+    {
+        uint32_t bits = exponent < 0 ? 0u - static_cast<uint32_t>(exponent) : static_cast<uint32_t>(exponent);
+        double result = 1.0;
+        for (; bits != 0; bits >>= 1)
+        {
+            if (bits & 1)
+            {
+                result *= x;
+            }
+            x *= x;
+        }
+        return exponent < 0 ? 1.0 / result : result;
+    }
+
+    // pow_int over a block, a bit of the exponent at a time across all rows
+    FUNDB_SIMD_CLONES static void batch_pow_int(double *__restrict a, size_t n, int32_t exponent)
+    {
+        double result[BATCH_BLOCK];
+        std::fill(result, result + n, 1.0);
+        uint32_t bits = exponent < 0 ? 0u - static_cast<uint32_t>(exponent) : static_cast<uint32_t>(exponent);
+        for (; bits != 0; bits >>= 1)
+        {
+            if (bits & 1)
+            {
+                for (size_t i = 0; i < n; ++i)
+                    result[i] *= a[i];
+            }
+            for (size_t i = 0; i < n; ++i)
+                a[i] *= a[i];
+        }
+        for (size_t i = 0; i < n; ++i)
+            a[i] = exponent < 0 ? 1.0 / result[i] : result[i];
+    }
+
+    FUNDB_SIMD_CLONES static void batch_binary(OpCode op, double *__restrict a, const double *__restrict b, size_t n)
+    {
+        switch (op)
+        {
+        case OpCode::Add:
+            for (size_t i = 0; i < n; ++i)
+                a[i] += b[i];
+            break;
+        case OpCode::Sub:
+            for (size_t i = 0; i < n; ++i)
+                a[i] -= b[i];
+            break;
+        case OpCode::Mul:
+            for (size_t i = 0; i < n; ++i)
+                a[i] *= b[i];
+            break;
+        case OpCode::Div:
+            for (size_t i = 0; i < n; ++i)
+                a[i] /= b[i];
+            break;
+        case OpCode::Pow:
+            for (size_t i = 0; i < n; ++i)
+                a[i] = std::pow(a[i], b[i]);
+            break;
+        default:
+            break;
+        }
+    }
+
+    FUNDB_SIMD_CLONES static void batch_unary(OpCode op, double *__restrict a, size_t n)
+    {
+        switch (op)
+        {
+        case OpCode::Neg:
+            for (size_t i = 0; i < n; ++i)
+                a[i] = -a[i];
+            break;
+        case OpCode::Sqrt:
+            for (size_t i = 0; i < n; ++i)
+                a[i] = std::sqrt(a[i]);
+            break;
+        case OpCode::Abs:
+            for (size_t i = 0; i < n; ++i)
+                a[i] = std::fabs(a[i]);
+            break;
+        case OpCode::Exp:
+            for (size_t i = 0; i < n; ++i)
+                a[i] = std::exp(a[i]);
+            break;
+        case OpCode::Log:
+            for (size_t i = 0; i < n; ++i)
+                a[i] = std::log(a[i]);
+            break;
+        case OpCode::Sin:
+            for (size_t i = 0; i < n; ++i)
+                a[i] = std::sin(a[i]);
+            break;
+        case OpCode::Cos:
+            for (size_t i = 0; i < n; ++i)
+                a[i] = std::cos(a[i]);
+            break;
+        case OpCode::Tan:
+            for (size_t i = 0; i < n; ++i)
+                a[i] = std::tan(a[i]);
+            break;
+        case OpCode::Asin:
+            for (size_t i = 0; i < n; ++i)
+                a[i] = std::asin(a[i]);
+            break;
+        case OpCode::Acos:
+            for (size_t i = 0; i < n; ++i)
+                a[i] = std::acos(a[i]);
+            break;
+        case OpCode::Atan:
+            for (size_t i = 0; i < n; ++i)
+                a[i] = std::atan(a[i]);
+            break;
+        case OpCode::Sinh:
+            for (size_t i = 0; i < n; ++i)
+                a[i] = std::sinh(a[i]);
+            break;
+        case OpCode::Cosh:
+            for (size_t i = 0; i < n; ++i)
+                a[i] = std::cosh(a[i]);
+            break;
+        case OpCode::Tanh:
+            for (size_t i = 0; i < n; ++i)
+                a[i] = std::tanh(a[i]);
+            break;
+        default:
+            break;
+        }
+    }
+
+    CompiledFunction::CompiledFunction(const Function &func, bool optimize)
+    {
+        auto program = std::make_shared<Program>();
+        program->symbols = func.symbols;
+        lower(*program, func.expr.get_basic(), 0, optimize);
+        if (optimize)
+        {
+            optimize_program(*program);
+        }
+        this->program = std::move(program);
+    }
+
+    CompiledFunction CompiledFunction::bind(std::vector<double> parameters) const
+    {
+        if (parameters.size() != this->program->parameter_count)
+        {
+            throw std::runtime_error("Expected " + std::to_string(this->program->parameter_count) + " template parameters, got " + std::to_string(parameters.size()) + ".");
+        }
+        CompiledFunction bound;
+        bound.program = this->program;
+        bound.parameters = std::move(parameters);
+        return bound;
+    }
+
+    // --- Program bytes: version, symbols, [u8 op][u32 operand] per instruction, constants, locals, parameters ---
+    // Version 1 programs have no locals field and never use them
+    static constexpr uint8_t PROGRAM_VERSION = 2;
+
+    std::optional<std::string> CompiledFunction::encode() const
+    {
+        const Program &program = *this->program;
+        if (!program.fallbacks.empty())
+        {
+            return std::nullopt;
+        }
+        std::string out;
+        ByteWriter writer(out);
+        writer.put<uint8_t>(PROGRAM_VERSION);
+        writer.put<uint32_t>(program.symbols.size());
+        for (const auto &symbol : program.symbols)
+        {
+            writer.put_string(symbol);
+        }
+        writer.put<uint32_t>(program.code.size());
+        for (const Instruction &ins : program.code)
+        {
+            writer.put<uint8_t>(static_cast<uint8_t>(ins.op));
+            writer.put<uint32_t>(ins.operand);
+        }
+        writer.put<uint32_t>(program.constants.size());
+        for (double constant : program.constants)
+        {
+            writer.put<double>(constant);
+        }
+        writer.put<uint32_t>(program.local_count);
+        writer.put<uint32_t>(program.parameter_count);
+        writer.put<uint32_t>(this->parameters.size());
+        for (double parameter : this->parameters)
+        {
+            writer.put<double>(parameter);
+        }
+        return out;
+    }
+
+    CompiledFunction CompiledFunction::decode(std::string_view bytes)
+    {
+        static const char *const corrupt = "Corrupt compiled program.";
+        ByteReader reader(bytes, corrupt);
+        const uint8_t version = reader.get<uint8_t>();
+        if (version == 0 || version > PROGRAM_VERSION)
+        {
+            throw std::runtime_error(corrupt);
+        }
+        auto program = std::make_shared<Program>();
+        // Counts are not trusted to size anything: a short input runs out before a large count does
+        for (uint32_t i = 0, n = reader.get<uint32_t>(); i < n; ++i)
+        {
+            program->symbols.emplace_back(reader.get_string());
+        }
+        std::vector<std::pair<uint8_t, uint32_t>> code;
+        for (uint32_t i = 0, n = reader.get<uint32_t>(); i < n; ++i)
+        {
+            const uint8_t op = reader.get<uint8_t>();
+            code.emplace_back(op, reader.get<uint32_t>());
+        }
+        for (uint32_t i = 0, n = reader.get<uint32_t>(); i < n; ++i)
+        {
+            program->constants.push_back(reader.get<double>());
+        }
+        program->local_count = version >= 2 ? reader.get<uint32_t>() : 0;
+        program->parameter_count = reader.get<uint32_t>();
+        CompiledFunction decoded;
+        for (uint32_t i = 0, n = reader.get<uint32_t>(); i < n; ++i)
+        {
+            decoded.parameters.push_back(reader.get<double>());
+        }
+        // A template's shape is stored with none of its parameters bound. Every local is stored by
+        // an instruction, so there are never more locals than instructions.
+        if (!reader.at_end() || (!decoded.parameters.empty() && decoded.parameters.size() != program->parameter_count) ||
+            program->local_count > code.size())
+        {
+            throw std::runtime_error(corrupt);
+        }
+
+        // Replay the stack height of every instruction, which also gives max_stack, and check that
+        // each local is stored before it is loaded
+        size_t depth = 0;
+        std::vector<bool> stored(program->local_count);
+        for (const auto &[op, operand] : code)
+        {
+            switch (static_cast<OpCode>(op))
+            {
+            case OpCode::Load:
+                if (operand >= stored.size() || !stored[operand])
+                {
+                    throw std::runtime_error(corrupt);
+                }
+                ++depth;
+                break;
+            case OpCode::Store:
+                if (operand >= stored.size() || depth < 1)
+                {
+                    throw std::runtime_error(corrupt);
+                }
+                stored[operand] = true;
+                break;
+            case OpCode::PowInt:
+                if (depth < 1 || std::abs(static_cast<int64_t>(static_cast<int32_t>(operand))) > MAX_MULTIPLIED_EXPONENT)
+                {
+                    throw std::runtime_error(corrupt);
+                }
+                break;
+            case OpCode::Const:
+            case OpCode::Var:
+            case OpCode::Param:
+            {
+                const size_t limit = static_cast<OpCode>(op) == OpCode::Const ? program->constants.size()
+                                     : static_cast<OpCode>(op) == OpCode::Var ? program->symbols.size()
+                                                                               : program->parameter_count;
+                if (operand >= limit)
+                {
+                    throw std::runtime_error(corrupt);
+                }
+                ++depth;
+                break;
+            }
+            case OpCode::Add:
+            case OpCode::Sub:
+            case OpCode::Mul:
+            case OpCode::Div:
+            case OpCode::Pow:
+                if (depth < 2)
+                {
+                    throw std::runtime_error(corrupt);
+                }
+                --depth;
+                break;
+            default:
+                // Unary operations; Symbolic needs fallbacks, which encode() never writes
+                if (op <= static_cast<uint8_t>(OpCode::Symbolic) || op > static_cast<uint8_t>(OpCode::Tanh) || depth < 1)
+                {
+                    throw std::runtime_error(corrupt);
+                }
+                break;
+            }
+            emit(*program, static_cast<OpCode>(op), operand, depth);
+        }
+        if (depth != 1)
+        {
+            throw std::runtime_error(corrupt);
+        }
+        decoded.program = std::move(program);
+        return decoded;
+    }
+
+    // `depth` is the stack height after the instruction has run
+    void CompiledFunction::emit(Program &program, OpCode op, uint32_t operand, size_t depth)
+    {
+        program.code.push_back({op, operand});
+        program.max_stack = std::max(program.max_stack, depth);
+    }
+
+    // --- Horner form: factor the symbol that most terms of a sum share out of them ---
+    static SymEngine::vec_basic term_factors(const SymEngine::RCP<const SymEngine::Basic> &term)
+    {
+        return SymEngine::is_a<SymEngine::Mul>(*term) ? term->get_args() : SymEngine::vec_basic{term};
+    }
+
+    // The symbol and exponent of a factor x or x**n with n a positive integer. Template parameters
+    // are coefficients, not variables.
+    static std::optional<std::pair<std::string, long>> symbol_power(const SymEngine::RCP<const SymEngine::Basic> &factor)
+    {
+        SymEngine::RCP<const SymEngine::Basic> base = factor;
+        long exponent = 1;
+        if (SymEngine::is_a<SymEngine::Pow>(*factor))
+        {
+            const auto &pow = SymEngine::down_cast<const SymEngine::Pow &>(*factor);
+            if (!SymEngine::is_a<SymEngine::Integer>(*pow.get_exp()))
+            {
+                return std::nullopt;
+            }
+            base = pow.get_base();
+            exponent = SymEngine::down_cast<const SymEngine::Integer &>(*pow.get_exp()).as_int();
+        }
+        if (!SymEngine::is_a<SymEngine::Symbol>(*base) || exponent <= 0)
+        {
+            return std::nullopt;
+        }
+        const std::string &name = SymEngine::down_cast<const SymEngine::Symbol &>(*base).get_name();
+        if (parameter_index(name))
+        {
+            return std::nullopt;
+        }
+        return std::make_pair(name, exponent);
+    }
+
+    // Rewrite the sum of `terms` as x**k * (the terms x**k divides, divided by it) + the others, for
+    // the symbol x that is a factor of the most terms and its lowest power k among them. Lowering
+    // applies this to every sum it meets, so a*x**3 + b*x**2 + c*x + d becomes x*(x*(a*x + b) + c) + d
+    // a step at a time. Each step merges at least two terms into one, so the steps run out; false
+    // if no symbol is a factor of two terms.
+    static bool horner_step(const SymEngine::vec_basic &terms, SymEngine::RCP<const SymEngine::Basic> &factored)
+    {
+        // Number of terms each symbol is a factor of, and its lowest power among them
+        std::map<std::string, std::pair<size_t, long>> shared;
+        for (const auto &term : terms)
+        {
+            for (const auto &factor : term_factors(term))
+            {
+                if (std::optional<std::pair<std::string, long>> power = symbol_power(factor))
+                {
+                    auto &[count, lowest] = shared.try_emplace(power->first, 0, power->second).first->second;
+                    ++count;
+                    lowest = std::min(lowest, power->second);
+                }
+            }
+        }
+        // Ties go to the first name, so the same sum always gets the same form
+        auto best = shared.end();
+        for (auto it = shared.begin(); it != shared.end(); ++it)
+        {
+            if (it->second.first >= 2 && (best == shared.end() || it->second.first > best->second.first))
+            {
+                best = it;
+            }
+        }
+        if (best == shared.end())
+        {
+            return false;
+        }
+
+        const std::string &name = best->first;
+        const long lowest = best->second.second;
+        const SymEngine::RCP<const SymEngine::Basic> x = SymEngine::symbol(name);
+        SymEngine::vec_basic divided, rest;
+        for (const auto &term : terms)
+        {
+            SymEngine::vec_basic factors = term_factors(term);
+            auto it = std::find_if(factors.begin(), factors.end(), [&](const auto &factor)
+                                   { auto power = symbol_power(factor); return power && power->first == name; });
+            if (it == factors.end())
+            {
+                rest.push_back(term);
+                continue;
+            }
+            const long exponent = symbol_power(*it)->second;
+            if (exponent == lowest)
+            {
+                factors.erase(it);
+            }
+            else
+            {
+                *it = SymEngine::pow(x, SymEngine::integer(exponent - lowest));
+            }
+            divided.push_back(SymEngine::mul(factors));
+        }
+        rest.push_back(SymEngine::mul(lowest == 1 ? x : SymEngine::pow(x, SymEngine::integer(lowest)), SymEngine::add(divided)));
+        factored = SymEngine::add(rest);
+        return true;
+    }
+
+    // --- Emit the postorder instructions for `node`; the stack holds `depth` values beforehand ---
+    void CompiledFunction::lower(Program &program, const SymEngine::RCP<const SymEngine::Basic> &node, size_t depth, bool optimize)
+    {
+        if (SymEngine::is_a_Number(*node) || SymEngine::is_a<SymEngine::Constant>(*node))
+        {
+            program.constants.push_back(SymEngine::eval_double(*node));
+            emit(program, OpCode::Const, program.constants.size() - 1, depth + 1);
+            return;
+        }
+
+        if (SymEngine::is_a<SymEngine::Symbol>(*node))
+        {
+            const std::string &name = SymEngine::down_cast<const SymEngine::Symbol &>(*node).get_name();
+            if (std::optional<size_t> parameter = parameter_index(name))
+            {
+                program.parameter_count = std::max(program.parameter_count, *parameter + 1);
+                emit(program, OpCode::Param, *parameter, depth + 1);
+                return;
+            }
+            auto it = std::find(program.symbols.begin(), program.symbols.end(), name);
+            if (it == program.symbols.end())
+            {
+                throw std::runtime_error("Expression uses symbol '" + name + "' which is not one of the function's symbols.");
+            }
+            emit(program, OpCode::Var, it - program.symbols.begin(), depth + 1);
+            return;
+        }
+
+        const SymEngine::vec_basic args = node->get_args();
+        if (SymEngine::is_a<SymEngine::Mul>(*node) && SymEngine::eq(*args[0], *SymEngine::minus_one))
+        {
+            // -1 * x * ... is a negation
+            lower(program, SymEngine::mul(SymEngine::vec_basic(args.begin() + 1, args.end())), depth, optimize);
+            emit(program, OpCode::Neg, 0, depth + 1);
+            return;
+        }
+
+        if (optimize && SymEngine::is_a<SymEngine::Add>(*node))
+        {
+            SymEngine::RCP<const SymEngine::Basic> factored;
+            if (horner_step(args, factored))
+            {
+                lower(program, factored, depth, optimize);
+                return;
+            }
+        }
+
+        if (SymEngine::is_a<SymEngine::Add>(*node) || SymEngine::is_a<SymEngine::Mul>(*node))
+        {
+            // Fold the n-ary node into a chain of binary operations to keep the stack shallow
+            const bool is_add = SymEngine::is_a<SymEngine::Add>(*node);
+            lower(program, args[0], depth, optimize);
+            for (size_t i = 1; i < args.size(); ++i)
+            {
+                // x + (-1)*y is a subtraction
+                if (is_add && SymEngine::is_a<SymEngine::Mul>(*args[i]) &&
+                    SymEngine::eq(*args[i]->get_args()[0], *SymEngine::minus_one))
+                {
+                    lower(program, SymEngine::neg(args[i]), depth + 1, optimize);
+                    emit(program, OpCode::Sub, 0, depth + 1);
+                    continue;
+                }
+                // x * y**-1 is a division
+                if (!is_add && SymEngine::is_a<SymEngine::Pow>(*args[i]) &&
+                    SymEngine::eq(*SymEngine::down_cast<const SymEngine::Pow &>(*args[i]).get_exp(), *SymEngine::minus_one))
+                {
+                    lower(program, SymEngine::down_cast<const SymEngine::Pow &>(*args[i]).get_base(), depth + 1, optimize);
+                    emit(program, OpCode::Div, 0, depth + 1);
+                    continue;
+                }
+                lower(program, args[i], depth + 1, optimize);
+                emit(program, is_add ? OpCode::Add : OpCode::Mul, 0, depth + 1);
+            }
+            return;
+        }
+
+        if (SymEngine::is_a<SymEngine::Pow>(*node))
+        {
+            const auto &pow = SymEngine::down_cast<const SymEngine::Pow &>(*node);
+            if (SymEngine::eq(*pow.get_base(), *SymEngine::E))
+            {
+                lower(program, pow.get_exp(), depth, optimize);
+                emit(program, OpCode::Exp, 0, depth + 1);
+                return;
+            }
+            if (SymEngine::eq(*pow.get_exp(), *SymEngine::rational(1, 2)))
+            {
+                lower(program, pow.get_base(), depth, optimize);
+                emit(program, OpCode::Sqrt, 0, depth + 1);
+                return;
+            }
+            lower(program, pow.get_base(), depth, optimize);
+            lower(program, pow.get_exp(), depth + 1, optimize);
+            emit(program, OpCode::Pow, 0, depth + 1);
+            return;
+        }
+
+        OpCode unary;
+        switch (node->get_type_code())
+        {
+        case SymEngine::SYMENGINE_LOG:
+            unary = OpCode::Log;
+            break;
+        case SymEngine::SYMENGINE_ABS:
+            unary = OpCode::Abs;
+            break;
+        case SymEngine::SYMENGINE_SIN:
+            unary = OpCode::Sin;
+            break;
+        case SymEngine::SYMENGINE_COS:
+            unary = OpCode::Cos;
+            break;
+        case SymEngine::SYMENGINE_TAN:
+            unary = OpCode::Tan;
+            break;
+        case SymEngine::SYMENGINE_ASIN:
+            unary = OpCode::Asin;
+            break;
+        case SymEngine::SYMENGINE_ACOS:
+            unary = OpCode::Acos;
+            break;
+        case SymEngine::SYMENGINE_ATAN:
+            unary = OpCode::Atan;
+            break;
+        case SymEngine::SYMENGINE_SINH:
+            unary = OpCode::Sinh;
+            break;
+        case SymEngine::SYMENGINE_COSH:
+            unary = OpCode::Cosh;
+            break;
+        case SymEngine::SYMENGINE_TANH:
+            unary = OpCode::Tanh;
+            break;
+        default:
+            // Anything else (special functions, piecewise, ...) keeps the symbolic path
+            program.fallbacks.push_back(node);
+            emit(program, OpCode::Symbolic, program.fallbacks.size() - 1, depth + 1);
+            return;
+        }
+        lower(program, args[0], depth, optimize);
+        emit(program, unary, 0, depth + 1);
+    }
+
+    // --- Optimization: number the values of the instruction stream, then emit each one once ---
+
+    static inline bool is_leaf(OpCode op)
+    {
+        return op == OpCode::Const || op == OpCode::Var || op == OpCode::Param || op == OpCode::Symbolic;
+    }
+
+    void CompiledFunction::optimize_program(Program &program)
+    {
+        // A value is an operation on the values of earlier instructions. Equal values get one
+        // number, found by (op, operand, operands); constants are keyed by their bits, and the
+        // operands of + and * in either order are the same value.
+        struct Value
+        {
+            OpCode op;
+            uint32_t operand;
+            uint32_t a;
+            uint32_t b;
+        };
+        static constexpr uint32_t NONE = UINT32_MAX;
+        std::vector<Value> values;
+        std::map<std::tuple<OpCode, uint64_t, uint32_t, uint32_t>, uint32_t> numbers;
+        auto number = [&](OpCode op, uint64_t key, uint32_t operand, uint32_t a, uint32_t b)
+        {
+            auto [it, added] = numbers.try_emplace(std::make_tuple(op, key, a, b), values.size());
+            if (added)
+            {
+                values.push_back({op, operand, a, b});
+            }
+            return it->second;
+        };
+        std::vector<uint32_t> stack;
+        for (const Instruction &ins : program.code)
+        {
+            if (is_leaf(ins.op))
+            {
+                uint64_t key = ins.operand;
+                if (ins.op == OpCode::Const)
+                {
+                    std::memcpy(&key, &program.constants[ins.operand], sizeof(key));
+                }
+                stack.push_back(number(ins.op, key, ins.operand, NONE, NONE));
+                continue;
+            }
+            if (ins.op < OpCode::Add || ins.op > OpCode::Pow)
+            {
+                stack.back() = number(ins.op, ins.operand, ins.operand, stack.back(), NONE);
+                continue;
+            }
+            const uint32_t b = stack.back();
+            stack.pop_back();
+            const uint32_t a = stack.back();
+            if (ins.op == OpCode::Pow && values[b].op == OpCode::Const)
+            {
+                const double exponent = program.constants[values[b].operand];
+                if (exponent == std::trunc(exponent) && std::fabs(exponent) <= MAX_MULTIPLIED_EXPONENT)
+                {
+                    const uint32_t operand = static_cast<uint32_t>(static_cast<int32_t>(exponent));
+                    stack.back() = number(OpCode::PowInt, operand, operand, a, NONE);
+                    continue;
+                }
+            }
+            if ((ins.op == OpCode::Add || ins.op == OpCode::Mul) && b < a)
+            {
+                stack.back() = number(ins.op, 0, 0, b, a);
+                continue;
+            }
+            stack.back() = number(ins.op, 0, 0, a, b);
+        }
+
+        // Operands always have lower numbers than their users, so one pass from the top finds the
+        // values still in use and how many users each has, and one from the bottom finds how deep a
+        // stack each needs when its deeper operand is evaluated first
+        const uint32_t root = stack.back();
+        std::vector<uint32_t> users(values.size());
+        std::vector<bool> used(values.size());
+        used[root] = true;
+        for (uint32_t i = root + 1; i-- > 0;)
+        {
+            if (!used[i])
+            {
+                continue;
+            }
+            for (uint32_t operand : {values[i].a, values[i].b})
+            {
+                if (operand != NONE)
+                {
+                    used[operand] = true;
+                    ++users[operand];
+                }
+            }
+        }
+        std::vector<size_t> need(values.size(), 1);
+        for (uint32_t i = 0; i <= root; ++i)
+        {
+            const Value &value = values[i];
+            if (value.b != NONE)
+            {
+                const bool commutes = value.op == OpCode::Add || value.op == OpCode::Mul;
+                const size_t a = need[value.a];
+                const size_t b = need[value.b];
+                need[i] = commutes ? (a == b ? a + 1 : std::max(a, b)) : std::max(a, b + 1);
+            }
+            else if (value.a != NONE)
+            {
+                need[i] = need[value.a];
+            }
+        }
+
+        // Emit each value the first time it is needed. One with several users is kept in a local
+        // and loaded after that, unless it is as cheap to push again.
+        Program optimized;
+        optimized.symbols = std::move(program.symbols);
+        optimized.fallbacks = std::move(program.fallbacks);
+        optimized.parameter_count = program.parameter_count;
+        std::vector<uint32_t> local(values.size(), NONE);
+        std::map<uint32_t, uint32_t> constant_index;
+        std::function<void(uint32_t, size_t)> emit_value = [&](uint32_t i, size_t depth)
+        {
+            const Value &value = values[i];
+            if (local[i] != NONE)
+            {
+                emit(optimized, OpCode::Load, local[i], depth + 1);
+                return;
+            }
+            if (value.op == OpCode::Const)
+            {
+                auto [it, added] = constant_index.try_emplace(value.operand, optimized.constants.size());
+                if (added)
+                {
+                    optimized.constants.push_back(program.constants[value.operand]);
+                }
+                emit(optimized, OpCode::Const, it->second, depth + 1);
+                return;
+            }
+            if (value.b != NONE)
+            {
+                // Both orders give the same result for + and *, so the deeper operand goes first
+                // and the stack stays shallow
+                const bool swap = (value.op == OpCode::Add || value.op == OpCode::Mul) && need[value.b] > need[value.a];
+                emit_value(swap ? value.b : value.a, depth);
+                emit_value(swap ? value.a : value.b, depth + 1);
+            }
+            else if (value.a != NONE)
+            {
+                emit_value(value.a, depth);
+            }
+            emit(optimized, value.op, value.operand, depth + 1);
+            if (users[i] > 1 && value.op != OpCode::Var && value.op != OpCode::Param)
+            {
+                local[i] = optimized.local_count++;
+                emit(optimized, OpCode::Store, local[i], depth + 1);
+            }
+        };
+        emit_value(root, 0);
+        program = std::move(optimized);
+    }
+
+    SymEngine::map_basic_basic CompiledFunction::fallback_subs(const double *args) const
+    {
+        const Program &program = *this->program;
+        SymEngine::map_basic_basic subs;
+        for (size_t i = 0; i < program.symbols.size(); ++i)
+        {
+            subs[SymEngine::symbol(program.symbols[i])] = SymEngine::real_double(args[i]);
+        }
+        for (size_t i = 0; i < this->parameters.size(); ++i)
+        {
+            subs[parameter_symbol(i)] = SymEngine::real_double(this->parameters[i]);
+        }
+        return subs;
+    }
+
+    double CompiledFunction::evaluate_fallback(uint32_t index, const double *args) const
+    {
+        return SymEngine::eval_double(*this->program->fallbacks[index]->subs(this->fallback_subs(args)));
+    }
+
+    void CompiledFunction::fallback_gradient(uint32_t index, const double *args, double *gradient) const
+    {
+        const Program &program = *this->program;
+        const SymEngine::map_basic_basic subs = this->fallback_subs(args);
+        for (size_t i = 0; i < program.symbols.size(); ++i)
+        {
+            const auto derivative = SymEngine::diff(program.fallbacks[index], SymEngine::symbol(program.symbols[i]));
+            gradient[i] = SymEngine::eval_double(*derivative->subs(subs));
+        }
+    }
+
+    double CompiledFunction::evaluate(const double *args) const
+    {
+        const Program &program = *this->program;
+        thread_local std::vector<double> stack;
+        thread_local std::vector<double> locals;
+        if (stack.size() < program.max_stack)
+        {
+            stack.resize(program.max_stack);
+        }
+        if (locals.size() < program.local_count)
+        {
+            locals.resize(program.local_count);
+        }
+
+        // `top` points one past the last value on the stack
+        double *top = stack.data();
+        for (const Instruction &ins : program.code)
+        {
+            switch (ins.op)
+            {
+            case OpCode::Const:
+                *top++ = program.constants[ins.operand];
+                break;
+            case OpCode::Var:
+                *top++ = args[ins.operand];
+                break;
+            case OpCode::Param:
+                *top++ = this->parameters[ins.operand];
+                break;
+            case OpCode::Symbolic:
+                *top++ = this->evaluate_fallback(ins.operand, args);
+                break;
+            case OpCode::Add:
+                --top;
+                top[-1] += top[0];
+                break;
+            case OpCode::Sub:
+                --top;
+                top[-1] -= top[0];
+                break;
+            case OpCode::Mul:
+                --top;
+                top[-1] *= top[0];
+                break;
+            case OpCode::Div:
+                --top;
+                top[-1] /= top[0];
+                break;
+            case OpCode::Pow:
+                --top;
+                top[-1] = std::pow(top[-1], top[0]);
+                break;
+            case OpCode::Neg:
+                top[-1] = -top[-1];
+                break;
+            case OpCode::Sqrt:
+                top[-1] = std::sqrt(top[-1]);
+                break;
+            case OpCode::Exp:
+                top[-1] = std::exp(top[-1]);
+                break;
+            case OpCode::Log:
+                top[-1] = std::log(top[-1]);
+                break;
+            case OpCode::Abs:
+                top[-1] = std::fabs(top[-1]);
+                break;
+            case OpCode::Sin:
+                top[-1] = std::sin(top[-1]);
+                break;
+            case OpCode::Cos:
+                top[-1] = std::cos(top[-1]);
+                break;
+            case OpCode::Tan:
+                top[-1] = std::tan(top[-1]);
+                break;
+            case OpCode::Asin:
+                top[-1] = std::asin(top[-1]);
+                break;
+            case OpCode::Acos:
+                top[-1] = std::acos(top[-1]);
+                break;
+            case OpCode::Atan:
+                top[-1] = std::atan(top[-1]);
+                break;
+            case OpCode::Sinh:
+                top[-1] = std::sinh(top[-1]);
+                break;
+            case OpCode::Cosh:
+                top[-1] = std::cosh(top[-1]);
+                break;
+            case OpCode::Tanh:
+                top[-1] = std::tanh(top[-1]);
+                break;
+            case OpCode::PowInt:
+                top[-1] = pow_int(top[-1], static_cast<int32_t>(ins.operand));
+                break;
+            case OpCode::Store:
+                locals[ins.operand] = top[-1];
+                break;
+            case OpCode::Load:
+                *top++ = locals[ins.operand];
+                break;
+            }
+        }
+        return top[-1];
+    }
+
+    const double *CompiledFunction::gather_args(const std::unordered_map<std::string, double> &values) const
+    {
+        const std::vector<std::string> &symbols = this->program->symbols;
+        thread_local std::vector<double> args;
+        args.resize(symbols.size());
+        for (size_t i = 0; i < symbols.size(); ++i)
+        {
+            auto it = values.find(symbols[i]);
+            if (it == values.end())
+            {
+                throw std::runtime_error("Missing value for symbol '" + symbols[i] + "' in evaluation map.");
+            }
+            args[i] = it->second;
+        }
+        return args.data();
+    }
+
+    double CompiledFunction::evaluate(const std::unordered_map<std::string, double> &values) const
+    {
+        return this->evaluate(this->gather_args(values));
+    }
+
+    // Multiply a gradient by the derivative of the operation applied to its value. Components that
+    // are zero stay zero, so an infinite derivative (sqrt at 0, say) only spreads to the symbols
+    // the operand depends on.
+    static inline void scale_gradient(double *gradient, size_t n, double derivative)
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            gradient[i] = gradient[i] == 0.0 ? 0.0 : gradient[i] * derivative;
+        }
+    }
+
+    // --- Forward-mode differentiation: the stack holds (value, gradient) pairs ---
+    double CompiledFunction::evaluate_with_gradient(const double *args, double *gradient) const
+    {
+        const Program &program = *this->program;
+        const size_t n = program.symbols.size();
+        thread_local std::vector<double> stack;
+        // One gradient of n entries per stack entry, and per local after the stack's
+        thread_local std::vector<double> partials;
+        thread_local std::vector<double> locals;
+        if (stack.size() < program.max_stack)
+        {
+            stack.resize(program.max_stack);
+        }
+        if (partials.size() < (program.max_stack + program.local_count) * n)
+        {
+            partials.resize((program.max_stack + program.local_count) * n);
+        }
+        if (locals.size() < program.local_count)
+        {
+            locals.resize(program.local_count);
+        }
+        double *local_partials = partials.data() + program.max_stack * n;
+
+        // `top` points one past the last value and `dtop` one past its gradient
+        double *top = stack.data();
+        double *dtop = partials.data();
+        for (const Instruction &ins : program.code)
+        {
+            switch (ins.op)
+            {
+            case OpCode::Const:
+            case OpCode::Param:
+                *top++ = ins.op == OpCode::Const ? program.constants[ins.operand] : this->parameters[ins.operand];
+                std::fill(dtop, dtop + n, 0.0);
+                dtop += n;
+                continue;
+            case OpCode::Var:
+                *top++ = args[ins.operand];
+                std::fill(dtop, dtop + n, 0.0);
+                dtop[ins.operand] = 1.0;
+                dtop += n;
+                continue;
+            case OpCode::Symbolic:
+                *top++ = this->evaluate_fallback(ins.operand, args);
+                this->fallback_gradient(ins.operand, args, dtop);
+                dtop += n;
+                continue;
+            case OpCode::Store:
+                locals[ins.operand] = top[-1];
+                std::copy(dtop - n, dtop, local_partials + ins.operand * n);
+                continue;
+            case OpCode::Load:
+                *top++ = locals[ins.operand];
+                std::copy(local_partials + ins.operand * n, local_partials + (ins.operand + 1) * n, dtop);
+                dtop += n;
+                continue;
+            default:
+                break;
+            }
+
+            if (ins.op >= OpCode::Add && ins.op <= OpCode::Pow)
+            {
+                // The right operand is popped; the result replaces the left one
+                --top;
+                dtop -= n;
+                const double a = top[-1];
+                const double b = top[0];
+                double *da = dtop - n;
+                const double *db = dtop;
+                switch (ins.op)
+                {
+                case OpCode::Add:
+                    top[-1] = a + b;
+                    for (size_t i = 0; i < n; ++i)
+                        da[i] += db[i];
+                    break;
+                case OpCode::Sub:
+                    top[-1] = a - b;
+                    for (size_t i = 0; i < n; ++i)
+                        da[i] -= db[i];
+                    break;
+                case OpCode::Mul:
+                    top[-1] = a * b;
+                    for (size_t i = 0; i < n; ++i)
+                        da[i] = da[i] * b + a * db[i];
+                    break;
+                case OpCode::Div:
+                {
+                    const double quotient = a / b;
+                    top[-1] = quotient;
+                    for (size_t i = 0; i < n; ++i)
+                        da[i] = (da[i] - quotient * db[i]) / b;
+                    break;
+                }
+                default:
+                {
+                    // d(a^b) = b a^(b-1) da + a^b log(a) db; each term only where its factor is
+                    // nonzero, so a constant exponent never takes the log of a negative base
+                    const double power = std::pow(a, b);
+                    top[-1] = power;
+                    for (size_t i = 0; i < n; ++i)
+                    {
+                        double d = 0.0;
+                        if (da[i] != 0.0)
+                            d += b * std::pow(a, b - 1) * da[i];
+                        if (db[i] != 0.0)
+                            d += power * std::log(a) * db[i];
+                        da[i] = d;
+                    }
+                    break;
+                }
+                }
+                continue;
+            }
+
+            double *da = dtop - n;
+            const double a = top[-1];
+            double value;
+            double derivative;
+            switch (ins.op)
+            {
+            case OpCode::Neg:
+                value = -a;
+                derivative = -1.0;
+                break;
+            case OpCode::Sqrt:
+                value = std::sqrt(a);
+                derivative = 0.5 / value;
+                break;
+            case OpCode::Exp:
+                value = std::exp(a);
+                derivative = value;
+                break;
+            case OpCode::Log:
+                value = std::log(a);
+                derivative = 1.0 / a;
+                break;
+            case OpCode::Abs:
+                value = std::fabs(a);
+                derivative = a > 0 ? 1.0 : a < 0 ? -1.0 : 0.0;
+                break;
+            case OpCode::Sin:
+                value = std::sin(a);
+                derivative = std::cos(a);
+                break;
+            case OpCode::Cos:
+                value = std::cos(a);
+                derivative = -std::sin(a);
+                break;
+            case OpCode::Tan:
+                value = std::tan(a);
+                derivative = 1.0 + value * value;
+                break;
+            case OpCode::Asin:
+                value = std::asin(a);
+                derivative = 1.0 / std::sqrt(1.0 - a * a);
+                break;
+            case OpCode::Acos:
+                value = std::acos(a);
+                derivative = -1.0 / std::sqrt(1.0 - a * a);
+                break;
+            case OpCode::Atan:
+                value = std::atan(a);
+                derivative = 1.0 / (1.0 + a * a);
+                break;
+            case OpCode::Sinh:
+                value = std::sinh(a);
+                derivative = std::cosh(a);
+                break;
+            case OpCode::Cosh:
+                value = std::cosh(a);
+                derivative = std::sinh(a);
+                break;
+            case OpCode::PowInt:
+            {
+                const int32_t exponent = static_cast<int32_t>(ins.operand);
+                value = pow_int(a, exponent);
+                derivative = exponent * pow_int(a, exponent - 1);
+                break;
+            }
+            default:
+                value = std::tanh(a);
+                derivative = 1.0 - value * value;
+                break;
+            }
+            top[-1] = value;
+            scale_gradient(da, n, derivative);
+        }
+        std::copy(dtop - n, dtop, gradient);
+        return top[-1];
+    }
+
+    ValueGradient CompiledFunction::evaluate_with_gradient(const std::unordered_map<std::string, double> &values) const
+    {
+        ValueGradient result{0.0, std::vector<double>(this->arity())};
+        result.value = this->evaluate_with_gradient(this->gather_args(values), result.gradient.data());
+        return result;
+    }
+
+    // --- Run the instruction stream once over `n` <= BATCH_BLOCK rows starting at `offset` ---
+    void CompiledFunction::evaluate_block(const double *const *columns, size_t offset, size_t n, double *out) const
+    {
+        const Program &program = *this->program;
+        // One BATCH_BLOCK-wide lane per stack entry
+        thread_local std::vector<double> stack;
+        thread_local std::vector<double> locals;
+        if (stack.size() < program.max_stack * BATCH_BLOCK)
+        {
+            stack.resize(program.max_stack * BATCH_BLOCK);
+        }
+        if (locals.size() < program.local_count * BATCH_BLOCK)
+        {
+            locals.resize(program.local_count * BATCH_BLOCK);
+        }
+
+        double *top = stack.data();
+        for (const Instruction &ins : program.code)
+        {
+            switch (ins.op)
+            {
+            case OpCode::Const:
+                std::fill(top, top + n, program.constants[ins.operand]);
+                top += BATCH_BLOCK;
+                break;
+            case OpCode::Param:
+                std::fill(top, top + n, this->parameters[ins.operand]);
+                top += BATCH_BLOCK;
+                break;
+            case OpCode::Var:
+                std::memcpy(top, columns[ins.operand] + offset, n * sizeof(double));
+                top += BATCH_BLOCK;
+                break;
+            case OpCode::Symbolic:
+            {
+                std::vector<double> args(program.symbols.size());
+                for (size_t row = 0; row < n; ++row)
+                {
+                    for (size_t i = 0; i < args.size(); ++i)
+                    {
+                        args[i] = columns[i][offset + row];
+                    }
+                    top[row] = this->evaluate_fallback(ins.operand, args.data());
+                }
+                top += BATCH_BLOCK;
+                break;
+            }
+            case OpCode::Add:
+            case OpCode::Sub:
+            case OpCode::Mul:
+            case OpCode::Div:
+            case OpCode::Pow:
+                top -= BATCH_BLOCK;
+                batch_binary(ins.op, top - BATCH_BLOCK, top, n);
+                break;
+            case OpCode::PowInt:
+                batch_pow_int(top - BATCH_BLOCK, n, static_cast<int32_t>(ins.operand));
+                break;
+            case OpCode::Store:
+                std::memcpy(locals.data() + ins.operand * BATCH_BLOCK, top - BATCH_BLOCK, n * sizeof(double));
+                break;
+            case OpCode::Load:
+                std::memcpy(top, locals.data() + ins.operand * BATCH_BLOCK, n * sizeof(double));
+                top += BATCH_BLOCK;
+                break;
+            default:
+                batch_unary(ins.op, top - BATCH_BLOCK, n);
+                break;
+            }
+        }
+        std::memcpy(out + offset, top - BATCH_BLOCK, n * sizeof(double));
+    }
+
+    void CompiledFunction::evaluate_batch(const std::vector<const double *> &columns, double *out, size_t count) const
+    {
+        if (columns.size() != this->arity())
+        {
+            throw std::runtime_error("Expected " + std::to_string(this->arity()) + " input columns, got " + std::to_string(columns.size()) + ".");
+        }
+
+        auto run = [&](size_t begin, size_t end)
+        {
+            for (size_t offset = begin; offset < end; offset += BATCH_BLOCK)
+            {
+                this->evaluate_block(columns.data(), offset, std::min(BATCH_BLOCK, end - offset), out);
+            }
+        };
+
+        // Split large batches into block-aligned chunks: one for the calling thread and one for each
+        // helper the shared budget grants
+        const size_t wanted = count / BATCH_ROWS_PER_THREAD;
+        BatchHelpers helpers(wanted > 1 ? wanted - 1 : 0);
+        if (helpers.count == 0)
+        {
+            run(0, count);
+            return;
+        }
+
+        size_t threads = helpers.count + 1;
+        size_t blocks = (count + BATCH_BLOCK - 1) / BATCH_BLOCK;
+        size_t chunk = (blocks + threads - 1) / threads * BATCH_BLOCK;
+        // The futures wait for their chunks when destroyed, so nothing outlives `columns` and `out`
+        // even if a chunk throws; otherwise the first exception is rethrown once all have finished
+        std::vector<std::future<void>> pending;
+        for (size_t begin = chunk; begin < count; begin += chunk)
+        {
+            pending.push_back(std::async(std::launch::async, run, begin, std::min(begin + chunk, count)));
+        }
+        run(0, std::min(chunk, count));
+        for (auto &future : pending)
+        {
+            future.wait();
+        }
+        for (auto &future : pending)
+        {
+            future.get();
+        }
+    }
+}
@@ -1,248 +1,2154 @@
 #include "../inc/db.h"
+#include "../inc/codec.h"
+#include "../inc/compiled.h"
+#include "../inc/hash.h"
+#include "../inc/worker_pool.h"
 #include <iostream>
-#include <fstream>
-#include <sstream>
 #include <string_view>
 #include <filesystem>
 #include <vector>
 #include <unordered_map>
-#include <functional>
+#include <unordered_set>
+#include <map>
+#include <algorithm>
+#include <cstring>
+#include <future>
+#include <cerrno>
+#include <unistd.h>
 
 namespace FunDB
 {
-    Database::Database(std::string data_filename, std::string index_filename, size_t hash_table_size)
-        : data_file(data_filename), index_file(index_filename), HASH_TABLE_SIZE(hash_table_size)
+    CachedFunction::CachedFunction(Function func)
+        : function(std::move(func))
     {
+        try
+        {
+            this->compiled.emplace(this->function);
+        }
+        catch (const std::exception &e)
+        {
+            this->compile_error = e.what();
+        }
+    }
+
+    CachedFunction::CachedFunction(Function func, const CachedFunction &shape, const SymEngine::vec_basic &parameters)
+        : function(std::move(func))
+    {
+        if (!shape.compiled)
+        {
+            this->compile_error = shape.compile_error;
+            return;
+        }
+        try
+        {
+            std::vector<double> values;
+            values.reserve(parameters.size());
+            for (const auto &parameter : parameters)
+            {
+                values.push_back(SymEngine::eval_double(*parameter));
+            }
+            this->compiled.emplace(shape.compiled->bind(std::move(values)));
+        }
+        catch (const std::exception &e)
+        {
+            this->compile_error = e.what();
+        }
+    }
+
+    CachedFunction::CachedFunction(Function func, CompiledFunction compiled)
+        : function(std::move(func)), compiled(std::move(compiled))
+    {
+    }
+
+    const CompiledFunction &CachedFunction::get_compiled() const
+    {
+        if (!this->compiled)
+        {
+            throw std::runtime_error(this->compile_error);
+        }
+        return *this->compiled;
+    }
+
+    // --- Index file layout: a 64-byte header followed by the slot array ---
+    // Each slot packs the top 16 bits of the key's hash (a fingerprint) above the 48-bit offset of
+    // its record in the data file, so most non-matching slots are rejected without reading the
+    // data file. An empty slot is all ones, which no real slot can be since offsets stay below 2^48 - 1.
+    static constexpr char INDEX_MAGIC[8] = {'F', 'U', 'N', 'D', 'B', 'I', 'D', 'X'};
+    static constexpr uint32_t INDEX_VERSION = 1;
+    static constexpr uint64_t OFFSET_MASK = (uint64_t{1} << 48) - 1;
+
+    struct IndexHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t reserved;
+        uint64_t capacity;
+        // Total size of the records the index points at, to tell how much of the data file is dead
+        uint64_t live_bytes;
+        // Size of the data file at the last checkpoint. Slots pointing below it were synced along
+        // with their records; records from here on are replayed when the index is opened.
+        uint64_t indexed_bytes;
+        // Slots holding template records rather than functions
+        uint64_t template_entries;
+        // Generation of the data file the index belongs to (see Database::data_generation)
+        uint32_t generation;
+        uint8_t padding[12];
+    };
+    static_assert(sizeof(IndexHeader) == 64, "The slot array must start on a cache line");
+
+    // The index grows once more than MAX_LOAD_NUM / MAX_LOAD_DEN of its slots are used, which keeps
+    // linear probe sequences short. A resize doubles the capacity and moves RESIZE_STEP old slots
+    // per write, so the old table (at most 70% full) is drained long before the new one fills up.
+    static constexpr size_t MAX_LOAD_NUM = 7;
+    static constexpr size_t MAX_LOAD_DEN = 10;
+    static constexpr size_t RESIZE_STEP = 64;
+    static constexpr size_t MIN_CAPACITY = 8;
+
+    // Writes compact the data file once it is more than MAX_SPACE_AMPLIFICATION times the size of
+    // its live records, so dead bytes stay bounded; small files are left alone
+    static constexpr double MAX_SPACE_AMPLIFICATION = 2.0;
+    static constexpr uint64_t MIN_COMPACTION_BYTES = 1 << 20;
+
+    // --- Data file record framing: [u32 key size][key][u32 value size][value][u32 checksum] ---
+    // The data file is the write-ahead log: records are only ever appended, and the index can be
+    // derived from them. The checksum is the low half of the XXH64 of the bytes before it, so
+    // recovery can tell a torn or garbled tail from a record. Records written before checksums
+    // were added have the top bit of their key size clear and no checksum.
+    static constexpr uint32_t RECORD_CHECKSUM_FLAG = uint32_t{1} << 31;
+
+    // load_many prefetches this much of each candidate record before it knows the record's size,
+    // enough for the key and the whole of most records
+    static constexpr size_t PREFETCH_BYTES = 512;
+
+    // for_each requests the pages of this many records from the kernel at a time, ahead of decoding them
+    static constexpr size_t SCAN_PREFETCH_RECORDS = 256;
+
+    // --- Templates (see codec.h) are records of their own, keyed by a NUL byte, a tag and their id ---
+    // Stores refuse names that start with NUL (see check_name), so template keys cannot collide with them.
+    static const std::string TEMPLATE_KEY_PREFIX("\0template:", 10);
+    // Compiled shapes kept in memory, independent of the function cache's size
+    static constexpr size_t TEMPLATE_CACHE_ENTRIES = 1024;
+
+    static std::string template_key(uint64_t template_id)
+    {
+        std::string key = TEMPLATE_KEY_PREFIX;
+        key.append(reinterpret_cast<const char *>(&template_id), sizeof(template_id));
+        return key;
+    }
+
+    static bool is_template_key(std::string_view key)
+    {
+        return key.substr(0, TEMPLATE_KEY_PREFIX.size()) == TEMPLATE_KEY_PREFIX;
+    }
+
+    // Throws unless `name` can be stored; checked before anything is appended
+    static void check_name(const std::string &name)
+    {
+        if (!name.empty() && name[0] == '\0')
+        {
+            throw std::runtime_error("Function names cannot start with a NUL byte.");
+        }
+    }
+
+    static uint64_t template_id_of(std::string_view key)
+    {
+        uint64_t template_id = 0;
+        if (key.size() != TEMPLATE_KEY_PREFIX.size() + sizeof(template_id))
+        {
+            throw std::runtime_error("Corrupt template key.");
+        }
+        std::memcpy(&template_id, key.data() + TEMPLATE_KEY_PREFIX.size(), sizeof(template_id));
+        return template_id;
+    }
+
+    // The group committer also checkpoints the index this often, bounding the replay after a crash
+    static constexpr std::chrono::seconds CHECKPOINT_INTERVAL{1};
+
+    static inline uint64_t make_slot(uint64_t offset, uint64_t hash)
+    {
+        return (hash & ~OFFSET_MASK) | offset;
+    }
+
+    static inline uint64_t slot_offset(uint64_t slot)
+    {
+        return slot & OFFSET_MASK;
+    }
+
+    static inline bool fingerprint_matches(uint64_t slot, uint64_t hash)
+    {
+        return ((slot ^ hash) & ~OFFSET_MASK) == 0;
+    }
+
+    static inline size_t table_capacity(const MappedFile &index)
+    {
+        return reinterpret_cast<const IndexHeader *>(index.data())->capacity;
+    }
+
+    static inline const uint64_t *table_slots(const MappedFile &index)
+    {
+        return reinterpret_cast<const uint64_t *>(index.data() + sizeof(IndexHeader));
+    }
+
+    static inline uint64_t *table_slots(MappedFile &index)
+    {
+        return reinterpret_cast<uint64_t *>(index.data() + sizeof(IndexHeader));
+    }
+
+    static inline IndexHeader *table_header(MappedFile &index)
+    {
+        return reinterpret_cast<IndexHeader *>(index.data());
+    }
+
+    static size_t round_up_capacity(size_t capacity)
+    {
+        size_t rounded = MIN_CAPACITY;
+        while (rounded < capacity)
+        {
+            rounded <<= 1;
+        }
+        return rounded;
+    }
+
+    Database::Database(std::string data_filename, std::string index_filename, size_t initial_capacity, size_t cache_entries)
+        : data_file(data_filename), index_file(index_filename), resize_file(index_filename + ".resize"),
+          compact_data_file(data_filename + ".compact"), compact_index_file(index_filename + ".compact"),
+          initial_capacity(round_up_capacity(initial_capacity)), cache(cache_entries),
+          sorted_names(index_filename + ".names"), name_filter(index_filename + ".bloom"), templates(TEMPLATE_CACHE_ENTRIES)
+    {
+        this->open_files();
+    }
+
+    // Snapshot mode: no data file or index is opened, so every write path finds them closed
+    Database::Database(std::unique_ptr<const Snapshot> snapshot, const std::string &image_filename, size_t cache_entries)
+        : data_file(image_filename), index_file(image_filename), resize_file(image_filename + ".resize"),
+          compact_data_file(image_filename + ".compact"), compact_index_file(image_filename + ".compact"),
+          initial_capacity(MIN_CAPACITY), cache(cache_entries),
+          sorted_names(image_filename + ".names"), name_filter(image_filename + ".bloom"), templates(TEMPLATE_CACHE_ENTRIES),
+          snapshot(std::move(snapshot))
+    {
+    }
+
+    std::unique_ptr<Database> Database::open_snapshot(const std::string &image_filename, size_t cache_entries, bool verify)
+    {
+        auto snapshot = std::make_unique<const Snapshot>(image_filename, verify);
+        return std::unique_ptr<Database>(new Database(std::move(snapshot), image_filename, cache_entries));
+    }
+
+    void Database::require_writable() const
+    {
+        if (this->snapshot)
+        {
+            throw std::runtime_error("Database is a read-only snapshot.");
+        }
+    }
+
+    Database::~Database()
+    {
+        {
+            std::unique_lock<std::mutex> lock(this->loads_mutex);
+            this->loads_done.wait(lock, [this]
+                                  { return this->pending_loads == 0; });
+        }
+        this->wait_for_compaction();
+        try
+        {
+            std::lock_guard<std::mutex> writer(this->write_mutex);
+            this->stop_commit_thread();
+            if (this->sorted_names.has_added())
+            {
+                this->merge_sorted_names();
+            }
+            this->checkpoint_locked();
+        }
+        catch (const std::exception &)
+        {
+            // Nothing is lost: the next open replays whatever the index does not cover
+        }
+    }
+
+    // --- Open and map the data and index files, creating an empty index if needed ---
+    void Database::open_files()
+    {
+        this->data_map = MappedFile(this->data_file, false);
+        this->index_map = MappedFile(this->index_file, true);
+
+        // A leftover resize file means a resize was interrupted, and names saved during it are
+        // only in that file; neither table can be trusted, so the index is derived again
+        bool interrupted_resize = std::filesystem::exists(this->resize_file);
+        std::filesystem::remove(this->resize_file);
+        // An interrupted compaction either left the old files in place or removed the index
+        // before swapping in the new data file; the index is rebuilt below in the second case
+        std::filesystem::remove(this->compact_data_file);
+        std::filesystem::remove(this->compact_index_file);
+        // Loaded first, so that names replayed into the index below are added to them as well
+        std::optional<uint64_t> names_covered_bytes = this->sorted_names.load();
+        std::optional<uint64_t> filter_covered_bytes = this->name_filter.load();
+
+        const IndexHeader *header = reinterpret_cast<const IndexHeader *>(this->index_map.data());
+        // The name files cannot be trusted either once the index has been derived again
+        bool rebuilt = true;
+        if (this->index_map.size() == 0)
+        {
+            this->init_index(this->index_map, this->initial_capacity);
+            this->rebuild_index();
+        }
+        else if (this->index_map.size() < sizeof(IndexHeader) || std::memcmp(header->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0)
+        {
+            // An index from before the header existed used a different hash; derive a new one from the data file
+            this->init_index(this->index_map, this->initial_capacity);
+            this->rebuild_index();
+        }
+        else if (header->version != INDEX_VERSION)
+        {
+            throw std::runtime_error("Unsupported index file version " + std::to_string(header->version) + ".");
+        }
+        else if (header->capacity == 0 || (header->capacity & (header->capacity - 1)) != 0 ||
+                 this->index_map.size() != sizeof(IndexHeader) + header->capacity * sizeof(uint64_t))
+        {
+            throw std::runtime_error("Index file size does not match its header.");
+        }
+        else if (interrupted_resize)
+        {
+            this->init_index(this->index_map, this->initial_capacity);
+            this->rebuild_index();
+        }
+        else
+        {
+            rebuilt = !this->recover_index();
+        }
+
+        const uint64_t *slots = table_slots(this->index_map);
+        this->entry_count = std::count_if(slots, slots + table_capacity(this->index_map),
+                                          [this](uint64_t slot)
+                                          { return slot != TOMBSTONE; });
+        this->live_bytes = table_header(this->index_map)->live_bytes;
+        this->template_count = table_header(this->index_map)->template_entries;
+        this->data_generation = table_header(this->index_map)->generation;
+        if (rebuilt)
+        {
+            names_covered_bytes.reset();
+            filter_covered_bytes.reset();
+        }
+        this->open_name_indexes(names_covered_bytes, filter_covered_bytes);
+    }
+
+    void Database::open_name_indexes(std::optional<uint64_t> names_covered_bytes, std::optional<uint64_t> filter_covered_bytes)
+    {
+        // Either one covering more than the data file holds names of records a crash lost; either
+        // one of another generation covers a data file that a compaction has since replaced, and
+        // its covered bytes are no record boundary in this one
+        const uint64_t data_bytes = this->data_map.size();
+        std::optional<uint64_t> replay_from;
+        if (!names_covered_bytes || *names_covered_bytes > data_bytes || this->sorted_names.generation() != this->data_generation)
+        {
+            this->sorted_names.install(this->sorted_names.build(this->collect_names(), data_bytes, this->data_generation));
+        }
+        else
+        {
+            replay_from = names_covered_bytes;
+        }
+        if (!filter_covered_bytes || *filter_covered_bytes > data_bytes || this->name_filter.generation() != this->data_generation)
+        {
+            this->name_filter.install(this->name_filter.build(this->collect_names(), data_bytes, this->data_generation));
+        }
+        else
+        {
+            replay_from = std::min(replay_from.value_or(data_bytes), *filter_covered_bytes);
+        }
+        if (!replay_from)
+        {
+            return;
+        }
+        // Adding a name again is harmless to both, so one pass serves the one that covers less too
+        this->scan_log(*replay_from, [this](uint64_t, const RecordView &record)
+                       {
+                           if (!is_template_key(record.key))
+                           {
+                               this->sorted_names.add(record.key);
+                               this->name_filter.add(hash64(record.key));
+                           } });
+    }
+
+    void Database::grow_name_filter()
+    {
+        // As with the sorted names, readers only check the filter under the shared lock
+        MappedFile table = this->name_filter.build(this->collect_names(), this->data_map.size(), this->data_generation);
+        std::unique_lock<std::shared_mutex> lock(this->mutex);
+        this->name_filter.install(std::move(table));
+    }
+
+    void Database::merge_sorted_names()
+    {
+        // Readers only look at the names under the shared lock, and only writers change them
+        NameIndex::Run run = this->sorted_names.merged(this->data_map.size(), this->data_generation);
+        std::unique_lock<std::shared_mutex> lock(this->mutex);
+        this->sorted_names.install(std::move(run));
+    }
+
+    // --- Reset `index` to a header and `capacity` empty slots ---
+    void Database::init_index(MappedFile &index, size_t capacity)
+    {
+        index.resize(sizeof(IndexHeader) + capacity * sizeof(uint64_t));
+
+        IndexHeader header{};
+        std::memcpy(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+        header.version = INDEX_VERSION;
+        header.capacity = capacity;
+        header.live_bytes = this->live_bytes;
+        header.template_entries = this->template_count;
+        header.generation = this->data_generation;
+        std::memcpy(index.data(), &header, sizeof(header));
+
+        // Every byte of an empty slot is 0xFF, so the new table can be filled with memset
+        std::memset(index.data() + sizeof(IndexHeader), 0xFF, capacity * sizeof(uint64_t));
+    }
+
+    // --- Re-index every record in the data file in append order, so the latest version of a name wins ---
+    void Database::rebuild_index()
+    {
+        this->entry_count = 0;
+        this->set_live_bytes(0);
+        this->set_template_count(0);
+        uint64_t valid_end = this->scan_log(0, [this](uint64_t offset, const RecordView &record)
+                                            { this->index_record(record.key, hash64(record.key), offset); });
+        if (this->resize_map.is_open())
+        {
+            this->migrate_slots(table_capacity(this->index_map));
+        }
+        this->truncate_log(valid_end);
+    }
+
+    // --- Bring an existing index up to date with the data file by replaying the log since the last checkpoint ---
+    // Slots changed after the checkpoint must point at one of the records replayed here. If a crash
+    // left one pointing at a record that never reached the disk, the version it replaced is lost
+    // from the index, so the whole index is derived again instead, and false is returned.
+    bool Database::recover_index()
+    {
+        const uint64_t indexed_bytes = table_header(this->index_map)->indexed_bytes;
+        std::vector<std::pair<uint64_t, uint64_t>> replayed; // Offset and key hash, in file order
+        uint64_t valid_end = indexed_bytes;
+        if (indexed_bytes <= this->data_map.size())
+        {
+            valid_end = this->scan_log(indexed_bytes, [&replayed](uint64_t offset, const RecordView &record)
+                                       { replayed.emplace_back(offset, hash64(record.key)); });
+        }
+
+        bool consistent = indexed_bytes <= this->data_map.size();
+        const uint64_t *slots = table_slots(this->index_map);
+        for (size_t i = 0; consistent && i < table_capacity(this->index_map); ++i)
+        {
+            if (slots[i] == TOMBSTONE || slot_offset(slots[i]) < indexed_bytes)
+            {
+                continue;
+            }
+            auto it = std::lower_bound(replayed.begin(), replayed.end(), std::make_pair(slot_offset(slots[i]), uint64_t{0}));
+            consistent = it != replayed.end() && it->first == slot_offset(slots[i]) && fingerprint_matches(slots[i], it->second);
+        }
+        if (!consistent)
+        {
+            this->init_index(this->index_map, this->initial_capacity);
+            this->rebuild_index();
+            return false;
+        }
+
+        this->truncate_log(valid_end);
+        if (replayed.empty())
+        {
+            return true;
+        }
+        this->entry_count = std::count_if(slots, slots + table_capacity(this->index_map),
+                                          [this](uint64_t slot)
+                                          { return slot != TOMBSTONE; });
+        this->live_bytes = table_header(this->index_map)->live_bytes;
+        this->template_count = table_header(this->index_map)->template_entries;
+        for (const auto &[offset, hash] : replayed)
+        {
+            this->index_record(this->key_at(offset), hash, offset);
+        }
+        if (this->resize_map.is_open())
+        {
+            this->migrate_slots(table_capacity(this->index_map));
+        }
+        // Replayed records may already have been indexed before the crash, which the running
+        // totals cannot tell, so they are counted again from the slots
+        this->recount_live_bytes();
+        return true;
+    }
+
+    // --- Visit each valid record from `offset` on, in file order; returns where the valid log ends ---
+    // The scan stops at a torn record, at one that fails its checksum, and at one without a
+    // checksum after one with it, since old-format records can only precede new ones.
+    uint64_t Database::scan_log(uint64_t offset, const std::function<void(uint64_t, const RecordView &)> &visit) const
+    {
+        bool checksummed = false;
+        while (offset < this->data_map.size())
+        {
+            std::optional<RecordView> record = this->read_record(offset, true);
+            if (!record || (checksummed && !record->checksummed))
+            {
+                break;
+            }
+            checksummed = record->checksummed;
+            visit(offset, *record);
+            offset = record->next_offset;
+        }
+        return offset;
+    }
+
+    // --- Cut off what a crash left after the last valid record, so new records follow valid ones ---
+    void Database::truncate_log(uint64_t valid_end)
+    {
+        if (valid_end < this->data_map.size())
+        {
+            this->data_map.resize(valid_end);
+        }
+    }
+
+    // Also counts the template records again
+    void Database::recount_live_bytes()
+    {
+        uint64_t live_bytes = 0;
+        size_t template_count = 0;
+        const uint64_t *slots = table_slots(this->index_map);
+        for (size_t i = 0; i < table_capacity(this->index_map); ++i)
+        {
+            if (slots[i] != TOMBSTONE)
+            {
+                live_bytes += this->record_size(slot_offset(slots[i]));
+                template_count += is_template_key(this->key_at(slot_offset(slots[i])));
+            }
+        }
+        this->set_live_bytes(live_bytes);
+        this->set_template_count(template_count);
+    }
+
+    // --- Sync both files and record in the index header how much of the data file the index covers ---
+    void Database::checkpoint_locked()
+    {
+        if (!this->index_map.is_open())
+        {
+            return;
+        }
+        this->data_map.sync();
+        this->index_map.sync();
+        this->name_filter.checkpoint(this->data_map.size(), this->data_generation);
+        if (!this->sorted_names.has_added())
+        {
+            this->sorted_names.set_covered_bytes(this->data_map.size());
+        }
+        if (this->resize_map.is_open())
+        {
+            // The index is spread over two tables until the resize finishes, and a crash meanwhile
+            // derives it again from the data file, so there is no point to record yet
+            this->resize_map.sync();
+            return;
+        }
+        // The slots are on disk before the header claims them
+        table_header(this->index_map)->indexed_bytes = this->data_map.size();
+        this->index_map.sync();
+    }
+
+    void Database::checkpoint()
+    {
+        std::lock_guard<std::mutex> writer(this->write_mutex);
+        this->checkpoint_locked();
+        this->mark_all_synced();
+    }
+
+    // --- Start growing the index into a new table of twice the capacity ---
+    void Database::start_resize()
+    {
+        this->resize_map = MappedFile(this->resize_file, true);
+        this->init_index(this->resize_map, 2 * table_capacity(this->index_map));
+        this->resize_cursor = 0;
+    }
+
+    // --- Move up to `count` slots of the old table into the new one ---
+    void Database::migrate_slots(size_t count)
+    {
+        const uint64_t *old_slots = table_slots(this->index_map);
+        uint64_t *new_slots = table_slots(this->resize_map);
+        const size_t end = std::min(table_capacity(this->index_map), this->resize_cursor + count);
+        for (; this->resize_cursor < end; ++this->resize_cursor)
+        {
+            uint64_t slot = old_slots[this->resize_cursor];
+            if (slot == TOMBSTONE)
+            {
+                continue;
+            }
+            // Slots only keep a fingerprint, so the key is read back to find its place in the new table
+            std::string_view key = this->key_at(slot_offset(slot));
+            size_t target = this->probe(this->resize_map, key, hash64(key));
+            // A name already in the new table was saved again during the resize and is newer
+            if (new_slots[target] == TOMBSTONE)
+            {
+                new_slots[target] = slot;
+            }
+        }
+        if (this->resize_cursor == table_capacity(this->index_map))
+        {
+            this->finish_resize();
+        }
+    }
+
+    // --- Make the fully populated new table the index ---
+    void Database::finish_resize()
+    {
+        std::filesystem::rename(this->resize_file, this->index_file);
+        this->index_map = std::move(this->resize_map);
+        this->resize_cursor = 0;
+    }
+
+    // Size of the record starting at `offset`, including its framing
+    uint64_t Database::record_size(uint64_t offset) const
+    {
+        std::optional<RecordView> record = this->read_record(offset);
+        if (!record)
+        {
+            throw std::runtime_error("Truncated record in data file.");
+        }
+        return record->next_offset - offset;
+    }
+
+    void Database::set_live_bytes(uint64_t live_bytes)
+    {
+        this->live_bytes = live_bytes;
+        table_header(this->index_map)->live_bytes = live_bytes;
+        if (this->resize_map.is_open())
+        {
+            table_header(this->resize_map)->live_bytes = live_bytes;
+        }
+    }
+
+    void Database::set_template_count(size_t template_count)
+    {
+        this->template_count = template_count;
+        table_header(this->index_map)->template_entries = template_count;
+        if (this->resize_map.is_open())
+        {
+            table_header(this->resize_map)->template_entries = template_count;
+        }
+    }
+
+    // Functions stored; template records are not counted
+    size_t Database::size() const
+    {
+        if (this->snapshot)
+        {
+            return this->snapshot->size();
+        }
+        std::shared_lock<std::shared_mutex> lock(this->mutex);
+        return this->entry_count - this->template_count;
+    }
+
+    size_t Database::capacity() const
+    {
+        if (this->snapshot)
+        {
+            // The hash is minimal: one slot per name
+            return this->snapshot->size();
+        }
+        std::shared_lock<std::shared_mutex> lock(this->mutex);
+        return table_capacity(this->resize_map.is_open() ? this->resize_map : this->index_map);
+    }
+
+    void Database::clear()
+    {
+        this->require_writable();
+        std::lock_guard<std::mutex> writer(this->write_mutex);
+        std::unique_lock<std::mutex> commit(this->commit_mutex);
+        std::unique_lock<std::shared_mutex> lock(this->mutex);
+        ++this->write_generation;
+        this->data_map.close();
+        this->index_map.close();
+        this->resize_map.close();
+        this->resize_cursor = 0;
+        this->live_bytes = 0;
+        std::filesystem::remove(this->data_file);
+        std::filesystem::remove(this->index_file);
+        std::filesystem::remove(this->resize_file);
+        std::filesystem::remove(this->compact_data_file);
+        std::filesystem::remove(this->compact_index_file);
+        this->cache.clear();
+        this->templates.clear();
+        this->template_count = 0;
+        this->sorted_names.clear();
+        this->name_filter.clear();
+        this->open_files();
+        // Writes still waiting for a group commit were removed along with the file
+        this->synced_writes = this->appended_writes;
+        this->commit_done.notify_all();
+    }
+
+    // Key of the record starting at `offset`, viewed directly in the data file mapping
+    std::string_view Database::key_at(uint64_t offset) const
+    {
+        const size_t data_size = this->data_map.size();
+        uint32_t ksize = 0;
+        if (offset + sizeof(ksize) > data_size)
+        {
+            throw std::runtime_error("Index points past the end of the data file.");
+        }
+        std::memcpy(&ksize, this->data_map.data() + offset, sizeof(ksize));
+        ksize &= ~RECORD_CHECKSUM_FLAG;
+        if (offset + sizeof(ksize) + ksize > data_size)
+        {
+            throw std::runtime_error("Index points past the end of the data file.");
+        }
+        return std::string_view(this->data_map.data() + offset + sizeof(ksize), ksize);
+    }
+
+    // Whole record starting at `offset`, or nullopt if it runs past the end of the data file
+    std::optional<Database::RecordView> Database::read_record(uint64_t offset, bool verify) const
+    {
+        return read_record_in(this->data_map, offset, verify);
+    }
+
+    std::optional<Database::RecordView> Database::read_record_in(const MappedFile &data_map, uint64_t offset, bool verify)
+    {
+        const size_t data_size = data_map.size();
+        const char *data = data_map.data();
+        uint32_t key_size = 0, value_size = 0, checksum = 0;
+        if (offset + sizeof(key_size) > data_size)
+        {
+            return std::nullopt;
+        }
+        std::memcpy(&key_size, data + offset, sizeof(key_size));
+        const bool checksummed = (key_size & RECORD_CHECKSUM_FLAG) != 0;
+        key_size &= ~RECORD_CHECKSUM_FLAG;
+        uint64_t value_offset = offset + sizeof(key_size) + key_size;
+        if (value_offset + sizeof(value_size) > data_size)
+        {
+            return std::nullopt;
+        }
+        std::memcpy(&value_size, data + value_offset, sizeof(value_size));
+        uint64_t value_end = value_offset + sizeof(value_size) + value_size;
+        uint64_t end = value_end + (checksummed ? sizeof(checksum) : 0);
+        if (end > data_size)
+        {
+            return std::nullopt;
+        }
+        if (checksummed && verify)
+        {
+            std::memcpy(&checksum, data + value_end, sizeof(checksum));
+            if (static_cast<uint32_t>(hash64(std::string_view(data + offset, value_end - offset))) != checksum)
+            {
+                return std::nullopt;
+            }
+        }
+        return RecordView{std::string_view(data + offset + sizeof(key_size), key_size),
+                          std::string_view(data + value_offset + sizeof(value_size), value_size),
+                          end, checksummed};
+    }
+
+    // --- Find the slot of `index` holding `key`, or the empty slot where it would be inserted ---
+    size_t Database::probe(const MappedFile &index, std::string_view key, uint64_t hash, size_t *probes) const
+    {
+        const uint64_t *hash_table = table_slots(index);
+        const size_t mask = table_capacity(index) - 1;
+        size_t hash_index = hash & mask;
+
+        // Probe the mapped hash table until a match is found or we find an empty slot; the load
+        // factor limit guarantees there is one
+        while (hash_table[hash_index] != TOMBSTONE)
+        {
+            if (probes)
+            {
+                ++*probes;
+            }
+            // Only slots whose fingerprint matches need their key read from the data file
+            if (fingerprint_matches(hash_table[hash_index], hash) &&
+                this->key_at(slot_offset(hash_table[hash_index])) == key)
+            {
+                return hash_index;
+            }
+
+            // Collision, move to the next slot
+            hash_index = (hash_index + 1) & mask;
+        }
+        return hash_index;
+    }
+
+    // Offset of the record `index` holds for `key`, or TOMBSTONE
+    uint64_t Database::find_in(const MappedFile &index, std::string_view key, uint64_t hash, size_t *probes) const
+    {
+        uint64_t slot = table_slots(index)[this->probe(index, key, hash, probes)];
+        return slot == TOMBSTONE ? TOMBSTONE : slot_offset(slot);
+    }
+
+    // --- Load data using the index for O(1) lookup ---
+    uint64_t Database::lookup_key(std::string_view key, uint64_t hash) const
+    {
+        ScopedTimer timer(this->metrics, Operation::Lookup);
+        size_t probes = 0;
+        uint64_t offset = this->find_key(key, hash, Metrics::enabled ? &probes : nullptr);
+        this->metrics.record_probes(probes);
+        return offset;
+    }
+
+    // Offset of the latest record of `key` in either table, or TOMBSTONE; unlike lookup_key it is
+    // not recorded in the metrics, which count lookups of names only
+    uint64_t Database::find_key(std::string_view key, uint64_t hash, size_t *probes) const
+    {
+        uint64_t offset = TOMBSTONE;
+        if (this->resize_map.is_open())
+        {
+            // Names saved or already moved during a resize are in the new table
+            offset = this->find_in(this->resize_map, key, hash, probes);
+        }
+        if (offset == TOMBSTONE)
+        {
+            offset = this->find_in(this->index_map, key, hash, probes);
+        }
+        return offset;
+    }
+
+    // --- Add the records a lookup of `hash` in `index` will compare keys with to `ranges` ---
+    // Walks the probe sequence like probe() but only reads the index, so the data file pages of
+    // many lookups can be requested before any of them is waited for
+    void Database::find_candidates(const MappedFile &index, uint64_t hash, std::vector<std::pair<uint64_t, size_t>> &ranges) const
+    {
+        const uint64_t *hash_table = table_slots(index);
+        const size_t mask = table_capacity(index) - 1;
+        for (size_t hash_index = hash & mask; hash_table[hash_index] != TOMBSTONE; hash_index = (hash_index + 1) & mask)
+        {
+            if (fingerprint_matches(hash_table[hash_index], hash))
+            {
+                ranges.emplace_back(slot_offset(hash_table[hash_index]), PREFETCH_BYTES);
+            }
+        }
+    }
+
+    // --- Point `key`'s slot at the record at `offset`, growing the index as needed ---
+    void Database::index_record(std::string_view key, uint64_t hash, uint64_t offset)
+    {
+        if (this->resize_map.is_open())
+        {
+            this->migrate_slots(RESIZE_STEP);
+        }
+        else if ((this->entry_count + 1) * MAX_LOAD_DEN > table_capacity(this->index_map) * MAX_LOAD_NUM)
+        {
+            this->start_resize();
+        }
+
+        MappedFile &index = this->resize_map.is_open() ? this->resize_map : this->index_map;
+        uint64_t *slots = table_slots(index);
+        size_t slot = this->probe(index, key, hash);
+        uint64_t previous = slots[slot] == TOMBSTONE ? TOMBSTONE : slot_offset(slots[slot]);
+        if (previous == TOMBSTONE && &index == &this->resize_map)
+        {
+            // During a resize the name may still be waiting in the old table
+            previous = this->find_in(this->index_map, key, hash);
+        }
+
+        uint64_t live_bytes = this->live_bytes + this->record_size(offset);
+        if (previous == TOMBSTONE)
+        {
+            ++this->entry_count;
+            if (is_template_key(key))
+            {
+                this->set_template_count(this->template_count + 1);
+            }
+            else
+            {
+                this->sorted_names.add(key);
+                this->name_filter.add(hash);
+            }
+        }
+        else
+        {
+            live_bytes -= this->record_size(previous);
+        }
+        this->set_live_bytes(live_bytes);
+        slots[slot] = make_slot(offset, hash);
+    }
+
+    // Frame a record at the end of `out`
+    static void encode_record(std::string &out, std::string_view key, std::string_view value)
+    {
+        if (key.size() >= RECORD_CHECKSUM_FLAG)
+        {
+            throw std::runtime_error("Function name is too long.");
+        }
+        const size_t start = out.size();
+        uint32_t key_size = static_cast<uint32_t>(key.size()) | RECORD_CHECKSUM_FLAG;
+        uint32_t value_size = value.size();
+        out.append(reinterpret_cast<const char *>(&key_size), sizeof(key_size));
+        out.append(key);
+        out.append(reinterpret_cast<const char *>(&value_size), sizeof(value_size));
+        out.append(value);
+        uint32_t checksum = static_cast<uint32_t>(hash64(std::string_view(out.data() + start, out.size() - start)));
+        out.append(reinterpret_cast<const char *>(&checksum), sizeof(checksum));
+    }
+
+    // --- Append framed records to the data file and return the offset of the first; the caller remaps it ---
+    uint64_t Database::append_records(const std::string &records)
+    {
+        if (this->data_map.size() + records.size() >= OFFSET_MASK)
+        {
+            throw std::runtime_error("Data file is full.");
+        }
+        return this->data_map.write_at_end(records.data(), records.size());
+    }
+
+    // `payload` followed by the optimized program of `func`, or `payload` alone if the function
+    // does not compile to a program that can be stored; evaluating it then reports why, as before
+    static std::string with_optimized_program(const Function &func, std::string payload)
+    {
+        std::optional<std::string> program;
+        try
+        {
+            program = CompiledFunction(func, true).encode();
+        }
+        catch (const std::exception &)
+        {
+        }
+        return program ? encode_optimized(payload, *program) : payload;
+    }
+
+    // --- Split a function into a template and its coefficients, if it has any ---
+    Database::EncodedFunction Database::encode_for_store(const Function &func) const
+    {
+        // A symbol named like a parameter would be stored as one
+        check_symbols(func);
+        TemplateSplit split = split_template(func);
+        if (split.parameters.empty())
+        {
+            std::string payload = func.serialize();
+            return {this->optimize_on_store ? with_optimized_program(func, std::move(payload)) : std::move(payload), {}, {}};
+        }
+        std::string shape_payload = split.shape.serialize();
+        const uint64_t template_id = hash64(shape_payload);
+        return {encode_templated({template_id, std::move(split.parameters)}), template_key(template_id), std::move(shape_payload)};
+    }
+
+    bool Database::resolve_template(const Function &func, EncodedFunction &encoded, std::unordered_map<std::string, std::string> &new_templates) const
+    {
+        if (encoded.template_key.empty())
+        {
+            return false;
+        }
+        // Ids are 64-bit hashes, so two shapes sharing one is unlikely but not impossible
+        std::optional<std::string_view> stored;
+        auto pending = new_templates.find(encoded.template_key);
+        if (pending != new_templates.end())
+        {
+            stored = pending->second;
+        }
+        else if (uint64_t offset = this->find_key(encoded.template_key, hash64(encoded.template_key)); offset != TOMBSTONE)
+        {
+            std::optional<RecordView> record = this->read_record(offset);
+            if (!record)
+            {
+                throw std::runtime_error("Truncated record in data file.");
+            }
+            stored = record->value;
+        }
+        if (!stored)
+        {
+            // The shape is optimized once, here, rather than for every function that uses it
+            if (this->optimize_on_store)
+            {
+                Function shape = decode_function(encoded.template_key, encoded.template_payload);
+                encoded.template_payload = with_optimized_program(shape, std::move(encoded.template_payload));
+            }
+            new_templates.emplace(encoded.template_key, encoded.template_payload);
+            return true;
+        }
+        // The stored shape may have been saved with its program, or without
+        if (split_optimized(*stored).payload != split_optimized(encoded.template_payload).payload)
+        {
+            encoded = {func.serialize(), {}, {}};
+        }
+        return false;
+    }
+
+    void Database::save_function(const Function &func)
+    {
+        this->require_writable();
+        check_name(func.name);
+        ScopedTimer timer(this->metrics, Operation::Store);
+        EncodedFunction encoded = encode_for_store(func);
+        std::unique_lock<std::mutex> writer(this->write_mutex);
+
+        // Append the new function to the data file, preceded by its template if that is new, then
+        // point the slots at the new records
+        std::string records;
+        std::unordered_map<std::string, std::string> new_templates;
+        size_t function_offset = 0;
+        if (this->resolve_template(func, encoded, new_templates))
+        {
+            encode_record(records, encoded.template_key, encoded.template_payload);
+            function_offset = records.size();
+        }
+        encode_record(records, func.name, encoded.payload);
+        uint64_t base_offset = this->append_records(records);
+        {
+            std::unique_lock<std::shared_mutex> lock(this->mutex);
+            this->data_map.remap();
+            if (function_offset != 0)
+            {
+                this->index_record(encoded.template_key, hash64(encoded.template_key), base_offset);
+            }
+            this->index_record(func.name, hash64(func.name), base_offset + function_offset);
+            this->cache.erase(func.name);
+            ++this->write_generation;
+        }
+        uint64_t write = this->log_write();
+        if (this->compaction_due())
+        {
+            this->start_background_compaction();
+        }
+        else if (this->sorted_names.merge_due())
+        {
+            this->merge_sorted_names();
+        }
+        if (this->name_filter.grow_due())
+        {
+            this->grow_name_filter();
+        }
+
+        // Other writers append while this one waits, so they can share its sync
+        writer.unlock();
+        this->wait_for_commit(write);
+    }
+
+    // --- Bulk load: one sequential append, one pass over the index, one sync ---
+    void Database::write_batch(const std::vector<Function> &functions)
+    {
+        this->require_writable();
+        if (functions.empty())
+        {
+            return;
+        }
+        ScopedTimer timer(this->metrics, Operation::Store);
+
+        // Serialize every function before taking the lock
+        std::vector<EncodedFunction> encoded;
+        encoded.reserve(functions.size());
+        for (const auto &func : functions)
+        {
+            check_name(func.name);
+            encoded.push_back(encode_for_store(func));
+        }
+
+        // Frame the records into one buffer, each new template ahead of its first user, and append
+        // it with a single write
+        std::lock_guard<std::mutex> writer(this->write_mutex);
+        std::string buffer;
+        std::vector<std::pair<std::string_view, uint64_t>> records; // Key and offset within the buffer
+        records.reserve(functions.size());
+        std::unordered_map<std::string, std::string> new_templates;
+        for (size_t i = 0; i < functions.size(); ++i)
+        {
+            if (this->resolve_template(functions[i], encoded[i], new_templates))
+            {
+                records.emplace_back(encoded[i].template_key, buffer.size());
+                encode_record(buffer, encoded[i].template_key, encoded[i].template_payload);
+            }
+            records.emplace_back(functions[i].name, buffer.size());
+            encode_record(buffer, functions[i].name, encoded[i].payload);
+        }
+        uint64_t base_offset = this->append_records(buffer);
+
+        // Point each slot at its new record; later duplicates in the batch win
+        {
+            std::unique_lock<std::shared_mutex> lock(this->mutex);
+            this->data_map.remap();
+            for (const auto &[key, offset] : records)
+            {
+                this->index_record(key, hash64(key), base_offset + offset);
+            }
+            for (const auto &func : functions)
+            {
+                this->cache.erase(func.name);
+            }
+            ++this->write_generation;
+        }
+
+        if (this->sorted_names.merge_due())
+        {
+            this->merge_sorted_names();
+        }
+        if (this->name_filter.grow_due())
+        {
+            this->grow_name_filter();
+        }
+        this->checkpoint_locked();
+        this->mark_all_synced();
+        if (this->compaction_due())
+        {
+            this->start_background_compaction();
+        }
+    }
+
+    bool Database::needs_compaction() const
+    {
+        std::shared_lock<std::shared_mutex> lock(this->mutex);
+        return this->compaction_due();
+    }
+
+    // Callers hold either lock; only writers change the sizes compared here
+    bool Database::compaction_due() const
+    {
+        const uint64_t data_bytes = this->data_map.size();
+        return data_bytes >= MIN_COMPACTION_BYTES && data_bytes > MAX_SPACE_AMPLIFICATION * this->live_bytes;
+    }
+
+    CompactionStats Database::compact()
+    {
+        this->require_writable();
+        std::lock_guard<std::mutex> writer(this->write_mutex);
+        return this->compact_locked();
+    }
+
+    // --- Rewrite the live records into a new data file and index, then swap them in ---
+    // Runs with write_mutex held. Nothing else changes the files meanwhile, so records are copied
+    // while readers carry on, and only the final swap excludes them.
+    CompactionStats Database::compact_locked()
+    {
+        // The slots to copy are all in one table once any resize has finished
+        if (this->resize_map.is_open())
+        {
+            std::unique_lock<std::shared_mutex> lock(this->mutex);
+            this->migrate_slots(table_capacity(this->index_map));
+        }
+
+        // Copy live records in file order, so records saved together stay together
+        std::vector<uint64_t> offsets;
+        offsets.reserve(this->entry_count);
+        const uint64_t *old_slots = table_slots(this->index_map);
+        for (size_t i = 0; i < table_capacity(this->index_map); ++i)
+        {
+            if (old_slots[i] != TOMBSTONE)
+            {
+                offsets.push_back(slot_offset(old_slots[i]));
+            }
+        }
+        std::sort(offsets.begin(), offsets.end());
+
+        // Templates are copied only while a live function still uses them; a shape whose last
+        // user was saved again with another shape is dropped here
+        std::unordered_set<uint64_t> used_templates;
+        for (uint64_t offset : offsets)
+        {
+            std::optional<RecordView> record = this->read_record(offset);
+            if (!record)
+            {
+                throw std::runtime_error("Truncated record in data file.");
+            }
+            if (!is_template_key(record->key) && is_templated(record->value))
+            {
+                used_templates.insert(templated_id(record->value));
+            }
+        }
+        size_t template_count = 0;
+        offsets.erase(std::remove_if(offsets.begin(), offsets.end(), [&](uint64_t offset)
+                                     {
+                                         std::string_view key = this->read_record(offset)->key;
+                                         if (!is_template_key(key))
+                                         {
+                                             return false;
+                                         }
+                                         bool used = used_templates.count(template_id_of(key)) != 0;
+                                         template_count += used;
+                                         return !used; }),
+                      offsets.end());
+
+        CompactionStats stats{offsets.size(), this->data_map.size(), 0, 0};
+        std::filesystem::remove(this->compact_data_file);
+        std::filesystem::remove(this->compact_index_file);
+        MappedFile new_data(this->compact_data_file, false);
+        MappedFile new_index(this->compact_index_file, true);
+        this->init_index(new_index, round_up_capacity(std::max(this->initial_capacity, offsets.size() * MAX_LOAD_DEN / MAX_LOAD_NUM + 1)));
+
+        // Records are copied in chunks so the new file is written with large sequential writes
+        std::string chunk;
+        uint64_t written = 0;
+        uint64_t *new_slots = table_slots(new_index);
+        const size_t new_mask = table_capacity(new_index) - 1;
+        for (uint64_t offset : offsets)
+        {
+            std::optional<RecordView> record = this->read_record(offset);
+            if (!record)
+            {
+                throw std::runtime_error("Truncated record in data file.");
+            }
+            // Keys in the old index are unique, so the new slot is simply the first empty one
+            uint64_t hash = hash64(record->key);
+            size_t slot = hash & new_mask;
+            while (new_slots[slot] != TOMBSTONE)
+            {
+                slot = (slot + 1) & new_mask;
+            }
+            new_slots[slot] = make_slot(written + chunk.size(), hash);
+            chunk.append(this->data_map.data() + offset, record->next_offset - offset);
+            if (chunk.size() >= WRITE_CHUNK_BYTES)
+            {
+                written += chunk.size();
+                new_data.append(chunk.data(), chunk.size());
+                chunk.clear();
+            }
+        }
+        if (!chunk.empty())
+        {
+            written += chunk.size();
+            new_data.append(chunk.data(), chunk.size());
+        }
+        table_header(new_index)->live_bytes = written;
+        table_header(new_index)->indexed_bytes = written;
+        table_header(new_index)->template_entries = template_count;
+        // The new data file is a new generation: name files left from the old one, should a crash
+        // keep them from being replaced below, are rebuilt when the database is opened
+        const uint32_t generation = this->data_generation + 1;
+        table_header(new_index)->generation = generation;
+        new_data.sync();
+        new_index.sync();
+        // The sorted names keep their order, but must cover the new file rather than the old one
+        NameIndex::Run names = this->sorted_names.merged(written, generation);
+
+        // Removing the old index first means a crash at any point below leaves either the old
+        // data file or the new one without an index, and the next open rebuilds a correct one.
+        // The committer reads the data file's descriptor under commit_mutex.
+        std::lock_guard<std::mutex> commit(this->commit_mutex);
+        std::unique_lock<std::shared_mutex> lock(this->mutex);
+        this->data_map.close();
+        this->index_map.close();
+        std::filesystem::remove(this->index_file);
+        std::filesystem::rename(this->compact_data_file, this->data_file);
+        std::filesystem::rename(this->compact_index_file, this->index_file);
+        this->data_map = MappedFile(this->data_file, false);
+        this->index_map = std::move(new_index);
+        this->data_generation = generation;
+        this->sorted_names.install(std::move(names));
+        // The filter already holds every name of the new file; until its header says so, it is
+        // taken for the old file's and rebuilt
+        this->name_filter.checkpoint(written, generation);
+        this->live_bytes = written;
+        this->entry_count = offsets.size();
+        this->template_count = template_count;
+        // Every write so far is in the new file, which has been synced
+        this->synced_writes = this->appended_writes;
+        this->commit_done.notify_all();
+
+        stats.bytes_after = written;
+        stats.reclaimed_bytes = stats.bytes_before - stats.bytes_after;
+        return stats;
+    }
+
+    void Database::start_background_compaction()
+    {
+        if (this->compaction_running.exchange(true))
+        {
+            return;
+        }
+        // The previous compaction has finished, so replacing its future does not block
+        this->background_compaction = std::async(std::launch::async, &Database::run_background_compaction, this);
+    }
+
+    void Database::run_background_compaction()
+    {
+        try
+        {
+            std::lock_guard<std::mutex> writer(this->write_mutex);
+            // An explicit compact() may have run since the write that asked for this one
+            if (this->compaction_due())
+            {
+                this->compact_locked();
+            }
+        }
+        catch (const std::exception &)
+        {
+            // The old files stay in use; the next write that finds compaction due tries again
+        }
+        this->compaction_running = false;
+    }
+
+    void Database::wait_for_compaction()
+    {
+        std::future<void> running;
+        {
+            std::lock_guard<std::mutex> writer(this->write_mutex);
+            running = std::move(this->background_compaction);
+        }
+        if (running.valid())
+        {
+            running.wait();
+        }
     }
 
-    void Database::clear()
+    std::future<CompactionStats> Database::compact_async()
     {
-        std::filesystem::remove(this->data_file);
-        std::filesystem::remove(this->index_file);
+        return std::async(std::launch::async, [this]
+                          { return this->compact(); });
+    }
+
+    // --- Write an immutable image of every function for open_snapshot ---
+    FreezeStats Database::freeze(const std::string &image_filename)
+    {
+        this->require_writable();
+        std::lock_guard<std::mutex> writer(this->write_mutex);
+        FreezeStats stats{};
+        SnapshotWriter image(image_filename);
+        // Writers wait and nothing else changes the files, so records are read without the lock.
+        // Payloads are copied as stored, less any optimized program, which goes in the image's
+        // program field. Templated ones share the program stored with their shape, so only the
+        // others are compiled here, unless they were stored optimized; the shapes follow once
+        // every name is written.
+        std::map<uint64_t, size_t> template_uses;
+        auto stored_payload = [this](std::string_view key)
+        {
+            std::optional<RecordView> record = this->read_record(this->find_key(key, hash64(key)));
+            if (!record)
+            {
+                throw std::runtime_error("Truncated record in data file.");
+            }
+            return std::string(record->value);
+        };
+        auto program_of = [](const std::string &key, const OptimizedRecord &stored)
+        {
+            if (!stored.program.empty())
+            {
+                return std::string(stored.program);
+            }
+            CachedFunction compiled(decode_function(key, stored.payload));
+            std::optional<std::string> program = compiled.compiled ? compiled.compiled->encode() : std::nullopt;
+            return program ? *program : std::string();
+        };
+        // A scan yields the names in sorted order, which is the order the image keeps its records in
+        NameScan scan = this->scan("");
+        while (std::optional<std::string> name = scan.next())
+        {
+            const std::string payload = stored_payload(*name);
+            const OptimizedRecord stored = split_optimized(payload);
+            std::string program;
+            if (is_templated(stored.payload))
+            {
+                ++template_uses[decode_templated(stored.payload).template_id];
+            }
+            else
+            {
+                program = program_of(*name, stored);
+                stats.precompiled += !program.empty();
+            }
+            image.add(*name, stored.payload, program);
+            ++stats.functions;
+        }
+        for (const auto &[template_id, uses] : template_uses)
+        {
+            const std::string key = template_key(template_id);
+            const std::string payload = stored_payload(key);
+            const OptimizedRecord stored = split_optimized(payload);
+            const std::string program = program_of(key, stored);
+            image.add_template(template_id, stored.payload, program);
+            stats.precompiled += program.empty() ? 0 : uses;
+        }
+        stats.image_bytes = image.finish();
+        return stats;
+    }
+
+    void Database::set_optimize_on_store(bool enabled)
+    {
+        this->require_writable();
+        this->optimize_on_store = enabled;
+    }
+
+    // --- Durability: per-write syncs and group commit ---
+
+    void Database::set_durability(const DurabilityOptions &options)
+    {
+        this->require_writable();
+        std::lock_guard<std::mutex> writer(this->write_mutex);
+        // Stopping the committer syncs whatever it had not synced yet
+        this->stop_commit_thread();
+        {
+            std::lock_guard<std::mutex> commit(this->commit_mutex);
+            this->durability = options;
+        }
+        if (options.mode == Durability::GroupCommit)
+        {
+            this->committer = std::thread(&Database::run_committer, this);
+        }
+    }
+
+    DurabilityOptions Database::get_durability() const
+    {
+        std::lock_guard<std::mutex> commit(this->commit_mutex);
+        return this->durability;
+    }
+
+    // Number the write just appended; in PerWrite mode it is also synced. Runs with write_mutex
+    // held, so a compaction cannot swap the data file meanwhile.
+    uint64_t Database::log_write()
+    {
+        const bool sync = this->durability.mode == Durability::PerWrite;
+        if (sync)
+        {
+            this->data_map.sync();
+        }
+        std::lock_guard<std::mutex> commit(this->commit_mutex);
+        ++this->appended_writes;
+        if (sync)
+        {
+            this->synced_writes = this->appended_writes;
+        }
+        return this->appended_writes;
     }
 
-    // --- Save index and data to files for O(1) lookup ---
-    void Database::save_index(const std::unordered_map<std::string, uint64_t> &index) const
+    // Block until a group commit has synced write number `write`; returns at once in other modes
+    void Database::wait_for_commit(uint64_t write)
     {
-        // Write data to the data file
-        std::ofstream data_stream(this->data_file, std::ios::binary | std::ios::trunc);
-        if (!data_stream)
+        std::unique_lock<std::mutex> commit(this->commit_mutex);
+        if (this->durability.mode != Durability::GroupCommit)
+        {
+            return;
+        }
+        this->commit_requested.notify_one();
+        this->commit_done.wait(commit, [this, write]
+                               { return this->synced_writes >= write || !this->commit_error.empty(); });
+        if (this->synced_writes < write)
         {
-            throw std::runtime_error("Could not open data file for writing.");
+            throw std::runtime_error(this->commit_error);
         }
+    }
 
-        std::vector<uint64_t> hash_table(HASH_TABLE_SIZE, TOMBSTONE);
-        std::hash<std::string> hasher;
+    void Database::mark_all_synced()
+    {
+        std::lock_guard<std::mutex> commit(this->commit_mutex);
+        this->synced_writes = this->appended_writes;
+        this->commit_done.notify_all();
+    }
 
-        for (const auto &pair : index)
+    // --- Committer thread: one data file sync per group of writes ---
+    void Database::run_committer()
+    {
+        auto last_checkpoint = std::chrono::steady_clock::now();
+        std::unique_lock<std::mutex> commit(this->commit_mutex);
+        while (true)
         {
-            // Get the key, value, and calculate hash
-            const std::string &key = pair.first;
-            const uint64_t offset_value = pair.second;
+            this->commit_requested.wait(commit, [this]
+                                        { return this->stop_committer || this->appended_writes > this->synced_writes; });
+            if (!this->stop_committer)
+            {
+                // The group stays open for the interval after its first write, unless it fills up first
+                this->commit_requested.wait_for(commit, this->durability.group_interval, [this]
+                                                { return this->stop_committer || this->appended_writes - this->synced_writes >= this->durability.group_size; });
+            }
 
-            // Write the key-value pair to the data file and get its offset
-            uint64_t data_offset = data_stream.tellp();
-            uint32_t ksize = key.size();
-            data_stream.write(reinterpret_cast<const char *>(&ksize), sizeof(ksize));
-            data_stream.write(key.data(), ksize);
-            data_stream.write(reinterpret_cast<const char *>(&offset_value), sizeof(offset_value));
+            const uint64_t target = this->appended_writes;
+            if (target > this->synced_writes)
+            {
+                // The sync runs on a duplicate descriptor without the lock, so the next group can
+                // append meanwhile; a compaction that swaps the file in between syncs the new one itself
+                int fd = ::dup(this->data_map.descriptor());
+                commit.unlock();
+                int result = fd < 0 ? -1 : ::fdatasync(fd);
+                int error = errno;
+                if (fd >= 0)
+                {
+                    ::close(fd);
+                }
+                commit.lock();
+                if (result == 0)
+                {
+                    this->synced_writes = std::max(this->synced_writes, target);
+                }
+                else
+                {
+                    this->commit_error = std::string("Could not sync data file: ") + std::strerror(error);
+                }
+                this->commit_done.notify_all();
+            }
+            if (this->stop_committer || !this->commit_error.empty())
+            {
+                return;
+            }
 
-            // Calculate hash index and resolve collisions using linear probing
-            size_t hash_index = hasher(key) % HASH_TABLE_SIZE;
-            while (hash_table[hash_index] != TOMBSTONE)
+            if (std::chrono::steady_clock::now() - last_checkpoint >= CHECKPOINT_INTERVAL)
             {
-                hash_index = (hash_index + 1) % HASH_TABLE_SIZE;
+                // A checkpoint needs the writer lock, whose holder may be waiting for this thread
+                // to stop, so it is only taken if free
+                commit.unlock();
+                std::unique_lock<std::mutex> writer(this->write_mutex, std::try_to_lock);
+                if (writer.owns_lock())
+                {
+                    try
+                    {
+                        this->checkpoint_locked();
+                        last_checkpoint = std::chrono::steady_clock::now();
+                    }
+                    catch (const std::exception &)
+                    {
+                        // The next open replays more of the log
+                    }
+                    writer.unlock();
+                }
+                commit.lock();
             }
-            hash_table[hash_index] = data_offset;
         }
+    }
 
-        // Write the hash table (offsets) to the index file
-        std::ofstream idx_stream(this->index_file, std::ios::binary | std::ios::trunc);
-        if (!idx_stream)
+    // Stop the committer after a final sync; runs with write_mutex held, so no writes are in flight
+    void Database::stop_commit_thread()
+    {
+        if (!this->committer.joinable())
+        {
+            return;
+        }
         {
-            throw std::runtime_error("Could not open index file for writing.");
+            std::lock_guard<std::mutex> commit(this->commit_mutex);
+            this->stop_committer = true;
         }
-        idx_stream.write(reinterpret_cast<const char *>(hash_table.data()), HASH_TABLE_SIZE * sizeof(uint64_t));
+        this->commit_requested.notify_one();
+        this->committer.join();
+        this->stop_committer = false;
     }
 
-    // --- Load data using the index for O(1) lookup ---
-    uint64_t Database::lookup_key(std::string_view key) const
+    std::shared_ptr<const CachedFunction> Database::load_cached(std::string_view name) const
     {
-        std::ifstream idx_stream(this->index_file, std::ios::binary);
-        if (!idx_stream)
+        ScopedTimer timer(this->metrics, Operation::Load);
+        std::string key(name);
+        if (auto cached = this->cache.get(key))
         {
-            return TOMBSTONE; // Index file doesn't exist yet
+            return *cached;
+        }
+        if (this->snapshot)
+        {
+            return this->load_from_snapshot(key);
         }
 
-        // Read the entire hash table into memory
-        std::vector<uint64_t> hash_table(HASH_TABLE_SIZE);
-        idx_stream.read(reinterpret_cast<char *>(hash_table.data()), HASH_TABLE_SIZE * sizeof(uint64_t));
+        // Copy the record out under the shared lock; parsing and compiling happen without it
+        std::string payload;
+        uint64_t generation;
+        {
+            std::shared_lock<std::shared_mutex> lock(this->mutex);
+            const uint64_t hash = hash64(name);
+            if (!this->name_filter.may_contain(hash))
+            {
+                return nullptr;
+            }
+            uint64_t offset = this->lookup_key(name, hash);
+            if (offset == TOMBSTONE)
+            {
+                return nullptr;
+            }
+            std::optional<RecordView> record = this->read_record(offset);
+            if (!record)
+            {
+                throw std::runtime_error("Truncated record in data file.");
+            }
+            payload.assign(record->value);
+            generation = this->write_generation;
+        }
+        return this->parse_and_cache(key, payload, generation);
+    }
 
-        std::hash<std::string_view> hasher;
-        size_t hash_index = hasher(key) % HASH_TABLE_SIZE;
+    // Function of a payload that is not templated, with the program stored with it, if any. Only
+    // a template's shape has parameters; a program with any elsewhere would read unbound ones.
+    static std::shared_ptr<const CachedFunction> stored_function(const std::string &key, const OptimizedRecord &record, bool is_shape = false)
+    {
+        Function func = decode_function(key, record.payload);
+        if (record.program.empty())
+        {
+            return std::make_shared<const CachedFunction>(std::move(func));
+        }
+        CompiledFunction compiled = CompiledFunction::decode(record.program);
+        if (!is_shape && compiled.parameter_count() != 0)
+        {
+            throw std::runtime_error("Corrupt compiled program.");
+        }
+        return std::make_shared<const CachedFunction>(std::move(func), std::move(compiled));
+    }
 
-        std::ifstream data_stream(this->data_file, std::ios::binary);
-        if (!data_stream)
+    std::shared_ptr<const CachedFunction> Database::parse_and_cache(const std::string &key, const std::string &payload, uint64_t generation) const
+    {
+        this->metrics.add_bytes_read(payload.size());
+        std::shared_ptr<const CachedFunction> loaded;
         {
-            return TOMBSTONE; // Data file doesn't exist yet
+            ScopedTimer parse_timer(this->metrics, Operation::Parse);
+            if (is_templated(payload))
+            {
+                // The shape is compiled once per template; this function only binds its coefficients
+                TemplatedRecord record = decode_templated(payload);
+                std::shared_ptr<const CachedFunction> shape = this->load_template(record.template_id);
+                loaded = std::make_shared<const CachedFunction>(instantiate_template(key, shape->function, record.parameters),
+                                                                *shape, record.parameters);
+            }
+            else
+            {
+                loaded = stored_function(key, split_optimized(payload));
+            }
         }
 
-        // Probe the hash table until a match is found or we find an empty slot
-        size_t start_index = hash_index;
-        while (hash_table[hash_index] != TOMBSTONE)
+        // A write since the record was read may have replaced it, in which case caching this copy
+        // would outlive the invalidation; writers cannot run while the shared lock is held
+        std::shared_lock<std::shared_mutex> lock(this->mutex);
+        if (this->write_generation == generation)
         {
-            uint64_t data_offset = hash_table[hash_index];
-            data_stream.seekg(data_offset);
+            this->cache.put(key, loaded);
+        }
+        return loaded;
+    }
 
-            uint32_t ksize = 0;
-            data_stream.read(reinterpret_cast<char *>(&ksize), sizeof(ksize));
+    std::shared_ptr<const CachedFunction> Database::load_from_snapshot(const std::string &key) const
+    {
+        std::optional<SnapshotRecord> record;
+        {
+            ScopedTimer lookup_timer(this->metrics, Operation::Lookup);
+            record = this->snapshot->find(key);
+        }
+        if (!record)
+        {
+            return nullptr;
+        }
+        this->metrics.add_bytes_read(record->payload.size() + record->program.size());
+        std::shared_ptr<const CachedFunction> loaded;
+        {
+            ScopedTimer parse_timer(this->metrics, Operation::Parse);
+            if (is_templated(record->payload))
+            {
+                TemplatedRecord templated = decode_templated(record->payload);
+                std::shared_ptr<const CachedFunction> shape = this->load_template(templated.template_id);
+                loaded = std::make_shared<const CachedFunction>(instantiate_template(key, shape->function, templated.parameters),
+                                                                *shape, templated.parameters);
+            }
+            else
+            {
+                loaded = stored_function(key, {record->payload, record->program});
+            }
+        }
+        // The image never changes, so nothing can have replaced the record meanwhile
+        this->cache.put(key, loaded);
+        return loaded;
+    }
 
-            std::string stored_key(ksize, '\0');
-            data_stream.read(&stored_key[0], ksize);
+    // --- Parsed and compiled shape of a template, read from its record on a cache miss ---
+    std::shared_ptr<const CachedFunction> Database::load_template(uint64_t template_id) const
+    {
+        if (auto cached = this->templates.get(template_id))
+        {
+            return *cached;
+        }
+        const std::string key = template_key(template_id);
+        if (this->snapshot)
+        {
+            std::optional<SnapshotRecord> record = this->snapshot->find_template(template_id);
+            if (!record)
+            {
+                throw std::runtime_error("Template of a stored function is missing from the snapshot.");
+            }
+            std::shared_ptr<const CachedFunction> shape = stored_function(key, {record->payload, record->program}, true);
+            this->templates.put(template_id, shape);
+            return shape;
+        }
+        std::string payload;
+        {
+            std::shared_lock<std::shared_mutex> lock(this->mutex);
+            uint64_t offset = this->find_key(key, hash64(key));
+            if (offset == TOMBSTONE)
+            {
+                throw std::runtime_error("Template of a stored function is missing from the data file.");
+            }
+            std::optional<RecordView> record = this->read_record(offset);
+            if (!record)
+            {
+                throw std::runtime_error("Truncated record in data file.");
+            }
+            payload.assign(record->value);
+        }
+        // Template records are never replaced, so there is no generation to check
+        std::shared_ptr<const CachedFunction> shape = stored_function(key, split_optimized(payload), true);
+        this->templates.put(template_id, shape);
+        return shape;
+    }
 
-            if (stored_key == key)
+    std::vector<std::shared_ptr<const CachedFunction>> Database::load_many(const std::vector<std::string_view> &names) const
+    {
+        ScopedTimer timer(this->metrics, Operation::Load);
+        std::vector<std::shared_ptr<const CachedFunction>> results(names.size());
+        struct Miss
+        {
+            size_t position;
+            std::string key;
+            uint64_t hash;
+            uint64_t offset;
+            std::string payload;
+        };
+        std::vector<Miss> misses;
+        for (size_t i = 0; i < names.size(); ++i)
+        {
+            std::string key(names[i]);
+            if (auto cached = this->cache.get(key))
+            {
+                results[i] = *cached;
+            }
+            else
             {
-                return data_offset;
+                const uint64_t hash = hash64(key);
+                misses.push_back({i, std::move(key), hash, TOMBSTONE, {}});
             }
+        }
+        if (misses.empty())
+        {
+            return results;
+        }
+        if (this->snapshot)
+        {
+            for (const Miss &miss : misses)
+            {
+                results[miss.position] = this->load_from_snapshot(miss.key);
+            }
+            return results;
+        }
 
-            // Collision, move to the next slot
-            hash_index = (hash_index + 1) % HASH_TABLE_SIZE;
-            if (hash_index == start_index)
+        uint64_t generation;
+        {
+            std::shared_lock<std::shared_mutex> lock(this->mutex);
+            // Names the filter rules out stay nullptr without a lookup
+            misses.erase(std::remove_if(misses.begin(), misses.end(), [this](const Miss &miss)
+                                        { return !this->name_filter.may_contain(miss.hash); }),
+                         misses.end());
+            // Request the records every lookup will compare against, then look the names up while
+            // the reads are in flight, then request the whole of each record found before copying
+            std::vector<std::pair<uint64_t, size_t>> ranges;
+            for (const Miss &miss : misses)
             {
-                // We've looped through the entire table
-                break;
+                if (this->resize_map.is_open())
+                {
+                    this->find_candidates(this->resize_map, miss.hash, ranges);
+                }
+                this->find_candidates(this->index_map, miss.hash, ranges);
+            }
+            this->data_map.prefetch(std::move(ranges));
+            ranges.clear();
+            for (Miss &miss : misses)
+            {
+                miss.offset = this->lookup_key(miss.key, miss.hash);
+                if (miss.offset != TOMBSTONE)
+                {
+                    uint64_t size = this->record_size(miss.offset);
+                    // The first PREFETCH_BYTES were requested already
+                    if (size > PREFETCH_BYTES)
+                    {
+                        ranges.emplace_back(miss.offset, size);
+                    }
+                }
+            }
+            this->data_map.prefetch(std::move(ranges));
+            for (Miss &miss : misses)
+            {
+                if (miss.offset == TOMBSTONE)
+                {
+                    continue;
+                }
+                std::optional<RecordView> record = this->read_record(miss.offset);
+                if (!record)
+                {
+                    throw std::runtime_error("Truncated record in data file.");
+                }
+                miss.payload.assign(record->value);
+            }
+            generation = this->write_generation;
+        }
+
+        for (Miss &miss : misses)
+        {
+            if (miss.offset != TOMBSTONE)
+            {
+                results[miss.position] = this->parse_and_cache(miss.key, miss.payload, generation);
             }
         }
-        return TOMBSTONE;
+        return results;
+    }
+
+    template <typename Task>
+    auto Database::submit_load(Task task) const
+    {
+        {
+            std::lock_guard<std::mutex> lock(this->loads_mutex);
+            ++this->pending_loads;
+        }
+        auto counted = [this, task = std::move(task)]()
+        {
+            // Counted as finished however the task ends
+            std::unique_ptr<const Database, void (*)(const Database *)> finished(this, &Database::finish_load);
+            return task();
+        };
+        return WorkerPool::shared().submit(std::move(counted));
     }
 
-    void Database::save_function(const Function &func) const
+    void Database::finish_load(const Database *database)
     {
-        // Append the new function to the data file
-        std::ofstream data_stream(this->data_file, std::ios::binary | std::ios::app);
-        if (!data_stream)
+        std::lock_guard<std::mutex> lock(database->loads_mutex);
+        if (--database->pending_loads == 0)
         {
-            throw std::runtime_error("Could not open data file for writing.");
+            database->loads_done.notify_all();
         }
+    }
 
-        uint64_t new_data_offset = data_stream.tellp();
+    std::future<std::shared_ptr<const CachedFunction>> Database::load_async(std::string name) const
+    {
+        return this->submit_load([this, name = std::move(name)]
+                                 { return this->load_cached(name); });
+    }
 
-        std::string serialized_data = func.serialize();
+    std::future<std::vector<std::shared_ptr<const CachedFunction>>> Database::load_many_async(std::vector<std::string> names) const
+    {
+        return this->submit_load([this, names = std::move(names)]
+                                 { return this->load_many(std::vector<std::string_view>(names.begin(), names.end())); });
+    }
 
-        uint32_t key_size = func.name.size();
-        uint32_t data_size = serialized_data.size();
+    bool Database::contains(std::string_view name) const
+    {
+        if (this->snapshot)
+        {
+            return this->snapshot->find(name).has_value();
+        }
+        std::shared_lock<std::shared_mutex> lock(this->mutex);
+        const uint64_t hash = hash64(name);
+        return this->name_filter.may_contain(hash) && this->lookup_key(name, hash) != TOMBSTONE;
+    }
 
-        data_stream.write(reinterpret_cast<const char *>(&key_size), sizeof(key_size));
-        data_stream.write(func.name.data(), key_size);
-        data_stream.write(reinterpret_cast<const char *>(&data_size), sizeof(data_size));
-        data_stream.write(serialized_data.data(), data_size);
+    std::vector<std::string> Database::names() const
+    {
+        if (this->snapshot)
+        {
+            return this->names_in_range("", std::nullopt, this->snapshot->size());
+        }
+        std::shared_lock<std::shared_mutex> lock(this->mutex);
+        return this->collect_names();
+    }
 
-        // Read the index file into memory for modification
-        std::vector<uint64_t> hash_table(HASH_TABLE_SIZE, TOMBSTONE);
-        if (std::ifstream idx_in(this->index_file, std::ios::binary); idx_in)
+    // Callers hold either lock
+    std::vector<std::string> Database::collect_names() const
+    {
+        std::vector<std::string> names;
+        names.reserve(this->entry_count - this->template_count);
+        const MappedFile &current = this->resize_map.is_open() ? this->resize_map : this->index_map;
+        const uint64_t *slots = table_slots(current);
+        for (size_t i = 0; i < table_capacity(current); ++i)
+        {
+            if (slots[i] == TOMBSTONE)
+            {
+                continue;
+            }
+            std::string_view key = this->key_at(slot_offset(slots[i]));
+            if (!is_template_key(key))
+            {
+                names.emplace_back(key);
+            }
+        }
+        if (this->resize_map.is_open())
         {
-            idx_in.read(reinterpret_cast<char *>(hash_table.data()), HASH_TABLE_SIZE * sizeof(uint64_t));
+            // Slots the resize has not reached yet are only in the old table, unless saved again since
+            const uint64_t *old_slots = table_slots(this->index_map);
+            for (size_t i = this->resize_cursor; i < table_capacity(this->index_map); ++i)
+            {
+                if (old_slots[i] == TOMBSTONE)
+                {
+                    continue;
+                }
+                std::string_view key = this->key_at(slot_offset(old_slots[i]));
+                if (!is_template_key(key) && this->find_in(this->resize_map, key, hash64(key)) == TOMBSTONE)
+                {
+                    names.emplace_back(key);
+                }
+            }
         }
+        return names;
+    }
 
-        // Find the correct slot for the new function using linear probing
-        std::hash<std::string> hasher;
-        size_t hash_index = hasher(func.name) % HASH_TABLE_SIZE;
-        size_t start_index = hash_index;
+    // Callers hold either lock
+    std::vector<uint64_t> Database::collect_offsets() const
+    {
+        std::vector<uint64_t> offsets;
+        offsets.reserve(this->entry_count);
+        const MappedFile &current = this->resize_map.is_open() ? this->resize_map : this->index_map;
+        const uint64_t *slots = table_slots(current);
+        for (size_t i = 0; i < table_capacity(current); ++i)
+        {
+            if (slots[i] != TOMBSTONE)
+            {
+                offsets.push_back(slot_offset(slots[i]));
+            }
+        }
+        if (this->resize_map.is_open())
+        {
+            // As in collect_names, the slots the resize has not reached count unless saved again since
+            const uint64_t *old_slots = table_slots(this->index_map);
+            for (size_t i = this->resize_cursor; i < table_capacity(this->index_map); ++i)
+            {
+                if (old_slots[i] == TOMBSTONE)
+                {
+                    continue;
+                }
+                std::string_view key = this->key_at(slot_offset(old_slots[i]));
+                if (this->find_in(this->resize_map, key, hash64(key)) == TOMBSTONE)
+                {
+                    offsets.push_back(slot_offset(old_slots[i]));
+                }
+            }
+        }
+        return offsets;
+    }
 
-        while (true)
+    // --- Scan every stored function without going through the cache ---
+    void Database::for_each(const std::function<void(const Function &)> &visit) const
+    {
+        // Shapes by template id, decoded once per scan; a template's record precedes the first
+        // function that uses it, so file order usually meets it first
+        std::unordered_map<uint64_t, Function> shapes;
+        auto visit_record = [&](std::string_view key, std::string_view payload)
         {
-            if (hash_table[hash_index] == TOMBSTONE)
+            if (!is_templated(payload))
             {
-                hash_table[hash_index] = new_data_offset;
-                break;
+                visit(decode_function(std::string(key), split_optimized(payload).payload));
+                return;
+            }
+            TemplatedRecord record = decode_templated(payload);
+            auto shape = shapes.find(record.template_id);
+            if (shape == shapes.end())
+            {
+                shape = shapes.emplace(record.template_id, this->load_template(record.template_id)->function).first;
             }
+            visit(instantiate_template(std::string(key), shape->second, record.parameters));
+        };
 
-            // Check if the key at the existing slot is a match to handle updates
-            std::ifstream data_check(this->data_file, std::ios::binary);
-            if (!data_check)
+        if (this->snapshot)
+        {
+            // The image holds the records in name order, which is also their order in the file
+            for (size_t rank = 0; rank < this->snapshot->size(); ++rank)
             {
-                hash_table[hash_index] = new_data_offset;
-                break;
+                SnapshotRecord record = this->snapshot->at(rank);
+                visit_record(record.name, record.payload);
             }
+            return;
+        }
 
-            data_check.seekg(hash_table[hash_index]);
-            uint32_t ksize;
-            data_check.read(reinterpret_cast<char *>(&ksize), sizeof(ksize));
-            std::string stored_key(ksize, '\0');
-            data_check.read(&stored_key[0], ksize);
+        // Records are only ever appended to a data file, and compact and clear replace the file
+        // rather than change it, so a mapping of it taken under the lock keeps every record found
+        // then for as long as the scan needs it
+        std::vector<uint64_t> offsets;
+        MappedFile data;
+        {
+            std::shared_lock<std::shared_mutex> lock(this->mutex);
+            offsets = this->collect_offsets();
+            data = MappedFile::open_read_only(this->data_file);
+        }
+        std::sort(offsets.begin(), offsets.end());
 
-            if (stored_key == func.name)
+        for (size_t start = 0; start < offsets.size(); start += SCAN_PREFETCH_RECORDS)
+        {
+            const size_t end = std::min(offsets.size(), start + SCAN_PREFETCH_RECORDS);
+            data.prefetch(offsets[start], offsets[end - 1] - offsets[start] + PREFETCH_BYTES);
+            for (size_t i = start; i < end; ++i)
             {
-                hash_table[hash_index] = new_data_offset;
-                break;
+                std::optional<RecordView> record = read_record_in(data, offsets[i]);
+                if (!record)
+                {
+                    throw std::runtime_error("Truncated record in data file.");
+                }
+                if (is_template_key(record->key))
+                {
+                    const std::string key(record->key);
+                    shapes.try_emplace(template_id_of(key), decode_function(key, split_optimized(record->value).payload));
+                    continue;
+                }
+                visit_record(record->key, record->value);
             }
+        }
+    }
 
-            // Move to the next slot for linear probing
-            hash_index = (hash_index + 1) % HASH_TABLE_SIZE;
+    // --- Sorted scans over the names ---
+    // Names fetched per lock while a NameScan runs
+    static constexpr size_t SCAN_BATCH_NAMES = 256;
 
-            // Prevent infinite loop if the table is full
-            if (hash_index == start_index)
+    // Smallest string after every string that starts with `prefix`, or nullopt if there is none
+    static std::optional<std::string> prefix_end(std::string prefix)
+    {
+        while (!prefix.empty() && static_cast<unsigned char>(prefix.back()) == 0xFF)
+        {
+            prefix.pop_back();
+        }
+        if (prefix.empty())
+        {
+            return std::nullopt;
+        }
+        prefix.back() = static_cast<char>(static_cast<unsigned char>(prefix.back()) + 1);
+        return prefix;
+    }
+
+    std::vector<std::string> Database::names_in_range(std::string_view lo, const std::optional<std::string> &hi, size_t limit) const
+    {
+        if (this->snapshot)
+        {
+            // Records are in name order, so the range is a run of ranks
+            std::vector<std::string> names;
+            for (size_t rank = this->snapshot->lower_bound(lo); rank < this->snapshot->size() && names.size() < limit; ++rank)
             {
-                throw std::runtime_error("Hash table is full.");
+                std::string_view name = this->snapshot->at(rank).name;
+                if (hi && name >= *hi)
+                {
+                    break;
+                }
+                names.emplace_back(name);
             }
+            return names;
         }
+        std::shared_lock<std::shared_mutex> lock(this->mutex);
+        return this->sorted_names.range(lo, hi, limit);
+    }
+
+    NameScan Database::scan(std::string lo, std::optional<std::string> hi) const
+    {
+        return NameScan(*this, std::move(lo), std::move(hi));
+    }
 
-        // Write the modified hash table back to the index file
-        std::ofstream idx_out(this->index_file, std::ios::binary | std::ios::trunc);
-        if (!idx_out)
+    NameScan Database::scan_prefix(std::string_view prefix, std::string_view after) const
+    {
+        std::string lo(prefix);
+        if (!after.empty() && after >= prefix)
         {
-            throw std::runtime_error("Could not open index file for writing.");
+            // The smallest string after `after`
+            lo.assign(after);
+            lo.push_back('\0');
         }
-        idx_out.write(reinterpret_cast<const char *>(hash_table.data()), HASH_TABLE_SIZE * sizeof(uint64_t));
+        return NameScan(*this, std::move(lo), prefix_end(std::string(prefix)));
     }
 
-    // Lookup a function by name
-    std::optional<Function> Database::load_function(std::string_view name) const
+    NameScan::NameScan(const Database &database, std::string lo, std::optional<std::string> hi)
+        : database(database), position(std::move(lo)), end(std::move(hi))
     {
-        uint64_t offset = this->lookup_key(name);
-        if (offset == TOMBSTONE)
+    }
+
+    // Fetch the batch after the last name fetched; false once the range is done
+    bool NameScan::fetch()
+    {
+        if (this->exhausted)
+        {
+            return false;
+        }
+        this->batch = this->database.names_in_range(this->position, this->end, SCAN_BATCH_NAMES);
+        this->next_in_batch = 0;
+        this->functions.clear();
+        this->next_function_in_batch = 0;
+        if (this->batch.size() < SCAN_BATCH_NAMES)
+        {
+            this->exhausted = true;
+        }
+        if (this->batch.empty())
+        {
+            return false;
+        }
+        // The smallest string after the last name
+        this->position = this->batch.back();
+        this->position.push_back('\0');
+        return true;
+    }
+
+    std::optional<std::string> NameScan::next()
+    {
+        if (this->next_in_batch == this->batch.size() && !this->fetch())
         {
             return std::nullopt;
         }
+        return std::move(this->batch[this->next_in_batch++]);
+    }
+
+    std::shared_ptr<const CachedFunction> NameScan::next_function()
+    {
+        while (true)
+        {
+            if (this->next_function_in_batch == this->functions.size())
+            {
+                if (this->next_in_batch == this->batch.size() && !this->fetch())
+                {
+                    return nullptr;
+                }
+                // Load the rest of the batch at once
+                this->functions = this->database.load_many(std::vector<std::string_view>(this->batch.begin() + this->next_in_batch, this->batch.end()));
+                this->next_function_in_batch = 0;
+                this->next_in_batch = this->batch.size();
+            }
+            // A name removed by a concurrent clear loads as nullptr and is skipped
+            if (auto func = this->functions[this->next_function_in_batch++])
+            {
+                return func;
+            }
+        }
+    }
 
-        std::ifstream file(this->data_file, std::ios::binary);
-        if (!file)
+    // Lookup a function by name
+    std::optional<Function> Database::load_function(std::string_view name) const
+    {
+        std::shared_ptr<const CachedFunction> cached = this->load_cached(name);
+        if (!cached)
         {
             return std::nullopt;
         }
+        return cached->function;
+    }
 
-        file.seekg(offset);
-        uint32_t key_size = 0, value_size = 0;
-        file.read(reinterpret_cast<char *>(&key_size), sizeof(key_size));
-        std::string key(key_size, '\0');
-        file.read(&key[0], key_size);
-        file.read(reinterpret_cast<char *>(&value_size), sizeof(value_size));
-        std::string value(value_size, '\0');
-        file.read(&value[0], value_size);
+    CacheStats Database::cache_stats() const
+    {
+        return {this->cache.hit_count(), this->cache.miss_count(), this->cache.size(), this->cache.max_size()};
+    }
 
-        // Parse value
-        size_t sep = value.find('|');
-        if (sep != std::string::npos)
+    DatabaseStats Database::stats() const
+    {
+        DatabaseStats stats{};
+        if (this->snapshot)
         {
-            std::string sym_str = value.substr(0, sep);
-            std::istringstream iss(sym_str);
-            std::string sym;
-            std::vector<std::string> symbols;
-            while (std::getline(iss, sym, ','))
-                symbols.push_back(sym);
-            SymEngine::Expression expr(value.substr(sep + 1));
-            return Function{key, symbols, expr};
+            stats.entries = this->snapshot->size();
+            stats.capacity = this->snapshot->size();
+            stats.data_bytes = this->snapshot->bytes();
+            stats.live_bytes = this->snapshot->bytes();
         }
-        return std::nullopt;
+        else
+        {
+            std::shared_lock<std::shared_mutex> lock(this->mutex);
+            stats.entries = this->entry_count - this->template_count;
+            stats.templates = this->template_count;
+            stats.capacity = table_capacity(this->resize_map.is_open() ? this->resize_map : this->index_map);
+            stats.data_bytes = this->data_map.size();
+            stats.live_bytes = this->live_bytes;
+        }
+        stats.cache = this->cache_stats();
+        stats.metrics = this->metrics.snapshot();
+        return stats;
     }
 
     double evaluate_stored_function(const Database &database, std::string_view search_name, const std::unordered_map<std::string, double> &values)
     {
-        std::optional<Function> func = database.load_function(search_name);
+        std::shared_ptr<const CachedFunction> func = database.load_cached(search_name);
+        if (func)
+        {
+            ScopedTimer timer(database.get_metrics(), Operation::Evaluate);
+            return func->get_compiled().evaluate(values);
+        }
+        throw std::runtime_error("Function '" + std::string(search_name) + "' not found in database.");
+    }
+
+    ValueGradient evaluate_stored_gradient(const Database &database, std::string_view search_name, const std::unordered_map<std::string, double> &values)
+    {
+        std::shared_ptr<const CachedFunction> func = database.load_cached(search_name);
+        if (func)
+        {
+            ScopedTimer timer(database.get_metrics(), Operation::Evaluate);
+            return func->get_compiled().evaluate_with_gradient(values);
+        }
+        throw std::runtime_error("Function '" + std::string(search_name) + "' not found in database.");
+    }
+
+    void evaluate_stored_batch(const Database &database, std::string_view search_name, const std::vector<const double *> &columns, double *out, size_t count)
+    {
+        std::shared_ptr<const CachedFunction> func = database.load_cached(search_name);
         if (func)
         {
-            return (*func).evaluate(values);
+            ScopedTimer timer(database.get_metrics(), Operation::Evaluate);
+            func->get_compiled().evaluate_batch(columns, out, count);
+            return;
         }
         throw std::runtime_error("Function '" + std::string(search_name) + "' not found in database.");
     }
-}
\ No newline at end of file
+}
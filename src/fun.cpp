@@ -1,4 +1,6 @@
 #include "../inc/fun.h"
+#include "../inc/compiled.h"
+#include "../inc/codec.h"
 #include <symengine/symbol.h>
 #include <iostream>
 #include <unordered_map>
@@ -24,18 +26,23 @@ namespace FunDB
         return static_cast<double>(evaluated_expr);
     }
 
+    void Function::evaluate_batch(const std::vector<const double *> &columns, double *out, size_t count) const
+    {
+        CompiledFunction(*this).evaluate_batch(columns, out, count);
+    }
+
+    ValueGradient Function::evaluate_with_gradient(const std::unordered_map<std::string, double> &values) const
+    {
+        return CompiledFunction(*this).evaluate_with_gradient(values);
+    }
+
     std::string Function::serialize() const
     {
-        std::ostringstream oss;
-        for (size_t i = 0; i < this->symbols.size(); ++i)
-        {
-            oss << this->symbols[i];
-            if (i + 1 < this->symbols.size())
-            {
-                oss << ",";
-            }
-        }
-        oss << "|" << this->expr;
-        return oss.str();
+        return encode_function(*this);
+    }
+
+    Function Function::deserialize(std::string name, std::string_view data)
+    {
+        return decode_function(std::move(name), data);
     }
-}
\ No newline at end of file
+}
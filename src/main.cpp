@@ -3,6 +3,8 @@
 #include <random>
 #include <chrono>
 #include <iostream>
+#include <algorithm>
+#include <cmath>
 
 int main()
 {
@@ -20,6 +22,7 @@ int main()
     // Generate and store 10,000 random functions
     std::uniform_int_distribution<int> dist(1, 1000);
     std::vector<std::string> keys;
+    std::vector<FunDB::Function> batch;
     const int total_funcs = 10'000;
     const int progress_width = 100;
     for (int i = 0; i < total_funcs; ++i)
@@ -32,7 +35,7 @@ int main()
             SymEngine::Expression x2(SymEngine::symbol("x"));
             SymEngine::Expression y2(SymEngine::symbol("y"));
             SymEngine::Expression expr = a * pow(x2, 2) + b * pow(y2, 2) + a * b * x2 * y2;
-            database.save_function({fname, {"x", "y"}, expr});
+            batch.push_back({fname, {"x", "y"}, expr});
         }
         keys.push_back(fname);
 
@@ -57,6 +60,9 @@ int main()
     }
     std::cout << std::endl;
 
+    // Store all generated functions with a single bulk write
+    database.write_batch(batch);
+
     // Look up and evaluate several random functions, measure time
     std::uniform_int_distribution<int> key_dist(0, keys.size() - 1);
     const int num_lookups = 100;
@@ -65,21 +71,61 @@ int main()
     {
         lookup_keys.push_back(keys[key_dist(rng)]);
     }
+    // Results are printed after the timed loop, so the timing covers only lookup and evaluation
+    std::vector<double> lookup_results(num_lookups);
     auto t_start = std::chrono::high_resolution_clock::now();
-    for (const auto &random_key : lookup_keys)
+    for (int i = 0; i < num_lookups; ++i)
     {
         try
         {
-            auto eval_result = FunDB::evaluate_stored_function(database, random_key, {{"x", 2.5}, {"y", 0.02}});
-            std::cout << "Evaluated loaded function with x=2.5, y=0.02: " << eval_result << " (Key: " << random_key << ")" << std::endl;
+            lookup_results[i] = FunDB::evaluate_stored_function(database, lookup_keys[i], {{"x", 2.5}, {"y", 0.02}});
         }
         catch (const std::runtime_error &e)
         {
-            std::cerr << "Error evaluating function '" << random_key << "': " << e.what() << std::endl;
+            lookup_results[i] = std::nan("");
         }
     }
     auto t_end = std::chrono::high_resolution_clock::now();
-    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(t_end - t_start).count();
-    std::cout << "\nLookup of " << num_lookups << " random functions took " << duration << " ms." << std::endl;
+    double duration_us = std::chrono::duration<double, std::micro>(t_end - t_start).count();
+    for (int i = 0; i < num_lookups; ++i)
+    {
+        std::cout << "Evaluated loaded function with x=2.5, y=0.02: " << lookup_results[i] << " (Key: " << lookup_keys[i] << ")" << std::endl;
+    }
+    std::cout << "\nLookup of " << num_lookups << " random functions took " << duration_us << " us." << std::endl;
+    std::cout << "For detailed measurements, run fundb_bench." << std::endl;
+
+    // Evaluate one function over many points, per point and as a single batch
+    const size_t num_points = 1'000'000;
+    std::uniform_real_distribution<double> point_dist(-10.0, 10.0);
+    std::vector<double> xs(num_points), ys(num_points), per_point(num_points), batched(num_points);
+    for (size_t i = 0; i < num_points; ++i)
+    {
+        xs[i] = point_dist(rng);
+        ys[i] = point_dist(rng);
+    }
+    const std::string &batch_key = lookup_keys.front();
+
+    const size_t num_slow_points = 10'000;
+    t_start = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < num_slow_points; ++i)
+    {
+        per_point[i] = FunDB::evaluate_stored_function(database, batch_key, {{"x", xs[i]}, {"y", ys[i]}});
+    }
+    t_end = std::chrono::high_resolution_clock::now();
+    double per_point_ns = std::chrono::duration<double, std::nano>(t_end - t_start).count() / num_slow_points;
+
+    t_start = std::chrono::high_resolution_clock::now();
+    FunDB::evaluate_stored_batch(database, batch_key, {xs.data(), ys.data()}, batched.data(), num_points);
+    t_end = std::chrono::high_resolution_clock::now();
+    double batch_ns = std::chrono::duration<double, std::nano>(t_end - t_start).count() / num_points;
+
+    double max_error = 0.0;
+    for (size_t i = 0; i < num_slow_points; ++i)
+    {
+        max_error = std::max(max_error, std::abs(per_point[i] - batched[i]));
+    }
+    std::cout << "Per-point evaluation: " << per_point_ns << " ns/point (" << num_slow_points << " points)" << std::endl;
+    std::cout << "Batch evaluation: " << batch_ns << " ns/point (" << num_points << " points), "
+              << per_point_ns / batch_ns << "x faster, max difference " << max_error << std::endl;
     return 0;
 }
\ No newline at end of file
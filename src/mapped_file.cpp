@@ -0,0 +1,215 @@
+#include "../inc/mapped_file.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+namespace FunDB
+{
+    // Mappings reserve at least this much address space, and grow at least twofold when the file
+    // outgrows them, so a file that is appended to is only re-mapped O(log size) times
+    static constexpr size_t MIN_RESERVED_BYTES = 1024 * 1024;
+
+    MappedFile::MappedFile(const std::filesystem::path &path, bool writable)
+        : writable(writable)
+    {
+        this->fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (this->fd < 0)
+        {
+            throw std::runtime_error("Could not open '" + path.string() + "': " + std::strerror(errno));
+        }
+        this->remap();
+    }
+
+    MappedFile MappedFile::open_read_only(const std::filesystem::path &path)
+    {
+        MappedFile file;
+        file.fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (file.fd < 0)
+        {
+            throw std::runtime_error("Could not open '" + path.string() + "': " + std::strerror(errno));
+        }
+        file.remap();
+        return file;
+    }
+
+    MappedFile::~MappedFile()
+    {
+        this->close();
+    }
+
+    MappedFile::MappedFile(MappedFile &&other) noexcept
+        : fd(std::exchange(other.fd, -1)),
+          base(std::exchange(other.base, nullptr)),
+          length(std::exchange(other.length, 0)),
+          reserved(std::exchange(other.reserved, 0)),
+          writable(other.writable)
+    {
+    }
+
+    MappedFile &MappedFile::operator=(MappedFile &&other) noexcept
+    {
+        if (this != &other)
+        {
+            this->close();
+            this->fd = std::exchange(other.fd, -1);
+            this->base = std::exchange(other.base, nullptr);
+            this->length = std::exchange(other.length, 0);
+            this->reserved = std::exchange(other.reserved, 0);
+            this->writable = other.writable;
+        }
+        return *this;
+    }
+
+    void MappedFile::unmap()
+    {
+        if (this->base != nullptr)
+        {
+            ::munmap(this->base, this->reserved);
+        }
+        this->base = nullptr;
+        this->length = 0;
+        this->reserved = 0;
+    }
+
+    void MappedFile::remap()
+    {
+        struct stat st;
+        if (::fstat(this->fd, &st) != 0)
+        {
+            throw std::runtime_error(std::string("Could not stat mapped file: ") + std::strerror(errno));
+        }
+        size_t file_size = static_cast<size_t>(st.st_size);
+        if (this->base != nullptr && file_size <= this->reserved)
+        {
+            // The pages past the old end of the file are mapped already and show what was appended
+            this->length = file_size;
+            return;
+        }
+
+        const size_t previous = this->reserved;
+        this->unmap();
+        if (file_size == 0)
+        {
+            return; // Leave an empty file unmapped until it has data
+        }
+
+        // Pages past the end of the file are only address space: they are never touched, since
+        // nothing reads beyond size()
+        static const size_t page_size = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+        size_t reserve = std::max({file_size, 2 * previous, MIN_RESERVED_BYTES});
+        reserve = (reserve + page_size - 1) & ~(page_size - 1);
+        int prot = this->writable ? (PROT_READ | PROT_WRITE) : PROT_READ;
+        void *addr = ::mmap(nullptr, reserve, prot, MAP_SHARED, this->fd, 0);
+        if (addr == MAP_FAILED)
+        {
+            throw std::runtime_error(std::string("Could not map file: ") + std::strerror(errno));
+        }
+        this->base = static_cast<char *>(addr);
+        this->length = file_size;
+        this->reserved = reserve;
+    }
+
+    void MappedFile::resize(size_t size)
+    {
+        this->unmap();
+        if (::ftruncate(this->fd, static_cast<off_t>(size)) != 0)
+        {
+            throw std::runtime_error(std::string("Could not resize mapped file: ") + std::strerror(errno));
+        }
+        this->remap();
+    }
+
+    uint64_t MappedFile::append(const void *buffer, size_t size)
+    {
+        const uint64_t offset = this->write_at_end(buffer, size);
+        this->remap();
+        return offset;
+    }
+
+    uint64_t MappedFile::write_at_end(const void *buffer, size_t size)
+    {
+        struct stat st;
+        if (::fstat(this->fd, &st) != 0)
+        {
+            throw std::runtime_error(std::string("Could not stat mapped file: ") + std::strerror(errno));
+        }
+        const uint64_t offset = static_cast<uint64_t>(st.st_size);
+
+        const char *bytes = static_cast<const char *>(buffer);
+        size_t written = 0;
+        while (written < size)
+        {
+            ssize_t n = ::pwrite(this->fd, bytes + written, size - written, static_cast<off_t>(offset + written));
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                throw std::runtime_error(std::string("Could not append to mapped file: ") + std::strerror(errno));
+            }
+            written += static_cast<size_t>(n);
+        }
+        return offset;
+    }
+
+    void MappedFile::sync()
+    {
+        if (this->writable && this->base != nullptr && ::msync(this->base, this->length, MS_SYNC) != 0)
+        {
+            throw std::runtime_error(std::string("Could not sync mapped file: ") + std::strerror(errno));
+        }
+        if (::fdatasync(this->fd) != 0)
+        {
+            throw std::runtime_error(std::string("Could not sync file: ") + std::strerror(errno));
+        }
+    }
+
+    void MappedFile::prefetch(uint64_t offset, size_t size) const
+    {
+        if (this->base == nullptr || offset >= this->length)
+        {
+            return;
+        }
+        static const uint64_t page_size = static_cast<uint64_t>(::sysconf(_SC_PAGESIZE));
+        const uint64_t start = offset & ~(page_size - 1);
+        const uint64_t end = std::min<uint64_t>(offset + size, this->length);
+        // Only advice: if it fails, the pages are read when they are touched
+        ::madvise(this->base + start, end - start, MADV_WILLNEED);
+    }
+
+    void MappedFile::prefetch(std::vector<std::pair<uint64_t, size_t>> ranges) const
+    {
+        // Reading a gap this small costs less than another system call
+        constexpr uint64_t MAX_GAP = 64 * 1024;
+        std::sort(ranges.begin(), ranges.end());
+        size_t i = 0;
+        while (i < ranges.size())
+        {
+            uint64_t start = ranges[i].first;
+            uint64_t end = start + ranges[i].second;
+            for (++i; i < ranges.size() && ranges[i].first <= end + MAX_GAP; ++i)
+            {
+                end = std::max<uint64_t>(end, ranges[i].first + ranges[i].second);
+            }
+            this->prefetch(start, end - start);
+        }
+    }
+
+    void MappedFile::close()
+    {
+        this->unmap();
+        if (this->fd >= 0)
+        {
+            ::close(this->fd);
+        }
+        this->fd = -1;
+    }
+}
@@ -0,0 +1,281 @@
+#include "../inc/metrics.h"
+#include "../inc/db.h"
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+
+namespace FunDB
+{
+    const char *operation_name(Operation operation)
+    {
+        switch (operation)
+        {
+        case Operation::Lookup:
+            return "lookup";
+        case Operation::Load:
+            return "load";
+        case Operation::Parse:
+            return "parse";
+        case Operation::Evaluate:
+            return "evaluate";
+        case Operation::Store:
+            return "store";
+        }
+        return "unknown";
+    }
+
+    // --- LatencyHistogram ---
+
+    size_t LatencyHistogram::bucket_of(uint64_t ns)
+    {
+        if (ns < LINEAR_BUCKETS)
+        {
+            return ns;
+        }
+        const size_t exponent = 63 - __builtin_clzll(ns);
+        if (exponent >= MAX_EXPONENT)
+        {
+            return BUCKETS - 1;
+        }
+        const size_t sub_bucket = (ns >> (exponent - 3)) & (SUB_BUCKETS - 1);
+        return LINEAR_BUCKETS + (exponent - 4) * SUB_BUCKETS + sub_bucket;
+    }
+
+    uint64_t LatencyHistogram::bucket_end(size_t bucket)
+    {
+        if (bucket < LINEAR_BUCKETS)
+        {
+            return bucket + 1;
+        }
+        const size_t exponent = 4 + (bucket - LINEAR_BUCKETS) / SUB_BUCKETS;
+        const uint64_t sub_bucket = (bucket - LINEAR_BUCKETS) % SUB_BUCKETS;
+        return (SUB_BUCKETS + sub_bucket + 1) << (exponent - 3);
+    }
+
+    uint64_t LatencyHistogram::quantile(double q) const
+    {
+        if (this->count == 0)
+        {
+            return 0;
+        }
+        const uint64_t target = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(q * this->count)));
+        uint64_t seen = 0;
+        for (size_t bucket = 0; bucket < BUCKETS; ++bucket)
+        {
+            seen += this->counts[bucket];
+            if (seen >= target)
+            {
+                return std::min(bucket_end(bucket) - 1, this->max_ns);
+            }
+        }
+        return this->max_ns;
+    }
+
+    uint64_t LatencyHistogram::count_at_most(uint64_t ns) const
+    {
+        uint64_t total = 0;
+        for (size_t bucket = 0; bucket < BUCKETS && bucket_end(bucket) - 1 <= ns; ++bucket)
+        {
+            total += this->counts[bucket];
+        }
+        return total;
+    }
+
+#if FUNDB_METRICS
+    // --- Metrics ---
+
+    size_t metric_stripe()
+    {
+        static std::atomic<size_t> next_thread{0};
+        thread_local const size_t stripe = next_thread.fetch_add(1, std::memory_order_relaxed) % METRIC_STRIPES;
+        return stripe;
+    }
+
+    // Entries of a Metrics that is gone never match again; the cache is dropped once it holds this
+    // many, and the blocks still in use are found again through their Metrics
+    static constexpr size_t MAX_CACHED_BLOCKS = 64;
+
+    thread_local std::vector<Metrics::CachedBlock> Metrics::cached_blocks;
+
+    static uint64_t next_metrics_id()
+    {
+        static std::atomic<uint64_t> last{0};
+        return last.fetch_add(1, std::memory_order_relaxed) + 1;
+    }
+
+    // Only the owning thread writes to a block, so an increment needs no read-modify-write
+    static void bump(std::atomic<uint64_t> &counter, uint64_t delta)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+    }
+
+    Metrics::Metrics() : id(next_metrics_id()) {}
+
+    Metrics::ThreadBlock &Metrics::block()
+    {
+        for (const CachedBlock &cached : cached_blocks)
+        {
+            if (cached.owner == this->id)
+            {
+                return *cached.block;
+            }
+        }
+        return this->register_thread();
+    }
+
+    Metrics::ThreadBlock &Metrics::register_thread()
+    {
+        ThreadBlock *block;
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            std::unique_ptr<ThreadBlock> &registered = this->blocks[std::this_thread::get_id()];
+            if (!registered)
+            {
+                registered = std::make_unique<ThreadBlock>();
+            }
+            block = registered.get();
+        }
+        if (cached_blocks.size() >= MAX_CACHED_BLOCKS)
+        {
+            cached_blocks.clear();
+        }
+        cached_blocks.push_back({this->id, block});
+        return *block;
+    }
+
+    bool Metrics::count(Operation operation)
+    {
+        static_assert((FUNDB_METRICS_SAMPLE_INTERVAL & (FUNDB_METRICS_SAMPLE_INTERVAL - 1)) == 0,
+                      "FUNDB_METRICS_SAMPLE_INTERVAL must be a power of two");
+        ThreadBlock &block = this->block();
+        bump(block.counts[static_cast<size_t>(operation)], 1);
+        return (block.operations++ & (FUNDB_METRICS_SAMPLE_INTERVAL - 1)) == 0;
+    }
+
+    void Metrics::record(Operation operation, uint64_t ns)
+    {
+        ThreadBlock &block = this->block();
+        const size_t op = static_cast<size_t>(operation);
+        bump(block.buckets[op][LatencyHistogram::bucket_of(ns)], 1);
+        bump(block.sums[op], ns);
+        if (ns > block.maxima[op].load(std::memory_order_relaxed))
+        {
+            block.maxima[op].store(ns, std::memory_order_relaxed);
+        }
+    }
+
+    void Metrics::record_probes(size_t probes)
+    {
+        bump(this->block().probes[std::min(probes, MAX_RECORDED_PROBES)], 1);
+    }
+
+    void Metrics::add_bytes_read(uint64_t bytes)
+    {
+        bump(this->block().bytes_read, bytes);
+    }
+
+    MetricsSnapshot Metrics::snapshot() const
+    {
+        MetricsSnapshot snapshot;
+        std::lock_guard<std::mutex> lock(this->mutex);
+        for (const auto &[thread, block] : this->blocks)
+        {
+            const ThreadBlock &counters = *block;
+            for (size_t op = 0; op < OPERATION_COUNT; ++op)
+            {
+                snapshot.counts[op] += counters.counts[op].load(std::memory_order_relaxed);
+                LatencyHistogram &histogram = snapshot.operations[op];
+                for (size_t bucket = 0; bucket < LatencyHistogram::BUCKETS; ++bucket)
+                {
+                    uint64_t count = counters.buckets[op][bucket].load(std::memory_order_relaxed);
+                    histogram.counts[bucket] += count;
+                    histogram.count += count;
+                }
+                histogram.sum_ns += counters.sums[op].load(std::memory_order_relaxed);
+                histogram.max_ns = std::max(histogram.max_ns, counters.maxima[op].load(std::memory_order_relaxed));
+            }
+            for (size_t probes = 0; probes <= MAX_RECORDED_PROBES; ++probes)
+            {
+                snapshot.probe_lengths[probes] += counters.probes[probes].load(std::memory_order_relaxed);
+            }
+            snapshot.bytes_read += counters.bytes_read.load(std::memory_order_relaxed);
+        }
+        return snapshot;
+    }
+#endif
+
+    // --- Prometheus text exposition format ---
+
+    // Bucket bounds exported for each latency histogram, in nanoseconds
+    static constexpr uint64_t EXPORTED_BOUNDS_NS[] = {
+        250, 500, 1'000, 2'500, 5'000, 10'000, 25'000, 50'000, 100'000, 250'000, 500'000,
+        1'000'000, 2'500'000, 5'000'000, 10'000'000, 25'000'000, 50'000'000, 100'000'000,
+        250'000'000, 500'000'000, 1'000'000'000};
+
+    std::string format_prometheus(const DatabaseStats &stats)
+    {
+        std::ostringstream out;
+        out.precision(9);
+
+        out << "# HELP fundb_functions Functions stored.\n# TYPE fundb_functions gauge\n"
+            << "fundb_functions " << stats.entries << "\n";
+        out << "# HELP fundb_templates Distinct expression shapes the stored functions share.\n# TYPE fundb_templates gauge\n"
+            << "fundb_templates " << stats.templates << "\n";
+        out << "# HELP fundb_index_slots Slots in the index.\n# TYPE fundb_index_slots gauge\n"
+            << "fundb_index_slots " << stats.capacity << "\n";
+        out << "# HELP fundb_data_bytes Size of the data file.\n# TYPE fundb_data_bytes gauge\n"
+            << "fundb_data_bytes " << stats.data_bytes << "\n";
+        out << "# HELP fundb_live_bytes Bytes of the data file taken by the latest record of each name.\n# TYPE fundb_live_bytes gauge\n"
+            << "fundb_live_bytes " << stats.live_bytes << "\n";
+        out << "# HELP fundb_cache_entries Functions in the cache.\n# TYPE fundb_cache_entries gauge\n"
+            << "fundb_cache_entries " << stats.cache.entries << "\n";
+        out << "# HELP fundb_cache_hits_total Cache lookups that found the function.\n# TYPE fundb_cache_hits_total counter\n"
+            << "fundb_cache_hits_total " << stats.cache.hits << "\n";
+        out << "# HELP fundb_cache_misses_total Cache lookups that did not.\n# TYPE fundb_cache_misses_total counter\n"
+            << "fundb_cache_misses_total " << stats.cache.misses << "\n";
+        if (!Metrics::enabled)
+        {
+            return out.str();
+        }
+
+        out << "# HELP fundb_read_bytes_total Record bytes read from the data file on cache misses.\n# TYPE fundb_read_bytes_total counter\n"
+            << "fundb_read_bytes_total " << stats.metrics.bytes_read << "\n";
+
+        out << "# HELP fundb_operations_total Database operations performed.\n# TYPE fundb_operations_total counter\n";
+        for (size_t op = 0; op < OPERATION_COUNT; ++op)
+        {
+            out << "fundb_operations_total{op=\"" << operation_name(static_cast<Operation>(op)) << "\"} " << stats.metrics.counts[op] << "\n";
+        }
+
+        out << "# HELP fundb_operation_duration_seconds Latency of a sample of database operations.\n# TYPE fundb_operation_duration_seconds histogram\n";
+        for (size_t op = 0; op < OPERATION_COUNT; ++op)
+        {
+            const LatencyHistogram &histogram = stats.metrics.operations[op];
+            const std::string label = std::string("{op=\"") + operation_name(static_cast<Operation>(op)) + "\"";
+            for (uint64_t bound : EXPORTED_BOUNDS_NS)
+            {
+                out << "fundb_operation_duration_seconds_bucket" << label << ",le=\"" << bound / 1e9 << "\"} "
+                    << histogram.count_at_most(bound) << "\n";
+            }
+            out << "fundb_operation_duration_seconds_bucket" << label << ",le=\"+Inf\"} " << histogram.count << "\n";
+            out << "fundb_operation_duration_seconds_sum" << label << "} " << histogram.sum_ns / 1e9 << "\n";
+            out << "fundb_operation_duration_seconds_count" << label << "} " << histogram.count << "\n";
+        }
+
+        out << "# HELP fundb_lookup_probes Occupied index slots compared per lookup.\n# TYPE fundb_lookup_probes histogram\n";
+        uint64_t lookups = 0, probes = 0;
+        for (size_t length = 0; length <= MAX_RECORDED_PROBES; ++length)
+        {
+            lookups += stats.metrics.probe_lengths[length];
+            probes += length * stats.metrics.probe_lengths[length];
+            if (length < MAX_RECORDED_PROBES)
+            {
+                out << "fundb_lookup_probes_bucket{le=\"" << length << "\"} " << lookups << "\n";
+            }
+        }
+        out << "fundb_lookup_probes_bucket{le=\"+Inf\"} " << lookups << "\n";
+        out << "fundb_lookup_probes_sum " << probes << "\n";
+        out << "fundb_lookup_probes_count " << lookups << "\n";
+        return out.str();
+    }
+}
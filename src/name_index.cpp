@@ -0,0 +1,304 @@
+#include "../inc/name_index.h"
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+
+namespace FunDB
+{
+    // --- Run file layout: a 32-byte header followed by the names, each as [u32 size][bytes] ---
+    static constexpr char NAMES_MAGIC[8] = {'F', 'U', 'N', 'D', 'B', 'N', 'M', 'S'};
+    static constexpr uint32_t NAMES_VERSION = 1;
+
+    struct NamesHeader
+    {
+        char magic[8];
+        uint32_t version;
+        // Generation of the data file the run was written for (see Database)
+        uint32_t generation;
+        uint64_t count;
+        // Size of the data file whose names the run holds; names of later records are added on load
+        uint64_t covered_bytes;
+    };
+    static_assert(sizeof(NamesHeader) == 32, "Names start right after the header");
+
+    // Merges wait for at least this many added names, so small databases are not rewritten often
+    static constexpr size_t MIN_MERGE_NAMES = 4096;
+
+    // Reads the names of a run one after the other, starting at some offset
+    class RunCursor
+    {
+    private:
+        const char *data;
+        uint64_t offset;
+        uint64_t end;
+
+    public:
+        RunCursor(const MappedFile &file, uint64_t offset)
+            : data(file.data()), offset(offset), end(file.size()) {}
+
+        // The next name, or nullopt at the end of the run or at a name running past it
+        std::optional<std::string_view> next()
+        {
+            uint32_t size = 0;
+            if (this->offset + sizeof(size) > this->end)
+            {
+                return std::nullopt;
+            }
+            std::memcpy(&size, this->data + this->offset, sizeof(size));
+            if (this->offset + sizeof(size) + size > this->end)
+            {
+                return std::nullopt;
+            }
+            std::string_view name(this->data + this->offset + sizeof(size), size);
+            this->offset += sizeof(size) + size;
+            return name;
+        }
+
+        uint64_t position() const { return this->offset; }
+    };
+
+    // Appends names to a new run file and notes the start of each block
+    class RunWriter
+    {
+    private:
+        NameIndex::Run run;
+        std::string chunk;
+
+        void flush()
+        {
+            this->run.file.append(this->chunk.data(), this->chunk.size());
+            this->chunk.clear();
+        }
+
+    public:
+        RunWriter(const std::filesystem::path &path, uint64_t data_bytes, uint32_t generation)
+        {
+            std::filesystem::remove(path);
+            this->run.file = MappedFile(path, true);
+            NamesHeader header{};
+            std::memcpy(header.magic, NAMES_MAGIC, sizeof(NAMES_MAGIC));
+            header.version = NAMES_VERSION;
+            header.generation = generation;
+            header.covered_bytes = data_bytes;
+            this->chunk.append(reinterpret_cast<const char *>(&header), sizeof(header));
+        }
+
+        void add(std::string_view name)
+        {
+            if (this->run.count % NameIndex::BLOCK_NAMES == 0)
+            {
+                this->run.blocks.emplace_back(name, this->run.file.size() + this->chunk.size());
+            }
+            uint32_t size = static_cast<uint32_t>(name.size());
+            this->chunk.append(reinterpret_cast<const char *>(&size), sizeof(size));
+            this->chunk.append(name);
+            ++this->run.count;
+            if (this->chunk.size() >= WRITE_CHUNK_BYTES)
+            {
+                this->flush();
+            }
+        }
+
+        NameIndex::Run finish()
+        {
+            this->flush();
+            reinterpret_cast<NamesHeader *>(this->run.file.data())->count = this->run.count;
+            this->run.file.sync();
+            return std::move(this->run);
+        }
+    };
+
+    NameIndex::NameIndex(std::filesystem::path path)
+        : path(path), new_path(path.string() + ".new")
+    {
+    }
+
+    std::optional<uint64_t> NameIndex::load()
+    {
+        this->run = Run{};
+        this->added.clear();
+        std::filesystem::remove(this->new_path);
+        if (!std::filesystem::exists(this->path))
+        {
+            return std::nullopt;
+        }
+        Run loaded;
+        loaded.file = MappedFile(this->path, true);
+        const NamesHeader *header = reinterpret_cast<const NamesHeader *>(loaded.file.data());
+        if (loaded.file.size() < sizeof(NamesHeader) || std::memcmp(header->magic, NAMES_MAGIC, sizeof(NAMES_MAGIC)) != 0 ||
+            header->version != NAMES_VERSION)
+        {
+            return std::nullopt;
+        }
+
+        // Walk the whole run once to find its blocks, and reject it unless it is complete and sorted
+        RunCursor cursor(loaded.file, sizeof(NamesHeader));
+        std::string_view previous;
+        for (uint64_t i = 0; i < header->count; ++i)
+        {
+            const uint64_t offset = cursor.position();
+            std::optional<std::string_view> name = cursor.next();
+            if (!name || (i > 0 && *name <= previous))
+            {
+                return std::nullopt;
+            }
+            if (i % BLOCK_NAMES == 0)
+            {
+                loaded.blocks.emplace_back(*name, offset);
+            }
+            previous = *name;
+        }
+        if (cursor.position() != loaded.file.size())
+        {
+            return std::nullopt;
+        }
+        loaded.count = header->count;
+        const uint64_t covered_bytes = header->covered_bytes;
+        this->run = std::move(loaded);
+        return covered_bytes;
+    }
+
+    void NameIndex::clear()
+    {
+        this->run = Run{};
+        this->added.clear();
+        std::filesystem::remove(this->path);
+        std::filesystem::remove(this->new_path);
+    }
+
+    uint64_t NameIndex::seek(std::string_view name) const
+    {
+        // The last block starting at or before `name` holds it, if the run does
+        auto block = std::upper_bound(this->run.blocks.begin(), this->run.blocks.end(), name,
+                                      [](std::string_view key, const std::pair<std::string, uint64_t> &entry)
+                                      { return key < entry.first; });
+        if (block == this->run.blocks.begin())
+        {
+            return sizeof(NamesHeader);
+        }
+        RunCursor cursor(this->run.file, std::prev(block)->second);
+        uint64_t offset = cursor.position();
+        for (std::optional<std::string_view> current = cursor.next(); current && *current < name; current = cursor.next())
+        {
+            offset = cursor.position();
+        }
+        return offset;
+    }
+
+    bool NameIndex::in_run(std::string_view name) const
+    {
+        if (this->run.count == 0)
+        {
+            return false;
+        }
+        RunCursor cursor(this->run.file, this->seek(name));
+        std::optional<std::string_view> found = cursor.next();
+        return found && *found == name;
+    }
+
+    void NameIndex::add(std::string_view name)
+    {
+        if (this->added.find(name) == this->added.end() && !this->in_run(name))
+        {
+            this->added.emplace(name);
+        }
+    }
+
+    bool NameIndex::merge_due() const
+    {
+        return this->added.size() >= std::max<uint64_t>(MIN_MERGE_NAMES, this->run.count / 8);
+    }
+
+    NameIndex::Run NameIndex::merged(uint64_t data_bytes, uint32_t generation) const
+    {
+        RunWriter writer(this->new_path, data_bytes, generation);
+        auto added = this->added.begin();
+        if (this->run.count > 0)
+        {
+            RunCursor cursor(this->run.file, sizeof(NamesHeader));
+            for (uint64_t i = 0; i < this->run.count; ++i)
+            {
+                std::string_view name = *cursor.next();
+                for (; added != this->added.end() && *added < name; ++added)
+                {
+                    writer.add(*added);
+                }
+                writer.add(name);
+            }
+        }
+        for (; added != this->added.end(); ++added)
+        {
+            writer.add(*added);
+        }
+        return writer.finish();
+    }
+
+    NameIndex::Run NameIndex::build(std::vector<std::string> names, uint64_t data_bytes, uint32_t generation) const
+    {
+        std::sort(names.begin(), names.end());
+        names.erase(std::unique(names.begin(), names.end()), names.end());
+        RunWriter writer(this->new_path, data_bytes, generation);
+        for (const auto &name : names)
+        {
+            writer.add(name);
+        }
+        return writer.finish();
+    }
+
+    void NameIndex::install(Run run)
+    {
+        std::filesystem::rename(this->new_path, this->path);
+        this->run = std::move(run);
+        this->added.clear();
+    }
+
+    uint32_t NameIndex::generation() const
+    {
+        return reinterpret_cast<const NamesHeader *>(this->run.file.data())->generation;
+    }
+
+    void NameIndex::set_covered_bytes(uint64_t data_bytes)
+    {
+        if (this->run.file.is_open() && this->run.file.size() >= sizeof(NamesHeader))
+        {
+            reinterpret_cast<NamesHeader *>(this->run.file.data())->covered_bytes = data_bytes;
+        }
+    }
+
+    std::vector<std::string> NameIndex::range(std::string_view lo, const std::optional<std::string> &hi, size_t limit) const
+    {
+        std::vector<std::string> names;
+        auto below_end = [&hi](std::string_view name)
+        { return !hi || name < *hi; };
+
+        // Merge the run, read on from the start of the range, with the added names
+        std::optional<RunCursor> cursor;
+        std::optional<std::string_view> from_run;
+        if (this->run.count > 0)
+        {
+            cursor.emplace(this->run.file, this->seek(lo));
+            from_run = cursor->next();
+        }
+        auto added = this->added.lower_bound(lo);
+        while (names.size() < limit)
+        {
+            const bool run_left = from_run && below_end(*from_run);
+            const bool added_left = added != this->added.end() && below_end(*added);
+            if (!run_left && !added_left)
+            {
+                break;
+            }
+            if (run_left && (!added_left || *from_run < *added))
+            {
+                names.emplace_back(*from_run);
+                from_run = cursor->next();
+            }
+            else
+            {
+                names.push_back(*added);
+                ++added;
+            }
+        }
+        return names;
+    }
+}
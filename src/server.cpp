@@ -1,192 +1,1148 @@
-#include "nlohmann/json.hpp"
-#include "../inc/db.h"
+#include "../inc/server.h"
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <cerrno>
+#include <cstring>
 #include <iostream>
 #include <string>
 #include <vector>
 #include <unordered_map>
 #include <sstream>
 #include <stdexcept>
-#include <optional>
+#include <algorithm>
+#include <cctype>
+#include <memory>
+#include <mutex>
+#include <tuple>
 
-// Function to handle a single client connection.
-void handle_client(FunDB::Database database, int client_socket)
+namespace FunDB
 {
-    char buffer[4096] = {0};
-    read(client_socket, buffer, 4096);
-    std::string request(buffer);
+    static constexpr size_t READ_CHUNK_BYTES = 64 * 1024;
+    // Names per page of GET /list, by default and at most
+    static constexpr size_t DEFAULT_LIST_LIMIT = 100;
+    static constexpr size_t MAX_LIST_LIMIT = 10000;
 
-    std::stringstream ss(request);
-    std::string method, path, http_version;
-    ss >> method >> path >> http_version;
+    // --- Server-wide counters, reported by GET /metrics after the database's own ---
+    struct ServerCounters
+    {
+        FunDB::StripedCounter http_requests;
+        FunDB::StripedCounter binary_requests;
+        FunDB::StripedCounter open_connections;
+    };
+    static ServerCounters server_counters;
+
+    static std::string format_server_metrics()
+    {
+        std::ostringstream out;
+        out << "# HELP fundb_requests_total Requests answered, by protocol.\n# TYPE fundb_requests_total counter\n"
+            << "fundb_requests_total{protocol=\"http\"} " << server_counters.http_requests.value() << "\n"
+            << "fundb_requests_total{protocol=\"binary\"} " << server_counters.binary_requests.value() << "\n";
+        out << "# HELP fundb_open_connections Client connections currently open.\n# TYPE fundb_open_connections gauge\n"
+            << "fundb_open_connections " << server_counters.open_connections.value() << "\n";
+        return out.str();
+    }
 
-    std::string body;
-    size_t body_start = request.find("\r\n\r\n");
-    if (body_start != std::string::npos)
+    // Decode %XX escapes and '+' in a query string component
+    static std::string url_decode(const std::string &text)
     {
-        body = request.substr(body_start + 4);
+        std::string decoded;
+        for (size_t i = 0; i < text.size(); ++i)
+        {
+            if (text[i] == '%' && i + 2 < text.size() && std::isxdigit(static_cast<unsigned char>(text[i + 1])) &&
+                std::isxdigit(static_cast<unsigned char>(text[i + 2])))
+            {
+                decoded += static_cast<char>(std::stoi(text.substr(i + 1, 2), nullptr, 16));
+                i += 2;
+            }
+            else
+            {
+                decoded += text[i] == '+' ? ' ' : text[i];
+            }
+        }
+        return decoded;
     }
 
-    std::string response_body;
-    std::string status_line = "HTTP/1.1 200 OK\r\n";
-    std::string content_type = "Content-Type: application/json\r\n";
+    static std::string query_parameter(const std::string &query, const std::string &key)
+    {
+        std::istringstream pairs(query);
+        std::string pair;
+        while (std::getline(pairs, pair, '&'))
+        {
+            size_t equals = pair.find('=');
+            if (url_decode(pair.substr(0, equals)) == key)
+            {
+                return equals == std::string::npos ? "" : url_decode(pair.substr(equals + 1));
+            }
+        }
+        return "";
+    }
 
-    try
+    // The `values` object of a request, mapping symbol names to numbers
+    static std::unordered_map<std::string, double> parse_values(const nlohmann::json &json_values)
     {
-        if (method == "POST")
+        std::unordered_map<std::string, double> values;
+        for (auto const &[key, val] : json_values.items())
         {
-            // Use nlohmann/json to parse the request body
-            nlohmann::json json_data = nlohmann::json::parse(body);
+            if (!val.is_number())
+            {
+                throw std::runtime_error("Invalid value format. Values must be numbers.");
+            }
+            values[key] = val.get<double>();
+        }
+        return values;
+    }
 
-            if (path == "/store")
+    // Route one request to the database and build its JSON response
+    HttpResponse handle_request(FunDB::Database &database, const HttpRequest &request)
+    {
+        HttpResponse response;
+
+        try
+        {
+            if (request.method == "POST")
             {
-                if (!json_data.contains("name") || !json_data.contains("expression") || !json_data.contains("symbols"))
+                // Use nlohmann/json to parse the request body
+                nlohmann::json json_data = nlohmann::json::parse(request.body);
+
+                if (request.path == "/store")
+                {
+                    if (!json_data.contains("name") || !json_data.contains("expression") || !json_data.contains("symbols"))
+                    {
+                        throw std::runtime_error("Missing 'name', 'symbols', or 'expression'.");
+                    }
+                    FunDB::Function func;
+                    func.name = json_data["name"].get<std::string>();
+                    func.expr = SymEngine::Expression(json_data["expression"].get<std::string>());
+
+                    for (const auto &symbol_json : json_data["symbols"])
+                    {
+                        func.symbols.push_back(symbol_json.get<std::string>());
+                    }
+
+                    database.save_function(func);
+                    response.body = "{\"status\":\"Function stored successfully.\"}";
+                    response.status_line = "HTTP/1.1 201 Created\r\n";
+                }
+                else if (request.path == "/evaluate")
                 {
-                    throw std::runtime_error("Missing 'name', 'symbols', or 'expression'.");
+                    if (!json_data.contains("name") || !json_data.contains("values"))
+                    {
+                        throw std::runtime_error("Missing 'name' or 'values'.");
+                    }
+                    const auto values = parse_values(json_data["values"]);
+                    double result = FunDB::evaluate_stored_function(database, json_data["name"].get<std::string>(), values);
+                    response.body = nlohmann::json{{"result", result}}.dump();
+                    response.status_line = "HTTP/1.1 200 OK\r\n";
                 }
-                FunDB::Function func;
-                func.name = json_data["name"].get<std::string>();
-                func.expr = SymEngine::Expression(json_data["expression"].get<std::string>());
+                else if (request.path == "/evaluate_gradient")
+                {
+                    if (!json_data.contains("name") || !json_data.contains("values"))
+                    {
+                        throw std::runtime_error("Missing 'name' or 'values'.");
+                    }
+                    const auto values = parse_values(json_data["values"]);
+                    const std::string name = json_data["name"].get<std::string>();
+                    const auto func = database.load_cached(name);
+                    if (!func)
+                    {
+                        throw std::runtime_error("Function '" + name + "' not found in database.");
+                    }
+                    FunDB::ValueGradient result;
+                    {
+                        FunDB::ScopedTimer timer(database.get_metrics(), FunDB::Operation::Evaluate);
+                        result = func->get_compiled().evaluate_with_gradient(values);
+                    }
+                    // Partials keyed by symbol, in the function's symbol order
+                    nlohmann::ordered_json gradient = nlohmann::ordered_json::object();
+                    const auto &symbols = func->get_compiled().get_symbols();
+                    for (size_t i = 0; i < symbols.size(); ++i)
+                    {
+                        gradient[symbols[i]] = result.gradient[i];
+                    }
+                    response.body = nlohmann::ordered_json{{"result", result.value}, {"gradient", gradient}}.dump();
+                    response.status_line = "HTTP/1.1 200 OK\r\n";
+                }
+                else
+                {
+                    response.status_line = "HTTP/1.1 404 Not Found\r\n";
+                    response.body = "{\"error\":\"Path not found.\"}";
+                }
+            }
+            else if (request.method == "GET")
+            {
+                if (request.path == "/metrics")
+                {
+                    response.content_type = "text/plain; version=0.0.4";
+                    response.body = FunDB::format_prometheus(database.stats());
+                    if (FunDB::Metrics::enabled)
+                    {
+                        response.body += format_server_metrics();
+                    }
+                }
+                else if (request.path == "/list")
+                {
+                    // Names in sorted order, a page at a time; every page but the last gives the
+                    // name to pass as `after` to get the next one
+                    const std::string limit_text = query_parameter(request.query, "limit");
+                    const size_t limit = limit_text.empty() ? DEFAULT_LIST_LIMIT : std::stoul(limit_text);
+                    if (limit == 0 || limit > MAX_LIST_LIMIT)
+                    {
+                        throw std::runtime_error("'limit' must be between 1 and " + std::to_string(MAX_LIST_LIMIT) + ".");
+                    }
+                    FunDB::NameScan scan = database.scan_prefix(query_parameter(request.query, "prefix"), query_parameter(request.query, "after"));
+                    nlohmann::json names = nlohmann::json::array();
+                    std::optional<std::string> name;
+                    while (names.size() < limit && (name = scan.next()))
+                    {
+                        names.push_back(*name);
+                    }
+                    nlohmann::json json_response{{"names", names}};
+                    if (!names.empty() && scan.next())
+                    {
+                        json_response["next"] = names.back();
+                    }
+                    response.body = json_response.dump();
+                }
+                else if (request.path.rfind("/load/", 0) == 0)
+                { // Check if path starts with "/load/"
+                    std::string name = request.path.substr(6);
+                    std::optional<FunDB::Function> func = database.load_function(name);
 
-                for (const auto &symbol_json : json_data["symbols"])
+                    if (func)
+                    {
+                        std::ostringstream exprstr;
+                        exprstr << func->expr;
+                        nlohmann::json json_response;
+                        json_response["name"] = func->name;
+                        json_response["symbols"] = func->symbols;
+                        json_response["expression"] = exprstr.str();
+                        response.body = json_response.dump();
+                    }
+                    else
+                    {
+                        response.status_line = "HTTP/1.1 404 Not Found\r\n";
+                        response.body = "{\"error\":\"Function not found.\"}";
+                    }
+                }
+                else
                 {
-                    func.symbols.push_back(symbol_json.get<std::string>());
+                    response.status_line = "HTTP/1.1 404 Not Found\r\n";
+                    response.body = "{\"error\":\"Path not found.\"}";
                 }
+            }
+            else
+            {
+                response.status_line = "HTTP/1.1 405 Method Not Allowed\r\n";
+                response.body = "{\"error\":\"Method not allowed.\"}";
+            }
+        }
+        catch (const nlohmann::json::parse_error &e)
+        {
+            response.status_line = "HTTP/1.1 400 Bad Request\r\n";
+            response.body = "{\"error\":\"Invalid JSON format: " + std::string(e.what()) + "\"}";
+        }
+        catch (const std::exception &e)
+        {
+            response.status_line = "HTTP/1.1 400 Bad Request\r\n";
+            response.body = "{\"error\":\"" + std::string(e.what()) + "\"}";
+        }
+        catch (...)
+        {
+            response.status_line = "HTTP/1.1 500 Internal Server Error\r\n";
+            response.body = "{\"error\":\"An unknown error occurred.\"}";
+        }
 
-                database.save_function(func);
-                response_body = "{\"status\":\"Function stored successfully.\"}";
-                status_line = "HTTP/1.1 201 Created\r\n";
+        return response;
+    }
+
+    // True if the connection should stay open after answering `request`
+    static bool wants_keep_alive(const HttpRequest &request)
+    {
+        auto it = request.headers.find("connection");
+        std::string connection = it == request.headers.end() ? "" : it->second;
+        std::transform(connection.begin(), connection.end(), connection.begin(), [](unsigned char c)
+                       { return std::tolower(c); });
+        if (request.version == "HTTP/1.0")
+        {
+            return connection == "keep-alive";
+        }
+        return connection != "close";
+    }
+
+    static void append_response(Connection &conn, const HttpResponse &response, bool keep_alive)
+    {
+        conn.output += response.status_line;
+        conn.output += "Content-Type: " + response.content_type + "\r\n";
+        conn.output += "Content-Length: " + std::to_string(response.body.length()) + "\r\n";
+        conn.output += keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+        conn.output += response.body;
+        if (!keep_alive)
+        {
+            conn.close_after_write = true;
+        }
+    }
+
+    static void append_error(Connection &conn, const std::string &status, const std::string &message)
+    {
+        HttpResponse response;
+        response.status_line = "HTTP/1.1 " + status + "\r\n";
+        response.body = nlohmann::json{{"error", message}}.dump();
+        append_response(conn, response, false);
+    }
+
+    static bool is_ndjson(const HttpRequest &request)
+    {
+        auto content_type = request.headers.find("content-type");
+        return content_type != request.headers.end() && content_type->second.rfind("application/x-ndjson", 0) == 0;
+    }
+
+    // --- Parse the request starting at `offset` in `conn.input`, once its headers and whole body have arrived ---
+    // Sets `consumed` to the request's length in bytes. Invalid requests get an error response queued.
+    ParseResult parse_request(Connection &conn, size_t offset, HttpRequest &request, size_t &consumed)
+    {
+        size_t header_end = conn.input.find("\r\n\r\n", offset);
+        if (header_end == std::string::npos)
+        {
+            if (conn.input.size() - offset > MAX_HEADER_BYTES)
+            {
+                append_error(conn, "431 Request Header Fields Too Large", "Request headers are too large.");
+                return ParseResult::Invalid;
+            }
+            return ParseResult::Incomplete;
+        }
+
+        std::istringstream lines(conn.input.substr(offset, header_end - offset));
+        std::string line;
+        std::getline(lines, line);
+        std::istringstream request_line(line);
+        request_line >> request.method >> request.path >> request.version;
+        if (request.method.empty() || request.path.empty() || request.version.rfind("HTTP/1.", 0) != 0)
+        {
+            append_error(conn, "400 Bad Request", "Malformed request line.");
+            return ParseResult::Invalid;
+        }
+        size_t query_start = request.path.find('?');
+        if (query_start != std::string::npos)
+        {
+            request.query = request.path.substr(query_start + 1);
+            request.path.resize(query_start);
+        }
+        while (std::getline(lines, line))
+        {
+            if (!line.empty() && line.back() == '\r')
+            {
+                line.pop_back();
+            }
+            size_t colon = line.find(':');
+            if (colon == std::string::npos)
+            {
+                continue;
             }
-            else if (path == "/evaluate")
+            std::string name = line.substr(0, colon);
+            std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c)
+                           { return std::tolower(c); });
+            size_t value_start = line.find_first_not_of(" \t", colon + 1);
+            request.headers[name] = value_start == std::string::npos ? "" : line.substr(value_start);
+        }
+
+        if (request.headers.count("transfer-encoding"))
+        {
+            append_error(conn, "501 Not Implemented", "Chunked request bodies are not supported; send Content-Length.");
+            return ParseResult::Invalid;
+        }
+        size_t content_length = 0;
+        auto length_header = request.headers.find("content-length");
+        if (length_header != request.headers.end())
+        {
+            const std::string &value = length_header->second;
+            if (value.empty() || value.size() > 19 || value.find_first_not_of("0123456789") != std::string::npos)
             {
-                if (!json_data.contains("name") || !json_data.contains("values"))
+                append_error(conn, "400 Bad Request", "Invalid Content-Length.");
+                return ParseResult::Invalid;
+            }
+            content_length = std::stoull(value);
+            if (content_length > MAX_BODY_BYTES)
+            {
+                append_error(conn, "413 Payload Too Large", "Request body is too large.");
+                return ParseResult::Invalid;
+            }
+        }
+
+        const size_t body_start = header_end + 4;
+        if (request.method == "POST" && request.path == "/evaluate_batch" && is_ndjson(request))
+        {
+            request.unread_body = content_length;
+            consumed = body_start - offset;
+            return ParseResult::Complete;
+        }
+        if (conn.input.size() < body_start + content_length)
+        {
+            return ParseResult::Incomplete;
+        }
+        request.body = conn.input.substr(body_start, content_length);
+        consumed = body_start + content_length - offset;
+        return ParseResult::Complete;
+    }
+
+    // --- Evaluate one batch item: a set of values for the default function, or a (name, values) pair ---
+    static nlohmann::json evaluate_batch_item(FunDB::Database &database, BatchStream &batch, const nlohmann::json &item, bool pair)
+    {
+        try
+        {
+            std::string name = batch.default_name;
+            const nlohmann::json *value_set = &item;
+            if (pair)
+            {
+                if (!item.is_object() || !item.contains("name") || !item.contains("values"))
                 {
                     throw std::runtime_error("Missing 'name' or 'values'.");
                 }
-                std::unordered_map<std::string, double> values;
-                for (auto const &[key, val] : json_data["values"].items())
+                name = item["name"].get<std::string>();
+                value_set = &item["values"];
+            }
+            if (!value_set->is_object())
+            {
+                throw std::runtime_error("Invalid value format. Values must be an object of numbers.");
+            }
+
+            auto found = batch.functions.find(name);
+            if (found == batch.functions.end())
+            {
+                if (batch.functions.size() >= MAX_BATCH_FUNCTIONS)
                 {
-                    if (!val.is_number())
-                    {
-                        throw std::runtime_error("Invalid value format. Values must be numbers.");
-                    }
-                    values[key] = val.get<double>();
+                    batch.functions.clear();
+                }
+                found = batch.functions.emplace(name, database.load_cached(name)).first;
+            }
+            if (!found->second)
+            {
+                throw std::runtime_error("Function '" + name + "' not found in database.");
+            }
+
+            const auto values = parse_values(*value_set);
+            FunDB::ScopedTimer timer(database.get_metrics(), FunDB::Operation::Evaluate);
+            return {{"result", found->second->get_compiled().evaluate(values)}};
+        }
+        catch (const std::exception &e)
+        {
+            return {{"error", e.what()}};
+        }
+    }
+
+    static void append_chunk(Connection &conn, const std::string &data)
+    {
+        if (data.empty())
+        {
+            return;
+        }
+        std::ostringstream size;
+        size << std::hex << data.size();
+        conn.output += size.str() + "\r\n" + data + "\r\n";
+    }
+
+    // --- Validate an /evaluate_batch request and start its streamed response ---
+    static void start_batch(Connection &conn, const HttpRequest &request)
+    {
+        BatchStream batch;
+        batch.keep_alive = wants_keep_alive(request);
+        if (is_ndjson(request))
+        {
+            // One item per line: a value set for ?name=, or {"name": ..., "values": {...}}
+            batch.ndjson = true;
+            batch.body_remaining = request.unread_body;
+            batch.default_name = query_parameter(request.query, "name");
+        }
+        else
+        {
+            nlohmann::json json_data;
+            try
+            {
+                json_data = nlohmann::json::parse(request.body);
+            }
+            catch (const nlohmann::json::parse_error &e)
+            {
+                append_error(conn, "400 Bad Request", "Invalid JSON format: " + std::string(e.what()));
+                return;
+            }
+            if (json_data.contains("name") && json_data.contains("values") && json_data["values"].is_array())
+            {
+                batch.default_name = json_data["name"].get<std::string>();
+                batch.items = std::move(json_data["values"]);
+            }
+            else if (json_data.contains("items") && json_data["items"].is_array())
+            {
+                batch.items = std::move(json_data["items"]);
+                batch.pairs = true;
+            }
+            else
+            {
+                append_error(conn, "400 Bad Request", "Expected 'name' with an array of 'values', or an array of 'items'.");
+                return;
+            }
+        }
+
+        conn.output += "HTTP/1.1 200 OK\r\nContent-Type: application/x-ndjson\r\nTransfer-Encoding: chunked\r\n";
+        conn.output += batch.keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+        conn.batch = std::move(batch);
+    }
+
+    // --- Evaluate the next items of the connection's batch; false if it has to wait for more input ---
+    // `offset` is where unconsumed input starts and is advanced past the NDJSON lines read.
+    static bool continue_batch(FunDB::Database &database, Connection &conn, size_t &offset)
+    {
+        BatchStream &batch = *conn.batch;
+        std::string lines;
+        bool progress = false;
+        while (conn.output.size() + lines.size() < OUTPUT_HIGH_WATER)
+        {
+            if (!batch.ndjson)
+            {
+                if (batch.next_item == batch.items.size())
+                {
+                    break;
                 }
+                lines += evaluate_batch_item(database, batch, batch.items[batch.next_item++], batch.pairs).dump() + "\n";
+                progress = true;
+                continue;
+            }
 
-                float result = FunDB::evaluate_stored_function(database, json_data["name"].get<std::string>(), values);
-                response_body = "{\"result\":" + std::to_string(result) + "}";
-                status_line = "HTTP/1.1 200 OK\r\n";
+            if (batch.body_remaining == 0)
+            {
+                break;
+            }
+            // A line ends at '\n' or, for the last one, at the end of the body
+            const size_t available = std::min(batch.body_remaining, conn.input.size() - offset);
+            size_t newline = conn.input.find('\n', offset);
+            size_t line_length;
+            if (newline != std::string::npos && newline < offset + available)
+            {
+                line_length = newline - offset;
+            }
+            else if (available == batch.body_remaining)
+            {
+                line_length = available;
             }
             else
             {
-                status_line = "HTTP/1.1 404 Not Found\r\n";
-                response_body = "{\"error\":\"Path not found.\"}";
+                if (available > MAX_LINE_BYTES)
+                {
+                    // Not recoverable: the rest of the body cannot be framed any more
+                    lines += nlohmann::json{{"error", "NDJSON line is too long."}}.dump() + "\n";
+                    batch.body_remaining = 0;
+                    batch.keep_alive = false;
+                }
+                break;
+            }
+
+            std::string line = conn.input.substr(offset, line_length);
+            const size_t line_bytes = std::min(batch.body_remaining, line_length + 1);
+            offset += line_bytes;
+            batch.body_remaining -= line_bytes;
+            progress = true;
+            if (line.find_first_not_of(" \t\r") == std::string::npos)
+            {
+                continue;
+            }
+
+            nlohmann::json item = nlohmann::json::parse(line, nullptr, false);
+            if (item.is_discarded())
+            {
+                lines += nlohmann::json{{"error", "Invalid JSON line."}}.dump() + "\n";
+                continue;
+            }
+            bool pair = item.is_object() && item.contains("name") && item.contains("values") && item["values"].is_object();
+            if (!pair && batch.default_name.empty())
+            {
+                lines += nlohmann::json{{"error", "Missing 'name': pass ?name= or send {\"name\", \"values\"} items."}}.dump() + "\n";
+                continue;
             }
+            lines += evaluate_batch_item(database, batch, item, pair).dump() + "\n";
         }
-        else if (method == "GET")
+        append_chunk(conn, lines);
+
+        const bool finished = batch.ndjson ? batch.body_remaining == 0 : batch.next_item == batch.items.size();
+        if (finished)
         {
-            if (path.rfind("/load/", 0) == 0)
-            { // Check if path starts with "/load/"
-                std::string name = path.substr(6);
-                std::optional<FunDB::Function> func = database.load_function(name);
+            conn.output += "0\r\n\r\n";
+            if (!batch.keep_alive)
+            {
+                conn.close_after_write = true;
+            }
+            conn.batch.reset();
+            return true;
+        }
+        return progress;
+    }
 
-                if (func)
+    // --- Answer one binary protocol request, appending the response frame to `out` ---
+    void handle_binary_request(FunDB::Database &database, const FunDB::WireFrame &frame, std::string &out)
+    {
+        FunDB::WireStatus status = FunDB::WireStatus::Ok;
+        std::string payload;
+        try
+        {
+            FunDB::ByteReader reader(frame.payload, "Malformed request.");
+            FunDB::ByteWriter writer(payload);
+            const std::string name(reader.get_string());
+            const FunDB::WireOp op = static_cast<FunDB::WireOp>(frame.code);
+            if (op == FunDB::WireOp::Store)
+            {
+                FunDB::Function func;
+                func.name = name;
+                uint32_t symbol_count = reader.get<uint32_t>();
+                for (uint32_t i = 0; i < symbol_count; ++i)
+                {
+                    func.symbols.emplace_back(reader.get_string());
+                }
+                func.expr = SymEngine::Expression(std::string(reader.get_string()));
+                if (!reader.at_end())
+                {
+                    throw std::runtime_error("Malformed request.");
+                }
+                database.save_function(func);
+            }
+            else if (op == FunDB::WireOp::Load || op == FunDB::WireOp::Evaluate || op == FunDB::WireOp::EvaluateBatch)
+            {
+                std::shared_ptr<const FunDB::CachedFunction> func = database.load_cached(name);
+                if (!func)
                 {
-                    std::ostringstream exprstr;
-                    exprstr << func->expr;
-                    nlohmann::json json_response;
-                    json_response["name"] = func->name;
-                    json_response["symbols"] = func->symbols;
-                    json_response["expression"] = exprstr.str();
-                    response_body = json_response.dump();
+                    status = FunDB::WireStatus::NotFound;
+                    throw std::runtime_error("Function '" + name + "' not found in database.");
+                }
+
+                if (op == FunDB::WireOp::Load)
+                {
+                    writer.put<uint32_t>(func->function.symbols.size());
+                    for (const auto &symbol : func->function.symbols)
+                    {
+                        writer.put_string(symbol);
+                    }
+                    std::ostringstream expression;
+                    expression << func->function.expr;
+                    writer.put_string(expression.str());
+                }
+                else if (op == FunDB::WireOp::Evaluate)
+                {
+                    const FunDB::CompiledFunction &compiled = func->get_compiled();
+                    uint32_t count = reader.get<uint32_t>();
+                    if (count != compiled.arity())
+                    {
+                        throw std::runtime_error("Expected " + std::to_string(compiled.arity()) + " arguments, got " + std::to_string(count) + ".");
+                    }
+                    // Copied out because the payload gives no alignment guarantee
+                    std::vector<double> args(count);
+                    std::memcpy(args.data(), reader.take(count * sizeof(double)).data(), count * sizeof(double));
+                    FunDB::ScopedTimer timer(database.get_metrics(), FunDB::Operation::Evaluate);
+                    writer.put<double>(compiled.evaluate(args.data()));
                 }
                 else
                 {
-                    status_line = "HTTP/1.1 404 Not Found\r\n";
-                    response_body = "{\"error\":\"Function not found.\"}";
+                    const FunDB::CompiledFunction &compiled = func->get_compiled();
+                    uint32_t rows = reader.get<uint32_t>();
+                    uint32_t column_count = reader.get<uint32_t>();
+                    if (column_count != compiled.arity())
+                    {
+                        throw std::runtime_error("Expected " + std::to_string(compiled.arity()) + " columns, got " + std::to_string(column_count) + ".");
+                    }
+                    // Check the claimed size against the frame before allocating for it; the results have
+                    // to fit in a response frame as well, and bound `rows` when there are no columns
+                    if (rows > (FunDB::MAX_WIRE_FRAME_BYTES - FunDB::WIRE_HEADER_BYTES) / sizeof(double))
+                    {
+                        throw std::runtime_error("Too many rows: " + std::to_string(rows) + ".");
+                    }
+                    const std::string_view data = reader.take(static_cast<size_t>(rows) * column_count * sizeof(double));
+                    std::vector<double> values(static_cast<size_t>(rows) * column_count);
+                    std::memcpy(values.data(), data.data(), data.size());
+                    std::vector<const double *> columns;
+                    for (uint32_t c = 0; c < column_count; ++c)
+                    {
+                        columns.push_back(values.data() + static_cast<size_t>(c) * rows);
+                    }
+                    std::vector<double> results(rows);
+                    {
+                        FunDB::ScopedTimer timer(database.get_metrics(), FunDB::Operation::Evaluate);
+                        compiled.evaluate_batch(columns, results.data(), rows);
+                    }
+                    writer.put_bytes(std::string_view(reinterpret_cast<const char *>(results.data()), rows * sizeof(double)));
                 }
             }
             else
             {
-                status_line = "HTTP/1.1 404 Not Found\r\n";
-                response_body = "{\"error\":\"Path not found.\"}";
+                throw std::runtime_error("Unknown opcode " + std::to_string(frame.code) + ".");
             }
         }
-        else
+        catch (const std::exception &e)
         {
-            status_line = "HTTP/1.1 405 Method Not Allowed\r\n";
-            response_body = "{\"error\":\"Method not allowed.\"}";
+            if (status == FunDB::WireStatus::Ok)
+            {
+                status = FunDB::WireStatus::Error;
+            }
+            payload.clear();
+            FunDB::ByteWriter(payload).put_string(e.what());
         }
+        FunDB::append_wire_frame(out, static_cast<uint8_t>(status), frame.id, payload);
     }
-    catch (const nlohmann::json::parse_error &e)
+
+    // True if a store is only answered once a sync has made it durable
+    static bool waits_for_sync(const FunDB::Database &database)
     {
-        status_line = "HTTP/1.1 400 Bad Request\r\n";
-        response_body = "{\"error\":\"Invalid JSON format: " + std::string(e.what()) + "\"}";
+        return database.get_durability().mode != FunDB::Durability::None;
+    }
+
+    // --- Answer every complete binary protocol frame in the input buffer, in order ---
+    static bool process_binary_input(FunDB::Database &database, Connection &conn, const Deferrer &defer)
+    {
+        size_t offset = 0;
+        bool progress = false;
+        while (!conn.close_after_write && !conn.waiting && conn.output.size() < OUTPUT_HIGH_WATER)
+        {
+            FunDB::WireFrame frame;
+            size_t size;
+            try
+            {
+                size = FunDB::parse_wire_frame(std::string_view(conn.input).substr(offset), frame);
+            }
+            catch (const std::exception &e)
+            {
+                // The stream cannot be framed any more, so report the error and hang up
+                std::string payload;
+                FunDB::ByteWriter(payload).put_string(e.what());
+                FunDB::append_wire_frame(conn.output, static_cast<uint8_t>(FunDB::WireStatus::Error), 0, payload);
+                conn.close_after_write = true;
+                progress = true;
+                break;
+            }
+            if (size == 0)
+            {
+                break;
+            }
+            server_counters.binary_requests.add(1);
+            offset += size;
+            progress = true;
+            if (defer && frame.code == static_cast<uint8_t>(FunDB::WireOp::Store) && waits_for_sync(database))
+            {
+                // The payload is copied, since the input buffer moves on in the meantime
+                auto work = [&database, code = frame.code, id = frame.id, payload = std::string(frame.payload)]()
+                {
+                    std::string out;
+                    handle_binary_request(database, FunDB::WireFrame{code, id, payload}, out);
+                    return std::function<void(Connection &)>([out = std::move(out)](Connection &deferred)
+                                                             { deferred.output += out; });
+                };
+                conn.waiting = true;
+                defer(std::move(work));
+                continue;
+            }
+            handle_binary_request(database, frame, conn.output);
+        }
+        conn.input.erase(0, offset);
+        return progress;
     }
-    catch (const std::exception &e)
+
+    // --- Answer the complete requests in the input buffer, in order, until output backs up ---
+    // Returns whether anything was consumed or produced, so the caller knows whether to try again.
+    bool process_input(FunDB::Database &database, Connection &conn, const Deferrer &defer)
     {
-        status_line = "HTTP/1.1 400 Bad Request\r\n";
-        response_body = "{\"error\":\"" + std::string(e.what()) + "\"}";
+        if (conn.binary)
+        {
+            return process_binary_input(database, conn, defer);
+        }
+        size_t offset = 0;
+        bool progress = false;
+        while (!conn.close_after_write && !conn.waiting && conn.output.size() < OUTPUT_HIGH_WATER)
+        {
+            if (conn.batch)
+            {
+                if (!continue_batch(database, conn, offset))
+                {
+                    break;
+                }
+                progress = true;
+                continue;
+            }
+
+            HttpRequest request;
+            size_t consumed = 0;
+            ParseResult result = parse_request(conn, offset, request, consumed);
+            if (result != ParseResult::Complete)
+            {
+                progress = progress || result == ParseResult::Invalid;
+                break;
+            }
+            offset += consumed;
+            progress = true;
+            server_counters.http_requests.add(1);
+            if (request.method == "POST" && request.path == "/evaluate_batch")
+            {
+                start_batch(conn, request);
+                continue;
+            }
+            const bool keep_alive = wants_keep_alive(request);
+            if (defer && request.method == "POST" && request.path == "/store" && waits_for_sync(database))
+            {
+                auto work = [&database, request = std::move(request), keep_alive]()
+                {
+                    HttpResponse response = handle_request(database, request);
+                    return std::function<void(Connection &)>([response = std::move(response), keep_alive](Connection &deferred)
+                                                             { append_response(deferred, response, keep_alive); });
+                };
+                conn.waiting = true;
+                defer(std::move(work));
+                continue;
+            }
+            append_response(conn, handle_request(database, request), keep_alive);
+        }
+        conn.input.erase(0, offset);
+        return progress;
     }
-    catch (...)
+
+    // --- Read what is available, up to MAX_BUFFERED_INPUT per call; false once the peer has closed or the socket failed ---
+    static bool read_input(int fd, Connection &conn)
     {
-        status_line = "HTTP/1.1 500 Internal Server Error\r\n";
-        response_body = "{\"error\":\"An unknown error occurred.\"}";
+        char buffer[READ_CHUNK_BYTES];
+        size_t total = 0;
+        while (total < MAX_BUFFERED_INPUT)
+        {
+            ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+            if (n > 0)
+            {
+                conn.input.append(buffer, static_cast<size_t>(n));
+                total += static_cast<size_t>(n);
+                continue;
+            }
+            if (n == 0)
+            {
+                return false;
+            }
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        return true;
     }
 
-    std::string response = status_line + content_type + "Content-Length: " + std::to_string(response_body.length()) + "\r\n\r\n" + response_body;
-    send(client_socket, response.c_str(), response.length(), 0);
-    close(client_socket);
-}
+    // --- Write as much pending output as the socket takes; false if the connection should be closed ---
+    static bool flush_output(int fd, Connection &conn)
+    {
+        while (conn.output_sent < conn.output.size())
+        {
+            ssize_t n = send(fd, conn.output.data() + conn.output_sent, conn.output.size() - conn.output_sent, MSG_NOSIGNAL);
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                return errno == EAGAIN || errno == EWOULDBLOCK;
+            }
+            conn.output_sent += static_cast<size_t>(n);
+        }
+        conn.output.clear();
+        conn.output_sent = 0;
+        return !conn.close_after_write;
+    }
 
-int main()
-{
-    int server_fd, client_socket;
-    struct sockaddr_in address;
-    int addrlen = sizeof(address);
-    int port = 6374;
+    // --- What work handed off an event loop produced, waiting for the loop to apply it ---
+    // Workers append here and write to `event_fd`, which wakes the loop. The workers share it,
+    // so it outlives a loop that is destroyed while their work is still running.
+    struct Completions
+    {
+        std::mutex mutex;
+        // Descriptor and id of the connection, and what to do to it
+        std::vector<std::tuple<int, uint64_t, std::function<void(Connection &)>>> done;
+        int event_fd = -1;
 
-    FunDB::Database database;
+        ~Completions()
+        {
+            if (this->event_fd >= 0)
+            {
+                close(this->event_fd);
+            }
+        }
+    };
+
+    // Every loop registers the listening sockets with EPOLLEXCLUSIVE, so a new connection wakes one loop
+    // rather than all of them, and the connection then stays on that loop's thread
+    EventLoop::EventLoop(FunDB::Database &database, int server_fd, int binary_fd, FunDB::WorkerPool &blocking_work)
+        : database(database), blocking_work(blocking_work), server_fd(server_fd), binary_fd(binary_fd)
+    {
+        this->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (this->epoll_fd < 0)
+        {
+            throw std::runtime_error(std::string("epoll_create1 failed: ") + std::strerror(errno));
+        }
+        this->completions = std::make_shared<Completions>();
+        this->completions->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (this->completions->event_fd < 0)
+        {
+            int error = errno;
+            close(this->epoll_fd);
+            throw std::runtime_error(std::string("eventfd failed: ") + std::strerror(error));
+        }
+        for (int listen_fd : {server_fd, binary_fd})
+        {
+            if (listen_fd < 0)
+            {
+                continue;
+            }
+            epoll_event listen_event{};
+            listen_event.events = EPOLLIN | EPOLLEXCLUSIVE;
+            listen_event.data.fd = listen_fd;
+            epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, listen_fd, &listen_event);
+        }
+        epoll_event completion_event{};
+        completion_event.events = EPOLLIN;
+        completion_event.data.fd = this->completions->event_fd;
+        epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, this->completions->event_fd, &completion_event);
+    }
+
+    EventLoop::~EventLoop()
+    {
+        for (const auto &[fd, conn] : this->connections)
+        {
+            close(fd);
+            server_counters.open_connections.add(-1);
+        }
+        close(this->epoll_fd);
+    }
+
+    int EventLoop::completion_fd() const
+    {
+        return this->completions->event_fd;
+    }
 
-    // Create socket
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0)
+    void EventLoop::adopt(int fd, bool binary)
     {
-        std::cerr << "Socket creation error." << std::endl;
-        return 1;
+        epoll_event client_event{};
+        client_event.events = EPOLLIN | EPOLLRDHUP;
+        client_event.data.fd = fd;
+        epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, fd, &client_event);
+        Connection &conn = this->connections[fd];
+        conn.binary = binary;
+        conn.id = ++this->last_id;
+        server_counters.open_connections.add(1);
     }
 
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(port);
+    void EventLoop::accept_from(int listen_fd)
+    {
+        int client_socket;
+        while ((client_socket = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+        {
+            int one = 1;
+            setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            this->adopt(client_socket, listen_fd == this->binary_fd);
+        }
+    }
+
+    // Hands a connection's deferred work to `blocking_work`; the result comes back through `completions`
+    Deferrer EventLoop::defer_for(int fd, uint64_t id)
+    {
+        return [&blocking_work = this->blocking_work, completions = this->completions, fd, id](DeferredWork work)
+        {
+            auto run = [completions, fd, id, work = std::move(work)]()
+            {
+                std::function<void(Connection &)> apply;
+                try
+                {
+                    apply = work();
+                }
+                catch (...)
+                {
+                    // The handlers answer their own errors, so this is unexpected; hang up rather than stall
+                    apply = [](Connection &deferred)
+                    { deferred.close_after_write = true; };
+                }
+                {
+                    std::lock_guard<std::mutex> lock(completions->mutex);
+                    completions->done.emplace_back(fd, id, std::move(apply));
+                }
+                uint64_t one = 1;
+                // Only fails once the counter is about to overflow, and the loop is awake by then
+                (void)!write(completions->event_fd, &one, sizeof(one));
+            };
+            blocking_work.submit(std::move(run));
+        };
+    }
+
+    // Read if `events` says so, answer and write what can be, then either close the connection
+    // or update what the loop waits for on it
+    void EventLoop::serve(int fd, Connection &conn, uint32_t events)
+    {
+        bool open = (events & EPOLLERR) == 0;
+        if (open && !conn.peer_closed && (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)))
+        {
+            conn.peer_closed = !read_input(fd, conn);
+        }
+        const Deferrer defer = this->defer_for(fd, conn.id);
+        // Alternate between evaluating and writing until the socket is full or input runs out
+        while (open)
+        {
+            bool progress = process_input(this->database, conn, defer);
+            open = flush_output(fd, conn);
+            if (!progress || !conn.output.empty())
+            {
+                break;
+            }
+        }
+        // A peer that half-closed after sending still gets answers to what it sent
+        if (open && conn.peer_closed && conn.output.empty() && !conn.waiting)
+        {
+            open = false;
+        }
+
+        if (!open)
+        {
+            epoll_ctl(this->epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+            close(fd);
+            this->connections.erase(fd);
+            this->closed.push_back(fd);
+            server_counters.open_connections.add(-1);
+            return;
+        }
+        // Only wait for writability while a response is still being written, and stop reading
+        // while the input buffer is full and nothing consumes it, because output is backed up
+        // or a request is waiting, so a client that does not read its results is throttled
+        uint32_t interest = 0;
+        if (!conn.peer_closed && ((conn.output.empty() && !conn.waiting) || conn.input.size() < MAX_BUFFERED_INPUT))
+        {
+            interest |= EPOLLIN | EPOLLRDHUP;
+        }
+        if (!conn.output.empty())
+        {
+            interest |= EPOLLOUT;
+        }
+        epoll_event client_event{};
+        client_event.events = interest;
+        client_event.data.fd = fd;
+        epoll_ctl(this->epoll_fd, EPOLL_CTL_MOD, fd, &client_event);
+    }
 
-    // Bind socket to the port
-    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0)
+    void EventLoop::apply_completions()
     {
-        std::cerr << "Bind failed." << std::endl;
-        return 1;
+        uint64_t count;
+        (void)!read(this->completions->event_fd, &count, sizeof(count));
+        {
+            std::lock_guard<std::mutex> lock(this->completions->mutex);
+            this->done.swap(this->completions->done);
+        }
+        // A connection that closed meanwhile is gone, or its descriptor now has another id
+        for (auto &[conn_fd, id, apply] : this->done)
+        {
+            auto found = this->connections.find(conn_fd);
+            if (found != this->connections.end() && found->second.id == id)
+            {
+                apply(found->second);
+                found->second.waiting = false;
+                this->serve(conn_fd, found->second, 0);
+            }
+        }
+        this->done.clear();
     }
 
-    // Listen for incoming connections
-    if (listen(server_fd, 3) < 0)
+    void EventLoop::dispatch(const epoll_event *events, int count)
     {
-        std::cerr << "Listen failed." << std::endl;
-        return 1;
+        this->closed.clear();
+        for (int i = 0; i < count; ++i)
+        {
+            const int fd = events[i].data.fd;
+            if (fd == this->server_fd || fd == this->binary_fd)
+            {
+                this->accept_from(fd);
+                continue;
+            }
+            if (fd == this->completions->event_fd)
+            {
+                this->apply_completions();
+                continue;
+            }
+            // Events for a connection closed earlier in this batch are stale, even if a connection
+            // accepted since has been given the same descriptor; it is polled again next time
+            if (std::find(this->closed.begin(), this->closed.end(), fd) != this->closed.end())
+            {
+                continue;
+            }
+            auto found = this->connections.find(fd);
+            if (found != this->connections.end())
+            {
+                this->serve(fd, found->second, events[i].events);
+            }
+        }
     }
 
-    std::cout << "Server listening on port " << port << std::endl;
+    void EventLoop::run()
+    {
+        std::vector<epoll_event> events(256);
+        while (true)
+        {
+            int ready = epoll_wait(this->epoll_fd, events.data(), events.size(), -1);
+            if (ready < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                std::cerr << "epoll_wait failed: " << std::strerror(errno) << std::endl;
+                return;
+            }
+            this->dispatch(events.data(), ready);
+        }
+    }
 
-    while (true)
+    void run_event_loop(FunDB::Database &database, int server_fd, int binary_fd, FunDB::WorkerPool &blocking_work)
     {
-        if ((client_socket = accept(server_fd, (struct sockaddr *)&address, (socklen_t *)&addrlen)) < 0)
+        try
         {
-            std::cerr << "Accept failed." << std::endl;
-            continue;
+            EventLoop loop(database, server_fd, binary_fd, blocking_work);
+            loop.run();
+        }
+        catch (const std::exception &e)
+        {
+            std::cerr << e.what() << std::endl;
         }
-        handle_client(database, client_socket);
     }
 
-    return 0;
+    // Non-blocking socket listening on `port` on all interfaces, or -1 after reporting why not
+    int open_listener(int port, int backlog)
+    {
+        int server_fd;
+        struct sockaddr_in address;
+
+        // Create socket
+        if ((server_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+        {
+            std::cerr << "Socket creation error." << std::endl;
+            return -1;
+        }
+        int one = 1;
+        setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = INADDR_ANY;
+        address.sin_port = htons(port);
+
+        // Bind socket to the port
+        if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0)
+        {
+            std::cerr << "Bind failed on port " << port << "." << std::endl;
+            close(server_fd);
+            return -1;
+        }
+
+        // Listen for incoming connections
+        if (listen(server_fd, backlog) < 0)
+        {
+            std::cerr << "Listen failed." << std::endl;
+            close(server_fd);
+            return -1;
+        }
+        return server_fd;
+    }
 }
@@ -0,0 +1,173 @@
+#include "../inc/server.h"
+#include <sys/socket.h>
+#include <csignal>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <thread>
+#include <algorithm>
+#include <chrono>
+
+// --- Server configuration, from the command line ---
+struct ServerOptions
+{
+    int port = 6374;
+    // Port of the binary protocol listener (see wire.h); 0 disables it
+    int binary_port = FunDB::DEFAULT_BINARY_PORT;
+    // Pending connections the kernel queues for accept()
+    int backlog = SOMAXCONN;
+    // Event loop threads; each accepts, reads, evaluates and writes for its own connections
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    // When a /store is durable before it is answered; see FunDB::Durability
+    FunDB::Durability durability = FunDB::Durability::None;
+    // Group commit: how long a group stays open for more stores, and how many end it early;
+    // see FunDB::DurabilityOptions
+    long group_interval_us = 0;
+    size_t group_size = 64;
+    // Serve this image from `fundb freeze` read-only instead of functions.dat
+    std::string snapshot;
+    // Store functions with their optimized programs; see Database::set_optimize_on_store
+    bool optimize = false;
+};
+
+static ServerOptions parse_options(int argc, char *argv[])
+{
+    ServerOptions options;
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        std::string flag = argv[i];
+        if (flag == "--durability")
+        {
+            std::string mode = argv[i + 1];
+            if (mode == "none")
+            {
+                options.durability = FunDB::Durability::None;
+            }
+            else if (mode == "write")
+            {
+                options.durability = FunDB::Durability::PerWrite;
+            }
+            else if (mode == "group")
+            {
+                options.durability = FunDB::Durability::GroupCommit;
+            }
+            else
+            {
+                throw std::runtime_error("Unknown durability mode " + mode + ".");
+            }
+            continue;
+        }
+        if (flag == "--snapshot")
+        {
+            options.snapshot = argv[i + 1];
+            continue;
+        }
+        if (flag == "--optimize")
+        {
+            std::string mode = argv[i + 1];
+            if (mode != "on" && mode != "off")
+            {
+                throw std::runtime_error("Unknown optimize mode " + mode + ".");
+            }
+            options.optimize = mode == "on";
+            continue;
+        }
+        int value = std::stoi(argv[i + 1]);
+        if (flag == "--port")
+        {
+            options.port = value;
+        }
+        else if (flag == "--binary-port")
+        {
+            options.binary_port = value;
+        }
+        else if (flag == "--backlog")
+        {
+            options.backlog = value;
+        }
+        else if (flag == "--threads" && value > 0)
+        {
+            options.threads = static_cast<unsigned>(value);
+        }
+        else if (flag == "--group-interval-us" && value >= 0)
+        {
+            options.group_interval_us = value;
+        }
+        else if (flag == "--group-size" && value > 0)
+        {
+            options.group_size = static_cast<size_t>(value);
+        }
+        else
+        {
+            throw std::runtime_error("Unknown option " + flag + ".");
+        }
+    }
+    return options;
+}
+
+int main(int argc, char *argv[])
+{
+    ServerOptions options;
+    try
+    {
+        options = parse_options(argc, argv);
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << e.what() << " Usage: my_app_server [--port N] [--binary-port N] [--backlog N] [--threads N] [--durability none|write|group] [--group-interval-us N] [--group-size N] [--optimize on|off] [--snapshot FILE]" << std::endl;
+        return 1;
+    }
+
+    std::unique_ptr<FunDB::Database> opened;
+    try
+    {
+        if (options.snapshot.empty())
+        {
+            opened = std::make_unique<FunDB::Database>();
+            opened->set_durability({options.durability, std::chrono::microseconds(options.group_interval_us), options.group_size});
+            opened->set_optimize_on_store(options.optimize);
+        }
+        else
+        {
+            opened = FunDB::Database::open_snapshot(options.snapshot);
+        }
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    FunDB::Database &database = *opened;
+
+    int server_fd = FunDB::open_listener(options.port, options.backlog);
+    int binary_fd = options.binary_port == 0 ? -1 : FunDB::open_listener(options.binary_port, options.backlog);
+    if (server_fd < 0 || (options.binary_port != 0 && binary_fd < 0))
+    {
+        return 1;
+    }
+
+    std::signal(SIGPIPE, SIG_IGN);
+    std::cout << "Server listening on port " << options.port << " with " << options.threads << " threads" << std::endl;
+    if (binary_fd >= 0)
+    {
+        std::cout << "Binary protocol listening on port " << options.binary_port << std::endl;
+    }
+
+    // Durable stores wait for their sync here instead of on an event loop. A group commit only
+    // fills up if that many stores can wait at once, so there are at least group_size threads.
+    FunDB::WorkerPool blocking_work(std::max<size_t>(options.group_size, 4));
+    std::vector<std::thread> loops;
+    for (unsigned i = 1; i < options.threads; ++i)
+    {
+        loops.emplace_back(FunDB::run_event_loop, std::ref(database), server_fd, binary_fd, std::ref(blocking_work));
+    }
+    FunDB::run_event_loop(database, server_fd, binary_fd, blocking_work);
+    for (auto &loop : loops)
+    {
+        loop.join();
+    }
+
+    return 0;
+}
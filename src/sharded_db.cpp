@@ -0,0 +1,223 @@
+#include "../inc/sharded_db.h"
+#include "../inc/hash.h"
+#include <algorithm>
+#include <fstream>
+#include <future>
+#include <iterator>
+#include <stdexcept>
+#include <type_traits>
+
+namespace FunDB
+{
+    // Shards are chosen from a differently seeded hash than the one the index probes with, so the
+    // names of one shard still spread over all of its index slots
+    static constexpr uint64_t SHARD_SEED = 0x9E3779B97F4A7C15;
+
+    // Run `task(i)` for each shard i on its own thread and collect the results, if any; if a task
+    // throws, the first exception is rethrown once all of them have finished
+    template <typename Task>
+    static auto for_each_shard(size_t count, Task task)
+    {
+        using Result = decltype(task(size_t{}));
+        std::vector<std::future<Result>> pending;
+        pending.reserve(count);
+        for (size_t i = 0; i < count; ++i)
+        {
+            pending.push_back(std::async(std::launch::async, task, i));
+        }
+        for (auto &future : pending)
+        {
+            future.wait();
+        }
+        if constexpr (std::is_void_v<Result>)
+        {
+            for (auto &future : pending)
+            {
+                future.get();
+            }
+        }
+        else
+        {
+            std::vector<Result> results;
+            results.reserve(count);
+            for (auto &future : pending)
+            {
+                results.push_back(future.get());
+            }
+            return results;
+        }
+    }
+
+    ShardedDatabase::ShardedDatabase(std::string base_name, size_t shard_count, size_t initial_capacity, size_t cache_entries)
+    {
+        if (shard_count == 0)
+        {
+            throw std::runtime_error("A sharded database needs at least one shard.");
+        }
+        const std::string count_file = base_name + ".shards";
+        std::ifstream existing(count_file);
+        size_t stored_count = 0;
+        if (existing >> stored_count)
+        {
+            if (stored_count != shard_count)
+            {
+                throw std::runtime_error("'" + base_name + "' has " + std::to_string(stored_count) + " shards, not " + std::to_string(shard_count) + ".");
+            }
+        }
+        else
+        {
+            std::ofstream created(count_file, std::ios::trunc);
+            created << shard_count << "\n";
+            if (!created)
+            {
+                throw std::runtime_error("Could not write '" + count_file + "'.");
+            }
+        }
+
+        const size_t shard_cache = (cache_entries + shard_count - 1) / shard_count;
+        for (size_t i = 0; i < shard_count; ++i)
+        {
+            const std::string prefix = base_name + "." + std::to_string(i);
+            this->shards.push_back(std::make_unique<Database>(prefix + ".dat", prefix + ".idx", initial_capacity, shard_cache));
+        }
+    }
+
+    size_t ShardedDatabase::shard_of(std::string_view name) const
+    {
+        return hash64(name, SHARD_SEED) % this->shards.size();
+    }
+
+    void ShardedDatabase::clear()
+    {
+        for_each_shard(this->shards.size(), [this](size_t i)
+                       { this->shards[i]->clear(); });
+    }
+
+    size_t ShardedDatabase::size() const
+    {
+        size_t total = 0;
+        for (const auto &shard : this->shards)
+        {
+            total += shard->size();
+        }
+        return total;
+    }
+
+    void ShardedDatabase::save_function(const Function &func)
+    {
+        this->shards[this->shard_of(func.name)]->save_function(func);
+    }
+
+    void ShardedDatabase::write_batch(const std::vector<Function> &functions)
+    {
+        std::vector<std::vector<Function>> parts(this->shards.size());
+        for (const Function &func : functions)
+        {
+            parts[this->shard_of(func.name)].push_back(func);
+        }
+        for_each_shard(this->shards.size(), [this, &parts](size_t i)
+                       {
+                           if (!parts[i].empty())
+                           {
+                               this->shards[i]->write_batch(parts[i]);
+                           } });
+    }
+
+    std::optional<Function> ShardedDatabase::load_function(std::string_view name) const
+    {
+        return this->shards[this->shard_of(name)]->load_function(name);
+    }
+
+    bool ShardedDatabase::contains(std::string_view name) const
+    {
+        return this->shards[this->shard_of(name)]->contains(name);
+    }
+
+    std::shared_ptr<const CachedFunction> ShardedDatabase::load_cached(std::string_view name) const
+    {
+        return this->shards[this->shard_of(name)]->load_cached(name);
+    }
+
+    std::vector<std::shared_ptr<const CachedFunction>> ShardedDatabase::load_many(const std::vector<std::string_view> &names) const
+    {
+        std::vector<std::vector<std::string_view>> parts(this->shards.size());
+        std::vector<std::vector<size_t>> positions(this->shards.size());
+        for (size_t i = 0; i < names.size(); ++i)
+        {
+            size_t shard = this->shard_of(names[i]);
+            parts[shard].push_back(names[i]);
+            positions[shard].push_back(i);
+        }
+        std::vector<std::shared_ptr<const CachedFunction>> results(names.size());
+        for (size_t shard = 0; shard < this->shards.size(); ++shard)
+        {
+            if (parts[shard].empty())
+            {
+                continue;
+            }
+            auto loaded = this->shards[shard]->load_many(parts[shard]);
+            for (size_t j = 0; j < loaded.size(); ++j)
+            {
+                results[positions[shard][j]] = std::move(loaded[j]);
+            }
+        }
+        return results;
+    }
+
+    std::vector<std::string> ShardedDatabase::names() const
+    {
+        auto parts = for_each_shard(this->shards.size(), [this](size_t i)
+                                    { return this->shards[i]->names(); });
+        std::vector<std::string> names;
+        for (auto &part : parts)
+        {
+            names.insert(names.end(), std::make_move_iterator(part.begin()), std::make_move_iterator(part.end()));
+        }
+        return names;
+    }
+
+    void ShardedDatabase::for_each(const std::function<void(const Function &)> &visit) const
+    {
+        // Each shard reads its own file in order, past its cache
+        for_each_shard(this->shards.size(), [this, &visit](size_t i)
+                       { this->shards[i]->for_each(visit); });
+    }
+
+    std::vector<CompactionStats> ShardedDatabase::compact()
+    {
+        return for_each_shard(this->shards.size(), [this](size_t i)
+                              { return this->shards[i]->compact(); });
+    }
+
+    void ShardedDatabase::set_durability(const DurabilityOptions &options)
+    {
+        for (auto &shard : this->shards)
+        {
+            shard->set_durability(options);
+        }
+    }
+
+    void ShardedDatabase::set_optimize_on_store(bool enabled)
+    {
+        for (auto &shard : this->shards)
+        {
+            shard->set_optimize_on_store(enabled);
+        }
+    }
+
+    void ShardedDatabase::checkpoint()
+    {
+        for_each_shard(this->shards.size(), [this](size_t i)
+                       { this->shards[i]->checkpoint(); });
+    }
+
+    std::vector<DatabaseStats> ShardedDatabase::stats() const
+    {
+        std::vector<DatabaseStats> stats;
+        for (const auto &shard : this->shards)
+        {
+            stats.push_back(shard->stats());
+        }
+        return stats;
+    }
+}
@@ -0,0 +1,388 @@
+#include "../inc/snapshot.h"
+#include "../inc/bytes.h"
+#include "../inc/hash.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <numeric>
+#include <stdexcept>
+
+namespace FunDB
+{
+    // --- Image layout: a 64-byte header, the records, then the tables ---
+    // Each record is [u32 name size][u32 payload size][u32 program size][name][payload][program].
+    // Shape records have an empty name. The tables start on an 8-byte boundary after the records:
+    // one u32 pilot per bucket (padded to 8 bytes), one u64 slot per name, the u64 offset of every
+    // name's record in name order, and a (u64 template id, u64 offset) pair per shape in id order.
+    static constexpr char SNAPSHOT_MAGIC[8] = {'F', 'U', 'N', 'D', 'B', 'S', 'N', 'P'};
+    static constexpr uint32_t SNAPSHOT_VERSION = 1;
+
+    struct SnapshotHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t templates;
+        uint64_t count;
+        uint64_t buckets;
+        // Seed the names are hashed with; raised while writing until no two names collide
+        uint64_t seed;
+        uint64_t records_end;
+        // hash64 of everything after the header
+        uint64_t checksum;
+        // hash64 of the header up to this field
+        uint64_t header_checksum;
+    };
+    static_assert(sizeof(SnapshotHeader) == 64, "Records start right after the header");
+
+    static constexpr size_t RECORD_HEADER_BYTES = 3 * sizeof(uint32_t);
+    // Names per bucket on average; more makes the pilots smaller but slower to choose
+    static constexpr uint64_t NAMES_PER_BUCKET = 4;
+    // Like index slots, a slot packs a 16-bit fingerprint of the name above its record's offset
+    static constexpr uint64_t OFFSET_MASK = (uint64_t{1} << 48) - 1;
+
+    static inline uint64_t align8(uint64_t offset)
+    {
+        return (offset + 7) & ~uint64_t{7};
+    }
+
+    static inline uint64_t bucket_of(uint64_t hash, uint64_t buckets)
+    {
+        return hash % buckets;
+    }
+
+    // Slot of a name in a bucket with `pilot`; the pilot is mixed into the whole hash, so names of
+    // one bucket move independently of each other as the pilot changes
+    static inline uint64_t slot_of(uint64_t hash, uint32_t pilot, uint64_t count)
+    {
+        hash ^= pilot * 0x9E3779B97F4A7C15;
+        hash = (hash ^ (hash >> 30)) * 0xBF58476D1CE4E5B9;
+        hash = (hash ^ (hash >> 27)) * 0x94D049BB133111EB;
+        return (hash ^ (hash >> 31)) % count;
+    }
+
+    static inline uint64_t fingerprint(uint64_t hash)
+    {
+        return hash >> 48;
+    }
+
+    SnapshotWriter::SnapshotWriter(std::filesystem::path path)
+        : path(path), new_path(path.string() + ".new")
+    {
+        std::filesystem::remove(this->new_path);
+        this->file = MappedFile(this->new_path, true);
+        // The header is filled in by finish()
+        this->chunk.assign(sizeof(SnapshotHeader), '\0');
+    }
+
+    void SnapshotWriter::flush()
+    {
+        this->file.append(this->chunk.data(), this->chunk.size());
+        this->chunk.clear();
+    }
+
+    std::string_view SnapshotWriter::name_at(uint64_t offset) const
+    {
+        uint32_t size;
+        std::memcpy(&size, this->file.data() + offset, sizeof(size));
+        return std::string_view(this->file.data() + offset + RECORD_HEADER_BYTES, size);
+    }
+
+    void SnapshotWriter::add(std::string_view name, std::string_view payload, std::string_view program)
+    {
+        if (!this->offsets.empty() && name <= this->last_name)
+        {
+            throw std::runtime_error("Snapshot names must be added in increasing order.");
+        }
+        this->offsets.push_back(this->file.size() + this->chunk.size());
+        ByteWriter writer(this->chunk);
+        writer.put<uint32_t>(name.size());
+        writer.put<uint32_t>(payload.size());
+        writer.put<uint32_t>(program.size());
+        writer.put_bytes(name);
+        writer.put_bytes(payload);
+        writer.put_bytes(program);
+        this->last_name.assign(name);
+        if (this->chunk.size() >= WRITE_CHUNK_BYTES)
+        {
+            this->flush();
+        }
+    }
+
+    void SnapshotWriter::add_template(uint64_t template_id, std::string_view payload, std::string_view program)
+    {
+        this->templates.emplace_back(template_id, this->file.size() + this->chunk.size());
+        ByteWriter writer(this->chunk);
+        writer.put<uint32_t>(0);
+        writer.put<uint32_t>(payload.size());
+        writer.put<uint32_t>(program.size());
+        writer.put_bytes(payload);
+        writer.put_bytes(program);
+        if (this->chunk.size() >= WRITE_CHUNK_BYTES)
+        {
+            this->flush();
+        }
+    }
+
+    bool SnapshotWriter::place(uint64_t seed, uint64_t buckets, std::vector<uint32_t> &pilots, std::vector<uint64_t> &slots) const
+    {
+        const uint64_t count = this->offsets.size();
+        std::vector<uint64_t> hashes(count);
+        // Group the names by bucket: members[starts[b], starts[b + 1]) are the names of bucket b
+        std::vector<uint64_t> starts(buckets + 1, 0);
+        for (uint64_t i = 0; i < count; ++i)
+        {
+            hashes[i] = hash64(this->name_at(this->offsets[i]), seed);
+            ++starts[bucket_of(hashes[i], buckets) + 1];
+        }
+        std::partial_sum(starts.begin(), starts.end(), starts.begin());
+        std::vector<uint64_t> members(count);
+        std::vector<uint64_t> next(starts.begin(), starts.end() - 1);
+        for (uint64_t i = 0; i < count; ++i)
+        {
+            members[next[bucket_of(hashes[i], buckets)]++] = i;
+        }
+
+        // Largest buckets first, while most slots are still free
+        std::vector<uint64_t> order(buckets);
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(), [&starts](uint64_t a, uint64_t b)
+                         { return starts[a + 1] - starts[a] > starts[b + 1] - starts[b]; });
+
+        std::vector<bool> taken(count, false);
+        std::vector<uint64_t> positions;
+        for (uint64_t bucket : order)
+        {
+            const uint64_t first = starts[bucket];
+            const uint64_t last = starts[bucket + 1];
+            if (first == last)
+            {
+                // Only empty buckets are left; their pilots are never read
+                break;
+            }
+            // Names with the same hash cannot be told apart by any pilot
+            for (uint64_t i = first; i < last; ++i)
+            {
+                for (uint64_t j = i + 1; j < last; ++j)
+                {
+                    if (hashes[members[i]] == hashes[members[j]])
+                    {
+                        return false;
+                    }
+                }
+            }
+            uint64_t pilot = 0;
+            while (true)
+            {
+                if (pilot > UINT32_MAX)
+                {
+                    return false;
+                }
+                positions.clear();
+                bool placed = true;
+                for (uint64_t i = first; i < last && placed; ++i)
+                {
+                    const uint64_t position = slot_of(hashes[members[i]], static_cast<uint32_t>(pilot), count);
+                    placed = !taken[position] && std::find(positions.begin(), positions.end(), position) == positions.end();
+                    positions.push_back(position);
+                }
+                if (placed)
+                {
+                    break;
+                }
+                ++pilot;
+            }
+            pilots[bucket] = static_cast<uint32_t>(pilot);
+            for (uint64_t i = first; i < last; ++i)
+            {
+                const uint64_t position = positions[i - first];
+                taken[position] = true;
+                slots[position] = (fingerprint(hashes[members[i]]) << 48) | this->offsets[members[i]];
+            }
+        }
+        return true;
+    }
+
+    uint64_t SnapshotWriter::finish()
+    {
+        const uint64_t records_end = this->file.size() + this->chunk.size();
+        if (records_end > OFFSET_MASK)
+        {
+            throw std::runtime_error("Snapshot records exceed the largest offset a slot can hold.");
+        }
+        this->chunk.append(align8(records_end) - records_end, '\0');
+        this->flush();
+
+        std::sort(this->templates.begin(), this->templates.end());
+        if (std::adjacent_find(this->templates.begin(), this->templates.end(), [](const auto &a, const auto &b)
+                               { return a.first == b.first; }) != this->templates.end())
+        {
+            throw std::runtime_error("Snapshot holds a template twice.");
+        }
+        const uint64_t count = this->offsets.size();
+        const uint64_t buckets = (count + NAMES_PER_BUCKET - 1) / NAMES_PER_BUCKET;
+        std::vector<uint32_t> pilots(buckets, 0);
+        std::vector<uint64_t> slots(count, 0);
+        uint64_t seed = 0;
+        while (!this->place(seed, buckets, pilots, slots))
+        {
+            ++seed;
+        }
+
+        this->chunk.append(reinterpret_cast<const char *>(pilots.data()), pilots.size() * sizeof(uint32_t));
+        this->chunk.append(align8(this->chunk.size()) - this->chunk.size(), '\0');
+        this->chunk.append(reinterpret_cast<const char *>(slots.data()), slots.size() * sizeof(uint64_t));
+        this->chunk.append(reinterpret_cast<const char *>(this->offsets.data()), this->offsets.size() * sizeof(uint64_t));
+        for (const auto &[template_id, offset] : this->templates)
+        {
+            ByteWriter writer(this->chunk);
+            writer.put<uint64_t>(template_id);
+            writer.put<uint64_t>(offset);
+        }
+        this->flush();
+
+        SnapshotHeader header{};
+        std::memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+        header.version = SNAPSHOT_VERSION;
+        header.templates = static_cast<uint32_t>(this->templates.size());
+        header.count = count;
+        header.buckets = buckets;
+        header.seed = seed;
+        header.records_end = records_end;
+        header.checksum = hash64(std::string_view(this->file.data() + sizeof(SnapshotHeader), this->file.size() - sizeof(SnapshotHeader)));
+        header.header_checksum = hash64(std::string_view(reinterpret_cast<const char *>(&header), offsetof(SnapshotHeader, header_checksum)));
+        std::memcpy(this->file.data(), &header, sizeof(header));
+        this->file.sync();
+        std::filesystem::rename(this->new_path, this->path);
+        return this->file.size();
+    }
+
+    Snapshot::Snapshot(const std::filesystem::path &path, bool verify)
+    {
+        if (!std::filesystem::exists(path))
+        {
+            throw std::runtime_error("Snapshot '" + path.string() + "' does not exist.");
+        }
+        this->file = MappedFile::open_read_only(path);
+        const SnapshotHeader *header = reinterpret_cast<const SnapshotHeader *>(this->file.data());
+        if (this->file.size() < sizeof(SnapshotHeader) || std::memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0)
+        {
+            throw std::runtime_error("'" + path.string() + "' is not a FunDB snapshot.");
+        }
+        if (header->version != SNAPSHOT_VERSION)
+        {
+            throw std::runtime_error("Unsupported snapshot version " + std::to_string(header->version) + ".");
+        }
+        if (header->header_checksum != hash64(std::string_view(this->file.data(), offsetof(SnapshotHeader, header_checksum))))
+        {
+            throw std::runtime_error("Snapshot header of '" + path.string() + "' is corrupt.");
+        }
+        const uint64_t size = this->file.size();
+        const uint64_t tables = align8(header->records_end);
+        if (header->records_end < sizeof(SnapshotHeader) || header->count > size / 16 || header->buckets > size / 4 ||
+            (header->count > 0) != (header->buckets > 0) ||
+            tables + align8(header->buckets * sizeof(uint32_t)) + (header->count + uint64_t{header->templates}) * 2 * sizeof(uint64_t) != size)
+        {
+            throw std::runtime_error("Snapshot '" + path.string() + "' is truncated.");
+        }
+        if (verify && header->checksum != hash64(std::string_view(this->file.data() + sizeof(SnapshotHeader), size - sizeof(SnapshotHeader))))
+        {
+            throw std::runtime_error("Checksum mismatch in snapshot '" + path.string() + "'.");
+        }
+
+        this->count = header->count;
+        this->buckets = header->buckets;
+        this->seed = header->seed;
+        this->records_end = header->records_end;
+        this->pilots = reinterpret_cast<const uint32_t *>(this->file.data() + tables);
+        this->slots = reinterpret_cast<const uint64_t *>(this->file.data() + tables + align8(this->buckets * sizeof(uint32_t)));
+        this->sorted = this->slots + this->count;
+        this->template_table = this->sorted + this->count;
+        this->template_count = header->templates;
+    }
+
+    SnapshotRecord Snapshot::record_at(uint64_t offset) const
+    {
+        if (offset < sizeof(SnapshotHeader) || offset >= this->records_end)
+        {
+            throw std::runtime_error("Corrupt snapshot record.");
+        }
+        ByteReader reader(std::string_view(this->file.data() + offset, this->records_end - offset), "Corrupt snapshot record.");
+        const uint32_t name_size = reader.get<uint32_t>();
+        const uint32_t payload_size = reader.get<uint32_t>();
+        const uint32_t program_size = reader.get<uint32_t>();
+        SnapshotRecord record;
+        record.name = reader.take(name_size);
+        record.payload = reader.take(payload_size);
+        record.program = reader.take(program_size);
+        return record;
+    }
+
+    std::optional<SnapshotRecord> Snapshot::find(std::string_view name) const
+    {
+        if (this->count == 0)
+        {
+            return std::nullopt;
+        }
+        const uint64_t hash = hash64(name, this->seed);
+        const uint64_t slot = this->slots[slot_of(hash, this->pilots[bucket_of(hash, this->buckets)], this->count)];
+        if ((slot >> 48) != fingerprint(hash))
+        {
+            return std::nullopt;
+        }
+        // Every name maps to some slot, so an absent name with a matching fingerprint is told
+        // apart by the record
+        SnapshotRecord record = this->record_at(slot & OFFSET_MASK);
+        if (record.name != name)
+        {
+            return std::nullopt;
+        }
+        return record;
+    }
+
+    std::optional<SnapshotRecord> Snapshot::find_template(uint64_t template_id) const
+    {
+        size_t lo = 0;
+        size_t hi = this->template_count;
+        while (lo < hi)
+        {
+            const size_t mid = lo + (hi - lo) / 2;
+            if (this->template_table[2 * mid] < template_id)
+            {
+                lo = mid + 1;
+            }
+            else
+            {
+                hi = mid;
+            }
+        }
+        if (lo == this->template_count || this->template_table[2 * lo] != template_id)
+        {
+            return std::nullopt;
+        }
+        return this->record_at(this->template_table[2 * lo + 1]);
+    }
+
+    SnapshotRecord Snapshot::at(size_t rank) const
+    {
+        return this->record_at(this->sorted[rank]);
+    }
+
+    size_t Snapshot::lower_bound(std::string_view name) const
+    {
+        size_t lo = 0;
+        size_t hi = this->count;
+        while (lo < hi)
+        {
+            const size_t mid = lo + (hi - lo) / 2;
+            if (this->at(mid).name < name)
+            {
+                lo = mid + 1;
+            }
+            else
+            {
+                hi = mid;
+            }
+        }
+        return lo;
+    }
+}
@@ -0,0 +1,53 @@
+#include "../inc/db.h"
+
+#include <iostream>
+#include <string>
+
+// Offline maintenance of a database's files
+static int usage()
+{
+    std::cerr << "Usage: fundb compact [data file] [index file]" << std::endl;
+    std::cerr << "       fundb freeze [data file] [index file] [image file]" << std::endl;
+    return 2;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        return usage();
+    }
+    const std::string command = argv[1];
+    const std::string data_file = argc > 2 ? argv[2] : "functions.dat";
+    const std::string index_file = argc > 3 ? argv[3] : "functions.idx";
+    const std::string image_file = argc > 4 ? argv[4] : "functions.snap";
+
+    try
+    {
+        if (command == "compact")
+        {
+            FunDB::Database database{data_file, index_file};
+            FunDB::CompactionStats stats = database.compact();
+            std::cout << "Compacted " << data_file << ": " << stats.live_records << " live records, "
+                      << stats.bytes_before << " -> " << stats.bytes_after << " bytes ("
+                      << stats.reclaimed_bytes << " bytes reclaimed)" << std::endl;
+            return 0;
+        }
+        if (command == "freeze")
+        {
+            FunDB::Database database{data_file, index_file};
+            FunDB::FreezeStats stats = database.freeze(image_file);
+            // Read the image back in full before reporting success
+            FunDB::Snapshot image(image_file, true);
+            std::cout << "Froze " << stats.functions << " functions (" << stats.precompiled << " precompiled) from "
+                      << data_file << " into " << image_file << ": " << stats.image_bytes << " bytes" << std::endl;
+            return 0;
+        }
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+    return usage();
+}
@@ -0,0 +1,73 @@
+#include "../inc/worker_pool.h"
+#include <algorithm>
+#include <utility>
+
+namespace FunDB
+{
+    WorkerPool::WorkerPool(size_t max_threads)
+        : max_threads(std::max<size_t>(1, max_threads))
+    {
+    }
+
+    WorkerPool::~WorkerPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->stopping = true;
+        }
+        this->work_available.notify_all();
+        for (auto &thread : this->threads)
+        {
+            thread.join();
+        }
+    }
+
+    void WorkerPool::post(std::function<void()> task)
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->tasks.push_back(std::move(task));
+        // Start another thread only if the waiting ones cannot take every queued task
+        if (this->tasks.size() > this->idle && this->threads.size() < this->max_threads)
+        {
+            this->threads.emplace_back(&WorkerPool::run, this);
+        }
+        else
+        {
+            this->work_available.notify_one();
+        }
+    }
+
+    void WorkerPool::run()
+    {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        while (true)
+        {
+            ++this->idle;
+            this->work_available.wait(lock, [this]
+                                      { return this->stopping || !this->tasks.empty(); });
+            --this->idle;
+            if (this->tasks.empty())
+            {
+                return;
+            }
+            std::function<void()> task = std::move(this->tasks.front());
+            this->tasks.pop_front();
+            lock.unlock();
+            // Tasks come from submit(), whose packaged_task keeps any exception for the future
+            task();
+            lock.lock();
+        }
+    }
+
+    size_t WorkerPool::thread_count() const
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        return this->threads.size();
+    }
+
+    WorkerPool &WorkerPool::shared()
+    {
+        static WorkerPool pool(std::max(4u, std::thread::hardware_concurrency() + 2));
+        return pool;
+    }
+}
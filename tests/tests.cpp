@@ -1,12 +1,30 @@
 #define CATCH_CONFIG_MAIN
 #include "../inc/fun.h"
 #include "../inc/db.h"
+#include "../inc/sharded_db.h"
+#include "../inc/compiled.h"
+#include "../inc/codec.h"
+#include "../inc/hash.h"
+#include "../inc/wire.h"
+#include "../inc/server.h"
+#include "../inc/mapped_file.h"
+#include "../inc/worker_pool.h"
 #include <symengine/expression.h> // Include this for Expression class
+#include <symengine/real_double.h>
 #include <catch2/catch_all.hpp>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdio>
 #include <iostream>
 #include <vector>
 #include <stdexcept>
 #include <cmath>
+#include <fstream>
+#include <thread>
+#include <atomic>
+#include <sstream>
 
 // The old custom test macros and functions have been removed to avoid conflicts.
 
@@ -43,6 +61,7 @@ TEST_CASE("Database save and load", "[Database]")
     REQUIRE(loaded_func.has_value());
     REQUIRE(loaded_func->name == func_to_save.name);
     REQUIRE(loaded_func->symbols == func_to_save.symbols);
+    REQUIRE(db.contains("test_save_load"));
 }
 
 // Test case 3: Test FunDB::evaluate_stored_function
@@ -71,6 +90,7 @@ TEST_CASE("Loading a non-existent function", "[Database]")
     db.clear();
     std::optional<FunDB::Function> loaded_func = db.load_function("non_existent_func");
     REQUIRE_FALSE(loaded_func.has_value());
+    REQUIRE_FALSE(db.contains("non_existent_func"));
 }
 
 // Test case 5: Test that evaluating a function with missing values throws an exception
@@ -85,3 +105,1906 @@ TEST_CASE("Evaluating with missing values", "[Function]")
 
     REQUIRE_THROWS_AS(func.evaluate(values), std::runtime_error);
 }
+
+// Test case 6: Test that a reopened database sees previously stored functions and updates
+TEST_CASE("Reopening a database", "[Database]")
+{
+    {
+        FunDB::Database db{"test_reopen.dat", "test_reopen.idx"};
+        db.clear();
+        db.save_function({"first", {"x"}, SymEngine::Expression("x + 1")});
+        db.save_function({"second", {"x"}, SymEngine::Expression("2*x")});
+        db.save_function({"first", {"x"}, SymEngine::Expression("x + 2")});
+    }
+
+    FunDB::Database db{"test_reopen.dat", "test_reopen.idx"};
+    REQUIRE(FunDB::evaluate_stored_function(db, "first", {{"x", 1.0}}) == Catch::Approx(3.0));
+    REQUIRE(FunDB::evaluate_stored_function(db, "second", {{"x", 1.0}}) == Catch::Approx(2.0));
+    REQUIRE_FALSE(db.load_function("third").has_value());
+}
+
+// Test case 7: Test that updates find their existing slot and a small table grows instead of filling up
+TEST_CASE("Saving past the initial index capacity", "[Database]")
+{
+    FunDB::Database db{"test_full.dat", "test_full.idx", 4};
+    db.clear();
+    REQUIRE(db.capacity() == 8);
+    for (int i = 0; i < 100; ++i)
+    {
+        db.save_function({"f" + std::to_string(i), {"x"}, SymEngine::Expression(std::to_string(i) + "*x")});
+    }
+
+    // Updating an existing key reuses its slot, whether or not it has been moved to the new table yet
+    db.save_function({"f2", {"x"}, SymEngine::Expression("3*x + 1")});
+    REQUIRE(db.size() == 100);
+    REQUIRE(db.capacity() >= 128);
+    REQUIRE(FunDB::evaluate_stored_function(db, "f2", {{"x", 2.0}}) == Catch::Approx(7.0));
+    for (int i = 0; i < 100; ++i)
+    {
+        if (i != 2)
+        {
+            REQUIRE(FunDB::evaluate_stored_function(db, "f" + std::to_string(i), {{"x", 2.0}}) == Catch::Approx(2.0 * i));
+        }
+    }
+    REQUIRE_FALSE(db.load_function("f100").has_value());
+}
+
+// Test case 8: Test Database::write_batch, including duplicate names inside one batch
+TEST_CASE("Bulk loading with write_batch", "[Database]")
+{
+    FunDB::Database db{"test_batch.dat", "test_batch.idx", 64};
+    db.clear();
+    db.save_function({"existing", {"x"}, SymEngine::Expression("x")});
+
+    std::vector<FunDB::Function> batch;
+    for (int i = 0; i < 10; ++i)
+    {
+        batch.push_back({"batch_" + std::to_string(i), {"x"}, SymEngine::Expression(std::to_string(i) + "*x")});
+    }
+    batch.push_back({"existing", {"x"}, SymEngine::Expression("x + 100")});
+    batch.push_back({"batch_3", {"x"}, SymEngine::Expression("x - 3")});
+    db.write_batch(batch);
+
+    REQUIRE(FunDB::evaluate_stored_function(db, "batch_7", {{"x", 2.0}}) == Catch::Approx(14.0));
+    REQUIRE(FunDB::evaluate_stored_function(db, "batch_3", {{"x", 2.0}}) == Catch::Approx(-1.0));
+    REQUIRE(FunDB::evaluate_stored_function(db, "existing", {{"x", 2.0}}) == Catch::Approx(102.0));
+
+    // A batch larger than the index grows it while the batch is indexed
+    FunDB::Database small{"test_batch_small.dat", "test_batch_small.idx", 4};
+    small.clear();
+    small.write_batch(batch);
+    REQUIRE(small.size() == 11);
+    REQUIRE(FunDB::evaluate_stored_function(small, "batch_9", {{"x", 2.0}}) == Catch::Approx(18.0));
+    REQUIRE(FunDB::evaluate_stored_function(small, "batch_3", {{"x", 2.0}}) == Catch::Approx(-1.0));
+}
+
+// Test case 9: Test that CompiledFunction agrees with symbolic evaluation
+TEST_CASE("Compiled evaluation matches symbolic evaluation", "[CompiledFunction]")
+{
+    const std::vector<std::string> expressions = {
+        "2*x + 3*y",
+        "x**2 - y/x + 7",
+        "-x*y + sqrt(x) - 1/2",
+        "exp(x - y) + log(x)*sin(y)",
+        "cos(x)**3/(1 + tanh(y)) - atan(x*y)",
+        "gamma(x + 1) + y",
+    };
+    std::unordered_map<std::string, double> values = {{"x", 1.75}, {"y", -0.5}};
+    const double args[] = {1.75, -0.5};
+
+    for (const auto &text : expressions)
+    {
+        FunDB::Function func{"f", {"x", "y"}, SymEngine::Expression(text)};
+        FunDB::CompiledFunction compiled(func);
+        REQUIRE(compiled.arity() == 2);
+        REQUIRE(compiled.evaluate(args) == Catch::Approx(func.evaluate(values)));
+        REQUIRE(compiled.evaluate(values) == Catch::Approx(func.evaluate(values)));
+    }
+
+    // Symbols outside of the argument list cannot be bound positionally
+    FunDB::Function free_symbol{"g", {"x"}, SymEngine::Expression("x + z")};
+    REQUIRE_THROWS_AS(FunDB::CompiledFunction(free_symbol), std::runtime_error);
+}
+
+// Test case 10: Test batch evaluation over columns against point-wise evaluation
+TEST_CASE("Batch evaluation over columns", "[CompiledFunction]")
+{
+    FunDB::Function func{"f", {"x", "y"}, SymEngine::Expression("3*x**2 + 5*y**2 + 15*x*y - sin(x)/(1 + y**2)")};
+    FunDB::CompiledFunction compiled(func);
+
+    // Not a multiple of the block size, and large enough to be split across threads
+    const size_t count = 300'007;
+    std::vector<double> xs(count), ys(count), out(count);
+    for (size_t i = 0; i < count; ++i)
+    {
+        xs[i] = 0.001 * static_cast<double>(i % 2000) - 1.0;
+        ys[i] = 0.5 - 0.0003 * static_cast<double>(i % 3000);
+    }
+    compiled.evaluate_batch({xs.data(), ys.data()}, out.data(), count);
+
+    for (size_t i = 0; i < count; i += 997)
+    {
+        const double args[] = {xs[i], ys[i]};
+        REQUIRE(out[i] == Catch::Approx(compiled.evaluate(args)));
+    }
+    const double last[] = {xs[count - 1], ys[count - 1]};
+    REQUIRE(out[count - 1] == Catch::Approx(compiled.evaluate(last)));
+
+    REQUIRE_THROWS_AS(compiled.evaluate_batch({xs.data()}, out.data(), count), std::runtime_error);
+}
+
+// Test case 11: Test the function cache: hits, misses, invalidation on save and the entry bound
+TEST_CASE("Function cache", "[Database]")
+{
+    FunDB::Database db{"test_cache.dat", "test_cache.idx", 1024, 2};
+    db.clear();
+    db.save_function({"a", {"x"}, SymEngine::Expression("x + 1")});
+    db.save_function({"b", {"x"}, SymEngine::Expression("x + 2")});
+    db.save_function({"c", {"x"}, SymEngine::Expression("x + 3")});
+
+    REQUIRE(FunDB::evaluate_stored_function(db, "a", {{"x", 0.0}}) == Catch::Approx(1.0));
+    REQUIRE(FunDB::evaluate_stored_function(db, "a", {{"x", 0.0}}) == Catch::Approx(1.0));
+    FunDB::CacheStats stats = db.cache_stats();
+    REQUIRE(stats.misses == 1);
+    REQUIRE(stats.hits == 1);
+
+    // Saving a cached name must not serve the stale entry
+    db.save_function({"a", {"x"}, SymEngine::Expression("x + 10")});
+    REQUIRE(FunDB::evaluate_stored_function(db, "a", {{"x", 0.0}}) == Catch::Approx(10.0));
+    REQUIRE(db.cache_stats().misses == 2);
+
+    db.load_function("b");
+    db.load_function("c");
+    stats = db.cache_stats();
+    REQUIRE(stats.entries == 2);
+    REQUIRE(stats.capacity == 2);
+
+    // Misses for absent names are counted but not cached
+    REQUIRE_FALSE(db.load_function("missing").has_value());
+    REQUIRE(db.cache_stats().entries == 2);
+}
+
+// Test case 12: Test the binary record format and decoding of legacy text records
+TEST_CASE("Function record encoding", "[Function]")
+{
+    const std::vector<std::string> expressions = {
+        "2*x + 3*y",
+        "0.1*x + 1/3*y**2 - 2.5e-300",
+        "exp(x)*sin(y) + pi - log(abs(x))",
+        "gamma(x) + z",
+        "123456789012*x - 7",
+    };
+    for (const auto &text : expressions)
+    {
+        FunDB::Function func{"f", {"x", "y"}, SymEngine::Expression(text)};
+        std::string payload = func.serialize();
+        REQUIRE(payload[0] == FunDB::BINARY_RECORD_TAG);
+
+        FunDB::Function decoded = FunDB::Function::deserialize("f", payload);
+        REQUIRE(decoded.name == "f");
+        REQUIRE(decoded.symbols == func.symbols);
+        REQUIRE(SymEngine::eq(*decoded.expr.get_basic(), *func.expr.get_basic()));
+    }
+
+    // Floating constants survive bit for bit
+    FunDB::Function precise{"p", {"x"}, SymEngine::Expression(SymEngine::real_double(0.1 + 0.2))};
+    FunDB::Function decoded = FunDB::Function::deserialize("p", precise.serialize());
+    REQUIRE(static_cast<double>(decoded.expr) == 0.1 + 0.2);
+
+    // Records written before the binary format are still readable
+    FunDB::Function legacy = FunDB::Function::deserialize("old", "x,y|2*x + y");
+    REQUIRE(legacy.symbols == std::vector<std::string>{"x", "y"});
+    REQUIRE(legacy.evaluate({{"x", 1.0}, {"y", 2.0}}) == Catch::Approx(4.0));
+
+    std::string truncated = precise.serialize();
+    truncated.pop_back();
+    REQUIRE_THROWS_AS(FunDB::Function::deserialize("p", truncated), std::runtime_error);
+}
+
+// Test case 13: Test that the index hash is stable and that headerless indexes are rebuilt
+TEST_CASE("Stable hashing and legacy index upgrade", "[Database]")
+{
+    // Reference XXH64 values; the on-disk index depends on these never changing
+    REQUIRE(FunDB::hash64("") == 0xEF46DB3751D8E999ULL);
+    REQUIRE(FunDB::hash64("abc") == 0x44BC2CF5AD770999ULL);
+    REQUIRE(FunDB::hash64("Nobody inspects the spammish repetition") == 0xFBCEA83C8A378BF1ULL);
+
+    // Write a data file with a legacy text record and a headerless all-empty index next to it
+    {
+        std::ofstream data("test_legacy.dat", std::ios::binary | std::ios::trunc);
+        const std::string key = "legacy_fn", value = "x,y|2*x + y";
+        uint32_t key_size = key.size(), value_size = value.size();
+        data.write(reinterpret_cast<const char *>(&key_size), sizeof(key_size));
+        data.write(key.data(), key_size);
+        data.write(reinterpret_cast<const char *>(&value_size), sizeof(value_size));
+        data.write(value.data(), value_size);
+
+        std::ofstream index("test_legacy.idx", std::ios::binary | std::ios::trunc);
+        std::vector<uint64_t> slots(16, 0xFFFFFFFFFFFFFFFF);
+        index.write(reinterpret_cast<const char *>(slots.data()), slots.size() * sizeof(uint64_t));
+    }
+
+    FunDB::Database db{"test_legacy.dat", "test_legacy.idx", 16};
+    REQUIRE(FunDB::evaluate_stored_function(db, "legacy_fn", {{"x", 1.0}, {"y", 2.0}}) == Catch::Approx(4.0));
+    REQUIRE_FALSE(db.load_function("other_fn").has_value());
+}
+
+// Test case 14: Test reopening an index in the middle of a resize and after an interrupted one
+TEST_CASE("Index resizing survives reopening", "[Database]")
+{
+    {
+        FunDB::Database db{"test_resize.dat", "test_resize.idx", 8};
+        db.clear();
+        for (int i = 0; i < 5; ++i)
+        {
+            db.save_function({"g" + std::to_string(i), {"x"}, SymEngine::Expression("x + " + std::to_string(i))});
+        }
+        // Five names and the template they share in eight slots crossed the load limit, so a
+        // resize is still in progress
+        REQUIRE(std::filesystem::exists("test_resize.idx.resize"));
+    }
+
+    // The half-built table is discarded and the index is derived from the data file again
+    FunDB::Database db{"test_resize.dat", "test_resize.idx", 8};
+    REQUIRE_FALSE(std::filesystem::exists("test_resize.idx.resize"));
+    REQUIRE(db.size() == 5);
+    for (int i = 0; i < 5; ++i)
+    {
+        REQUIRE(FunDB::evaluate_stored_function(db, "g" + std::to_string(i), {{"x", 1.0}}) == Catch::Approx(1.0 + i));
+    }
+    db.save_function({"g6", {"x"}, SymEngine::Expression("x")});
+    REQUIRE(db.load_function("g6").has_value());
+}
+
+// Test case 15: Test that compaction drops superseded records and keeps the latest ones
+TEST_CASE("Compacting the data file", "[Database]")
+{
+    FunDB::Database db{"test_compact.dat", "test_compact.idx", 16};
+    db.clear();
+    // Powers have no coefficients, so every record is stored whole and has the same size
+    for (int version = 1; version <= 5; ++version)
+    {
+        for (int i = 0; i < 20; ++i)
+        {
+            db.save_function({"h" + std::to_string(i), {"x"}, SymEngine::Expression("x**" + std::to_string(version + 1))});
+        }
+    }
+    const uint64_t size_before = std::filesystem::file_size("test_compact.dat");
+
+    FunDB::CompactionStats stats = db.compact();
+    REQUIRE(stats.live_records == 20);
+    REQUIRE(stats.bytes_before == size_before);
+    REQUIRE(stats.bytes_after == std::filesystem::file_size("test_compact.dat"));
+    REQUIRE(stats.reclaimed_bytes == stats.bytes_before - stats.bytes_after);
+    REQUIRE(stats.bytes_after * 5 == stats.bytes_before);
+    REQUIRE_FALSE(db.needs_compaction());
+
+    for (int i = 0; i < 20; ++i)
+    {
+        REQUIRE(FunDB::evaluate_stored_function(db, "h" + std::to_string(i), {{"x", 2.0}}) == Catch::Approx(64.0));
+    }
+    db.save_function({"h0", {"x"}, SymEngine::Expression("x")});
+    REQUIRE(FunDB::evaluate_stored_function(db, "h0", {{"x", 1.0}}) == Catch::Approx(1.0));
+
+    // Compacting again in the background reclaims just the record replaced above
+    FunDB::CompactionStats again = db.compact_async().get();
+    REQUIRE(again.live_records == 20);
+    REQUIRE(again.reclaimed_bytes > 0);
+
+    // The compacted files are what a fresh open sees, including after a crash that removed the index
+    std::filesystem::remove("test_compact.idx");
+    FunDB::Database reopened{"test_compact.dat", "test_compact.idx", 16};
+    REQUIRE(reopened.size() == 20);
+    REQUIRE(FunDB::evaluate_stored_function(reopened, "h0", {{"x", 1.0}}) == Catch::Approx(1.0));
+    REQUIRE(FunDB::evaluate_stored_function(reopened, "h19", {{"x", 2.0}}) == Catch::Approx(64.0));
+
+    // Writes compact on their own once most of a large data file is dead
+    FunDB::Database churn{"test_churn.dat", "test_churn.idx"};
+    churn.clear();
+    std::vector<FunDB::Function> batch;
+    for (int i = 0; i < 4000; ++i)
+    {
+        batch.push_back({std::string(200, 'n') + std::to_string(i), {"x"}, SymEngine::Expression("x")});
+    }
+    for (int round = 0; round < 3; ++round)
+    {
+        churn.write_batch(batch);
+    }
+    // The write that found compaction due started it in the background
+    churn.wait_for_compaction();
+    REQUIRE_FALSE(churn.needs_compaction());
+    REQUIRE(std::filesystem::file_size("test_churn.dat") < 2 * (1 << 20));
+    REQUIRE(churn.size() == 4000);
+    REQUIRE(churn.load_function(std::string(200, 'n') + "3999").has_value());
+}
+
+// Test case 16: Test concurrent readers against a writer that updates, grows and compacts the database
+TEST_CASE("Concurrent readers and a writer", "[Database]")
+{
+    FunDB::Database db{"test_concurrent.dat", "test_concurrent.idx", 8, 64};
+    db.clear();
+    for (int i = 0; i < 50; ++i)
+    {
+        db.save_function({"c" + std::to_string(i), {"x"}, SymEngine::Expression("x")});
+    }
+
+    // Every stored version of cN is x + k*N for some k >= 0, so readers can check what they see
+    std::atomic<bool> done{false};
+    std::atomic<int> bad_reads{0};
+    std::vector<std::thread> readers;
+    for (int t = 0; t < 4; ++t)
+    {
+        readers.emplace_back([&db, &done, &bad_reads, t]
+                             {
+            for (int n = 0; !done.load() || n < 200; ++n)
+            {
+                int i = (n * 7 + t) % 50;
+                double value = FunDB::evaluate_stored_function(db, "c" + std::to_string(i), {{"x", 1.0}});
+                double steps = (value - 1.0) / (i == 0 ? 1.0 : i);
+                if (i == 0 ? value != 1.0 : steps != std::floor(steps))
+                {
+                    ++bad_reads;
+                }
+            } });
+    }
+
+    for (int k = 1; k <= 20; ++k)
+    {
+        for (int i = 0; i < 50; ++i)
+        {
+            std::string term = std::to_string(k * i);
+            db.save_function({"c" + std::to_string(i), {"x"}, SymEngine::Expression("x + " + term)});
+        }
+        // New names grow the index while it is being read
+        db.save_function({"extra" + std::to_string(k), {"x"}, SymEngine::Expression("x")});
+        if (k % 5 == 0)
+        {
+            db.compact_async().get();
+        }
+    }
+    done = true;
+    for (auto &reader : readers)
+    {
+        reader.join();
+    }
+
+    REQUIRE(bad_reads == 0);
+    REQUIRE(db.size() == 70);
+    REQUIRE(FunDB::evaluate_stored_function(db, "c7", {{"x", 1.0}}) == Catch::Approx(141.0));
+}
+
+// Test case 17: Test binary protocol framing, including partial and malformed frames
+TEST_CASE("Wire protocol framing", "[Wire]")
+{
+    std::string payload;
+    FunDB::ByteWriter writer(payload);
+    writer.put_string("f");
+    writer.put<double>(0.1);
+
+    std::string stream;
+    FunDB::append_wire_frame(stream, static_cast<uint8_t>(FunDB::WireOp::Evaluate), 7, payload);
+    FunDB::append_wire_frame(stream, static_cast<uint8_t>(FunDB::WireOp::Load), 8, "");
+    REQUIRE(stream.size() == 2 * FunDB::WIRE_HEADER_BYTES + payload.size());
+
+    // A frame is only returned once all of it has arrived
+    FunDB::WireFrame frame;
+    for (size_t partial = 0; partial < FunDB::WIRE_HEADER_BYTES + payload.size(); ++partial)
+    {
+        REQUIRE(FunDB::parse_wire_frame(std::string_view(stream).substr(0, partial), frame) == 0);
+    }
+    size_t first = FunDB::parse_wire_frame(stream, frame);
+    REQUIRE(first == FunDB::WIRE_HEADER_BYTES + payload.size());
+    REQUIRE(frame.code == static_cast<uint8_t>(FunDB::WireOp::Evaluate));
+    REQUIRE(frame.id == 7);
+    FunDB::ByteReader reader(frame.payload);
+    REQUIRE(reader.get_string() == "f");
+    REQUIRE(reader.get<double>() == 0.1); // Doubles travel bit for bit
+    REQUIRE(reader.at_end());
+
+    REQUIRE(FunDB::parse_wire_frame(std::string_view(stream).substr(first), frame) == FunDB::WIRE_HEADER_BYTES);
+    REQUIRE(frame.id == 8);
+    REQUIRE(frame.payload.empty());
+
+    // Lengths too small to hold a header, or beyond the limit, cannot be framed
+    std::string bad;
+    FunDB::ByteWriter(bad).put<uint32_t>(2);
+    REQUIRE_THROWS_AS(FunDB::parse_wire_frame(bad, frame), std::runtime_error);
+    bad.clear();
+    FunDB::ByteWriter(bad).put<uint32_t>(FunDB::MAX_WIRE_FRAME_BYTES + 1);
+    REQUIRE_THROWS_AS(FunDB::parse_wire_frame(bad, frame), std::runtime_error);
+}
+
+// Test case 18: Test durability modes and recovery of the index from the data file after a crash
+TEST_CASE("Write-ahead log recovery and durability modes", "[Database]")
+{
+    {
+        FunDB::Database db{"test_wal.dat", "test_wal.idx", 8, 64};
+        db.clear();
+        db.set_durability({FunDB::Durability::GroupCommit, std::chrono::microseconds(500), 16});
+        std::vector<std::thread> writers;
+        for (int t = 0; t < 4; ++t)
+        {
+            writers.emplace_back([&db, t]
+                                 {
+                for (int i = 0; i < 50; ++i)
+                {
+                    db.save_function({"w" + std::to_string(t * 50 + i), {"x"}, SymEngine::Expression("x + " + std::to_string(i))});
+                } });
+        }
+        for (auto &writer : writers)
+        {
+            writer.join();
+        }
+        db.set_durability({FunDB::Durability::PerWrite});
+        db.save_function({"w0", {"x"}, SymEngine::Expression("2*x")});
+        REQUIRE(db.size() == 200);
+    }
+    {
+        FunDB::Database db{"test_wal.dat", "test_wal.idx", 8, 64};
+        REQUIRE(db.size() == 200);
+        REQUIRE(FunDB::evaluate_stored_function(db, "w0", {{"x", 3.0}}) == Catch::Approx(6.0));
+        REQUIRE(FunDB::evaluate_stored_function(db, "w199", {{"x", 3.0}}) == Catch::Approx(52.0));
+
+        // Copying the files of an open database gives what a crash would leave behind: an index
+        // that has moved past its last checkpoint
+        db.checkpoint();
+        db.save_function({"w1", {"x"}, SymEngine::Expression("3*x")});
+        db.save_function({"fresh", {"x"}, SymEngine::Expression("x - 1")});
+        std::filesystem::copy_file("test_wal.dat", "test_crash.dat", std::filesystem::copy_options::overwrite_existing);
+        std::filesystem::copy_file("test_wal.idx", "test_crash.idx", std::filesystem::copy_options::overwrite_existing);
+        std::filesystem::copy_file("test_wal.idx.names", "test_crash.idx.names", std::filesystem::copy_options::overwrite_existing);
+        std::filesystem::copy_file("test_wal.idx.bloom", "test_crash.idx.bloom", std::filesystem::copy_options::overwrite_existing);
+    }
+    const auto valid_size = std::filesystem::file_size("test_crash.dat");
+
+    SECTION("Records after the checkpoint are replayed and a torn tail is cut off")
+    {
+        {
+            std::ofstream data("test_crash.dat", std::ios::binary | std::ios::app);
+            data.write("\x05\x00\x00\x80gar", 7);
+        }
+        FunDB::Database db{"test_crash.dat", "test_crash.idx", 8, 64};
+        REQUIRE(std::filesystem::file_size("test_crash.dat") == valid_size);
+        REQUIRE(db.size() == 201);
+        REQUIRE(FunDB::evaluate_stored_function(db, "w1", {{"x", 2.0}}) == Catch::Approx(6.0));
+        REQUIRE(FunDB::evaluate_stored_function(db, "fresh", {{"x", 2.0}}) == Catch::Approx(1.0));
+
+        // New records follow the last valid one and survive the next recovery
+        db.save_function({"after", {"x"}, SymEngine::Expression("x")});
+        std::filesystem::copy_file("test_crash.dat", "test_crash2.dat", std::filesystem::copy_options::overwrite_existing);
+        std::filesystem::copy_file("test_crash.idx", "test_crash2.idx", std::filesystem::copy_options::overwrite_existing);
+        std::filesystem::copy_file("test_crash.idx.names", "test_crash2.idx.names", std::filesystem::copy_options::overwrite_existing);
+        std::filesystem::copy_file("test_crash.idx.bloom", "test_crash2.idx.bloom", std::filesystem::copy_options::overwrite_existing);
+        FunDB::Database reopened{"test_crash2.dat", "test_crash2.idx", 8, 64};
+        REQUIRE(reopened.size() == 202);
+        REQUIRE(reopened.load_function("after").has_value());
+    }
+
+    SECTION("A record lost in the crash falls back to the version before it")
+    {
+        // Garble the last record ("fresh"): its checksum no longer matches, so the slot pointing
+        // at it cannot be trusted and the index is derived again from the data file
+        {
+            std::fstream data("test_crash.dat", std::ios::binary | std::ios::in | std::ios::out);
+            data.seekp(static_cast<std::streamoff>(valid_size) - 6);
+            data.put('\x7f');
+        }
+        FunDB::Database db{"test_crash.dat", "test_crash.idx", 8, 64};
+        REQUIRE(db.size() == 200);
+        REQUIRE_FALSE(db.load_function("fresh").has_value());
+        REQUIRE(FunDB::evaluate_stored_function(db, "w1", {{"x", 2.0}}) == Catch::Approx(6.0));
+        REQUIRE(std::filesystem::file_size("test_crash.dat") < valid_size);
+    }
+}
+
+// Test case 19: Test operation metrics, the latency histogram and the Prometheus rendering
+TEST_CASE("Operation metrics", "[Metrics]")
+{
+    // Every value falls in the bucket whose range contains it, and buckets stay within 12.5%
+    for (uint64_t ns : {0ull, 1ull, 15ull, 16ull, 17ull, 31ull, 32ull, 1000ull, 123456789ull})
+    {
+        size_t bucket = FunDB::LatencyHistogram::bucket_of(ns);
+        REQUIRE(FunDB::LatencyHistogram::bucket_end(bucket) > ns);
+        REQUIRE((bucket == 0 || FunDB::LatencyHistogram::bucket_end(bucket - 1) <= ns));
+        REQUIRE(FunDB::LatencyHistogram::bucket_end(bucket) - 1 - ns <= ns / 8);
+    }
+    FunDB::LatencyHistogram histogram;
+    for (uint64_t ns = 1; ns <= 1000; ++ns)
+    {
+        histogram.counts[FunDB::LatencyHistogram::bucket_of(ns)]++;
+        histogram.count++;
+        histogram.max_ns = ns;
+    }
+    REQUIRE(histogram.quantile(0.5) >= 500);
+    REQUIRE(histogram.quantile(0.5) <= 500 + 500 / 8);
+    REQUIRE(histogram.quantile(1.0) == 1000);
+    REQUIRE(histogram.count_at_most(15) == 15);
+
+    FunDB::Database db{"test_metrics.dat", "test_metrics.idx"};
+    db.clear();
+    for (int i = 0; i < 10; ++i)
+    {
+        db.save_function({"m" + std::to_string(i), {"x"}, SymEngine::Expression("x + " + std::to_string(i))});
+    }
+    // The first evaluation of each name misses the cache, the second hits it
+    for (int round = 0; round < 2; ++round)
+    {
+        for (int i = 0; i < 10; ++i)
+        {
+            REQUIRE(FunDB::evaluate_stored_function(db, "m" + std::to_string(i), {{"x", 1.0}}) == Catch::Approx(1.0 + i));
+        }
+    }
+    REQUIRE_FALSE(db.load_function("absent").has_value());
+
+    FunDB::DatabaseStats stats = db.stats();
+    REQUIRE(stats.entries == 10);
+    REQUIRE(stats.cache.hits == 10);
+    std::string text = FunDB::format_prometheus(stats);
+    REQUIRE(text.find("fundb_functions 10\n") != std::string::npos);
+    if (FunDB::Metrics::enabled)
+    {
+        auto count = [&stats](FunDB::Operation op)
+        { return stats.metrics.counts[static_cast<size_t>(op)]; };
+        REQUIRE(count(FunDB::Operation::Store) == 10);
+        REQUIRE(count(FunDB::Operation::Load) == 21);
+        // The name filter rules out the absent name before it is looked up in the index
+        REQUIRE(count(FunDB::Operation::Lookup) == 10);
+        REQUIRE(count(FunDB::Operation::Parse) == 10);
+        REQUIRE(count(FunDB::Operation::Evaluate) == 20);
+        uint64_t lookups = 0;
+        for (uint64_t n : stats.metrics.probe_lengths)
+        {
+            lookups += n;
+        }
+        REQUIRE(lookups == 10);
+        REQUIRE(stats.metrics.bytes_read > 0);
+        // Only a sample of the operations is timed
+        uint64_t timed = 0;
+        for (const auto &latencies : stats.metrics.operations)
+        {
+            timed += latencies.count;
+            REQUIRE(latencies.quantile(0.5) <= latencies.max_ns);
+        }
+        REQUIRE(timed > 0);
+        REQUIRE(timed < 71);
+        REQUIRE(text.find("fundb_operations_total{op=\"store\"} 10\n") != std::string::npos);
+        REQUIRE(text.find("fundb_lookup_probes_count 10\n") != std::string::npos);
+
+        // Each thread counts in its own block, and the blocks of threads that have exited still count
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; ++t)
+        {
+            threads.emplace_back([&db]()
+                                 {
+                                     for (int i = 0; i < 1000; ++i)
+                                     {
+                                         db.contains("m" + std::to_string(i % 10));
+                                     } });
+        }
+        for (auto &thread : threads)
+        {
+            thread.join();
+        }
+        REQUIRE(db.stats().metrics.counts[static_cast<size_t>(FunDB::Operation::Lookup)] == 4010);
+    }
+}
+
+// Test case 20: Test loading many functions at once and loading in the background
+TEST_CASE("Multi-get and asynchronous loads", "[Database]")
+{
+    {
+        FunDB::Database db{"test_many.dat", "test_many.idx", 16};
+        db.clear();
+        for (int i = 0; i < 100; ++i)
+        {
+            db.save_function({"g" + std::to_string(i), {"x"}, SymEngine::Expression("x * " + std::to_string(i))});
+        }
+    }
+
+    // A fresh database starts with a cold cache, so the batch is read from the data file
+    FunDB::Database db{"test_many.dat", "test_many.idx"};
+    REQUIRE(db.load_function("g7").has_value());
+    std::vector<std::string_view> names = {"g3", "absent", "g99", "g7", "g3"};
+    auto loaded = db.load_many(names);
+    REQUIRE(loaded.size() == names.size());
+    REQUIRE(loaded[0]->function.name == "g3");
+    REQUIRE(loaded[1] == nullptr);
+    REQUIRE(loaded[2]->get_compiled().evaluate({{"x", 2.0}}) == Catch::Approx(198.0));
+    REQUIRE(loaded[3]->function.name == "g7");
+    REQUIRE(loaded[4]->function.name == "g3");
+    REQUIRE(db.load_many({}).empty());
+
+    // Everything found is now cached
+    uint64_t hits = db.cache_stats().hits;
+    auto again = db.load_many({"g3", "g99", "g7"});
+    REQUIRE(db.cache_stats().hits == hits + 3);
+    REQUIRE(again[1] == loaded[2]);
+
+    // A name saved after it was cached is reloaded
+    db.save_function({"g99", {"x"}, SymEngine::Expression("x + 1")});
+    REQUIRE(db.load_many({"g99"})[0]->get_compiled().evaluate({{"x", 2.0}}) == Catch::Approx(3.0));
+
+    std::vector<std::string> all;
+    for (int i = 0; i < 100; ++i)
+    {
+        all.push_back("g" + std::to_string(i));
+    }
+    auto pending = db.load_many_async(all);
+    auto one = db.load_async("g42");
+    auto missing = db.load_async("absent");
+    auto everything = pending.get();
+    REQUIRE(everything.size() == 100);
+    for (int i = 0; i < 99; ++i)
+    {
+        REQUIRE(everything[i]->function.name == "g" + std::to_string(i));
+    }
+    REQUIRE(one.get()->get_compiled().evaluate({{"x", 1.0}}) == Catch::Approx(42.0));
+    REQUIRE(missing.get() == nullptr);
+}
+
+// Test case 21: Test routing, bulk loads and scans of a sharded database
+TEST_CASE("Sharded database", "[ShardedDatabase]")
+{
+    {
+        FunDB::ShardedDatabase db{"test_sharded", 4, 16};
+        db.clear();
+        std::vector<FunDB::Function> batch;
+        for (int i = 0; i < 1000; ++i)
+        {
+            batch.push_back({"s" + std::to_string(i), {"x"}, SymEngine::Expression("x + " + std::to_string(i))});
+        }
+        db.write_batch(batch);
+        REQUIRE(db.size() == 1000);
+        // Names spread over every shard, and each shard holds exactly the names routed to it
+        for (size_t i = 0; i < db.shard_count(); ++i)
+        {
+            REQUIRE(db.shard(i).size() > 150);
+        }
+        REQUIRE(db.shard(db.shard_of("s7")).contains("s7"));
+
+        // Concurrent writers to different shards
+        std::vector<std::thread> writers;
+        for (int t = 0; t < 4; ++t)
+        {
+            writers.emplace_back([&db, t]
+                                 {
+                                     for (int i = 0; i < 50; ++i)
+                                     {
+                                         db.save_function({"w" + std::to_string(t) + "_" + std::to_string(i), {"x"}, SymEngine::Expression("x")});
+                                     } });
+        }
+        for (auto &writer : writers)
+        {
+            writer.join();
+        }
+        REQUIRE(db.size() == 1200);
+        // Saved one at a time into small indexes, some shards are likely mid-resize here
+        REQUIRE(db.names().size() == 1200);
+    }
+
+    // Reopened with the same shard count, everything is found again
+    FunDB::ShardedDatabase db{"test_sharded", 4};
+    REQUIRE(db.size() == 1200);
+    REQUIRE(db.load_function("s999")->name == "s999");
+    REQUIRE(db.contains("w3_49"));
+    REQUIRE_FALSE(db.contains("absent"));
+    REQUIRE(FunDB::evaluate_stored_function(db.shard_for("s10"), "s10", {{"x", 1.0}}) == Catch::Approx(11.0));
+    auto loaded = db.load_many({"s5", "absent", "s500"});
+    REQUIRE(loaded[0]->function.name == "s5");
+    REQUIRE(loaded[1] == nullptr);
+    REQUIRE(loaded[2]->function.name == "s500");
+
+    REQUIRE(db.names().size() == 1200);
+    std::atomic<size_t> visited{0};
+    std::atomic<size_t> numbered{0};
+    db.for_each([&](const FunDB::Function &func)
+                {
+                    ++visited;
+                    if (func.name[0] == 's')
+                    {
+                        ++numbered;
+                    } });
+    REQUIRE(visited == 1200);
+    REQUIRE(numbered == 1000);
+
+    REQUIRE_THROWS_AS(FunDB::ShardedDatabase("test_sharded", 8), std::runtime_error);
+    db.clear();
+    REQUIRE(db.size() == 0);
+    REQUIRE(db.names().empty());
+}
+
+
+// Test case 22: Test that functions differing only in their coefficients share one stored template
+TEST_CASE("Parametric templates", "[Database][Codec]")
+{
+    // Coefficients of sums and products are taken out; exponents stay in the shape
+    FunDB::Function quadratic{"q", {"x", "y"}, SymEngine::Expression("3*x**2 + 5*y**2 - 2*x*y")};
+    FunDB::TemplateSplit split = FunDB::split_template(quadratic);
+    REQUIRE(split.parameters.size() == 3);
+    FunDB::Function other{"o", {"x", "y"}, SymEngine::Expression("7*x**2 + 1.5*y**2 + 4*x*y")};
+    REQUIRE(FunDB::split_template(other).shape.serialize() == split.shape.serialize());
+    FunDB::Function restored = FunDB::instantiate_template("q", split.shape, split.parameters);
+    REQUIRE(SymEngine::eq(*restored.expr.get_basic(), *quadratic.expr.get_basic()));
+    REQUIRE(FunDB::split_template(FunDB::Function{"s", {"x"}, SymEngine::Expression("sin(x)")}).parameters.empty());
+    REQUIRE(FunDB::parameter_index(std::string("\x01") + "3") == 3u);
+    REQUIRE_FALSE(FunDB::parameter_index(std::string("\x01") + "p"));
+    REQUIRE_FALSE(FunDB::parameter_index("3"));
+    // Symbols named like parameters are refused rather than stored as coefficients
+    REQUIRE_THROWS(FunDB::check_symbols({"r", {"x"}, SymEngine::Expression("2*x") + SymEngine::Expression(FunDB::parameter_symbol(0))}));
+    REQUIRE_THROWS(FunDB::check_symbols({"r", {std::string("\x01") + "p"}, SymEngine::Expression("1")}));
+    FunDB::check_symbols(quadratic);
+
+    {
+        FunDB::Database db("test_templates.dat", "test_templates.idx", 16);
+        db.clear();
+        // From 2 on, since a coefficient of 1 is no number in the expression and gives another shape
+        std::vector<FunDB::Function> batch;
+        for (int i = 2; i <= 101; ++i)
+        {
+            std::string a = std::to_string(i), b = std::to_string(i + 1);
+            batch.push_back({"poly" + a, {"x", "y"}, SymEngine::Expression(a + "*x**2 + " + b + "*y**2 + " + a + "*x*y")});
+        }
+        db.write_batch(batch);
+        db.save_function({"poly_single", {"x", "y"}, SymEngine::Expression("0.5*x**2 + 2*y**2 + 3*x*y")});
+        db.save_function({"plain", {"x"}, SymEngine::Expression("sin(x)")});
+
+        FunDB::DatabaseStats stats = db.stats();
+        REQUIRE(stats.entries == 102);
+        REQUIRE(stats.templates == 1);
+        REQUIRE(db.size() == 102);
+        REQUIRE(db.names().size() == 102);
+        REQUIRE(FunDB::format_prometheus(stats).find("fundb_templates 1") != std::string::npos);
+    }
+
+    // Reopened, functions load back to the expressions saved and evaluate through the shared shape
+    FunDB::Database db("test_templates.dat", "test_templates.idx", 16);
+    REQUIRE(db.stats().templates == 1);
+    std::optional<FunDB::Function> loaded = db.load_function("poly7");
+    REQUIRE(loaded);
+    REQUIRE(SymEngine::eq(*loaded->expr.get_basic(), *SymEngine::Expression("7*x**2 + 8*y**2 + 7*x*y").get_basic()));
+    REQUIRE(FunDB::evaluate_stored_function(db, "poly7", {{"x", 2.0}, {"y", 3.0}}) == Catch::Approx(28.0 + 72.0 + 42.0));
+    REQUIRE(FunDB::evaluate_stored_function(db, "poly_single", {{"x", 2.0}, {"y", 1.0}}) == Catch::Approx(2.0 + 2.0 + 6.0));
+    REQUIRE(FunDB::evaluate_stored_function(db, "plain", {{"x", 0.5}}) == Catch::Approx(std::sin(0.5)));
+    std::vector<double> xs{1.0, 2.0}, ys{0.0, 1.0}, out(2);
+    FunDB::evaluate_stored_batch(db, "poly3", {xs.data(), ys.data()}, out.data(), 2);
+    REQUIRE(out[0] == Catch::Approx(3.0));
+    REQUIRE(out[1] == Catch::Approx(12.0 + 4.0 + 6.0));
+
+    // Names that start with NUL are refused before anything is written, through the API and
+    // both protocols, so no store can repoint the slot of the shared template
+    std::string template_name("\0template:", 10);
+    const uint64_t template_id = FunDB::hash64(split.shape.serialize());
+    template_name.append(reinterpret_cast<const char *>(&template_id), sizeof(template_id));
+    const uint64_t data_bytes = db.stats().data_bytes;
+    REQUIRE_THROWS(db.save_function({template_name, {"x"}, SymEngine::Expression("x")}));
+    REQUIRE_THROWS(db.write_batch({{"fine", {"x"}, SymEngine::Expression("x")}, {template_name, {"x"}, SymEngine::Expression("x")}}));
+    FunDB::HttpRequest store;
+    store.method = "POST";
+    store.path = "/store";
+    store.body = R"({"name":"\u0000x","symbols":["x"],"expression":"x"})";
+    REQUIRE(FunDB::handle_request(db, store).status_line == "HTTP/1.1 400 Bad Request\r\n");
+    std::string payload, out;
+    FunDB::ByteWriter writer(payload);
+    writer.put_string(template_name);
+    writer.put<uint32_t>(1);
+    writer.put_string("x");
+    writer.put_string("x");
+    FunDB::handle_binary_request(db, {static_cast<uint8_t>(FunDB::WireOp::Store), 1, payload}, out);
+    FunDB::WireFrame response;
+    REQUIRE(FunDB::parse_wire_frame(out, response) == out.size());
+    REQUIRE(response.code == static_cast<uint8_t>(FunDB::WireStatus::Error));
+    REQUIRE(db.stats().data_bytes == data_bytes);
+    REQUIRE_FALSE(db.contains("fine"));
+    REQUIRE(db.stats().templates == 1);
+    REQUIRE(FunDB::evaluate_stored_function(db, "poly9", {{"x", 2.0}, {"y", 3.0}}) == Catch::Approx(36.0 + 90.0 + 54.0));
+
+    // Overwriting keeps the template; compaction keeps it while functions still use it
+    db.save_function({"poly7", {"x", "y"}, SymEngine::Expression("x**2 + y**2 + x*y")});
+    FunDB::CompactionStats compacted = db.compact();
+    REQUIRE(compacted.live_records == 103);
+    REQUIRE(db.stats().templates == 1);
+    REQUIRE(FunDB::evaluate_stored_function(db, "poly7", {{"x", 1.0}, {"y", 1.0}}) == Catch::Approx(3.0));
+    REQUIRE(db.load_function("poly50"));
+
+    // A shape whose last user was saved again with another shape is dropped by compaction
+    db.save_function({"lonely", {"x"}, SymEngine::Expression("3*sin(x) + 2")});
+    REQUIRE(db.stats().templates == 2);
+    db.save_function({"lonely", {"x"}, SymEngine::Expression("cos(x)")});
+    REQUIRE(db.stats().templates == 2);
+    compacted = db.compact();
+    REQUIRE(compacted.live_records == 104);
+    REQUIRE(db.stats().templates == 1);
+    REQUIRE(db.size() == 103);
+    REQUIRE(FunDB::evaluate_stored_function(db, "lonely", {{"x", 0.0}}) == Catch::Approx(1.0));
+    REQUIRE(FunDB::evaluate_stored_function(db, "poly50", {{"x", 1.0}, {"y", 0.0}}) == Catch::Approx(50.0));
+    db.clear();
+    REQUIRE(db.stats().templates == 0);
+}
+
+
+// Test case 23: Test sorted prefix and range scans over the names and how they survive reopening
+TEST_CASE("Sorted name scans", "[Database]")
+{
+    auto collect = [](FunDB::NameScan scan)
+    {
+        std::vector<std::string> names;
+        while (std::optional<std::string> name = scan.next())
+        {
+            names.push_back(*name);
+        }
+        return names;
+    };
+
+    {
+        FunDB::Database db{"test_scan.dat", "test_scan.idx"};
+        db.clear();
+        REQUIRE(collect(db.scan("")).empty());
+        for (const char *name : {"model_v3/b", "model_v2/a", "model_v3/a", "other", "model_v3/c/deep", "model_v4"})
+        {
+            db.save_function({name, {"x"}, SymEngine::Expression("x**2")});
+        }
+        // Saving a name again does not list it twice
+        db.save_function({"model_v3/a", {"x"}, SymEngine::Expression("x**3")});
+
+        REQUIRE(collect(db.scan_prefix("model_v3/")) == std::vector<std::string>{"model_v3/a", "model_v3/b", "model_v3/c/deep"});
+        REQUIRE(collect(db.scan("model_v2/a", std::string("model_v3/b"))) == std::vector<std::string>{"model_v2/a", "model_v3/a"});
+        REQUIRE(collect(db.scan("")).size() == 6);
+        REQUIRE(collect(db.scan_prefix("model_v3/", "model_v3/a")) == std::vector<std::string>{"model_v3/b", "model_v3/c/deep"});
+        REQUIRE(collect(db.scan_prefix("nothing")).empty());
+
+        // Enough new names to merge them into a new run, across several scan batches
+        std::vector<FunDB::Function> batch;
+        for (int i = 0; i < 5000; ++i)
+        {
+            char name[32];
+            std::snprintf(name, sizeof(name), "bulk/%05d", i);
+            batch.push_back({name, {"x"}, SymEngine::Expression("x")});
+        }
+        db.write_batch(batch);
+        std::vector<std::string> bulk = collect(db.scan_prefix("bulk/"));
+        REQUIRE(bulk.size() == 5000);
+        REQUIRE(std::is_sorted(bulk.begin(), bulk.end()));
+        REQUIRE(bulk.front() == "bulk/00000");
+        db.save_function({"late", {"x"}, SymEngine::Expression("x")});
+    }
+
+    // The run on disk plus the records after it give the same names again
+    {
+        FunDB::Database db{"test_scan.dat", "test_scan.idx"};
+        REQUIRE(collect(db.scan("")).size() == 5007);
+        REQUIRE(collect(db.scan_prefix("la")) == std::vector<std::string>{"late"});
+
+        FunDB::NameScan functions = db.scan_prefix("model_v3/");
+        std::shared_ptr<const FunDB::CachedFunction> first = functions.next_function();
+        REQUIRE(first->function.name == "model_v3/a");
+        REQUIRE(first->get_compiled().evaluate({{"x", 2.0}}) == Catch::Approx(8.0));
+        REQUIRE(functions.next_function()->function.name == "model_v3/b");
+        REQUIRE(functions.next_function()->function.name == "model_v3/c/deep");
+        REQUIRE(functions.next_function() == nullptr);
+
+        db.compact();
+        REQUIRE(collect(db.scan_prefix("model_")).size() == 5);
+    }
+
+    // A lost run is rebuilt from the index
+    std::filesystem::remove("test_scan.idx.names");
+    FunDB::Database db{"test_scan.dat", "test_scan.idx"};
+    REQUIRE(collect(db.scan("")).size() == 5007);
+    REQUIRE(collect(db.scan("bulk/04998")).size() == 2 + 7);
+    db.clear();
+    REQUIRE(collect(db.scan("")).empty());
+}
+
+
+// Test case 24: Test that the name filter rules out absent names and keeps up with saved ones
+TEST_CASE("Name filter for absent names", "[Database]")
+{
+    {
+        FunDB::Database db{"test_filter.dat", "test_filter.idx", 16};
+        db.clear();
+        // Enough names to outgrow the smallest filter several times over
+        std::vector<FunDB::Function> batch;
+        for (int i = 0; i < 3000; ++i)
+        {
+            batch.push_back({"present_" + std::to_string(i), {"x"}, SymEngine::Expression("x")});
+        }
+        db.write_batch(batch);
+        for (int i = 3000; i < 3100; ++i)
+        {
+            db.save_function({"present_" + std::to_string(i), {"x"}, SymEngine::Expression("x")});
+        }
+        // Every saved name passes, including through load_many
+        int found = 0;
+        for (int i = 0; i < 3100; ++i)
+        {
+            found += db.contains("present_" + std::to_string(i));
+        }
+        REQUIRE(found == 3100);
+        auto loaded = db.load_many({"present_5", "absent", "present_3050"});
+        REQUIRE(loaded[0]);
+        REQUIRE_FALSE(loaded[1]);
+        REQUIRE(loaded[2]);
+    }
+    REQUIRE(std::filesystem::exists("test_filter.idx.bloom"));
+
+    // Reopened, absent names mostly stop at the filter: far fewer index lookups than queries
+    {
+        FunDB::Database db{"test_filter.dat", "test_filter.idx", 16};
+        db.save_function({"after_reopen", {"x"}, SymEngine::Expression("x")});
+        REQUIRE(db.contains("after_reopen"));
+        REQUIRE(db.contains("present_3099"));
+        int absent = 0;
+        for (int i = 0; i < 1000; ++i)
+        {
+            absent += !db.load_function("absent_" + std::to_string(i)).has_value();
+        }
+        REQUIRE(absent == 1000);
+        if (FunDB::Metrics::enabled)
+        {
+            REQUIRE(db.stats().metrics.counts[static_cast<size_t>(FunDB::Operation::Lookup)] < 50);
+        }
+
+        // Compaction keeps the filter valid for the new data file
+        db.compact();
+        REQUIRE(db.contains("present_42"));
+    }
+
+    // A lost filter is rebuilt
+    std::filesystem::remove("test_filter.idx.bloom");
+    FunDB::Database reopened{"test_filter.dat", "test_filter.idx", 16};
+    REQUIRE(reopened.contains("after_reopen"));
+    REQUIRE(reopened.contains("present_0"));
+    REQUIRE_FALSE(reopened.contains("absent"));
+}
+
+
+// Test case 25: Test freezing a database into an immutable snapshot and serving reads from it
+TEST_CASE("Frozen snapshots", "[Snapshot]")
+{
+    {
+        FunDB::Database db{"test_freeze.dat", "test_freeze.idx"};
+        db.clear();
+        std::vector<FunDB::Function> batch;
+        for (int i = 0; i < 2000; ++i)
+        {
+            // Templated functions sharing one shape, next to plain ones
+            batch.push_back({"poly/" + std::to_string(i), {"x", "y"}, SymEngine::Expression(std::to_string(i + 2) + "*x**2 + y")});
+            batch.push_back({"plain/" + std::to_string(i), {"x"}, SymEngine::Expression("x + " + std::to_string(i))});
+        }
+        db.write_batch(batch);
+        // Only the latest version of a name is frozen
+        db.save_function({"plain/7", {"x"}, SymEngine::Expression("x**3")});
+
+        FunDB::FreezeStats stats = db.freeze("test_freeze.snap");
+        REQUIRE(stats.functions == 4000);
+        REQUIRE(stats.precompiled == 4000);
+        REQUIRE(stats.image_bytes == std::filesystem::file_size("test_freeze.snap"));
+    }
+
+    {
+        std::unique_ptr<FunDB::Database> snapshot = FunDB::Database::open_snapshot("test_freeze.snap", 64, true);
+        REQUIRE(snapshot->is_snapshot());
+        REQUIRE(snapshot->size() == 4000);
+        int found = 0;
+        for (int i = 0; i < 2000; ++i)
+        {
+            found += snapshot->contains("poly/" + std::to_string(i));
+            found += snapshot->contains("plain/" + std::to_string(i));
+            found += snapshot->contains("absent/" + std::to_string(i));
+        }
+        REQUIRE(found == 4000);
+        REQUIRE(FunDB::evaluate_stored_function(*snapshot, "poly/10", {{"x", 2.0}, {"y", 1.0}}) == Catch::Approx(49.0));
+        REQUIRE(FunDB::evaluate_stored_function(*snapshot, "plain/7", {{"x", 2.0}}) == Catch::Approx(8.0));
+        REQUIRE(FunDB::evaluate_stored_function(*snapshot, "plain/1999", {{"x", 1.0}}) == Catch::Approx(2000.0));
+        REQUIRE(snapshot->load_function("poly/3")->symbols == std::vector<std::string>{"x", "y"});
+        REQUIRE_FALSE(snapshot->load_function("absent").has_value());
+        auto loaded = snapshot->load_many({"plain/5", "absent", "poly/5"});
+        REQUIRE(loaded[0]->function.name == "plain/5");
+        REQUIRE_FALSE(loaded[1]);
+        REQUIRE(loaded[2]->get_compiled().evaluate({{"x", 1.0}, {"y", 0.0}}) == Catch::Approx(7.0));
+
+        // Records are kept in name order, so scans need no other index
+        std::vector<std::string> names;
+        FunDB::NameScan scan = snapshot->scan_prefix("plain/1");
+        while (std::optional<std::string> name = scan.next())
+        {
+            names.push_back(*name);
+        }
+        REQUIRE(names.size() == 1111);
+        REQUIRE(std::is_sorted(names.begin(), names.end()));
+        REQUIRE(snapshot->names().size() == 4000);
+        REQUIRE(snapshot->names_in_range("poly/999", std::nullopt, 10) == std::vector<std::string>{"poly/999"});
+
+        REQUIRE_THROWS_AS(snapshot->save_function({"new", {"x"}, SymEngine::Expression("x")}), std::runtime_error);
+        REQUIRE_THROWS_AS(snapshot->clear(), std::runtime_error);
+        REQUIRE(snapshot->stats().entries == 4000);
+    }
+
+    // A damaged record is caught by the checksum, a damaged header on every open
+    {
+        std::filesystem::copy_file("test_freeze.snap", "test_freeze_bad.snap", std::filesystem::copy_options::overwrite_existing);
+        std::fstream image("test_freeze_bad.snap", std::ios::binary | std::ios::in | std::ios::out);
+        image.seekp(100);
+        image.put('\x7f');
+    }
+    REQUIRE_THROWS_AS(FunDB::Database::open_snapshot("test_freeze_bad.snap", 64, true), std::runtime_error);
+    {
+        std::fstream image("test_freeze_bad.snap", std::ios::binary | std::ios::in | std::ios::out);
+        image.seekp(20);
+        image.put('\x7f');
+    }
+    REQUIRE_THROWS_AS(FunDB::Database::open_snapshot("test_freeze_bad.snap"), std::runtime_error);
+    REQUIRE_THROWS_AS(FunDB::Database::open_snapshot("test_missing.snap"), std::runtime_error);
+    REQUIRE_FALSE(std::filesystem::exists("test_missing.snap"));
+
+    // Images are opened without write access, so they can be read-only files
+    const auto read_only = std::filesystem::perms::owner_read | std::filesystem::perms::group_read | std::filesystem::perms::others_read;
+    std::filesystem::permissions("test_freeze.snap", read_only);
+    {
+        std::unique_ptr<FunDB::Database> snapshot = FunDB::Database::open_snapshot("test_freeze.snap", 64, true);
+        REQUIRE(snapshot->size() == 4000);
+        REQUIRE(FunDB::evaluate_stored_function(*snapshot, "plain/7", {{"x", 2.0}}) == Catch::Approx(8.0));
+    }
+    std::filesystem::permissions("test_freeze.snap", read_only | std::filesystem::perms::owner_write);
+
+    // An empty database freezes into an empty image
+    {
+        FunDB::Database db{"test_freeze.dat", "test_freeze.idx"};
+        db.clear();
+        REQUIRE(db.freeze("test_freeze.snap").functions == 0);
+    }
+    std::unique_ptr<FunDB::Database> empty = FunDB::Database::open_snapshot("test_freeze.snap");
+    REQUIRE(empty->size() == 0);
+    REQUIRE_FALSE(empty->contains("anything"));
+    REQUIRE(empty->names().empty());
+
+    // Compiled programs survive the round trip, and malformed ones are refused
+    FunDB::CompiledFunction compiled(FunDB::Function{"f", {"x", "y"}, SymEngine::Expression("x**2 - 3*y")});
+    std::optional<std::string> bytes = compiled.encode();
+    REQUIRE(bytes.has_value());
+    FunDB::CompiledFunction decoded = FunDB::CompiledFunction::decode(*bytes);
+    REQUIRE(decoded.get_symbols() == compiled.get_symbols());
+    REQUIRE(decoded.evaluate({{"x", 3.0}, {"y", 1.0}}) == Catch::Approx(6.0));
+    REQUIRE_THROWS_AS(FunDB::CompiledFunction::decode(bytes->substr(0, bytes->size() - 1)), std::runtime_error);
+    REQUIRE_THROWS_AS(FunDB::CompiledFunction::decode("\x01garbage"), std::runtime_error);
+}
+
+// Test case 26: Test evaluating a function's value and gradient in one pass
+TEST_CASE("Value and gradient", "[CompiledFunction]")
+{
+    // f = x^3 y - 2 x / y + 5, so df/dx = 3 x^2 y - 2 / y and df/dy = x^3 + 2 x / y^2
+    FunDB::Function poly{"poly", {"x", "y"}, SymEngine::Expression("x**3*y - 2*x/y + 5")};
+    FunDB::ValueGradient result = poly.evaluate_with_gradient({{"x", 2.0}, {"y", 4.0}});
+    REQUIRE(result.value == Catch::Approx(36.0));
+    REQUIRE(result.gradient.size() == 2);
+    REQUIRE(result.gradient[0] == Catch::Approx(47.5));
+    REQUIRE(result.gradient[1] == Catch::Approx(8.25));
+
+    // Elementary functions and a variable exponent
+    const double x = 0.7, y = 1.3;
+    FunDB::CompiledFunction mixed(FunDB::Function{"mixed", {"x", "y"}, SymEngine::Expression("sin(x)*exp(y) + log(x*y) + sqrt(y) + x**y")});
+    double gradient[2];
+    const double args[] = {x, y};
+    REQUIRE(mixed.evaluate_with_gradient(args, gradient) == Catch::Approx(mixed.evaluate(args)));
+    REQUIRE(gradient[0] == Catch::Approx(std::cos(x) * std::exp(y) + 1 / x + y * std::pow(x, y - 1)));
+    REQUIRE(gradient[1] == Catch::Approx(std::sin(x) * std::exp(y) + 1 / y + 0.5 / std::sqrt(y) + std::pow(x, y) * std::log(x)));
+
+    // A constant exponent does not take the log of a negative base
+    FunDB::Function square{"square", {"x"}, SymEngine::Expression("x**2")};
+    result = square.evaluate_with_gradient({{"x", -3.0}});
+    REQUIRE(result.value == Catch::Approx(9.0));
+    REQUIRE(result.gradient[0] == Catch::Approx(-6.0));
+
+    // Stored functions, including ones that share a template
+    FunDB::Database db{"test_gradient.dat", "test_gradient.idx"};
+    db.clear();
+    db.save_function({"a", {"x", "y"}, SymEngine::Expression("3*x + x*y")});
+    db.save_function({"b", {"x", "y"}, SymEngine::Expression("5*x + x*y")});
+    result = FunDB::evaluate_stored_gradient(db, "b", {{"x", 2.0}, {"y", 3.0}});
+    REQUIRE(result.value == Catch::Approx(16.0));
+    REQUIRE(result.gradient[0] == Catch::Approx(8.0));
+    REQUIRE(result.gradient[1] == Catch::Approx(2.0));
+    REQUIRE_THROWS_AS(FunDB::evaluate_stored_gradient(db, "a", {{"x", 2.0}}), std::runtime_error);
+    REQUIRE_THROWS_AS(FunDB::evaluate_stored_gradient(db, "missing", {{"x", 2.0}}), std::runtime_error);
+}
+
+// Test case 27: Test optimizing functions as they are stored
+TEST_CASE("Store-time optimization", "[CompiledFunction][Database]")
+{
+    // Optimized programs give the same values, batches and gradients as the expressions as written
+    const std::vector<std::string> expressions = {
+        "3*x**4*y + 2*x**3 - 5*x**2*y**2 + x*y - 7",
+        "sin(x*y) + cos(x*y) + (x*y)**2 + sqrt(x*y + 1)",
+        "x**-3 + y**2/x**2 - (x + y)**5",
+        "exp(x)*x**2 + exp(x)*y + x**2.5",
+    };
+    const double points[][2] = {{0.7, 1.3}, {-1.5, 0.25}, {2.0, -0.5}};
+    for (const auto &text : expressions)
+    {
+        const FunDB::Function func{"f", {"x", "y"}, SymEngine::Expression(text)};
+        const FunDB::CompiledFunction plain(func);
+        const FunDB::CompiledFunction optimized(func, true);
+        for (const auto &point : points)
+        {
+            if (text.find("2.5") != std::string::npos && point[0] < 0)
+            {
+                continue;
+            }
+            double plain_gradient[2], optimized_gradient[2];
+            REQUIRE(optimized.evaluate(point) == Catch::Approx(plain.evaluate(point)));
+            REQUIRE(optimized.evaluate_with_gradient(point, optimized_gradient) == Catch::Approx(plain.evaluate(point)));
+            plain.evaluate_with_gradient(point, plain_gradient);
+            REQUIRE(optimized_gradient[0] == Catch::Approx(plain_gradient[0]));
+            REQUIRE(optimized_gradient[1] == Catch::Approx(plain_gradient[1]));
+        }
+        std::vector<double> xs(1000), ys(1000), plain_out(1000), optimized_out(1000);
+        for (size_t i = 0; i < xs.size(); ++i)
+        {
+            xs[i] = 0.5 + i * 0.001;
+            ys[i] = 1.0 - i * 0.0005;
+        }
+        plain.evaluate_batch({xs.data(), ys.data()}, plain_out.data(), xs.size());
+        optimized.evaluate_batch({xs.data(), ys.data()}, optimized_out.data(), xs.size());
+        size_t mismatches = 0;
+        for (size_t i = 0; i < xs.size(); ++i)
+        {
+            mismatches += !(optimized_out[i] == Catch::Approx(plain_out[i]));
+        }
+        REQUIRE(mismatches == 0);
+
+        // Locals and multiplied-out powers survive encoding
+        FunDB::CompiledFunction decoded = FunDB::CompiledFunction::decode(*optimized.encode());
+        REQUIRE(decoded.evaluate(points[0]) == Catch::Approx(plain.evaluate(points[0])));
+    }
+
+    // Horner form and multiplied-out powers make a shorter program
+    const FunDB::Function poly{"poly", {"x", "y"}, SymEngine::Expression("x**5*y + 2*x**4*y + 3*x**3*y + 4*x**2*y + 5*x*y")};
+    REQUIRE(FunDB::CompiledFunction(poly, true).encode()->size() < FunDB::CompiledFunction(poly).encode()->size());
+
+    FunDB::Database db{"test_optimize.dat", "test_optimize.idx"};
+    db.clear();
+    // A shape stored before optimization is turned on is still shared afterwards
+    db.save_function({"before", {"x", "y"}, SymEngine::Expression("2*x**2 + 3*x*y")});
+    db.set_optimize_on_store(true);
+    db.save_function({"after", {"x", "y"}, SymEngine::Expression("4*x**2 + 5*x*y")});
+    db.save_function({"cubic", {"x"}, SymEngine::Expression("7*x**3 - 2*x**2 + x - 1")});
+    db.write_batch({{"plain", {"x", "y"}, SymEngine::Expression("x**3*y + x*y**2 + (x*y)**2")},
+                    {"special", {"x"}, SymEngine::Expression("x**2 + gamma(x)")}});
+    REQUIRE(db.stats().templates == 2);
+
+    // load_function returns the expressions as saved
+    REQUIRE(db.load_function("after")->expr == SymEngine::Expression("4*x**2 + 5*x*y"));
+    REQUIRE(db.load_function("plain")->expr == SymEngine::Expression("x**3*y + x*y**2 + (x*y)**2"));
+    REQUIRE(db.load_function("special").has_value());
+    REQUIRE(FunDB::evaluate_stored_function(db, "after", {{"x", 2.0}, {"y", 3.0}}) == Catch::Approx(46.0));
+    REQUIRE(FunDB::evaluate_stored_function(db, "cubic", {{"x", 2.0}}) == Catch::Approx(49.0));
+    REQUIRE(FunDB::evaluate_stored_function(db, "plain", {{"x", 2.0}, {"y", 3.0}}) == Catch::Approx(78.0));
+
+    // Stored programs are read back after a reopen and carried into snapshots
+    db.set_optimize_on_store(false);
+    REQUIRE(db.freeze("test_optimize.snap").precompiled >= 3);
+    {
+        FunDB::Database reopened{"test_optimize.dat", "test_optimize.idx"};
+        REQUIRE(FunDB::evaluate_stored_function(reopened, "plain", {{"x", 2.0}, {"y", 3.0}}) == Catch::Approx(78.0));
+        REQUIRE(FunDB::evaluate_stored_gradient(reopened, "cubic", {{"x", 2.0}}).gradient[0] == Catch::Approx(77.0));
+        REQUIRE(reopened.load_function("cubic")->expr == SymEngine::Expression("7*x**3 - 2*x**2 + x - 1"));
+    }
+    std::unique_ptr<FunDB::Database> snapshot = FunDB::Database::open_snapshot("test_optimize.snap", 64, true);
+    REQUIRE(FunDB::evaluate_stored_function(*snapshot, "after", {{"x", 2.0}, {"y", 3.0}}) == Catch::Approx(46.0));
+    REQUIRE(snapshot->load_function("plain")->expr == SymEngine::Expression("x**3*y + x*y**2 + (x*y)**2"));
+
+    // Optimized records are framed like any other; a truncated one is refused
+    const std::string wrapped = FunDB::encode_optimized(poly.serialize(), *FunDB::CompiledFunction(poly, true).encode());
+    REQUIRE(FunDB::split_optimized(wrapped).payload == poly.serialize());
+    REQUIRE(FunDB::decode_function("poly", wrapped).expr == poly.expr);
+    REQUIRE_THROWS_AS(FunDB::split_optimized(wrapped.substr(0, 6)), std::runtime_error);
+}
+
+// An HTTP/1.1 request with its body framed by Content-Length
+static std::string http_request(const std::string &method, const std::string &path, const std::string &body, const std::string &headers = "")
+{
+    return method + " " + path + " HTTP/1.1\r\nHost: fundb\r\n" + headers + "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body;
+}
+
+// The Content-Length framed responses in `output`, in order, as (status line and headers, body) pairs
+static std::vector<std::pair<std::string, std::string>> http_responses(const std::string &output)
+{
+    std::vector<std::pair<std::string, std::string>> responses;
+    size_t offset = 0;
+    while (offset < output.size())
+    {
+        size_t header_end = output.find("\r\n\r\n", offset);
+        REQUIRE(header_end != std::string::npos);
+        std::string head = output.substr(offset, header_end - offset);
+        size_t length_at = head.find("Content-Length: ");
+        REQUIRE(length_at != std::string::npos);
+        size_t length = std::stoul(head.substr(length_at + 16));
+        responses.emplace_back(head, output.substr(header_end + 4, length));
+        offset = header_end + 4 + length;
+    }
+    return responses;
+}
+
+// Test case 28: Test the server's HTTP request framing on an in-memory connection
+TEST_CASE("HTTP request framing", "[Server]")
+{
+    FunDB::Database db{"test_http.dat", "test_http.idx"};
+    db.clear();
+
+    // A body larger than one read waits for the rest of its Content-Length
+    const std::string large = http_request("POST", "/store", R"({"name":"f","symbols":["x"],"expression":"2*x + 1"})" + std::string(8000, ' '));
+    FunDB::Connection conn;
+    conn.input = large.substr(0, 4000);
+    REQUIRE_FALSE(FunDB::process_input(db, conn));
+    REQUIRE(conn.output.empty());
+    REQUIRE(conn.input.size() == 4000);
+    conn.input += large.substr(4000);
+    REQUIRE(FunDB::process_input(db, conn));
+    REQUIRE(conn.input.empty());
+    auto responses = http_responses(conn.output);
+    REQUIRE(responses.size() == 1);
+    REQUIRE(responses[0].first.rfind("HTTP/1.1 201 Created\r\n", 0) == 0);
+    REQUIRE(db.load_function("f").has_value());
+
+    // Pipelined keep-alive requests are answered in order, up to a request that is still arriving
+    conn = FunDB::Connection();
+    const std::string partial = http_request("POST", "/evaluate", R"({"name":"f","values":{"x":1}})");
+    conn.input = http_request("POST", "/evaluate", R"({"name":"f","values":{"x":3}})") +
+                 http_request("GET", "/load/f", "") +
+                 http_request("GET", "/load/missing", "") +
+                 partial.substr(0, partial.size() - 5);
+    REQUIRE(FunDB::process_input(db, conn));
+    REQUIRE(conn.input == partial.substr(0, partial.size() - 5));
+    conn.input += partial.substr(partial.size() - 5);
+    REQUIRE(FunDB::process_input(db, conn));
+    REQUIRE_FALSE(conn.close_after_write);
+    responses = http_responses(conn.output);
+    REQUIRE(responses.size() == 4);
+    REQUIRE(responses[0].first.find("Connection: keep-alive") != std::string::npos);
+    REQUIRE(nlohmann::json::parse(responses[0].second)["result"].get<double>() == Catch::Approx(7.0));
+    REQUIRE(nlohmann::json::parse(responses[1].second)["name"] == "f");
+    REQUIRE(responses[2].first.rfind("HTTP/1.1 404 Not Found\r\n", 0) == 0);
+    REQUIRE(nlohmann::json::parse(responses[3].second)["result"].get<double>() == Catch::Approx(3.0));
+
+    // Connection: close answers that request and leaves the rest unread
+    conn = FunDB::Connection();
+    conn.input = http_request("GET", "/load/f", "", "Connection: close\r\n") + http_request("GET", "/load/f", "");
+    FunDB::process_input(db, conn);
+    REQUIRE(conn.close_after_write);
+    responses = http_responses(conn.output);
+    REQUIRE(responses.size() == 1);
+    REQUIRE(responses[0].first.find("Connection: close") != std::string::npos);
+
+    // Framing errors are answered and close the connection
+    const std::pair<std::string, std::string> invalid[] = {
+        {"POST /store HTTP/1.1\r\nContent-Length: 12x\r\n\r\n", "HTTP/1.1 400 Bad Request\r\n"},
+        {"POST /store HTTP/1.1\r\nContent-Length: 99999999999999999999\r\n\r\n", "HTTP/1.1 400 Bad Request\r\n"},
+        {"POST /store HTTP/1.1\r\nContent-Length: " + std::to_string(FunDB::MAX_BODY_BYTES + 1) + "\r\n\r\n", "HTTP/1.1 413 Payload Too Large\r\n"},
+        {"POST /store HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n5\r\nhello\r\n0\r\n\r\n", "HTTP/1.1 501 Not Implemented\r\n"},
+        {"NONSENSE\r\n\r\n", "HTTP/1.1 400 Bad Request\r\n"},
+    };
+    for (const auto &[request, status] : invalid)
+    {
+        conn = FunDB::Connection();
+        conn.input = request + http_request("GET", "/load/f", "");
+        REQUIRE(FunDB::process_input(db, conn));
+        REQUIRE(conn.close_after_write);
+        responses = http_responses(conn.output);
+        REQUIRE(responses.size() == 1);
+        REQUIRE(responses[0].first.rfind(status, 0) == 0);
+    }
+
+    // Headers that never end are refused once they pass MAX_HEADER_BYTES
+    conn = FunDB::Connection();
+    conn.input = "GET /load/f HTTP/1.1\r\nX-Padding: " + std::string(FunDB::MAX_HEADER_BYTES, 'a');
+    REQUIRE(FunDB::process_input(db, conn));
+    REQUIRE(http_responses(conn.output)[0].first.rfind("HTTP/1.1 431 ", 0) == 0);
+}
+
+// One chunk of a chunked response body
+static std::string http_chunk(const std::string &data)
+{
+    std::ostringstream size;
+    size << std::hex << data.size();
+    return size.str() + "\r\n" + data + "\r\n";
+}
+
+// Test case 29: Test streaming /evaluate_batch, checking the chunked response byte for byte
+TEST_CASE("Streamed batch evaluation", "[Server]")
+{
+    FunDB::Database db{"test_stream.dat", "test_stream.idx"};
+    db.clear();
+    db.save_function({"f", {"x"}, SymEngine::Expression("2*x + 1")});
+    const std::string head = "HTTP/1.1 200 OK\r\nContent-Type: application/x-ndjson\r\nTransfer-Encoding: chunked\r\n";
+    const std::string ndjson = "Content-Type: application/x-ndjson\r\n";
+
+    // NDJSON split across reads: each read answers the lines it completes, and the last line
+    // needs no newline
+    const std::string body = "{\"x\":1}\n{\"x\":2}\nnot json\n{\"name\":\"missing\",\"values\":{\"x\":1}}\n{\"x\":\"a\"}\n\n{\"x\":3}";
+    const std::string request = http_request("POST", "/evaluate_batch?name=f", body, ndjson);
+    const size_t body_start = request.size() - body.size();
+    FunDB::Connection conn;
+    conn.input = request.substr(0, body_start + 5);
+    REQUIRE(FunDB::process_input(db, conn));
+    REQUIRE(conn.batch.has_value());
+    REQUIRE(conn.input == "{\"x\":");
+    std::string expected = head + "Connection: keep-alive\r\n\r\n";
+    REQUIRE(conn.output == expected);
+
+    conn.input += request.substr(body_start + 5, 7);
+    REQUIRE(FunDB::process_input(db, conn));
+    expected += http_chunk("{\"result\":3.0}\n");
+    REQUIRE(conn.output == expected);
+    REQUIRE(conn.input == "{\"x\"");
+
+    // The rest of the body, followed by a pipelined request on the same connection
+    conn.input += request.substr(body_start + 12) + http_request("GET", "/load/missing", "");
+    REQUIRE(FunDB::process_input(db, conn));
+    REQUIRE_FALSE(conn.batch.has_value());
+    REQUIRE_FALSE(conn.close_after_write);
+    REQUIRE(conn.input.empty());
+    expected += http_chunk("{\"result\":5.0}\n"
+                           "{\"error\":\"Invalid JSON line.\"}\n"
+                           "{\"error\":\"Function 'missing' not found in database.\"}\n"
+                           "{\"error\":\"Invalid value format. Values must be numbers.\"}\n"
+                           "{\"result\":7.0}\n") +
+                "0\r\n\r\n";
+    REQUIRE(conn.output.substr(0, expected.size()) == expected);
+    REQUIRE(conn.output.substr(expected.size()).rfind("HTTP/1.1 404 Not Found\r\n", 0) == 0);
+
+    // Without ?name=, only (name, values) items can be evaluated
+    conn = FunDB::Connection();
+    conn.input = http_request("POST", "/evaluate_batch", "{\"name\":\"f\",\"values\":{\"x\":0}}\n{\"x\":1}\n", ndjson + "Connection: close\r\n");
+    REQUIRE(FunDB::process_input(db, conn));
+    REQUIRE(conn.close_after_write);
+    REQUIRE(conn.output == head + "Connection: close\r\n\r\n" +
+                               http_chunk("{\"result\":1.0}\n"
+                                          "{\"error\":\"Missing 'name': pass ?name= or send {\\\"name\\\", \\\"values\\\"} items.\"}\n") +
+                               "0\r\n\r\n");
+
+    // A JSON body is parsed up front and streamed the same way
+    conn = FunDB::Connection();
+    conn.input = http_request("POST", "/evaluate_batch", R"({"items":[{"name":"f","values":{"x":4}},{"name":"f"}]})");
+    REQUIRE(FunDB::process_input(db, conn));
+    REQUIRE(conn.output == head + "Connection: keep-alive\r\n\r\n" +
+                               http_chunk("{\"result\":9.0}\n{\"error\":\"Missing 'name' or 'values'.\"}\n") + "0\r\n\r\n");
+
+    // A line longer than MAX_LINE_BYTES ends the batch and the connection, since the rest of the
+    // body cannot be framed
+    conn = FunDB::Connection();
+    const std::string long_request = http_request("POST", "/evaluate_batch?name=f", std::string(FunDB::MAX_LINE_BYTES + 100, 'a'), ndjson);
+    conn.input = long_request.substr(0, long_request.size() - 50);
+    REQUIRE(FunDB::process_input(db, conn));
+    REQUIRE(conn.close_after_write);
+    REQUIRE_FALSE(conn.batch.has_value());
+    REQUIRE(conn.output == head + "Connection: keep-alive\r\n\r\n" + http_chunk("{\"error\":\"NDJSON line is too long.\"}\n") + "0\r\n\r\n");
+
+    // The functions a batch has looked up are dropped once MAX_BATCH_FUNCTIONS names are held
+    conn = FunDB::Connection();
+    conn.input = "POST /evaluate_batch?name=f HTTP/1.1\r\nContent-Type: application/x-ndjson\r\nContent-Length: 1000000\r\n\r\n{\"x\":1}\n";
+    for (size_t i = 1; i < FunDB::MAX_BATCH_FUNCTIONS; ++i)
+    {
+        conn.input += "{\"name\":\"m" + std::to_string(i) + "\",\"values\":{}}\n";
+    }
+    REQUIRE(FunDB::process_input(db, conn));
+    REQUIRE(conn.batch->functions.size() == FunDB::MAX_BATCH_FUNCTIONS);
+    conn.output.clear();
+    conn.input += "{\"name\":\"another\",\"values\":{}}\n";
+    REQUIRE(FunDB::process_input(db, conn));
+    REQUIRE(conn.batch->functions.size() == 1);
+    conn.output.clear();
+    conn.input += "{\"x\":2}\n";
+    REQUIRE(FunDB::process_input(db, conn));
+    REQUIRE(conn.batch->functions.size() == 2);
+    REQUIRE(conn.output == http_chunk("{\"result\":5.0}\n"));
+}
+
+// An EvaluateBatch request for `name` claiming `rows` rows of `columns` columns, followed by `values`
+static FunDB::WireFrame batch_frame(std::string &payload, const std::string &name, uint32_t rows, uint32_t columns, const std::vector<double> &values)
+{
+    payload.clear();
+    FunDB::ByteWriter writer(payload);
+    writer.put_string(name);
+    writer.put<uint32_t>(rows);
+    writer.put<uint32_t>(columns);
+    for (double value : values)
+    {
+        writer.put<double>(value);
+    }
+    return {static_cast<uint8_t>(FunDB::WireOp::EvaluateBatch), 1, payload};
+}
+
+// Test case 30: Test batch requests over the binary protocol, including ones that overstate their size
+TEST_CASE("Binary protocol batch requests", "[Server][Wire]")
+{
+    FunDB::Database db{"test_binary.dat", "test_binary.idx"};
+    db.clear();
+    db.save_function({"f", {"x", "y"}, SymEngine::Expression("x + 10*y")});
+    db.save_function({"constant", {}, SymEngine::Expression("4")});
+
+    std::string payload, out;
+    FunDB::WireFrame response;
+    auto answer = [&](const FunDB::WireFrame &request)
+    {
+        out.clear();
+        FunDB::handle_binary_request(db, request, out);
+        REQUIRE(FunDB::parse_wire_frame(out, response) == out.size());
+        return static_cast<FunDB::WireStatus>(response.code);
+    };
+
+    // Two rows, sent column by column
+    REQUIRE(answer(batch_frame(payload, "f", 2, 2, {1, 2, 3, 4})) == FunDB::WireStatus::Ok);
+    FunDB::ByteReader results(response.payload);
+    REQUIRE(results.get<double>() == Catch::Approx(31.0));
+    REQUIRE(results.get<double>() == Catch::Approx(42.0));
+    REQUIRE(results.at_end());
+
+    // Row counts the payload does not hold are refused before anything is allocated for them
+    REQUIRE(answer(batch_frame(payload, "f", 3, 2, {1, 2, 3, 4})) == FunDB::WireStatus::Error);
+    REQUIRE(FunDB::ByteReader(response.payload).get_string() == "Malformed request.");
+    REQUIRE(answer(batch_frame(payload, "f", 8000000, 2, {1, 2})) == FunDB::WireStatus::Error);
+    REQUIRE(FunDB::ByteReader(response.payload).get_string() == "Malformed request.");
+    REQUIRE(answer(batch_frame(payload, "f", 0xFFFFFFFF, 2, {1, 2})) == FunDB::WireStatus::Error);
+    REQUIRE(FunDB::ByteReader(response.payload).get_string() == "Too many rows: 4294967295.");
+    // With no columns the payload bounds nothing, but the results must still fit in a frame
+    REQUIRE(answer(batch_frame(payload, "constant", 0xFFFFFFFF, 0, {})) == FunDB::WireStatus::Error);
+    REQUIRE(FunDB::ByteReader(response.payload).get_string() == "Too many rows: 4294967295.");
+    REQUIRE(answer(batch_frame(payload, "constant", 3, 0, {})) == FunDB::WireStatus::Ok);
+    REQUIRE(response.payload.size() == 3 * sizeof(double));
+
+    // A refused request does not end the connection
+    FunDB::Connection conn;
+    conn.binary = true;
+    FunDB::append_wire_frame(conn.input, static_cast<uint8_t>(FunDB::WireOp::EvaluateBatch), 1, batch_frame(payload, "f", 0xFFFFFFFF, 2, {}).payload);
+    FunDB::append_wire_frame(conn.input, static_cast<uint8_t>(FunDB::WireOp::EvaluateBatch), 2, batch_frame(payload, "f", 1, 2, {5, 6}).payload);
+    REQUIRE(FunDB::process_input(db, conn));
+    REQUIRE_FALSE(conn.close_after_write);
+    REQUIRE(conn.input.empty());
+    size_t first = FunDB::parse_wire_frame(conn.output, response);
+    REQUIRE(response.code == static_cast<uint8_t>(FunDB::WireStatus::Error));
+    REQUIRE(FunDB::parse_wire_frame(std::string_view(conn.output).substr(first), response) == conn.output.size() - first);
+    REQUIRE(response.id == 2);
+    REQUIRE(FunDB::ByteReader(response.payload).get<double>() == Catch::Approx(65.0));
+}
+
+// Test case 31: Test that appending to a mapped file reuses its reserved mapping
+TEST_CASE("Mapped file growth", "[MappedFile]")
+{
+    std::filesystem::remove("test_mapped.bin");
+    FunDB::MappedFile file("test_mapped.bin", false);
+    REQUIRE(file.size() == 0);
+    const std::string record(100, 'r');
+    REQUIRE(file.append(record.data(), record.size()) == 0);
+    const char *mapping = file.data();
+    REQUIRE(mapping != nullptr);
+
+    // Appends within the reservation show up in the same mapping
+    size_t misplaced = 0;
+    for (size_t i = 1; i < 1000; ++i)
+    {
+        misplaced += file.write_at_end(&i, sizeof(i)) != 100 + (i - 1) * sizeof(i);
+        file.remap();
+    }
+    REQUIRE(misplaced == 0);
+    REQUIRE(file.data() == mapping);
+    REQUIRE(file.size() == 100 + 999 * sizeof(size_t));
+    size_t last;
+    std::memcpy(&last, file.data() + file.size() - sizeof(last), sizeof(last));
+    REQUIRE(last == 999);
+
+    // Outgrowing it maps the file afresh, with everything written so far
+    const std::string large(3 * 1024 * 1024, 'l');
+    const uint64_t large_offset = file.append(large.data(), large.size());
+    REQUIRE(file.size() == large_offset + large.size());
+    REQUIRE(std::string_view(file.data(), 100) == record);
+    REQUIRE(file.data()[file.size() - 1] == 'l');
+
+    // Shrinking keeps only what is left
+    file.resize(100);
+    REQUIRE(file.size() == 100);
+    REQUIRE(std::string_view(file.data(), file.size()) == record);
+    file.close();
+    REQUIRE(FunDB::MappedFile::open_read_only("test_mapped.bin").size() == 100);
+}
+
+// Threads of this process, running or not
+static size_t process_thread_count()
+{
+    return std::distance(std::filesystem::directory_iterator("/proc/self/task"), std::filesystem::directory_iterator());
+}
+
+// Test case 32: Test that background work runs on a bounded pool of threads
+TEST_CASE("Bounded worker pool", "[WorkerPool][Database]")
+{
+    // Tasks beyond the pool's threads queue up rather than starting more
+    {
+        FunDB::WorkerPool pool(3);
+        std::atomic<int> running{0};
+        std::atomic<int> peak{0};
+        std::vector<std::future<int>> results;
+        for (int i = 0; i < 40; ++i)
+        {
+            results.push_back(pool.submit([&running, &peak, i]
+                                          {
+                int now = ++running;
+                int seen = peak.load();
+                while (now > seen && !peak.compare_exchange_weak(seen, now))
+                {
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                --running;
+                return i * i; }));
+        }
+        int wrong = 0;
+        for (int i = 0; i < 40; ++i)
+        {
+            wrong += results[i].get() != i * i;
+        }
+        REQUIRE(wrong == 0);
+        REQUIRE(peak.load() <= 3);
+        REQUIRE(pool.thread_count() <= 3);
+        REQUIRE_THROWS_AS(pool.submit([]
+                                      { throw std::runtime_error("failed"); })
+                              .get(),
+                          std::runtime_error);
+    }
+
+    // Asynchronous loads issued faster than they finish share the pool's threads
+    FunDB::Database db{"test_pool.dat", "test_pool.idx"};
+    db.clear();
+    for (int i = 0; i < 50; ++i)
+    {
+        db.save_function({"p" + std::to_string(i), {"x"}, SymEngine::Expression(std::to_string(i) + "*x")});
+    }
+    const size_t threads_before = process_thread_count();
+    std::vector<std::future<std::shared_ptr<const FunDB::CachedFunction>>> loads;
+    std::vector<std::future<std::vector<std::shared_ptr<const FunDB::CachedFunction>>>> batches;
+    size_t peak_threads = threads_before;
+    for (int i = 0; i < 500; ++i)
+    {
+        loads.push_back(db.load_async("p" + std::to_string(i % 50)));
+        if (i % 10 == 0)
+        {
+            batches.push_back(db.load_many_async({"p1", "missing", "p2"}));
+        }
+        peak_threads = std::max(peak_threads, process_thread_count());
+    }
+    size_t missing = 0;
+    for (size_t i = 0; i < loads.size(); ++i)
+    {
+        auto func = loads[i].get();
+        missing += !func || func->get_compiled().evaluate({{"x", 1.0}}) != static_cast<double>(i % 50);
+    }
+    for (auto &batch : batches)
+    {
+        auto funcs = batch.get();
+        missing += !funcs[0] || funcs[1] || !funcs[2];
+    }
+    REQUIRE(missing == 0);
+    REQUIRE(peak_threads - threads_before <= FunDB::WorkerPool::shared().capacity());
+    REQUIRE(FunDB::WorkerPool::shared().thread_count() <= FunDB::WorkerPool::shared().capacity());
+
+    // A database waits for its queued loads before it closes
+    {
+        FunDB::Database closing{"test_pool.dat", "test_pool.idx"};
+        for (int i = 0; i < 100; ++i)
+        {
+            closing.load_async("p" + std::to_string(i % 50));
+        }
+    }
+}
+
+// Test case 33: Test that durable stores are handed off the event loop and answered in order
+TEST_CASE("Deferred durable stores", "[Server][Database]")
+{
+    FunDB::Database db{"test_deferred.dat", "test_deferred.idx"};
+    db.clear();
+    db.set_durability({FunDB::Durability::PerWrite});
+
+    std::vector<FunDB::DeferredWork> deferred;
+    const FunDB::Deferrer defer = [&](FunDB::DeferredWork work)
+    { deferred.push_back(std::move(work)); };
+
+    // A store waits for its sync elsewhere, and the request pipelined after it waits for the store
+    FunDB::Connection conn;
+    conn.input = http_request("POST", "/store", R"({"name":"f","symbols":["x"],"expression":"3*x"})") +
+                 http_request("POST", "/evaluate", R"({"name":"f","values":{"x":2}})");
+    REQUIRE(FunDB::process_input(db, conn, defer));
+    REQUIRE(conn.waiting);
+    REQUIRE(conn.output.empty());
+    REQUIRE(deferred.size() == 1);
+    REQUIRE_FALSE(FunDB::process_input(db, conn, defer));
+    REQUIRE(conn.output.empty());
+
+    deferred[0]()(conn);
+    conn.waiting = false;
+    auto responses = http_responses(conn.output);
+    REQUIRE(responses.size() == 1);
+    REQUIRE(responses[0].first.rfind("HTTP/1.1 201 Created\r\n", 0) == 0);
+    REQUIRE(FunDB::process_input(db, conn, defer));
+    REQUIRE(conn.input.empty());
+    responses = http_responses(conn.output);
+    REQUIRE(responses.size() == 2);
+    REQUIRE(nlohmann::json::parse(responses[1].second)["result"].get<double>() == Catch::Approx(6.0));
+
+    // The binary protocol defers its stores the same way
+    db.set_durability({FunDB::Durability::GroupCommit, std::chrono::microseconds(200), 4});
+    deferred.clear();
+    std::string payload;
+    FunDB::ByteWriter writer(payload);
+    writer.put_string("g");
+    writer.put<uint32_t>(1);
+    writer.put_string("x");
+    writer.put_string("x + 1");
+    conn = FunDB::Connection();
+    conn.binary = true;
+    FunDB::append_wire_frame(conn.input, static_cast<uint8_t>(FunDB::WireOp::Store), 7, payload);
+    REQUIRE(FunDB::process_input(db, conn, defer));
+    REQUIRE(conn.waiting);
+    REQUIRE(conn.output.empty());
+    REQUIRE(deferred.size() == 1);
+    // The copied payload outlives the input buffer
+    conn.input.clear();
+    deferred[0]()(conn);
+    FunDB::WireFrame response;
+    REQUIRE(FunDB::parse_wire_frame(conn.output, response) == conn.output.size());
+    REQUIRE(response.code == static_cast<uint8_t>(FunDB::WireStatus::Ok));
+    REQUIRE(response.id == 7);
+    REQUIRE(db.load_function("g").has_value());
+
+    // Without a deferrer, or without durability, stores are answered at once
+    conn = FunDB::Connection();
+    conn.input = http_request("POST", "/store", R"({"name":"h","symbols":["x"],"expression":"x"})");
+    REQUIRE(FunDB::process_input(db, conn));
+    REQUIRE_FALSE(conn.waiting);
+    REQUIRE(http_responses(conn.output).size() == 1);
+    db.set_durability({FunDB::Durability::None});
+    conn = FunDB::Connection();
+    conn.input = http_request("POST", "/store", R"({"name":"h","symbols":["x"],"expression":"x"})");
+    REQUIRE(FunDB::process_input(db, conn, defer));
+    REQUIRE_FALSE(conn.waiting);
+    REQUIRE(deferred.size() == 1);
+}
+
+// Test case 34: Test that scanning every function reads the data file in order and bypasses the cache
+TEST_CASE("Uncached scans", "[Database]")
+{
+    FunDB::Database db{"test_for_each.dat", "test_for_each.idx", 16};
+    db.clear();
+    std::vector<FunDB::Function> batch;
+    for (int i = 2; i <= 11; ++i)
+    {
+        std::string a = std::to_string(i);
+        batch.push_back({"poly" + a, {"x"}, SymEngine::Expression(a + "*x**2 + " + a + "*x")});
+    }
+    db.write_batch(batch);
+    db.save_function({"plain", {"x"}, SymEngine::Expression("sin(x)")});
+    // Saved again, so its latest record is now the last in the file
+    db.save_function({"poly5", {"x"}, SymEngine::Expression("50*x**2 + 50*x")});
+    REQUIRE(db.load_cached("plain"));
+    const FunDB::CacheStats before = db.cache_stats();
+
+    // Writes while the scan runs, even a compaction, leave what it reads as it was when it began
+    std::vector<FunDB::Function> visited;
+    db.for_each([&](const FunDB::Function &func)
+                {
+                    if (visited.empty())
+                    {
+                        db.save_function({"late", {"x"}, SymEngine::Expression("x")});
+                        db.compact();
+                    }
+                    visited.push_back(func); });
+    const FunDB::CacheStats after = db.cache_stats();
+    REQUIRE(after.hits == before.hits);
+    REQUIRE(after.misses == before.misses);
+    REQUIRE(after.entries == before.entries);
+
+    std::vector<std::string> expected_order = {"poly2", "poly3", "poly4", "poly6", "poly7", "poly8", "poly9", "poly10", "poly11", "plain", "poly5"};
+    std::vector<std::string> order;
+    size_t wrong = 0;
+    for (const auto &func : visited)
+    {
+        order.push_back(func.name);
+        wrong += !SymEngine::eq(*func.expr.get_basic(), *db.load_function(func.name)->expr.get_basic());
+    }
+    REQUIRE(order == expected_order);
+    REQUIRE(wrong == 0);
+    REQUIRE(db.contains("late"));
+
+    // A snapshot is scanned in name order, the order of its records
+    db.freeze("test_for_each.snap");
+    auto frozen = FunDB::Database::open_snapshot("test_for_each.snap");
+    order.clear();
+    frozen->for_each([&](const FunDB::Function &func)
+                     { order.push_back(func.name); });
+    REQUIRE(order == std::vector<std::string>{"late", "plain", "poly10", "poly11", "poly2", "poly3", "poly4", "poly5", "poly6", "poly7", "poly8", "poly9"});
+    REQUIRE(frozen->cache_stats().entries == 0);
+}
+
+// Test case 35: Test that a connection closed by a deferred store's answer ignores its other events in the batch
+TEST_CASE("Event loop closing a connection mid-batch", "[Server]")
+{
+    FunDB::Database db{"test_event_loop.dat", "test_event_loop.idx"};
+    db.clear();
+    db.set_durability({FunDB::Durability::PerWrite});
+    auto open_connections = [&db]()
+    {
+        FunDB::Connection probe;
+        probe.input = http_request("GET", "/metrics", "");
+        FunDB::process_input(db, probe);
+        const std::string gauge = "\nfundb_open_connections ";
+        size_t at = probe.output.find(gauge);
+        REQUIRE(at != std::string::npos);
+        return std::stol(probe.output.substr(at + gauge.size()));
+    };
+    const long before = open_connections();
+
+    FunDB::WorkerPool blocking_work(1);
+    FunDB::EventLoop loop(db, -1, -1, blocking_work);
+    int sockets[2];
+    REQUIRE(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, sockets) == 0);
+    loop.adopt(sockets[0], false);
+    REQUIRE(open_connections() == before + 1);
+
+    // The client sends a store and half-closes; the store waits for its sync on the pool
+    const std::string request = http_request("POST", "/store", R"({"name":"f","symbols":["x"],"expression":"2*x"})");
+    REQUIRE(send(sockets[1], request.data(), request.size(), 0) == static_cast<ssize_t>(request.size()));
+    REQUIRE(shutdown(sockets[1], SHUT_WR) == 0);
+    epoll_event readable{};
+    readable.events = EPOLLIN | EPOLLRDHUP;
+    readable.data.fd = sockets[0];
+    loop.dispatch(&readable, 1);
+    pollfd completion{loop.completion_fd(), POLLIN, 0};
+    REQUIRE(poll(&completion, 1, 10000) == 1);
+
+    // Its answer drains the output and closes the connection, so the hang-up after it in the same
+    // batch must not close the descriptor or count the connection a second time
+    epoll_event batch[2]{};
+    batch[0].events = EPOLLIN;
+    batch[0].data.fd = loop.completion_fd();
+    batch[1].events = EPOLLIN | EPOLLRDHUP | EPOLLHUP;
+    batch[1].data.fd = sockets[0];
+    loop.dispatch(batch, 2);
+    REQUIRE(open_connections() == before);
+
+    std::string received;
+    char buffer[4096];
+    ssize_t n;
+    while ((n = recv(sockets[1], buffer, sizeof(buffer), 0)) > 0)
+    {
+        received.append(buffer, static_cast<size_t>(n));
+    }
+    REQUIRE(n == 0);
+    auto responses = http_responses(received);
+    REQUIRE(responses.size() == 1);
+    REQUIRE(responses[0].first.rfind("HTTP/1.1 201 Created\r\n", 0) == 0);
+    close(sockets[1]);
+}
+
+// Test case 36: Test that name files left from the data file a compaction replaced are rebuilt, not replayed
+TEST_CASE("Name files from before a compaction", "[Database]")
+{
+    {
+        FunDB::Database db{"test_stale.dat", "test_stale.idx"};
+        db.clear();
+        for (int round = 1; round <= 3; ++round)
+        {
+            for (int i = 0; i < 20; ++i)
+            {
+                db.save_function({"f" + std::to_string(i), {"x"}, SymEngine::Expression(std::to_string(round) + "*sin(x)")});
+            }
+        }
+    }
+    // What a crash right after compaction renamed its files into place leaves: name files that
+    // cover a prefix of the old data file
+    std::filesystem::copy_file("test_stale.idx.names", "test_stale.idx.names.old", std::filesystem::copy_options::overwrite_existing);
+    std::filesystem::copy_file("test_stale.idx.bloom", "test_stale.idx.bloom.old", std::filesystem::copy_options::overwrite_existing);
+    {
+        FunDB::Database db{"test_stale.dat", "test_stale.idx"};
+        db.compact();
+        // Enough new records that the old prefix ends inside the new file
+        for (int i = 0; i < 100; ++i)
+        {
+            db.save_function({"late" + std::to_string(i), {"x"}, SymEngine::Expression("x")});
+        }
+    }
+    std::filesystem::copy_file("test_stale.idx.names.old", "test_stale.idx.names", std::filesystem::copy_options::overwrite_existing);
+    std::filesystem::copy_file("test_stale.idx.bloom.old", "test_stale.idx.bloom", std::filesystem::copy_options::overwrite_existing);
+
+    FunDB::Database db{"test_stale.dat", "test_stale.idx"};
+    size_t late = 0;
+    for (FunDB::NameScan scan = db.scan_prefix("late"); scan.next();)
+    {
+        ++late;
+    }
+    REQUIRE(late == 100);
+    REQUIRE(db.scan_prefix("f").next() == "f0");
+    // A filter missing the late names would answer that they are absent
+    size_t found = 0;
+    for (int i = 0; i < 100; ++i)
+    {
+        found += db.contains("late" + std::to_string(i)) && db.load_function("late" + std::to_string(i)).has_value();
+    }
+    REQUIRE(found == 100);
+}
+
+// Test case 37: Test paging through GET /list with its limit, prefix and next cursor
+TEST_CASE("Listing names a page at a time", "[Server]")
+{
+    FunDB::Database db{"test_list.dat", "test_list.idx"};
+    db.clear();
+    for (const char *name : {"my fn1", "my fn2", "my fn3", "my fn4", "other"})
+    {
+        db.save_function({name, {"x"}, SymEngine::Expression("x")});
+    }
+
+    // The prefix is URL-decoded, and a full page gives the name to continue after
+    FunDB::Connection conn;
+    conn.input = http_request("GET", "/list?prefix=my%20fn&limit=2", "");
+    REQUIRE(FunDB::process_input(db, conn));
+    auto responses = http_responses(conn.output);
+    REQUIRE(responses.size() == 1);
+    nlohmann::json page = nlohmann::json::parse(responses[0].second);
+    REQUIRE(page["names"] == nlohmann::json{"my fn1", "my fn2"});
+    REQUIRE(page["next"] == "my fn2");
+
+    // The last page has no next
+    conn = FunDB::Connection();
+    conn.input = http_request("GET", "/list?prefix=my+fn&limit=2&after=my%20fn2", "");
+    REQUIRE(FunDB::process_input(db, conn));
+    page = nlohmann::json::parse(http_responses(conn.output)[0].second);
+    REQUIRE(page["names"] == nlohmann::json{"my fn3", "my fn4"});
+    REQUIRE_FALSE(page.contains("next"));
+
+    // Without parameters every name fits on the default page
+    conn = FunDB::Connection();
+    conn.input = http_request("GET", "/list", "");
+    REQUIRE(FunDB::process_input(db, conn));
+    page = nlohmann::json::parse(http_responses(conn.output)[0].second);
+    REQUIRE(page["names"].size() == 5);
+    REQUIRE(page["names"].back() == "other");
+    REQUIRE_FALSE(page.contains("next"));
+
+    // Limits outside 1..MAX_LIST_LIMIT are refused
+    for (const std::string &limit : {std::string("0"), std::to_string(10001)})
+    {
+        conn = FunDB::Connection();
+        conn.input = http_request("GET", "/list?limit=" + limit, "");
+        REQUIRE(FunDB::process_input(db, conn));
+        REQUIRE(http_responses(conn.output)[0].first.rfind("HTTP/1.1 400 Bad Request\r\n", 0) == 0);
+    }
+}
+
+// Test case 38: Test POST /evaluate_gradient, whose partials come back keyed in symbol order
+TEST_CASE("Evaluating a gradient over HTTP", "[Server]")
+{
+    FunDB::Database db{"test_gradient_http.dat", "test_gradient_http.idx"};
+    db.clear();
+    db.save_function({"g", {"y", "x"}, SymEngine::Expression("x**2*y + 3*y")});
+
+    FunDB::Connection conn;
+    conn.input = http_request("POST", "/evaluate_gradient", R"({"name":"g","values":{"x":2,"y":5}})") +
+                 http_request("POST", "/evaluate_gradient", R"({"name":"missing","values":{"x":2}})") +
+                 http_request("POST", "/evaluate_gradient", R"({"name":"g"})");
+    REQUIRE(FunDB::process_input(db, conn));
+    auto responses = http_responses(conn.output);
+    REQUIRE(responses.size() == 3);
+
+    REQUIRE(responses[0].first.rfind("HTTP/1.1 200 OK\r\n", 0) == 0);
+    nlohmann::ordered_json reply = nlohmann::ordered_json::parse(responses[0].second);
+    REQUIRE(reply["result"].get<double>() == Catch::Approx(35.0));
+    std::vector<std::string> keys;
+    for (const auto &partial : reply["gradient"].items())
+    {
+        keys.push_back(partial.key());
+    }
+    REQUIRE(keys == std::vector<std::string>{"y", "x"});
+    REQUIRE(reply["gradient"]["y"].get<double>() == Catch::Approx(7.0));
+    REQUIRE(reply["gradient"]["x"].get<double>() == Catch::Approx(20.0));
+
+    // An unknown name and a request without values are both refused
+    REQUIRE(responses[1].first.rfind("HTTP/1.1 400 Bad Request\r\n", 0) == 0);
+    REQUIRE(nlohmann::json::parse(responses[1].second)["error"] == "Function 'missing' not found in database.");
+    REQUIRE(responses[2].first.rfind("HTTP/1.1 400 Bad Request\r\n", 0) == 0);
+    REQUIRE(nlohmann::json::parse(responses[2].second)["error"] == "Missing 'name' or 'values'.");
+}